@@ -31,28 +31,30 @@ uint16_t DFRobotDFPlayerMini::calculateCheckSum(uint8_t *buffer){
 }
 
 void DFRobotDFPlayerMini::sendStack(){
-//   if (_sending[Stack_ACK]) {  //if the ack mode is on wait until the last transmition
-//     while (_isSending) {
-//       delay(0);
-//       available();
-//     }
-//   }
+  writeFrame(_sending);
+}
+
+void DFRobotDFPlayerMini::writeFrame(const uint8_t *frame){
+  //if the last frame asked for an ack wait until it arrives
+  waitAck();
 
 #ifdef _DEBUG
   Serial.println();
   Serial.print(F("sending:"));
   for (int i=0; i<DFPLAYER_SEND_LENGTH; i++) {
-    Serial.print(_sending[i],HEX);
+    Serial.print(frame[i],HEX);
     Serial.print(F(" "));
   }
   Serial.println();
 #endif
-  _serial->write(_sending, DFPLAYER_SEND_LENGTH);
-//   _timeOutTimer = millis();
-  _isSending = _sending[Stack_ACK];
+  _serial->write(frame, DFPLAYER_SEND_LENGTH);
+  TT_TRACE(TT_TRACE_DFPLAYER_TX, frame[Stack_Command], arrayToUint16(frame + Stack_Parameter));
+  _timeOutTimer = Kernel::Clock::now();
+  _isSending = frame[Stack_ACK];
+  _ackReceived = false;
   
-  if (!_sending[Stack_ACK]) { //if the ack mode is off wait 10 ms after one transmition.
-    ThisThread::sleep_for(10ms);
+  if (!frame[Stack_ACK]) { //if the ack mode is off wait 10 ms after one transmition.
+    ThisThread::sleep_for(DFPLAYER_FRAME_GAP);
   }
 }
 
@@ -61,10 +63,245 @@ void DFRobotDFPlayerMini::sendStack(uint8_t command){
 }
 
 void DFRobotDFPlayerMini::sendStack(uint8_t command, uint16_t argument){
+  if (_async) {
+    enqueue(command, argument);
+  }
+  else{
+    transmit(command, argument);
+  }
+}
+
+void DFRobotDFPlayerMini::transmit(uint8_t command, uint16_t argument){
+  _serialMutex.lock();
   _sending[Stack_Command] = command;
   uint16ToArray(argument, _sending+Stack_Parameter);
   uint16ToArray(calculateCheckSum(_sending), _sending+Stack_CheckSum);
   sendStack();
+  observeCommand(command, argument);
+  _serialMutex.unlock();
+}
+
+bool DFRobotDFPlayerMini::waitAck(){
+  while (_isSending) {
+    available();
+    if (_isSending) {
+      waitReceived(_timeOutTimer + std::chrono::milliseconds(_timeOutDuration));
+    }
+  }
+  return _ackReceived;
+}
+
+bool DFRobotDFPlayerMini::startAsync(){
+  if (!_async) {
+    if (_worker.start(callback(this, &DFRobotDFPlayerMini::worker)) != osOK) {
+      return false;
+    }
+    _async = true;
+  }
+  return true;
+}
+
+bool DFRobotDFPlayerMini::send(uint8_t command, uint16_t argument){
+  if (_async) {
+    return enqueue(command, argument);
+  }
+  transmit(command, argument);
+  return true;
+}
+
+bool DFRobotDFPlayerMini::sendFrame(const DFPlayerFrame &frame){
+  return sendFrames(&frame, 1);
+}
+
+bool DFRobotDFPlayerMini::sendFrames(const DFPlayerFrame *frames, size_t count){
+  bool retval = true;
+
+  if (_async) {
+    //The queue only needs the command and argument, the worker rebuilds each frame with the current ACK setting.
+    for (size_t i=0; i<count; i++) {
+      retval &= enqueue(frames[i].bytes[Stack_Command], arrayToUint16(frames[i].bytes + Stack_Parameter));
+    }
+    return retval;
+  }
+
+  //One lock for the whole sequence so no other frame lands in the middle of it.
+  _serialMutex.lock();
+  for (size_t i=0; i<count; i++) {
+    writeFrame(frames[i].bytes);
+    observeCommand(frames[i].bytes[Stack_Command], arrayToUint16(frames[i].bytes + Stack_Parameter));
+  }
+  _serialMutex.unlock();
+
+  return retval;
+}
+
+void DFRobotDFPlayerMini::setCommandCallback(Callback<void(uint8_t, bool)> callback){
+  _onCommandDone = callback;
+}
+
+bool DFRobotDFPlayerMini::enqueue(uint8_t command, uint16_t argument, uint16_t settle){
+  DFPlayerCommand next = {command, argument, settle};
+
+  //Cleared first so waitIdle() can't see a stale idle flag once the command is visible.
+  _events.clear(DFPLAYER_FLAG_IDLE);
+
+  core_util_critical_section_enter();
+  bool queued = _coalesce && coalesce(command, argument);
+  if (!queued && _queueCount < DFPLAYER_QUEUE_LENGTH) {
+    _queue[(_queueHead + _queueCount) % DFPLAYER_QUEUE_LENGTH] = next;
+    _queueCount++;
+    queued = true;
+  }
+  core_util_critical_section_exit();
+
+  if (queued) {
+    _events.set(DFPLAYER_FLAG_QUEUED);
+  }
+  return queued;
+}
+
+bool DFRobotDFPlayerMini::dequeue(DFPlayerCommand &next){
+  bool popped = false;
+  core_util_critical_section_enter();
+  if (_queueCount) {
+    next = _queue[_queueHead];
+    _queueHead = (_queueHead + 1) % DFPLAYER_QUEUE_LENGTH;
+    _queueCount--;
+    popped = true;
+  }
+  core_util_critical_section_exit();
+  return popped;
+}
+
+static bool isPlayCommand(uint8_t command){
+  return command == 0x03 || command == 0x0F || command == 0x12 || command == 0x14;
+}
+
+bool DFRobotDFPlayerMini::coalesce(uint8_t command, uint16_t argument){
+  //Called inside the enqueue critical section. Returns true if the command was merged into the queue.
+  for (int i=_queueCount-1; i>=0; i--) {
+    DFPlayerCommand &queued = _queue[(_queueHead + i) % DFPLAYER_QUEUE_LENGTH];
+    switch (command) {
+      case 0x06:
+        if (queued.command == 0x04 || queued.command == 0x05) { //an absolute volume replaces pending steps
+          removeQueued(i);
+          break;
+        }
+        //fall through
+      case 0x07:
+        if (queued.command == command) {
+          queued.argument = argument;
+          return true;
+        }
+        break;
+      case 0x04:
+      case 0x05:
+        if (queued.command == 0x06) {
+          if (command == 0x04 && queued.argument < DFPLAYER_MAX_VOLUME) {
+            queued.argument++;
+          }
+          else if (command == 0x05 && queued.argument > 0) {
+            queued.argument--;
+          }
+          return true;
+        }
+        break;
+      default:
+        if (isPlayCommand(command) && isPlayCommand(queued.command)) {
+          removeQueued(i);
+        }
+        break;
+    }
+  }
+  return false;
+}
+
+void DFRobotDFPlayerMini::removeQueued(uint8_t index){
+  for (uint8_t i=index; i+1<_queueCount; i++) {
+    _queue[(_queueHead + i) % DFPLAYER_QUEUE_LENGTH] = _queue[(_queueHead + i + 1) % DFPLAYER_QUEUE_LENGTH];
+  }
+  _queueCount--;
+}
+
+void DFRobotDFPlayerMini::setCoalescing(bool enable){
+  _coalesce = enable;
+}
+
+void DFRobotDFPlayerMini::worker(){
+  DFPlayerCommand next;
+  while (true) {
+    _busy = true;
+    if (!dequeue(next)) {
+      _busy = false;
+      _events.set(DFPLAYER_FLAG_IDLE);
+      //Parse unsolicited frames while idle so message callbacks fire without anyone polling.
+      if (_events.wait_any(DFPLAYER_FLAG_QUEUED | DFPLAYER_FLAG_WORKER_RECEIVED) & DFPLAYER_FLAG_WORKER_RECEIVED) {
+        available();
+      }
+      continue;
+    }
+
+    _serialMutex.lock();
+    transmit(next.command, next.argument);
+    //The next frame goes as soon as this one is acknowledged, with ACK off sendStack() has already left the gap.
+    bool acknowledged = _sending[Stack_ACK] ? waitAck() : true;
+    if (next.command == 0x0C) {
+      //After a reset the module reports online when it's ready.
+      waitAvailable(next.settle);
+    }
+    else if (next.settle) {
+      ThisThread::sleep_for(std::chrono::milliseconds(next.settle));
+    }
+    _serialMutex.unlock();
+
+    if (_onCommandDone) {
+      _onCommandDone(next.command, acknowledged);
+    }
+  }
+}
+
+bool DFRobotDFPlayerMini::waitIdle(unsigned long duration){
+  Kernel::Clock::time_point deadline = Kernel::Clock::now() + std::chrono::milliseconds(duration);
+  while (_queueCount || _busy) {
+    if (!duration) {
+      _events.wait_any(DFPLAYER_FLAG_IDLE);
+    }
+    else{
+      if (Kernel::Clock::now() >= deadline) {
+        return false;
+      }
+      _events.wait_any_until(DFPLAYER_FLAG_IDLE, deadline);
+    }
+  }
+  return true;
+}
+
+int DFRobotDFPlayerMini::query(uint8_t command, uint16_t argument){
+  int retval = -1;
+  uint16_t cached;
+
+  //Jumps ahead of anything already queued, the reply has to be read by this thread.
+  _serialMutex.lock();
+  if (cacheLookup(command, cached)) {
+    _serialMutex.unlock();
+    return cached;
+  }
+
+  transmit(command, argument);
+  //Skip unsolicited frames that arrive first so they can't be mistaken for the reply.
+  while (waitAvailable()) {
+    uint8_t type = readType();
+    if (type == DFPlayerFeedBack && _handleCommand == command) {
+      retval = read();
+      break;
+    }
+    else if (type == TimeOut || type == WrongStack || type == DFPlayerError) {
+      break;
+    }
+  }
+  _serialMutex.unlock();
+
+  return retval;
 }
 
 void DFRobotDFPlayerMini::sendStack(uint8_t command, uint8_t argumentHigh, uint8_t argumentLow){
@@ -81,24 +318,122 @@ void DFRobotDFPlayerMini::disableACK(){
   _sending[Stack_ACK] = 0x00;
 }
 
-bool DFRobotDFPlayerMini::waitAvailable(unsigned long duration){
-//   unsigned long timer = millis();
-//   if (!duration) {
-//     duration = _timeOutDuration;
-//   }
-//   while (!available()){
-//     if (millis() - timer > duration) {
-//       return false;
-//     }
-//     delay(0);
-//   }
-    ThisThread::sleep_for(std::chrono::milliseconds(duration));
+void DFRobotDFPlayerMini::setCacheLifetime(unsigned long duration){
+  _serialMutex.lock();
+  _cacheLifetime = duration;
+  _serialMutex.unlock();
+}
 
+void DFRobotDFPlayerMini::setMessageCallback(Callback<void(uint8_t, uint16_t)> callback){
+  _serialMutex.lock();
+  _onMessage = callback;
+  _serialMutex.unlock();
+}
+
+void DFRobotDFPlayerMini::cacheStore(uint8_t command, uint16_t value){
+  //0x4E depends on the folder asked for, so it isn't cached.
+  if (command < DFPLAYER_CACHE_FIRST || command >= DFPLAYER_CACHE_FIRST + DFPLAYER_CACHE_LENGTH || command == 0x4E) {
+    return;
+  }
+  _cache[command - DFPLAYER_CACHE_FIRST] = value;
+  _cacheTime[command - DFPLAYER_CACHE_FIRST] = Kernel::Clock::now();
+  _cacheValid |= 1 << (command - DFPLAYER_CACHE_FIRST);
+}
+
+bool DFRobotDFPlayerMini::cacheLookup(uint8_t command, uint16_t &value){
+  if (command < DFPLAYER_CACHE_FIRST || command >= DFPLAYER_CACHE_FIRST + DFPLAYER_CACHE_LENGTH) {
+    return false;
+  }
+  uint8_t index = command - DFPLAYER_CACHE_FIRST;
+  if (!(_cacheValid & (1 << index)) || Kernel::Clock::now() - _cacheTime[index] >= std::chrono::milliseconds(_cacheLifetime)) {
+    return false;
+  }
+  value = _cache[index];
   return true;
 }
 
+void DFRobotDFPlayerMini::cacheInvalidate(uint8_t command){
+  _cacheValid &= ~(1 << (command - DFPLAYER_CACHE_FIRST));
+}
+
+void DFRobotDFPlayerMini::cacheInvalidate(){
+  _cacheValid = 0;
+}
+
+void DFRobotDFPlayerMini::observeCommand(uint8_t command, uint16_t argument){
+  uint16_t volume;
+  switch (command) {
+    case 0x06:
+    case 0x07:
+      //The set value is what the module will report.
+      cacheStore(command - 0x06 + 0x43, argument);
+      break;
+    case 0x04:
+    case 0x05:
+      if (cacheLookup(0x43, volume)) {
+        if (command == 0x04 && volume < DFPLAYER_MAX_VOLUME) {
+          volume++;
+        }
+        else if (command == 0x05 && volume > 0) {
+          volume--;
+        }
+        cacheStore(0x43, volume);
+      }
+      break;
+    case 0x09:
+    case 0x0C:
+      cacheInvalidate();
+      break;
+    default:
+      //Anything else may change what is playing.
+      cacheInvalidate(0x42);
+      cacheInvalidate(0x4B);
+      cacheInvalidate(0x4C);
+      cacheInvalidate(0x4D);
+      break;
+  }
+}
+
+bool DFRobotDFPlayerMini::waitAvailable(unsigned long duration){
+  if (!duration) {
+    duration = _timeOutDuration;
+  }
+  Kernel::Clock::time_point deadline = Kernel::Clock::now() + std::chrono::milliseconds(duration);
+  bool retval = true;
+
+  //Only one thread can wait on the receive flag at a time or the other misses its wake up.
+  _serialMutex.lock();
+  while (!available()){
+    if (Kernel::Clock::now() >= deadline) {
+      retval = false;
+      break;
+    }
+    waitReceived(deadline);
+  }
+  _serialMutex.unlock();
+
+  return retval;
+}
+
+bool DFRobotDFPlayerMini::waitReceived(Kernel::Clock::time_point deadline){
+  //available() stops after each frame, so bytes may already be waiting.
+  if (_serial->readable()) {
+    return true;
+  }
+  //The flag is cleared on wake, available() then drains everything that arrived, so no bytes are missed.
+  uint32_t flags = _events.wait_any_until(DFPLAYER_FLAG_RECEIVED, deadline);
+  return !(flags & osFlagsError);
+}
+
+void DFRobotDFPlayerMini::serialEvent(){
+  //Called from interrupt context, BufferedSerial::read() takes a mutex so the bytes are parsed by the waiting thread.
+  _events.set(DFPLAYER_FLAG_RECEIVED | DFPLAYER_FLAG_WORKER_RECEIVED);
+}
+
 bool DFRobotDFPlayerMini::begin(BufferedSerial &stream, bool isACK, bool doReset){
   _serial = &stream;
+  _receivedIndex = 0;
+  _serial->sigio(callback(this, &DFRobotDFPlayerMini::serialEvent));
   
   if (isACK) {
     enableACK();
@@ -151,8 +486,10 @@ uint8_t DFRobotDFPlayerMini::readCommand(){
 
 void DFRobotDFPlayerMini::parseStack(){
   uint8_t handleCommand = *(_received + Stack_Command);
+  TT_TRACE(TT_TRACE_DFPLAYER_RX, handleCommand, arrayToUint16(_received + Stack_Parameter));
   if (handleCommand == 0x41) { //handle the 0x41 ack feedback as a spcecial case, in case the pollusion of _handleCommand, _handleParameter, and _handleType.
     _isSending = false;
+    _ackReceived = true;
     return;
   }
   
@@ -214,9 +551,35 @@ void DFRobotDFPlayerMini::parseStack(){
       handleError(WrongStack);
       break;
   }
+
+  switch (_handleCommand) {
+    case 0x3D:
+      cacheInvalidate(0x42);
+      cacheInvalidate(0x4B);
+      cacheInvalidate(0x4C);
+      cacheInvalidate(0x4D);
+      break;
+    case 0x3A:
+    case 0x3B:
+    case 0x3F:
+      //The media changed, every count may be different.
+      cacheInvalidate();
+      break;
+    case 0x40:
+      break;
+    default:
+      if (_handleType == DFPlayerFeedBack) {
+        cacheStore(_handleCommand, _handleParameter);
+      }
+      return;
+  }
+
+  if (_onMessage) {
+    _onMessage(_handleType, _handleParameter);
+  }
 }
 
-uint16_t DFRobotDFPlayerMini::arrayToUint16(uint8_t *array){
+uint16_t DFRobotDFPlayerMini::arrayToUint16(const uint8_t *array){
   uint16_t value = *array;
   value <<=8;
   value += *(array+1);
@@ -228,66 +591,64 @@ bool DFRobotDFPlayerMini::validateStack(){
 }
 
 bool DFRobotDFPlayerMini::available(){
-//   while (_serial->available()) {
-//     delay(0);
-//     if (_receivedIndex == 0) {
-//       _received[Stack_Header] = _serial->read();
-// #ifdef _DEBUG
-//       Serial.print(F("received:"));
-//       Serial.print(_received[_receivedIndex],HEX);
-//       Serial.print(F(" "));
-// #endif
-//       if (_received[Stack_Header] == 0x7E) {
-//         _receivedIndex ++;
-//       }
-//     }
-//     else{
-//       _received[_receivedIndex] = _serial->read();
-// #ifdef _DEBUG
-//       Serial.print(_received[_receivedIndex],HEX);
-//       Serial.print(F(" "));
-// #endif
-//       switch (_receivedIndex) {
-//         case Stack_Version:
-//           if (_received[_receivedIndex] != 0xFF) {
-//             return handleError(WrongStack);
-//           }
-//           break;
-//         case Stack_Length:
-//           if (_received[_receivedIndex] != 0x06) {
-//             return handleError(WrongStack);
-//           }
-//           break;
-//         case Stack_End:
-// #ifdef _DEBUG
-//           Serial.println();
-// #endif
-//           if (_received[_receivedIndex] != 0xEF) {
-//             return handleError(WrongStack);
-//           }
-//           else{
-//             if (validateStack()) {
-//               _receivedIndex = 0;
-//               parseStack();
-//               return _isAvailable;
-//             }
-//             else{
-//               return handleError(WrongStack);
-//             }
-//           }
-//           break;
-//         default:
-//           break;
-//       }
-//       _receivedIndex++;
-//     }
-//   }
+  //Another thread is mid transfer and will parse whatever arrives, report what is already known.
+  if (!_serialMutex.trylock()) {
+    return _isAvailable;
+  }
+  bool retval = parseReceived();
+  _serialMutex.unlock();
+  return retval;
+}
+
+bool DFRobotDFPlayerMini::parseReceived(){
+  uint8_t byte;
+  while (_serial->readable() && _serial->read(&byte, 1) == 1) {
+    if (_receivedIndex == 0) {
+      _received[Stack_Header] = byte;
+      if (_received[Stack_Header] == 0x7E) {
+        _receivedIndex ++;
+      }
+    }
+    else{
+      _received[_receivedIndex] = byte;
+      switch (_receivedIndex) {
+        case Stack_Version:
+          if (_received[_receivedIndex] != 0xFF) {
+            return handleError(WrongStack);
+          }
+          break;
+        case Stack_Length:
+          if (_received[_receivedIndex] != 0x06) {
+            return handleError(WrongStack);
+          }
+          break;
+        case Stack_End:
+          if (_received[_receivedIndex] != 0xEF) {
+            return handleError(WrongStack);
+          }
+          else{
+            if (validateStack()) {
+              _receivedIndex = 0;
+              parseStack();
+              return _isAvailable;
+            }
+            else{
+              return handleError(WrongStack);
+            }
+          }
+          break;
+        default:
+          break;
+      }
+      _receivedIndex++;
+    }
+  }
   
-//   if (_isSending && (millis()-_timeOutTimer>=_timeOutDuration)) {
-//     return handleError(TimeOut);
-//   }
+  if (_isSending && (Kernel::Clock::now() - _timeOutTimer >= std::chrono::milliseconds(_timeOutDuration))) {
+    return handleError(TimeOut);
+  }
   
-  return true;
+  return _isAvailable;
 }
 
 void DFRobotDFPlayerMini::next(){
@@ -323,8 +684,13 @@ void DFRobotDFPlayerMini::loop(int fileNumber) {
 }
 
 void DFRobotDFPlayerMini::outputDevice(uint8_t device) {
-  sendStack(0x09, device);
-  ThisThread::sleep_for(200ms);
+  if (_async) {
+    enqueue(0x09, device, 200);
+  }
+  else{
+    sendStack(0x09, device);
+    ThisThread::sleep_for(200ms);
+  }
 }
 
 void DFRobotDFPlayerMini::sleep(){
@@ -332,7 +698,12 @@ void DFRobotDFPlayerMini::sleep(){
 }
 
 void DFRobotDFPlayerMini::reset(){
-  sendStack(0x0C);
+  if (_async) {
+    enqueue(0x0C, 0, 2000);
+  }
+  else{
+    sendStack(0x0C);
+  }
 }
 
 void DFRobotDFPlayerMini::start(){
@@ -404,128 +775,49 @@ void DFRobotDFPlayerMini::disableDAC(){
 }
 
 int DFRobotDFPlayerMini::readState(){
-  sendStack(0x42);
-  if (waitAvailable()) {
-    if (readType() == DFPlayerFeedBack) {
-      return read();
-    }
-    else{
-      return -1;
-    }
-  }
-  else{
-    return -1;
-  }
+  return query(0x42);
 }
 
 int DFRobotDFPlayerMini::readVolume(){
-  sendStack(0x43);
-  if (waitAvailable()) {
-    return read();
-  }
-  else{
-    return -1;
-  }
+  return query(0x43);
 }
 
 int DFRobotDFPlayerMini::readEQ(){
-  sendStack(0x44);
-  if (waitAvailable()) {
-    if (readType() == DFPlayerFeedBack) {
-      return read();
-    }
-    else{
-      return -1;
-    }
-  }
-  else{
-    return -1;
-  }
+  return query(0x44);
 }
 
 int DFRobotDFPlayerMini::readFileCounts(uint8_t device){
   switch (device) {
     case DFPLAYER_DEVICE_U_DISK:
-      sendStack(0x47);
-      break;
+      return query(0x47);
     case DFPLAYER_DEVICE_SD:
-      sendStack(0x48);
-      break;
+      return query(0x48);
     case DFPLAYER_DEVICE_FLASH:
-      sendStack(0x49);
-      break;
+      return query(0x49);
     default:
-      break;
-  }
-  
-  if (waitAvailable()) {
-    if (readType() == DFPlayerFeedBack) {
-      return read();
-    }
-    else{
       return -1;
-    }
-  }
-  else{
-    return -1;
   }
 }
 
 int DFRobotDFPlayerMini::readCurrentFileNumber(uint8_t device){
   switch (device) {
     case DFPLAYER_DEVICE_U_DISK:
-      sendStack(0x4B);
-      break;
+      return query(0x4B);
     case DFPLAYER_DEVICE_SD:
-      sendStack(0x4C);
-      break;
+      return query(0x4C);
     case DFPLAYER_DEVICE_FLASH:
-      sendStack(0x4D);
-      break;
+      return query(0x4D);
     default:
-      break;
-  }
-  if (waitAvailable()) {
-    if (readType() == DFPlayerFeedBack) {
-      return read();
-    }
-    else{
       return -1;
-    }
-  }
-  else{
-    return -1;
   }
 }
 
 int DFRobotDFPlayerMini::readFileCountsInFolder(int folderNumber){
-  sendStack(0x4E, folderNumber);
-  if (waitAvailable()) {
-    if (readType() == DFPlayerFeedBack) {
-      return read();
-    }
-    else{
-      return -1;
-    }
-  }
-  else{
-    return -1;
-  }
+  return query(0x4E, folderNumber);
 }
 
 int DFRobotDFPlayerMini::readFolderCounts(){
-  sendStack(0x4F);
-  if (waitAvailable()) {
-    if (readType() == DFPlayerFeedBack) {
-      return read();
-    }
-    else{
-      return -1;
-    }
-  }
-  else{
-    return -1;
-  }
+  return query(0x4F);
 }
 
 int DFRobotDFPlayerMini::readFileCounts(){
@@ -12,6 +12,7 @@
  */
 
 #include "mbed.h"
+#include "tttrace.h"
 
 #ifndef DFRobotDFPlayerMini_cpp
     #define DFRobotDFPlayerMini_cpp
@@ -33,6 +34,27 @@
 #define DFPLAYER_RECEIVED_LENGTH 10
 #define DFPLAYER_SEND_LENGTH 10
 
+//Set from the serial sigio callback whenever bytes arrive.
+#define DFPLAYER_FLAG_RECEIVED (1UL << 0)
+//Set when a command is added to the async queue.
+#define DFPLAYER_FLAG_QUEUED (1UL << 1)
+//Set when the async worker has emptied the queue.
+#define DFPLAYER_FLAG_IDLE (1UL << 2)
+//Also set on receive, for the idle worker. Kept separate so it can't steal a wake up from a thread waiting on a reply.
+#define DFPLAYER_FLAG_WORKER_RECEIVED (1UL << 3)
+
+//Commands held by the async queue before send() starts failing.
+#define DFPLAYER_QUEUE_LENGTH 16
+#define DFPLAYER_WORKER_STACK_SIZE 1024
+//Gap left after each frame when ACK is off, the module drops frames sent closer together.
+#define DFPLAYER_FRAME_GAP 10ms
+#define DFPLAYER_MAX_VOLUME 30
+
+//Query replies 0x42 to 0x4F are cached by command, how long they are trusted for (ms).
+#define DFPLAYER_CACHE_FIRST 0x42
+#define DFPLAYER_CACHE_LENGTH 14
+#define DFPLAYER_CACHE_LIFETIME 1000
+
 //#define _DEBUG
 
 #define TimeOut 0
@@ -65,10 +87,37 @@
 #define Stack_CheckSum 7
 #define Stack_End 9
 
+//A complete frame ready to write, build them with dfPlayerFrame().
+struct DFPlayerFrame {
+  uint8_t bytes[DFPLAYER_SEND_LENGTH];
+};
+
+//Build a frame, checksum included. Constant arguments build it at compile time:
+//  static constexpr DFPlayerFrame playFirst = dfPlayerFrame(0x03, 1);
+//or call it at runtime to fill caller owned arrays of frames.
+constexpr DFPlayerFrame dfPlayerFrame(uint8_t command, uint16_t argument = 0, bool ack = false){
+  DFPlayerFrame frame = {{0x7E, 0xFF, 0x06, command, (uint8_t)ack, (uint8_t)(argument >> 8), (uint8_t)argument, 0, 0, 0xEF}};
+  uint16_t sum = 0;
+  for (int i=Stack_Version; i<Stack_CheckSum; i++) {
+    sum += frame.bytes[i];
+  }
+  sum = -sum;
+  frame.bytes[Stack_CheckSum] = (uint8_t)(sum >> 8);
+  frame.bytes[Stack_CheckSum + 1] = (uint8_t)sum;
+  return frame;
+}
+
+struct DFPlayerCommand {
+  uint8_t command;
+  uint16_t argument;
+  //Time the module needs after this command (ms), the worker waits it out so the caller doesn't have to.
+  uint16_t settle;
+};
+
 class DFRobotDFPlayerMini {
   BufferedSerial* _serial;
   
-  unsigned long _timeOutTimer;
+  Kernel::Clock::time_point _timeOutTimer;
   unsigned long _timeOutDuration = 500;
   
   uint8_t _received[DFPLAYER_RECEIVED_LENGTH];
@@ -76,17 +125,54 @@ class DFRobotDFPlayerMini {
   
   uint8_t _receivedIndex=0;
 
+  EventFlags _events;
+
+  //Held while a frame is sent and acknowledged, so the worker and query calls don't interleave on the UART.
+  Mutex _serialMutex;
+
+  bool _async = false;
+  volatile bool _busy = false;
+  //Ring of commands waiting for the worker, guarded by critical sections so it can be filled from ISRs.
+  DFPlayerCommand _queue[DFPLAYER_QUEUE_LENGTH];
+  uint8_t _queueHead = 0;
+  volatile uint8_t _queueCount = 0;
+  bool _coalesce = true;
+  uint64_t _workerStack[DFPLAYER_WORKER_STACK_SIZE / sizeof(uint64_t)];
+  Thread _worker{osPriorityNormal, DFPLAYER_WORKER_STACK_SIZE, (unsigned char *)_workerStack, "dfplayer"};
+  Callback<void(uint8_t, bool)> _onCommandDone = nullptr;
+  bool _ackReceived = false;
+
+  uint16_t _cache[DFPLAYER_CACHE_LENGTH];
+  Kernel::Clock::time_point _cacheTime[DFPLAYER_CACHE_LENGTH];
+  uint16_t _cacheValid = 0;
+  unsigned long _cacheLifetime = DFPLAYER_CACHE_LIFETIME;
+  Callback<void(uint8_t, uint16_t)> _onMessage = nullptr;
+
   void sendStack();
+  void writeFrame(const uint8_t *frame);
   void sendStack(uint8_t command);
   void sendStack(uint8_t command, uint16_t argument);
   void sendStack(uint8_t command, uint8_t argumentHigh, uint8_t argumentLow);
+  void transmit(uint8_t command, uint16_t argument);
+  bool waitAck();
+  bool enqueue(uint8_t command, uint16_t argument, uint16_t settle = 0);
+  bool dequeue(DFPlayerCommand &next);
+  bool coalesce(uint8_t command, uint16_t argument);
+  void removeQueued(uint8_t index);
+  int query(uint8_t command, uint16_t argument = 0);
+  void cacheStore(uint8_t command, uint16_t value);
+  bool cacheLookup(uint8_t command, uint16_t &value);
+  void cacheInvalidate(uint8_t command);
+  void cacheInvalidate();
+  void observeCommand(uint8_t command, uint16_t argument);
+  void worker();
 
   void enableACK();
   void disableACK();
   
   void uint16ToArray(uint16_t value,uint8_t *array);
   
-  uint16_t arrayToUint16(uint8_t *array);
+  uint16_t arrayToUint16(const uint8_t *array);
   
   uint16_t calculateCheckSum(uint8_t *buffer);
   
@@ -94,6 +180,10 @@ class DFRobotDFPlayerMini {
 
   void parseStack();
   bool validateStack();
+
+  void serialEvent();
+  bool waitReceived(Kernel::Clock::time_point deadline);
+  bool parseReceived();
   
   uint8_t device = DFPLAYER_DEVICE_SD;
   
@@ -122,6 +212,37 @@ class DFRobotDFPlayerMini {
   
   void setTimeOut(unsigned long timeOutDuration);
   
+  //Send commands from a worker thread instead of the caller. Queries still block until their reply.
+  bool startAsync();
+  
+  //Queue a raw command, or send it straight away when async is off. False if the queue is full.
+  bool send(uint8_t command, uint16_t argument = 0);
+  
+  //Send frames built with dfPlayerFrame() straight from the caller's memory, nothing is copied into _sending.
+  //A sequence holds the UART for its whole length, frames are still paced by ACK or DFPLAYER_FRAME_GAP.
+  //Once async the frames are queued by command and argument like any other command.
+  bool sendFrame(const DFPlayerFrame &frame);
+  bool sendFrames(const DFPlayerFrame *frames, size_t count);
+  
+  //Called on the worker thread once each queued command is acknowledged (true) or timed out (false).
+  void setCommandCallback(Callback<void(uint8_t, bool)> callback);
+  
+  //Merge queued commands that haven't been sent yet, on by default. Volume and EQ sets keep only the last value,
+  //volumeUp()/volumeDown() adjust a queued volume() and a new play drops any queued play it replaces.
+  //Merged commands don't get their own setCommandCallback() call.
+  void setCoalescing(bool enable);
+  
+  //How long cached query replies are served for instead of asking the module (ms), 0 always asks.
+  //The cache also follows sent commands and is dropped when playback or the inserted media changes.
+  void setCacheLifetime(unsigned long duration);
+  
+  //Called with the message type and parameter for unsolicited frames: DFPlayerPlayFinished, card/USB insert,
+  //remove and online, and DFPlayerError. Runs on whichever thread parses the frame, the worker once async.
+  void setMessageCallback(Callback<void(uint8_t, uint16_t)> callback);
+  
+  //Wait for the async queue to empty. Duration in ms, 0 waits forever.
+  bool waitIdle(unsigned long duration = 0);
+  
   void next();
   
   void previous();
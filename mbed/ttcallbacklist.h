@@ -0,0 +1,168 @@
+/**
+*     _____ _____ ___      _ _ _             _   _    _    _
+*    |_   _|_   _/ __|__ _| | | |__  __ _ __| |_| |  (_)__| |_
+*      | |   | || (__/ _` | | | '_ \/ _` / _| / / |__| (_-<  _|
+*      |_|   |_| \___\__,_|_|_|_.__/\__,_\__|_\_\____|_/__/\__|
+*
+*
+* @file TTCallbackList.h
+* @brief This file contains TTCallbackList, a fixed capacity list of callbacks all run for one event.
+*
+* Used in place of a single Callback so several listeners can subscribe to a driver event without overwriting each
+* other. The callbacks are stored in the list, it never touches the heap. Subscribe, unsubscribe and call are all safe
+* from any context including ISRs, and calling an empty list costs one load.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_CALLBACK_LIST_H
+#define TT_CALLBACK_LIST_H
+
+/** @brief Default number of listeners per event. */
+#ifndef TT_CALLBACK_LIST_LENGTH
+    #define TT_CALLBACK_LIST_LENGTH 4
+#endif
+
+#include "mbed.h"
+#include <cstdint>
+
+template<typename F, int N = TT_CALLBACK_LIST_LENGTH>
+class TTCallbackList;
+
+template<int N, typename... Args>
+class TTCallbackList<void(Args...), N>{
+
+    static_assert(N > 0 && N <= 32, "The slots are kept as a 32 bit mask");
+
+    public:
+        TTCallbackList(){}
+
+        TTCallbackList(const TTCallbackList &) = delete;
+        TTCallbackList &operator=(const TTCallbackList &) = delete;
+
+        /**
+        * @brief Add a listener. Safe to call from any context, it is called from the next Call() that starts.
+        * @param callback Function to call.
+        * @returns Handle to unsubscribe with, or -1 if the list is full or callback is empty.
+        */
+        int Subscribe(Callback<void(Args...)> callback){
+            if(!callback){
+                return -1;
+            }
+
+            int handle = -1;
+
+            core_util_critical_section_enter();
+            for(int i = 0; i < N; i++){
+                if((claimed & (1u << i)) == 0){
+                    claimed |= 1u << i;
+                    handle = i;
+                    break;
+                }
+            }
+            core_util_critical_section_exit();
+
+            //Claimed but not active, nothing calls the slot while it is written.
+            if(handle >= 0){
+                callbacks[handle] = callback;
+                core_util_atomic_fetch_or_u32(&active, 1u << handle);
+            }
+
+            return handle;
+        }
+
+        /**
+        * @brief Remove a listener. Safe to call from any context. A Call() it interrupted may still finish calling it.
+        * @param handle Handle from Subscribe().
+        * @returns Was the handle subscribed?
+        */
+        bool Unsubscribe(int handle){
+            if(handle < 0 || handle >= N){
+                return false;
+            }
+
+            core_util_critical_section_enter();
+            bool subscribed = (active & (1u << handle)) != 0;
+            if(subscribed){
+                active &= ~(1u << handle);
+                retired |= 1u << handle;
+            }
+            core_util_critical_section_exit();
+
+            Release();
+            return subscribed;
+        }
+
+        /** @brief Remove every listener. Safe to call from any context. */
+        void Clear(){
+            core_util_critical_section_enter();
+            retired |= active;
+            active = 0;
+            core_util_critical_section_exit();
+
+            Release();
+        }
+
+        /**
+        * @brief Are there any listeners? Wait-free, safe to call from any context.
+        * @returns true if no callbacks are subscribed.
+        */
+        bool IsEmpty() const{
+            return core_util_atomic_load_u32(&active) == 0;
+        }
+
+        /**
+        * @brief Run every listener in subscription slot order. Safe to call from any context.
+        * @param args Arguments passed to each callback.
+        */
+        void Call(Args... args){
+            if(core_util_atomic_load_u32(&active) == 0){
+                return;
+            }
+
+            //Unsubscribed slots aren't reused until no call could still be running them. Counted before the slots are
+            //read, a slot freed and subscribed again in between would otherwise be called while it is written.
+            core_util_atomic_incr_u32(&calling, 1);
+            uint32_t pending = core_util_atomic_load_u32(&active);
+            for(int i = 0; pending != 0; i++, pending >>= 1){
+                if((pending & 1) != 0){
+                    callbacks[i](args...);
+                }
+            }
+
+            if(core_util_atomic_decr_u32(&calling, 1) == 0 && core_util_atomic_load_u32(&retired) != 0){
+                Release();
+            }
+        }
+
+    private:
+        /** @brief Subscribed callbacks, valid where active has a bit set. */
+        Callback<void(Args...)> callbacks[N];
+
+        /** @brief Slots in use, including retired ones. */
+        volatile uint32_t claimed = 0;
+
+        /** @brief Slots Call() runs. */
+        volatile uint32_t active = 0;
+
+        /** @brief Unsubscribed slots a running Call() may still be using. */
+        volatile uint32_t retired = 0;
+
+        /** @brief Number of Call()s running, more than one when an ISR interrupts another. */
+        volatile uint32_t calling = 0;
+
+        /** @brief Free the retired slots once no Call() is running. */
+        void Release(){
+            core_util_critical_section_enter();
+            if(calling == 0){
+                claimed &= ~retired;
+                retired = 0;
+            }
+            core_util_critical_section_exit();
+        }
+};
+
+#endif
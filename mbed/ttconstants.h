@@ -30,6 +30,7 @@ enum ttErrors{
     //Encoders
     TT_NO_REGISTERED_ENCODER,
     TT_OVERWROTE_ENCODER,
+    TT_HARDWARE_UNSUPPORTED,
 
     //Motors
     TT_ALREADY_MOVING,
@@ -38,6 +39,13 @@ enum ttErrors{
 
     //Threads
     TT_MUTEX_TIMEOUT,
+
+    //Callbacks
+    TT_CALLBACK_LIST_FULL,
+    TT_INVALID_CALLBACK,
+
+    //Settings
+    TT_INVALID_LIMITS,
     TT_SUCCESS = 0                         //Should always be zero element.
 };  
 
@@ -15,10 +15,13 @@
 */
 
 #include "ttdcmotor.h"
+#include <cmath>
 
 TTDcMotor::TTDcMotor(PinName en, PinName A, PinName B, float period, bool inaInbActiveLow) 
-    : pwm(en), A(A), B(B), inaInbActiveLow(inaInbActiveLow){
+    : pwm(en), A(A), B(B), positionPid(10, 0, 0, 1000), velocityPid(0.0005f, 0.005f, 0, 1),
+      inaInbActiveLow(inaInbActiveLow){
         pwm.period(period);
+        periodUs = period * 1000000;
 }
 
 int TTDcMotor::Spin(float speed, bool direction){
@@ -39,39 +42,102 @@ int TTDcMotor::Spin(float speed, bool direction){
             retVal = TT_CEILINGED_SPEED;
         }
 
-        pwm.write(speed);
-        SetDirection(direction);
+        targetDuty = direction == clockwise ? speed : -speed;
+        StartRamp();
 
         mtx.unlock();
         return retVal;
     }
 }
 
+#if TTLIBS_FIXED_POINT
+int TTDcMotor::SpinQ16(ttq16 speed, bool direction){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        int retVal = TT_SUCCESS;
+
+        if(speed < 0){
+            speed = 0;
+            retVal = TT_FLOORED_SPEED;
+        }
+        else if(speed > TT_Q16_ONE){
+            speed = TT_Q16_ONE;
+            retVal = TT_CEILINGED_SPEED;
+        }
+
+        if(slewRate == 0 && !currentSensing){
+            //Nothing to ramp, keep the output integer only.
+            core_util_critical_section_enter();
+            pwm.pulsewidth_us(ttQ16MulInt(periodUs, speed));
+            SetDirection(direction);
+            targetDuty = ttQ16ToFloat(direction == clockwise ? speed : -speed);
+            appliedDuty = targetDuty;
+            core_util_critical_section_exit();
+        }
+        else{
+            targetDuty = ttQ16ToFloat(direction == clockwise ? speed : -speed);
+            StartRamp();
+        }
+
+        mtx.unlock();
+        return retVal;
+    }
+}
+#endif
+
 int TTDcMotor::Stop(void){
     if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
         return TT_MUTEX_TIMEOUT;
     }
     else{
-        pwm.write(0);
-        A = inaInbActiveLow;
-        B = inaInbActiveLow;
+        scheduler.Cancel(controlTask);
+        mode = openLoop;
+        moving = false;
+        Halt();
+        RemoveMoveISR();
 
         mtx.unlock();
         return TT_SUCCESS;
     }
 }
 
+void TTDcMotor::Halt(void){
+    scheduler.Cancel(rampTask);
+    targetDuty = 0;
+    appliedDuty = 0;
+
+    if(haltMode == brake){
+        //Both half-bridges on to the same rail short the motor.
+        A = !inaInbActiveLow;
+        B = !inaInbActiveLow;
+        pwm.write(1);
+    }
+    else{
+        pwm.write(0);
+        A = inaInbActiveLow;
+        B = inaInbActiveLow;
+    }
+}
+
 int TTDcMotor::RegisterEncoder(PinName inA, PinName inB, PinMode inAMode, PinMode inBMode){
     if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
         return TT_MUTEX_TIMEOUT;
     }
+    else if(moving){
+        //The ISRs are using the current encoder.
+        mtx.unlock();
+        return TT_ALREADY_MOVING;
+    }
     else{
         bool existingEncoder = false;
         if(encoder != 0){
             existingEncoder = true;
         }
 
-        encoder = new TTEncoder(inA, inB, inAMode, inBMode);
+        encoder = 0;
+        encoder = encoderStorage.Construct(inA, inB, inAMode, inBMode);
 
         mtx.unlock();
 
@@ -85,16 +151,26 @@ int TTDcMotor::RegisterEncoder(PinName inA, PinName inB, PinMode inAMode, PinMod
 }
 
 int TTDcMotor::IsMoving(void){
-    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
-        return TT_MUTEX_TIMEOUT;
-    }
-    else{
-        bool retval = moving;
-        mtx.unlock();
-        return retval;
-    }
+    return core_util_atomic_load_bool(&moving);
 }
 
+#if TTLIBS_INSTRUMENT
+TTInstrumentSnapshot TTDcMotor::GetMoveInstrumentation(void){
+    return moveProbe.Snapshot();
+}
+
+TTInstrumentSnapshot TTDcMotor::GetControlInstrumentation(void){
+    return controlProbe.Snapshot();
+}
+
+void TTDcMotor::ResetInstrumentation(void){
+    core_util_critical_section_enter();
+    moveProbe.Reset();
+    controlProbe.Reset();
+    core_util_critical_section_exit();
+}
+#endif
+
 int TTDcMotor::Move(float speed, int x, bool direction){
     if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
         return TT_MUTEX_TIMEOUT;
@@ -103,6 +179,7 @@ int TTDcMotor::Move(float speed, int x, bool direction){
         if(!moving){
             if(encoder != 0){
                 moving = true;
+                moveDirection = direction;
                 if(direction == encoder->clockwise){
                     endInterrupts = encoder->getInterruptCount() + x;
                 }
@@ -110,7 +187,18 @@ int TTDcMotor::Move(float speed, int x, bool direction){
                     endInterrupts = encoder->getInterruptCount() - x;
                 }
 
-                encoder->SetOnInterruptCallback(callback(this, &TTDcMotor::MoveISR));
+                //Only on the encoder's edges for the length of the move. Set before an edge can end the move and remove it.
+                core_util_critical_section_enter();
+                int handle = encoder->AddDriverCallback(callback(this, &TTDcMotor::MoveISR));
+                moveHandle = handle >= 0 ? handle : -1;
+                core_util_critical_section_exit();
+
+                //Nothing would end the move.
+                if(handle < 0){
+                    moving = false;
+                    mtx.unlock();
+                    return TT_CALLBACK_LIST_FULL;
+                }
 
                 mtx.unlock();
                 return Spin(speed, direction);
@@ -127,17 +215,389 @@ int TTDcMotor::Move(float speed, int x, bool direction){
     }
 }
 
-int TTDcMotor::SetMoveEndedCallback(function<void()> callback){
+int TTDcMotor::MoveTo(int position){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        targetPosition = position;
+        int retval = StartControl(positionControl);
+        mtx.unlock();
+        return retval;
+    }
+}
+
+int TTDcMotor::MoveBy(int pulses, bool direction){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else if(encoder == 0){
+        mtx.unlock();
+        return TT_NO_REGISTERED_ENCODER;
+    }
+    else{
+        //Relative to the current target so repeated moves don't accumulate settling error.
+        float from = mode == positionControl ? targetPosition : encoder->getInterruptCount();
+        int retval = MoveTo(direction == clockwise ? from + pulses : from - pulses);
+        mtx.unlock();
+        return retval;
+    }
+}
+
+int TTDcMotor::SetVelocity(float velocity){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        targetVelocity = velocity;
+        int retval = StartControl(velocityControl);
+        mtx.unlock();
+        return retval;
+    }
+}
+
+int TTDcMotor::SetPositionGains(float kp, float ki, float kd){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        core_util_critical_section_enter();
+        positionPid.SetGains(kp, ki, kd);
+        core_util_critical_section_exit();
+        mtx.unlock();
+        return TT_SUCCESS;
+    }
+}
+
+int TTDcMotor::SetVelocityGains(float kp, float ki, float kd, float kff){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        core_util_critical_section_enter();
+        velocityPid.SetGains(kp, ki, kd);
+        feedForward = kff;
+        core_util_critical_section_exit();
+        mtx.unlock();
+        return TT_SUCCESS;
+    }
+}
+
+int TTDcMotor::SetMotionLimits(float velocity, float acceleration){
+    //The setpoint generator divides by the acceleration and can't move without a velocity.
+    if(velocity <= 0 || acceleration <= 0){
+        return TT_INVALID_LIMITS;
+    }
+    else if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        core_util_critical_section_enter();
+        maxVelocity = velocity;
+        maxAcceleration = acceleration;
+        positionPid.SetLimit(velocity);
+        core_util_critical_section_exit();
+        mtx.unlock();
+        return TT_SUCCESS;
+    }
+}
+
+int TTDcMotor::SetPositionTolerance(int counts){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        positionTolerance = counts;
+        mtx.unlock();
+        return TT_SUCCESS;
+    }
+}
+
+int TTDcMotor::StartControl(uint8_t newMode){
+    if(encoder == 0){
+        return TT_NO_REGISTERED_ENCODER;
+    }
+
+    //An open loop Move() owns the motor.
+    if(moving && mode == openLoop){
+        return TT_ALREADY_MOVING;
+    }
+
+    settledTicks = 0;
+
+    if(mode == openLoop){
+        //Start the setpoint from where the shaft is so the first update doesn't jump.
+        positionPid.Reset();
+        velocityPid.Reset();
+        setpointPosition = encoder->getInterruptCount();
+        setpointVelocity = encoder->GetVelocity();
+
+        //The control loop ramps its own output from here, carrying on from the applied duty.
+        scheduler.Cancel(rampTask);
+        moving = true;
+        mode = newMode;
+#if TTLIBS_INSTRUMENT
+        //The first update isn't late against the last move's.
+        controlProbe.Restart();
+#endif
+        scheduler.Schedule(controlTask, chrono::microseconds(TTDCMOTOR_CONTROL_PERIOD).count());
+    }
+    else{
+        mode = newMode;
+    }
+
+    return TT_SUCCESS;
+}
+
+void TTDcMotor::GenerateSetpoint(float dt){
+    float dv = maxAcceleration * dt;
+    float desired;
+
+    if(mode == velocityControl){
+        desired = targetVelocity;
+    }
+    else{
+        float remaining = targetPosition - setpointPosition;
+
+        //Arrived, hold the target.
+        if(fabsf(remaining) <= fabsf(setpointVelocity) * dt && fabsf(setpointVelocity) <= dv){
+            setpointPosition = targetPosition;
+            setpointVelocity = 0;
+            return;
+        }
+
+        //Brake once the stopping distance reaches the target, otherwise head for it at full speed.
+        bool toward = (remaining > 0) == (setpointVelocity > 0);
+        float stopping = (setpointVelocity * setpointVelocity) / (2 * maxAcceleration);
+        if(toward && fabsf(remaining) <= stopping){
+            desired = 0;
+        }
+        else{
+            desired = remaining > 0 ? maxVelocity : -maxVelocity;
+        }
+    }
+
+    float change = desired - setpointVelocity;
+    setpointVelocity += change > dv ? dv : (change < -dv ? -dv : change);
+    setpointPosition += setpointVelocity * dt;
+}
+
+void TTDcMotor::ControlISR(void){
+    TT_INSTRUMENT_SCOPE(controlProbe);
+#if TTLIBS_INSTRUMENT
+    controlProbe.Interval(ttInstrumentCycles(), ttInstrumentUsToCycles(chrono::microseconds(TTDCMOTOR_CONTROL_PERIOD).count()));
+#endif
+
+    const float dt = chrono::duration<float>(TTDCMOTOR_CONTROL_PERIOD).count();
+
+    //Rescheduled from when it was due, not when it ran, so the loop period stays exact.
+    scheduler.ScheduleNext(controlTask, chrono::microseconds(TTDCMOTOR_CONTROL_PERIOD).count());
+
+    GenerateSetpoint(dt);
+
+    float position = encoder->getInterruptCount();
+    float velocity = encoder->GetVelocity();
+
+    //Cascade, the position loop trims the setpoint velocity the velocity loop tracks.
+    float velocityCommand = setpointVelocity;
+    if(mode == positionControl){
+        velocityCommand += positionPid.Update(setpointPosition - position, dt);
+    }
+
+    float duty = (feedForward * velocityCommand) + velocityPid.Update(velocityCommand - velocity, dt);
+    targetDuty = duty > 1 ? 1 : (duty < -1 ? -1 : duty);
+    RampStep(dt);
+
+    if(mode == positionControl && setpointPosition == targetPosition && setpointVelocity == 0 &&
+       fabsf(targetPosition - position) <= positionTolerance){
+        if(++settledTicks >= TTDCMOTOR_SETTLE_TICKS){
+            scheduler.Cancel(controlTask);
+            mode = openLoop;
+            EndMove();
+        }
+    }
+    else{
+        settledTicks = 0;
+    }
+}
+
+void TTDcMotor::Output(float duty){
+    SetDirection(duty >= 0 ? clockwise : anticlockwise);
+    pwm.write(fabsf(duty));
+}
+
+int TTDcMotor::SetSlewRate(float rate){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        core_util_critical_section_enter();
+        slewRate = rate > 0 ? rate : 0;
+        core_util_critical_section_exit();
+        mtx.unlock();
+        return TT_SUCCESS;
+    }
+}
+
+int TTDcMotor::SetStopMode(int stopMode){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        haltMode = stopMode == brake ? brake : coast;
+        mtx.unlock();
+        return TT_SUCCESS;
+    }
+}
+
+int TTDcMotor::SetCurrentLimit(PinName sense, float fullScale, float limit){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        int retval = TT_SUCCESS;
+
+        core_util_critical_section_enter();
+        currentSensing = false;
+        current = 0;
+        dutyCeiling = 1;
+        core_util_critical_section_exit();
+
+        if(sense != NC){
+#if DEVICE_ANALOGIN
+            analogin_init(&currentSense, sense);
+            currentFullScale = fullScale;
+            currentLimit = limit;
+            currentSensing = true;
+
+            //Start watching the current if the motor is already being driven.
+            StartRamp();
+#else
+            retval = TT_HARDWARE_UNSUPPORTED;
+#endif
+        }
+
+        mtx.unlock();
+        return retval;
+    }
+}
+
+float TTDcMotor::GetCurrent(void){
+    return current;
+}
+
+float TTDcMotor::GetDuty(void){
+    return appliedDuty;
+}
+
+void TTDcMotor::StartRamp(void){
+    if(slewRate == 0 && !currentSensing){
+        core_util_critical_section_enter();
+        RampStep(0);
+        core_util_critical_section_exit();
+    }
+    //The control loop ramps its own output while it runs.
+    else if(mode == openLoop && !rampTask.IsScheduled()){
+        scheduler.Schedule(rampTask, 0);
+    }
+}
+
+void TTDcMotor::RampStep(float dt){
+    float target = targetDuty;
+    float duty = appliedDuty;
+
+#if DEVICE_ANALOGIN
+    if(currentSensing){
+        float sample = analogin_read(&currentSense) * currentFullScale;
+        float filtered = current + (sample - current) * TTDCMOTOR_CURRENT_FILTER;
+        current = filtered;
+
+        if(filtered > currentLimit){
+            //Current rises with duty, scale back in proportion.
+            float ceiling = fabsf(duty) * currentLimit / filtered;
+            dutyCeiling = ceiling < dutyCeiling ? ceiling : dutyCeiling;
+        }
+        else{
+            dutyCeiling += TTDCMOTOR_CURRENT_RECOVERY * dt;
+            dutyCeiling = dutyCeiling > 1 ? 1 : dutyCeiling;
+        }
+
+        target = target > dutyCeiling ? dutyCeiling : (target < -dutyCeiling ? -dutyCeiling : target);
+    }
+#endif
+
+    //Passing through zero on the way, so reversing slows down first.
+    float change = target - duty;
+    if(slewRate > 0){
+        float step = slewRate * dt;
+        change = change > step ? step : (change < -step ? -step : change);
+    }
+    duty += change;
+
+#if DEVICE_ANALOGIN
+    //Cutting the duty for the current limit doesn't wait for the slew rate.
+    if(currentSensing){
+        duty = duty > dutyCeiling ? dutyCeiling : (duty < -dutyCeiling ? -dutyCeiling : duty);
+    }
+#endif
+
+    appliedDuty = duty;
+    Output(duty);
+}
+
+void TTDcMotor::RampISR(void){
+    const float dt = chrono::duration<float>(TTDCMOTOR_RAMP_PERIOD).count();
+
+    if(mode != openLoop){
+        return;
+    }
+
+    RampStep(dt);
+
+    //Keep going until the target is reached, or for as long as the motor is driven to watch the current.
+    if(appliedDuty != targetDuty || (currentSensing && appliedDuty != 0)){
+        scheduler.ScheduleNext(rampTask, chrono::microseconds(TTDCMOTOR_RAMP_PERIOD).count());
+    }
+}
+
+void TTDcMotor::EndMove(void){
+    Halt();
+    moving = false;
+    RemoveMoveISR();
+
+    if(!onMoveEndedCallbacks.IsEmpty()){
+        scheduler.Defer(callback(this, &TTDcMotor::NotifyMoveEnded));
+    }
+}
+
+void TTDcMotor::RemoveMoveISR(void){
+    //Stop() and EndMove() can race, only one of them removes it.
+    core_util_critical_section_enter();
+    int handle = moveHandle;
+    moveHandle = -1;
+    core_util_critical_section_exit();
+
+    if(handle >= 0){
+        encoder->RemoveDriverCallback(handle);
+    }
+}
+
+void TTDcMotor::NotifyMoveEnded(void){
+    onMoveEndedCallbacks.Call();
+}
+
+int TTDcMotor::SetMoveEndedCallback(Callback<void()> callback){
     if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
         return TT_MUTEX_TIMEOUT;
     }
     else{
         bool existingCallback = false;
-        if(onMoveEndedCallback != 0){
+        if(!onMoveEndedCallbacks.IsEmpty()){
             existingCallback = true;
         }
 
-        onMoveEndedCallback = callback;
+        onMoveEndedCallbacks.Clear();
+        onMoveEndedCallbacks.Subscribe(callback);
 
         mtx.unlock();
 
@@ -150,6 +610,15 @@ int TTDcMotor::SetMoveEndedCallback(function<void()> callback){
     }
 }
 
+int TTDcMotor::AddMoveEndedCallback(Callback<void()> callback){
+    int handle = onMoveEndedCallbacks.Subscribe(callback);
+    return handle >= 0 ? handle : TT_CALLBACK_LIST_FULL;
+}
+
+int TTDcMotor::RemoveMoveEndedCallback(int handle){
+    return onMoveEndedCallbacks.Unsubscribe(handle) ? TT_SUCCESS : TT_INVALID_CALLBACK;
+}
+
 int TTDcMotor::SetDirection(bool dir){
     if(dir){
         A = inaInbActiveLow;
@@ -165,12 +634,18 @@ int TTDcMotor::SetDirection(bool dir){
 }
 
 void TTDcMotor::MoveISR(void){
-    if(encoder->getInterruptCount() != endInterrupts){
-        //DO nothing
+    TT_INSTRUMENT_SCOPE(moveProbe);
+
+    //Stop() takes the mutex so can't be used here. EndMove() removes this callback.
+    if(!moving || mode != openLoop){
+        return;
     }
-    else{
-        Stop();
-        encoder->SetOnInterruptCallback(0);
-        moving = false;
+
+    //Passed rather than equal, so a skipped edge can't run the motor forever.
+    int count = encoder->getInterruptCount();
+    bool passed = moveDirection == clockwise ? count >= endInterrupts : count <= endInterrupts;
+
+    if(passed){
+        EndMove();
     }
 }
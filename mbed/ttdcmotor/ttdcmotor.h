@@ -21,9 +21,30 @@
 #ifndef TT_DC_MOTOR_H
 #define TT_DC_MOTOR_H
 
+/* @brief Closed loop control update period. */
+#define TTDCMOTOR_CONTROL_PERIOD 1ms
+
+/* @brief Consecutive control updates inside the position tolerance before a closed loop move ends. */
+#define TTDCMOTOR_SETTLE_TICKS 10
+
+/* @brief Open loop duty ramp update period. The closed loop ramps its output every control update instead. */
+#define TTDCMOTOR_RAMP_PERIOD 1ms
+
+/* @brief Share of each current sample added into the filtered current, smoothing PWM ripple. */
+#define TTDCMOTOR_CURRENT_FILTER 0.25f
+
+/* @brief Duty per second the current limit lets the duty back up at once the current is under the limit. */
+#define TTDCMOTOR_CURRENT_RECOVERY 2.0f
+
 #include "mbed.h"
+#include "ttcallbacklist.h"
 #include "ttencoder.h"
 #include "ttconstants.h"
+#include "ttfixed.h"
+#include "ttpid.h"
+#include "ttinplace.h"
+#include "ttscheduler.h"
+#include "ttinstrument.h"
 
 class TTDcMotor{
     public:
@@ -46,11 +67,13 @@ class TTDcMotor{
         * @returns TT_SUCCESS or negative error code.
         * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
         * @retval TT_OVERWROTE_ENCODER Overwrote existing encoder instance.
+        * @retval TT_ALREADY_MOVING The motor is moving and using the current encoder, stop it first.
         */
         int RegisterEncoder(PinName inA, PinName inB, PinMode inAMode = PullDefault, PinMode inBMode = PullDefault);
 
         /*
-        * @brief Moves the motor perpetually.
+        * @brief Moves the motor perpetually. The duty ramps to the speed at the slew rate, a change of direction slows
+        * through zero first. Spin(0, direction) ramps down to a stop.
         * @param speed Percentage speed, (0 <= speed <= 1).
         * @param direction Speed clockwise or anti-clockwise.
         * @returns TT_SUCCESS or negative error code.
@@ -60,6 +83,16 @@ class TTDcMotor{
         */
         int Spin(float speed, bool direction);
 
+#if TTLIBS_FIXED_POINT
+        /*
+        * @brief Moves the motor perpetually using integer math only. Ramping and current limiting use float math.
+        * @param speed Q16.16 percentage speed, (0 <= speed <= TT_Q16_ONE).
+        * @param direction Speed clockwise or anti-clockwise.
+        * @returns TT_SUCCESS or negative error code. See Spin().
+        */
+        int SpinQ16(ttq16 speed, bool direction);
+#endif
+
         /*
         * @brief Move the motor x encoder in direction.
         * @param speed 0% (0) to 100% (1) speed to move at.
@@ -69,35 +102,183 @@ class TTDcMotor{
         * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
         * @retval TT_NO_REGISTERED_ENCODER No encoder registered, use RegisterEncoder() to set one.
         * @retval TT_ALREADY_MOVING The motor is currently moving, wait until it has stopped.
+        * @retval TT_CALLBACK_LIST_FULL The encoder already has TT_CALLBACK_LIST_LENGTH interrupt callbacks.
         */
         int Move(float speed, int pulses, bool direction);
 
         /*
-        * @brief Is the motor currently moving?
-        * @returns True, false or negative error code.
+        * @brief Move to an absolute encoder count under closed loop control.
+        * A trapezoidal setpoint limited by SetMotionLimits() is tracked by the position loop, which feeds the velocity loop.
+        * Can be called again while moving to change the target. Ends once settled inside the position tolerance.
+        * @param position Target encoder count.
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        * @retval TT_NO_REGISTERED_ENCODER No encoder registered, use RegisterEncoder() to set one.
+        * @retval TT_ALREADY_MOVING An open loop Move() is running, wait until it has stopped.
+        */
+        int MoveTo(int position);
+
+        /*
+        * @brief Move x encoder pulses from the current target under closed loop control.
+        * @param pulses Number of encoder pulses to move.
+        * @param direction Direction to move in.
+        * @returns TT_SUCCESS or negative error code. See MoveTo().
+        */
+        int MoveBy(int pulses, bool direction);
+
+        /*
+        * @brief Hold a velocity under closed loop control, ramped by the acceleration limit. Runs until Stop().
+        * @param velocity Velocity in encoder counts/s. Positive = clockwise, negative = anti-clockwise.
+        * @returns TT_SUCCESS or negative error code. See MoveTo().
+        */
+        int SetVelocity(float velocity);
+
+        /*
+        * @brief Set the position loop gains. The output is a velocity correction in counts/s.
+        * @param kp Proportional gain, (counts/s) per count.
+        * @param ki Integral gain.
+        * @param kd Derivative gain.
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        */
+        int SetPositionGains(float kp, float ki, float kd);
+
+        /*
+        * @brief Set the velocity loop gains. The output is a duty correction.
+        * @param kp Proportional gain, duty per (counts/s).
+        * @param ki Integral gain.
+        * @param kd Derivative gain.
+        * @param kff Feed-forward, duty per (counts/s) of setpoint velocity.
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        */
+        int SetVelocityGains(float kp, float ki, float kd, float kff);
+
+        /*
+        * @brief Set the limits of the closed loop setpoint generator.
+        * @param velocity Highest velocity in counts/s, greater than 0.
+        * @param acceleration Acceleration and deceleration in counts/s^2, greater than 0.
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        * @retval TT_INVALID_LIMITS velocity or acceleration isn't positive, the limits are left as they were.
+        */
+        int SetMotionLimits(float velocity, float acceleration);
+
+        /*
+        * @brief Set how close a closed loop move must settle to its target to end.
+        * @param counts Tolerance in encoder counts.
+        * @returns TT_SUCCESS or negative error code.
         * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        */
+        int SetPositionTolerance(int counts);
+
+        /*
+        * @brief Is the motor currently moving? Wait-free, safe to call from any context including ISRs.
+        * @returns True or false.
         */  
         int IsMoving(void);
 
+#if TTLIBS_INSTRUMENT
         /*
-        * @brief Stops any motor movement.
+        * @brief Get timing statistics for the open loop move check run on every encoder edge.
+        * @returns Snapshot of the MoveISR statistics.
+        */
+        TTInstrumentSnapshot GetMoveInstrumentation(void);
+
+        /*
+        * @brief Get timing statistics for the closed loop update. Jitter is against TTDCMOTOR_CONTROL_PERIOD.
+        * @returns Snapshot of the ControlISR statistics.
+        */
+        TTInstrumentSnapshot GetControlInstrumentation(void);
+
+        /* @brief Clear the move and control statistics. */
+        void ResetInstrumentation(void);
+#endif
+
+        /*
+        * @brief Stops any motor movement, including closed loop control, straight away without ramping.
+        * The h-bridge coasts or brakes as set by SetStopMode().
         * @returns TT_DC_MOTOR_SUCCESS or negative error code.
         * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
         */
         int Stop(void);
 
         /*
-        * @brief Register a callback for when motor movement has finished.
+        * @brief Limit how fast the duty changes, so starting, stopping and reversing don't draw current spikes.
+        * Applies to Spin(), Move() and the closed loop output, so slow rates also slow the closed loop response.
+        * @param rate Duty per second, e.g. 5 takes 200ms from stopped to full speed. 0 changes the duty at once.
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        */
+        int SetSlewRate(float rate);
+
+        /*
+        * @brief Set what the h-bridge does on Stop() and at the end of a move.
+        * @param stopMode "thisObject".coast to turn the outputs off, or "thisObject".brake to turn both half-bridges
+        * on to the same rail, shorting the motor so it stops faster.
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        */
+        int SetStopMode(int stopMode);
+
+        /*
+        * @brief Limit the duty so the motor current stays under a limit, read from a current sense output every ramp or
+        * control update. Over the limit the duty is scaled back in proportion, it recovers at TTDCMOTOR_CURRENT_RECOVERY.
+        * In open loop the ramp keeps running to watch the current while the motor is driven.
+        * @param sense Current sense ADC pin, NC to stop limiting.
+        * @param fullScale Current in amps at a full scale ADC reading.
+        * @param limit Current limit in amps.
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        * @retval TT_HARDWARE_UNSUPPORTED The target has no ADC.
+        */
+        int SetCurrentLimit(PinName sense, float fullScale, float limit);
+
+        /*
+        * @brief Get the filtered motor current. Wait-free, safe to call from any context including ISRs.
+        * @returns Current in amps, 0 without a current sense pin.
+        */
+        float GetCurrent(void);
+
+        /*
+        * @brief Get the duty the h-bridge is driven at, which lags the requested speed while ramping.
+        * Wait-free, safe to call from any context including ISRs.
+        * @returns -1 to 1. Positive = clockwise, negative = anti-clockwise.
+        */
+        float GetDuty(void);
+
+        /*
+        * @brief Register a callback for when motor movement has finished. Runs on the TTScheduler deferred thread.
         * @param callback Callback to add.
         * @returns TT_SUCCESS or negative error code.
         * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
         * @retval TT_OVERWROTE_CALLBACK Overwrote existing callback.
         */
-        int SetMoveEndedCallback(function<void()> callback);
+        int SetMoveEndedCallback(Callback<void()> callback);
+
+        /*
+        * @brief Add a callback for when motor movement has finished, alongside any others. Runs on the TTScheduler
+        * deferred thread. Safe to call from any context including ISRs.
+        * @param callback Callback to add.
+        * @returns Handle for RemoveMoveEndedCallback() or negative error code.
+        * @retval TT_CALLBACK_LIST_FULL TT_CALLBACK_LIST_LENGTH callbacks are already added.
+        */
+        int AddMoveEndedCallback(Callback<void()> callback);
+
+        /*
+        * @brief Remove a callback added with AddMoveEndedCallback(). Safe to call from any context including ISRs.
+        * @param handle Handle from AddMoveEndedCallback().
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_INVALID_CALLBACK No callback is added with the handle.
+        */
+        int RemoveMoveEndedCallback(int handle);
 
         /* @brief Convenient contextual shortcut to TTConstants. */
         enum direction{clockwise = TT_CLOCKWISE, anticlockwise = TT_ANTICLOCKWISE};
 
+        /* @brief H-bridge states when stopped. */
+        enum stopMode{coast, brake};
+
     private:
         /* @brief Make this class thread safe by protecting members from simultaneous access. */
         Mutex mtx;
@@ -105,6 +286,9 @@ class TTDcMotor{
         /* @brief ISR callback for checking if a move is finished on encoder interrupt. */
         void MoveISR(void);
 
+        /* @brief Coast or brake the h-bridge without taking the mutex, so it can be used from ISRs. */
+        void Halt(void);
+
         /*
         * @brief Set the h-bridge A and B channels to choos emotor direction.
         * @param dir Direction to spin. Can be "thisObject".clockwise or "thisObject".anticlockwise.
@@ -115,6 +299,9 @@ class TTDcMotor{
         /* @brief H-bridge pwm pin. */
         PwmOut pwm;
 
+        /* @brief PWM period in microseconds, for integer duty writes. */
+        int periodUs;
+
         /* @brief H-bridge A channel enable pin. */
         DigitalOut A;
 
@@ -124,11 +311,96 @@ class TTDcMotor{
         /* @brief Have a encoder unique top this motor if required. */
         TTEncoder *encoder = 0;
 
+        /* @brief Storage for the encoder so registering it doesn't use the heap. */
+        TTInPlace<TTEncoder> encoderStorage;
+
         /* @brief Number of interrupts that indicates a move end location. */
         int endInterrupts = 0;
 
+        /* @brief Direction of the open loop move, to tell when endInterrupts has been passed. */
+        bool moveDirection = clockwise;
+
+    //========================================================================= CLOSED LOOP
+        /* @brief Closed loop control modes. */
+        enum controlMode{openLoop, positionControl, velocityControl};
+
+        /* @brief Current control mode. */
+        volatile uint8_t mode = openLoop;
+
+        /* @brief Shared scheduler the control loop runs on. */
+        TTScheduler &scheduler = TTScheduler::Get();
+
+        /* @brief Runs ControlISR every TTDCMOTOR_CONTROL_PERIOD. */
+        TTSchedulerTask controlTask{callback(this, &TTDcMotor::ControlISR)};
+
+#if TTLIBS_INSTRUMENT
+        /* @brief MoveISR timing. */
+        TTInstrumentProbe moveProbe;
+
+        /* @brief ControlISR timing. */
+        TTInstrumentProbe controlProbe;
+#endif
+
+        /* @brief Position loop, setpoint position -> velocity correction. */
+        TTPid positionPid;
+
+        /* @brief Velocity loop, velocity -> duty correction. */
+        TTPid velocityPid;
+
+        /* @brief Duty per (counts/s) of setpoint velocity. */
+        float feedForward = 0;
+
+        /* @brief Target encoder count of a position move. */
+        volatile float targetPosition = 0;
+
+        /* @brief Target velocity in velocity control. */
+        volatile float targetVelocity = 0;
+
+        /* @brief Generated setpoint position. */
+        float setpointPosition = 0;
+
+        /* @brief Generated setpoint velocity. */
+        float setpointVelocity = 0;
+
+        /* @brief Setpoint generator velocity limit in counts/s. */
+        float maxVelocity = 1000;
+
+        /* @brief Setpoint generator acceleration limit in counts/s^2. */
+        float maxAcceleration = 5000;
+
+        /* @brief Settling tolerance in counts. */
+        int positionTolerance = 2;
+
+        /* @brief Consecutive updates spent inside the tolerance. */
+        uint32_t settledTicks = 0;
+
+        /*
+        * @brief Start closed loop control if it isn't already running.
+        * @param newMode positionControl or velocityControl.
+        * @returns TT_SUCCESS or negative error code.
+        */
+        int StartControl(uint8_t newMode);
+
+        /* @brief Step the trapezoidal setpoint generator. */
+        void GenerateSetpoint(float dt);
+
+        /* @brief Fixed rate control update. */
+        void ControlISR(void);
+
+        /* @brief End a move from an ISR and notify. */
+        void EndMove(void);
+
+        /* @brief Take MoveISR off the encoder's callbacks. Safe to call from ISRs. */
+        void RemoveMoveISR(void);
+
+        /* @brief Handle of MoveISR in the encoder's callbacks, -1 while it isn't added. */
+        volatile int moveHandle = -1;
+
+        /* @brief Run the move ended callbacks. Runs on the deferred thread. */
+        void NotifyMoveEnded(void);
+
         /* @brief Store if the motor is currently moving. */
-        bool moving = false;
+        volatile bool moving = false;
 
         /* @brief Is the h-bridge enable active low? */
         bool enActiveLow;
@@ -136,8 +408,81 @@ class TTDcMotor{
         /* @brief Are the h-bridge A and B channels active low? */
         bool inaInbActiveLow;
 
-        /* @brief Store the move ended callback. */
-        function<void()> onMoveEndedCallback = 0;
+        /* @brief Store the move ended callbacks. */
+        TTCallbackList<void()> onMoveEndedCallbacks;
+
+    //========================================================================= RAMP
+        /* @brief Runs RampISR every TTDCMOTOR_RAMP_PERIOD while the open loop duty is ramping or current limited. */
+        TTSchedulerTask rampTask{callback(this, &TTDcMotor::RampISR)};
+
+        /* @brief Requested duty, -1 to 1. */
+        volatile float targetDuty = 0;
+
+        /* @brief Duty the h-bridge is driven at, -1 to 1. */
+        volatile float appliedDuty = 0;
+
+        /* @brief Duty change per second, 0 for none. */
+        float slewRate = 0;
+
+        /* @brief H-bridge state when stopped, coast or brake. */
+        uint8_t haltMode = coast;
+
+        /* @brief Highest duty magnitude the current limit allows. */
+        float dutyCeiling = 1;
+
+        /* @brief Is the current sensed and limited? */
+        volatile bool currentSensing = false;
+
+#if DEVICE_ANALOGIN
+        /* @brief Current sense ADC, the HAL rather than AnalogIn so it can be read from ISRs. */
+        analogin_t currentSense;
+#endif
+
+        /* @brief Amps at a full scale ADC reading. */
+        float currentFullScale = 0;
+
+        /* @brief Current limit in amps. */
+        float currentLimit = 0;
+
+        /* @brief Filtered current in amps. */
+        volatile float current = 0;
+
+        /* @brief Move the duty to targetDuty, straight away or by starting the ramp. Call with the mutex held. */
+        void StartRamp(void);
+
+        /*
+        * @brief Move the applied duty toward targetDuty by the slew rate and current limit, then drive the h-bridge.
+        * @param dt Seconds since the last step.
+        */
+        void RampStep(float dt);
+
+        /* @brief Fixed rate open loop ramp update. */
+        void RampISR(void);
+
+        /*
+        * @brief Drive the h-bridge without taking the mutex.
+        * @param duty -1 to 1. Positive = clockwise, negative = anti-clockwise.
+        */
+        void Output(float duty);
+};
+
+/*
+* @brief TTDcMotor with its pins fixed at compile time, the encoder is registered on construction when EncAPin and EncBPin are set.
+* e.g. TTDcMotorT<PA_8, PB_4, PB_5, PA_0, PA_1> motor(0.001f);
+*/
+template<PinName EnPin, PinName APin, PinName BPin, PinName EncAPin = NC, PinName EncBPin = NC>
+class TTDcMotorT : public TTDcMotor{
+    public:
+        /*
+        * @brief Create the motor.
+        * @param period PWM period in seconds.
+        * @param inaInbActiveLow (Optional) Are A and B channels active low?
+        */
+        TTDcMotorT(float period, bool inaInbActiveLow = false) : TTDcMotor(EnPin, APin, BPin, period, inaInbActiveLow){
+            if(EncAPin != NC && EncBPin != NC){
+                RegisterEncoder(EncAPin, EncBPin);
+            }
+        }
 };
 
 
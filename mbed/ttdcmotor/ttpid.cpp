@@ -0,0 +1,65 @@
+/**
+*     _____ _____ ___ _    _
+*    |_   _|_   _| _ (_)__| |
+*      | |   | | |  _/ / _` |
+*      |_| |_| |_| |_|_\__,_|
+*
+*
+* @file TTPid.cpp
+* @brief This file contains the functions associated with TTPid.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "ttpid.h"
+
+TTPid::TTPid(float kp, float ki, float kd, float limit) : kp(kp), ki(ki), kd(kd), limit(limit){
+}
+
+void TTPid::SetGains(float kp, float ki, float kd){
+    this->kp = kp;
+    this->ki = ki;
+    this->kd = kd;
+}
+
+void TTPid::SetLimit(float limit){
+    this->limit = limit;
+}
+
+float TTPid::Update(float error, float dt){
+    //No derivative kick on the first update.
+    float derivative = primed && dt > 0 ? (error - previousError) / dt : 0;
+    previousError = error;
+    primed = true;
+
+    float candidate = integral + (error * dt);
+    float output = (kp * error) + (ki * candidate) + (kd * derivative);
+
+    //Conditional integration, only keep the new integral if it doesn't drive further into saturation.
+    if(output > limit){
+        if(error < 0){
+            integral = candidate;
+        }
+        output = limit;
+    }
+    else if(output < -limit){
+        if(error > 0){
+            integral = candidate;
+        }
+        output = -limit;
+    }
+    else{
+        integral = candidate;
+    }
+
+    return output;
+}
+
+void TTPid::Reset(void){
+    integral = 0;
+    previousError = 0;
+    primed = false;
+}
\ No newline at end of file
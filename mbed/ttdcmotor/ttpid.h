@@ -0,0 +1,82 @@
+/**
+*     _____ _____ ___ _    _
+*    |_   _|_   _| _ (_)__| |
+*      | |   | | |  _/ / _` |
+*      |_| |_| |_| |_|_\__,_|
+*
+*
+* @file TTPid.h
+* @brief This file contains the definitions and delcarations associated with TTPid.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_PID_H
+#define TT_PID_H
+
+#include "mbed.h"
+
+class TTPid{
+    public:
+        /*
+        * @brief Create a PID controller.
+        * @param kp Proportional gain.
+        * @param ki Integral gain.
+        * @param kd Derivative gain.
+        * @param limit Output is clamped to +-limit.
+        */
+        TTPid(float kp = 0, float ki = 0, float kd = 0, float limit = 1);
+
+        /*
+        * @brief Set the gains. Keeps the integral.
+        * @param kp Proportional gain.
+        * @param ki Integral gain.
+        * @param kd Derivative gain.
+        */
+        void SetGains(float kp, float ki, float kd);
+
+        /*
+        * @brief Set the output limit.
+        * @param limit Output is clamped to +-limit.
+        */
+        void SetLimit(float limit);
+
+        /*
+        * @brief Run one update. Safe to call from ISRs.
+        * The integral stops growing while the output is saturated in the direction of the error, so it can't wind up.
+        * @param error Setpoint - measurement.
+        * @param dt Time since the last update in seconds.
+        * @returns Clamped controller output.
+        */
+        float Update(float error, float dt);
+
+        /* @brief Clear the integral and derivative history. */
+        void Reset(void);
+
+    private:
+        /* @brief Proportional gain. */
+        float kp;
+
+        /* @brief Integral gain. */
+        float ki;
+
+        /* @brief Derivative gain. */
+        float kd;
+
+        /* @brief Output clamp. */
+        float limit;
+
+        /* @brief Accumulated error * time. */
+        float integral = 0;
+
+        /* @brief Error at the last update. */
+        float previousError = 0;
+
+        /* @brief Has there been an update since the last reset? */
+        bool primed = false;
+};
+
+#endif
\ No newline at end of file
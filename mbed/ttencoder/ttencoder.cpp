@@ -16,62 +16,295 @@
 */
 
 #include "ttencoder.h"
+#include "us_ticker_api.h"
+#include <cmath>
 
-TTEncoder::TTEncoder(PinName inA, PinName inB, PinMode inAMode, PinMode inBMode){
-    this->inA = new InterruptIn(inA, inAMode);
-    this->inB = new InterruptIn(inB, inBMode);
+//Codes are (inA << 1) | inB. Clockwise runs 2, 3, 1, 0, the same order as the state machine ISRs.
+const int8_t TTEncoder::transitionTable[16] = {
+    //To:   0                   1                   2                   3
+            0,                  -1,                 1,                  illegalTransition,  //From 0
+            1,                  0,                  illegalTransition,  -1,                 //From 1
+            -1,                 illegalTransition,  0,                  1,                  //From 2
+            illegalTransition,  1,                  -1,                 0                   //From 3
+};
 
-    this->inA->rise(callback(this, &TTEncoder::inARiseISR));
-    this->inA->fall(callback(this, &TTEncoder::inAFallISR));
-    this->inB->rise(callback(this, &TTEncoder::inBRiseISR));
-    this->inB->fall(callback(this, &TTEncoder::inBFallISR));
+TTEncoder::TTEncoder(PinName inA, PinName inB, PinMode inAMode, PinMode inBMode)
+    : pinA(inA), pinB(inB), modeA(inAMode), modeB(inBMode){
+    AttachInterrupts();
+}
+
+TTEncoder::~TTEncoder(){
+    if(dispatcher != 0){
+        dispatcher->Remove(*this);
+    }
 }
 
 int TTEncoder::getInterruptCount(void){
-    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
-        return TT_MUTEX_TIMEOUT;
+    TTEncoderTimer *counter = timer;
+    if(counter != 0){
+        return (int)counter->Read();
     }
-    else{
-        int retval = changeCount[clockwise] - changeCount[anticlockwise];
-        mtx.unlock();
-        return retval;
+
+    return core_util_atomic_load_s32(&netCount);
+}
+
+int64_t TTEncoder::getInterruptCount64(void){
+    TTEncoderTimer *counter = timer;
+    if(counter != 0){
+        return counter->Read();
     }
+
+    //Interrupt counts are 32 bit, sign extend the net count.
+    return core_util_atomic_load_s32(&netCount);
+}
+
+float TTEncoder::GetVelocity(void){
+    TTEncoderTimer *counter = timer;
+    if(counter != 0){
+        //Callers in other contexts share the window, so sample and update it in one go.
+        core_util_critical_section_enter();
+        int64_t count = counter->Read();
+        uint32_t now = us_ticker_read();
+        uint32_t elapsed = now - counterTime;
+
+        if(elapsed >= TTENCODER_VELOCITY_WINDOW_US){
+            counterVelocity = (count - counterCount) * 1000000.0f / elapsed;
+            counterTime = now;
+            counterCount = count;
+        }
+
+        float velocity = counterVelocity;
+        core_util_critical_section_exit();
+        return velocity;
+    }
+
+    //Retry if the ISR overwrote the edges part way through reading them.
+    for(int attempt = 0; attempt < 3; attempt++){
+        uint32_t head = core_util_atomic_load_u32(&edgeHead);
+        uint32_t now = us_ticker_read();
+
+        if(head < 2){
+            return 0;
+        }
+
+        uint32_t available = head < TTENCODER_EDGE_BUFFER_LENGTH ? head : TTENCODER_EDGE_BUFFER_LENGTH;
+        Edge newest = edges[(head - 1) % TTENCODER_EDGE_BUFFER_LENGTH];
+        uint32_t since = now - newest.time;
+
+        if(since > TTENCODER_VELOCITY_TIMEOUT_US){
+            return 0;
+        }
+
+        //Frequency over half the buffer while it spans a short time, otherwise the period of the last cycle.
+        //The other half is slack for edges arriving while this one reads.
+        uint32_t span = available - 1;
+        if(span > TTENCODER_EDGE_BUFFER_LENGTH / 2){
+            span = TTENCODER_EDGE_BUFFER_LENGTH / 2;
+        }
+
+        Edge oldest = edges[(head - 1 - span) % TTENCODER_EDGE_BUFFER_LENGTH];
+        if(newest.time - oldest.time > TTENCODER_VELOCITY_WINDOW_US && span > 4){
+            span = 4;
+            oldest = edges[(head - 1 - span) % TTENCODER_EDGE_BUFFER_LENGTH];
+        }
+
+        if(core_util_atomic_load_u32(&edgeHead) - head > TTENCODER_EDGE_BUFFER_LENGTH - 1 - span){
+            continue;
+        }
+
+        uint32_t elapsed = newest.time - oldest.time;
+        if(elapsed == 0){
+            return 0;
+        }
+
+        float velocity = (newest.count - oldest.count) * 1000000.0f / elapsed;
+
+        //No edge for longer than a count takes means the shaft has slowed to at most one count in that time.
+        if(since > 0){
+            float limit = 1000000.0f / since;
+            if(fabsf(velocity) > limit){
+                velocity = velocity > 0 ? limit : -limit;
+            }
+        }
+
+        return velocity;
+    }
+
+    //Edges kept arriving faster than they could be read.
+    return 0;
 }
 
 int TTEncoder::getInterruptCount(int direction){
+    TTEncoderTimer *counter = timer;
+    if(counter != 0){
+        return counter->Read(direction);
+    }
+
+    return core_util_atomic_load_u32(&changeCount[direction]);
+}
+
+int TTEncoder::Reset(void){
+    TTEncoderTimer *counter = timer;
+    if(counter != 0){
+        counter->Reset(0);
+        return TT_SUCCESS;
+    }
+
+    //Keep the counts consistent with each other if an edge arrives part way through.
+    core_util_critical_section_enter();
+    changeCount[clockwise] = 0;
+    changeCount[anticlockwise] = 0;
+    netCount = 0;
+
+    //Old edges hold old counts.
+    edgeHead = 0;
+    core_util_critical_section_exit();
+    return TT_SUCCESS;
+}
+
+int TTEncoder::UseHardwareCounter(bool enable){
     if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
         return TT_MUTEX_TIMEOUT;
     }
     else{
-        int retval =  changeCount[direction];
+        int retval = TT_SUCCESS;
+
+        if(dispatcher != 0){
+            //The dispatcher has the pins.
+            retval = TT_HARDWARE_UNSUPPORTED;
+        }
+        else if(enable && timer == 0){
+            //Free the pins for the timer.
+            int32_t count = netCount;
+            DetachInterrupts();
+
+            TTEncoderTimer *counter = timerStorage.Construct(pinA, pinB, modeA, modeB);
+            if(counter->IsSupported()){
+                counter->Reset(count);
+                counterTime = us_ticker_read();
+                counterCount = count;
+                counterVelocity = 0;
+                timer = counter;
+            }
+            else{
+                timerStorage.Destroy();
+                AttachInterrupts();
+                retval = TT_HARDWARE_UNSUPPORTED;
+            }
+        }
+        else if(!enable && timer != 0){
+            TTEncoderTimer *counter = timer;
+
+            //Readers fall back to the interrupt counts as soon as timer is cleared.
+            core_util_critical_section_enter();
+            netCount = (int32_t)counter->Read();
+            changeCount[clockwise] = 0;
+            changeCount[anticlockwise] = 0;
+            timer = 0;
+            core_util_critical_section_exit();
+
+            timerStorage.Destroy();
+            AttachInterrupts();
+        }
+
         mtx.unlock();
         return retval;
     }
 }
 
-int TTEncoder::Reset(void){
+void TTEncoder::AttachInterrupts(void){
+    if(inA == 0){
+        inA = inAStorage.Construct(pinA, modeA);
+    }
+
+    if(inB == 0){
+        inB = inBStorage.Construct(pinB, modeB);
+    }
+
+    if(lookupTable){
+        //Start from the real pin levels so the first edge decodes properly.
+        lastCode = (inA->read() << 1) | inB->read();
+
+        inA->rise(callback(this, &TTEncoder::EdgeISR));
+        inA->fall(callback(this, &TTEncoder::EdgeISR));
+        inB->rise(callback(this, &TTEncoder::EdgeISR));
+        inB->fall(callback(this, &TTEncoder::EdgeISR));
+    }
+    else{
+        inA->rise(callback(this, &TTEncoder::inARiseISR));
+        inA->fall(callback(this, &TTEncoder::inAFallISR));
+        inB->rise(callback(this, &TTEncoder::inBRiseISR));
+        inB->fall(callback(this, &TTEncoder::inBFallISR));
+    }
+}
+
+void TTEncoder::DetachInterrupts(void){
+    //No handlers on either edge clears the line's interrupt mask before the pin is freed.
+    if(inA != 0){
+        inA->rise(nullptr);
+        inA->fall(nullptr);
+    }
+
+    if(inB != 0){
+        inB->rise(nullptr);
+        inB->fall(nullptr);
+    }
+
+    inA = 0;
+    inB = 0;
+    inAStorage.Destroy();
+    inBStorage.Destroy();
+}
+
+int TTEncoder::getIllegalTransitionCount(void){
+    return core_util_atomic_load_u32(&illegalCount);
+}
+
+#if TTLIBS_INSTRUMENT
+TTInstrumentSnapshot TTEncoder::getEdgeInstrumentation(void){
+    return edgeProbe.Snapshot();
+}
+
+void TTEncoder::resetInstrumentation(void){
+    core_util_critical_section_enter();
+    edgeProbe.Reset();
+    core_util_critical_section_exit();
+}
+#endif
+
+int TTEncoder::UseLookupTable(bool enable){
     if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
         return TT_MUTEX_TIMEOUT;
     }
     else{
-        changeCount[clockwise] = 0;
-        changeCount[anticlockwise] = 0;
+        lookupTable = enable;
+
+        //The hardware counter and dispatcher don't use the ISRs, they are attached when either lets go.
+        if(timer == 0 && dispatcher == 0){
+            AttachInterrupts();
+        }
+
         mtx.unlock();
         return TT_SUCCESS;
     }
 }
 
-int TTEncoder::SetOnInterruptCallback(function<void()> callback){
+int TTEncoder::SetOnInterruptCallback(Callback<void()> callback){
     if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
         return TT_MUTEX_TIMEOUT;
     }
     else{
+        //Everything but the driver callbacks, a moving TTDcMotor would never see its move end.
         bool existingCallback = false;
-        if(onInterruptCallback != 0){
-            existingCallback = true;
+        for(int i = 0; i < TT_CALLBACK_LIST_LENGTH; i++){
+            core_util_critical_section_enter();
+            if((driverHandles & (1u << i)) == 0 && onInterruptCallbacks.Unsubscribe(i)){
+                existingCallback = true;
+            }
+            core_util_critical_section_exit();
         }
 
-        onInterruptCallback = callback;
+        onInterruptCallbacks.Subscribe(callback);
 
         mtx.unlock();
 
@@ -84,91 +317,185 @@ int TTEncoder::SetOnInterruptCallback(function<void()> callback){
     }
 }
 
+int TTEncoder::AddOnInterruptCallback(Callback<void()> callback){
+    int handle = onInterruptCallbacks.Subscribe(callback);
+    return handle >= 0 ? handle : TT_CALLBACK_LIST_FULL;
+}
+
+int TTEncoder::RemoveOnInterruptCallback(int handle){
+    if(handle >= 0 && handle < TT_CALLBACK_LIST_LENGTH && (core_util_atomic_load_u32(&driverHandles) & (1u << handle)) != 0){
+        return TT_INVALID_CALLBACK;
+    }
+
+    return onInterruptCallbacks.Unsubscribe(handle) ? TT_SUCCESS : TT_INVALID_CALLBACK;
+}
+
+int TTEncoder::AddDriverCallback(Callback<void()> callback){
+    //Marked in the same critical section so SetOnInterruptCallback() never sees it unmarked.
+    core_util_critical_section_enter();
+    int handle = onInterruptCallbacks.Subscribe(callback);
+    if(handle >= 0){
+        driverHandles |= 1u << handle;
+    }
+    core_util_critical_section_exit();
+
+    return handle >= 0 ? handle : TT_CALLBACK_LIST_FULL;
+}
+
+void TTEncoder::RemoveDriverCallback(int handle){
+    core_util_critical_section_enter();
+    driverHandles &= ~(1u << handle);
+    onInterruptCallbacks.Unsubscribe(handle);
+    core_util_critical_section_exit();
+}
+
+
+void TTEncoder::RecordEdge(void){
+    Edge &edge = edges[edgeHead % TTENCODER_EDGE_BUFFER_LENGTH];
+    edge.time = us_ticker_read();
+    edge.count = netCount;
+    edgeHead++;
+    TT_TRACE(TT_TRACE_ENCODER_EDGE, ttTraceSource(this), (uint16_t)netCount);
+}
+
+void TTEncoder::EdgeISR(void){
+    TT_INSTRUMENT_SCOPE(edgeProbe);
+
+    Decode((inA->read() << 1) | inB->read());
+
+    onInterruptCallbacks.Call();
+}
+
+bool TTEncoder::Decode(uint8_t code){
+    int8_t delta = transitionTable[(lastCode << 2) | code];
+    lastCode = code;
+
+    if(delta == 1){
+        changeCount[clockwise]++;
+        netCount++;
+    }
+    else if(delta == -1){
+        changeCount[anticlockwise]++;
+        netCount--;
+    }
+    else if(delta == illegalTransition){
+        //Missed an edge, direction unknown.
+        illegalCount++;
+        TT_INSTRUMENT_DROP(edgeProbe);
+    }
+
+    if(delta == 1 || delta == -1){
+        RecordEdge();
+        return true;
+    }
+
+    return false;
+}
 
 void TTEncoder::inARiseISR(void){
+    TT_INSTRUMENT_SCOPE(edgeProbe);
+
     switch(state){
         case 2:
             changeCount[anticlockwise]++;
+            netCount--;
             state = 1;
+            RecordEdge();
             break;
 
         case 3:
             changeCount[clockwise]++;
+            netCount++;
             state = 0;
+            RecordEdge();
             break;
 
         default:
             //Illegal
+            TT_INSTRUMENT_DROP(edgeProbe);
             break;
     }
 
-    if(onInterruptCallback != 0){
-        onInterruptCallback();
-    }
+    onInterruptCallbacks.Call();
 }
 
 void TTEncoder::inAFallISR(void){
+    TT_INSTRUMENT_SCOPE(edgeProbe);
+
     switch(state){
         case 0:
             changeCount[anticlockwise]++;
+            netCount--;
             state = 3;
+            RecordEdge();
             break;
 
         case 1:
             changeCount[clockwise]++;
+            netCount++;
             state = 2;
+            RecordEdge();
             break;
 
         default:
             //Illegal
+            TT_INSTRUMENT_DROP(edgeProbe);
             break;
     }
 
-    if(onInterruptCallback != 0){
-        onInterruptCallback();
-    }
+    onInterruptCallbacks.Call();
 }
 
 void TTEncoder::inBRiseISR(void){
+    TT_INSTRUMENT_SCOPE(edgeProbe);
+
     switch(state){
         case 0:
             changeCount[clockwise]++;
+            netCount++;
             state = 1;
+            RecordEdge();
             break;
 
         case 3:
             changeCount[anticlockwise]++;
+            netCount--;
             state = 2;
+            RecordEdge();
             break;
 
         default:
             //Illegal
+            TT_INSTRUMENT_DROP(edgeProbe);
             break;
     }
 
-    if(onInterruptCallback != 0){
-        onInterruptCallback();
-    }
+    onInterruptCallbacks.Call();
 }
 
 void TTEncoder::inBFallISR(void){
+    TT_INSTRUMENT_SCOPE(edgeProbe);
+
     switch(state){
         case 1:
             changeCount[anticlockwise]++;
+            netCount--;
             state = 0;
+            RecordEdge();
             break;
         
         case 2:
             changeCount[clockwise]++;
+            netCount++;
             state = 3;
+            RecordEdge();
             break;
 
         default:
             //Illegal
+            TT_INSTRUMENT_DROP(edgeProbe);
             break;
     }
 
-    if(onInterruptCallback != 0){
-        onInterruptCallback();
-    }
+    onInterruptCallbacks.Call();
 }
\ No newline at end of file
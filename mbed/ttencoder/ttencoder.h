@@ -17,10 +17,29 @@
 #ifndef TT_ENCODER_H
 #define TT_ENCODER_H
 
+/* @brief Number of timestamped edges kept for velocity estimation. Must be a power of two. */
+#define TTENCODER_EDGE_BUFFER_LENGTH 16
+
+/* @brief Above this edge span velocity is measured over one quadrature cycle rather than the whole buffer. */
+#define TTENCODER_VELOCITY_WINDOW_US 10000
+
+/* @brief Velocity reads zero when there has been no edge for this long. */
+#define TTENCODER_VELOCITY_TIMEOUT_US 250000
+
 #include "mbed.h"
+#include "ttcallbacklist.h"
 #include "ttconstants.h"
+#include "ttencoderdispatcher.h"
+#include "ttencodertimer.h"
+#include "ttinplace.h"
+#include "ttinstrument.h"
+#include "tttrace.h"
 
 class TTEncoder{
+
+    friend class TTEncoderDispatcher;
+    friend class TTDcMotor;
+
     public:
         /*
         * @brief Create an asynchronus interrupt-driven encoder object to track shaft interrupts.
@@ -33,35 +52,116 @@ class TTEncoder{
 
         /*
         * @brief Get the net number of inA and inB have risen AND fallen. 
-        * @returns Net inA and inB count or negative error code.
-        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        * Wait-free, safe to call from any context including ISRs.
+        * @returns Net inA and inB count.
         */
         int getInterruptCount(void);
 
+        /*
+        * @brief Get the net number of inA and inB have risen AND fallen, without wrapping at 32 bits.
+        * Wait-free with the interrupt decoder, a short critical section with the hardware counter.
+        * @returns Net inA and inB count.
+        */
+        int64_t getInterruptCount64(void);
+
+        /*
+        * @brief Get the shaft velocity from the edge timestamps. Constant time, safe to call from any context.
+        * At high speed the count over the newest half of the edge buffer is divided by its time span. At low speed the period
+        * of the last quadrature cycle is used, limited by the time since the last edge so it decays when stopping.
+        * With the hardware counter the count is averaged over TTENCODER_VELOCITY_WINDOW_US between calls.
+        * @returns Velocity in counts/s. Positive = clockwise, negative = anti-clockwise.
+        */
+        float GetVelocity(void);
+
         /*
         * @brief Get the number of times inA and inB have risen AND fallen in a specific direction.
+        * Wait-free, safe to call from any context including ISRs.
         * @param direction Can be "thisObject".clockwise or "thisObject".anticlockwise.
-        * @returns Net inA and inB count in a direction or negative error code.
-        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        * @returns Net inA and inB count in a direction.
         */
         int getInterruptCount(int direction);
         
         /*
-        * @brief Reset all interrupt counts to zero.
+        * @brief Reset all interrupt counts to zero. Safe to call from any context including ISRs.
+        * @returns TT_SUCCESS.
+        */
+        int Reset(void);
+
+        /*
+        * @brief Get the number of illegal transitions seen, where both inA and inB changed between interrupts.
+        * Only counted when decoding with the lookup table. Each one is at least one lost count.
+        * @returns Illegal transition count.
+        */
+        int getIllegalTransitionCount(void);
+
+#if TTLIBS_INSTRUMENT
+        /*
+        * @brief Get timing statistics for the edge ISRs, including the interrupt callback.
+        * Dropped counts illegal transitions in either decoding mode.
+        * @returns Snapshot of the edge ISR statistics.
+        */
+        TTInstrumentSnapshot getEdgeInstrumentation(void);
+
+        /* @brief Clear the edge ISR statistics. */
+        void resetInstrumentation(void);
+#endif
+
+        /*
+        * @brief Decode with one ISR per pin that reads both pins and looks the transition up in a table,
+        * instead of a state machine ISR per edge. Cheaper per edge and counts illegal transitions.
+        * Takes effect when the encoder leaves a TTEncoderDispatcher, which always uses the lookup table.
+        * @param enable Use the lookup table?
         * @returns TT_SUCCESS or negative error code.
         * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
         */
-        int Reset(void);
+        int UseLookupTable(bool enable);
+
+        /*
+        * @brief Count edges with a timer in encoder mode instead of pin interrupts, so edges cost no CPU time.
+        * Only possible when inA and inB are channels 1 and 2 of a timer with an encoder mode, see TTEncoderTimer.
+        * The net count carries over, direction counts restart from zero. Edges during the switch may be missed.
+        * Don't switch while other threads are reading the counts.
+        * @warning The interrupt callback is not called per edge while the hardware counter is in use.
+        * @param enable Use the hardware counter?
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        * @retval TT_HARDWARE_UNSUPPORTED These pins can't be counted in hardware or the encoder is in a
+        * TTEncoderDispatcher, interrupts are still used.
+        */
+        int UseHardwareCounter(bool enable);
 
         /*
-        * @brief Set a single void callback function to be called on inA or inB interrupt.
-        * This function will OVERWRITE any exisitng callback.
+        * @brief Set a single void callback function to be called on inA or inB interrupt. Runs in the edge ISR, keep it short.
+        * This function will OVERWRITE any exisitng callbacks, use AddOnInterruptCallback() to keep them. The callback a
+        * TTDcMotor adds for the length of a Move() is left in place.
+        * @warning Not called while the hardware counter is in use or the encoder is in a TTEncoderDispatcher.
         * @param callack Function to call. 
         * @returns TT_SUCCESS or negative error code.
         * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
         * @retval TT_OVERWROTE_CALLBACK TO set this callback, the existing callback had to be overwritten.
         */
-        int SetOnInterruptCallback(function<void()> callback);
+        int SetOnInterruptCallback(Callback<void()> callback);
+
+        /*
+        * @brief Add a callback to be called on inA or inB interrupt, alongside any others. Runs in the edge ISR, keep it short.
+        * Safe to call from any context including ISRs.
+        * @warning Not called while the hardware counter is in use or the encoder is in a TTEncoderDispatcher.
+        * @param callback Function to call.
+        * @returns Handle for RemoveOnInterruptCallback() or negative error code.
+        * @retval TT_CALLBACK_LIST_FULL TT_CALLBACK_LIST_LENGTH callbacks are already added.
+        */
+        int AddOnInterruptCallback(Callback<void()> callback);
+
+        /*
+        * @brief Remove a callback added with AddOnInterruptCallback(). Safe to call from any context including ISRs.
+        * @param handle Handle from AddOnInterruptCallback().
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_INVALID_CALLBACK No callback is added with the handle, or it belongs to a TTDcMotor.
+        */
+        int RemoveOnInterruptCallback(int handle);
+
+        /* @brief Leaves any TTEncoderDispatcher it is in. */
+        ~TTEncoder();
 
         /* @brief Convenient contextual shortcut to TTConstants. */
         enum direction{clockwise = TT_CLOCKWISE, anticlockwise = TT_ANTICLOCKWISE};
@@ -70,18 +170,111 @@ class TTEncoder{
         /* @brief Make this class thread safe by protecting members from simultaneous access. */
         Mutex mtx;
 
-        /* @brief Encoder output A input. */
+        /* @brief Encoder output A input. 0 while the hardware counter is in use. */
         InterruptIn *inA = 0;
 
-        /* @brief Encoder output B input. */
+        /* @brief Encoder output B input. 0 while the hardware counter is in use. */
         InterruptIn *inB = 0;
 
+        /* @brief Encoder output A pin. */
+        PinName pinA;
+
+        /* @brief Encoder output B pin. */
+        PinName pinB;
+
+        /* @brief Pin mode for the encoder output A input. */
+        PinMode modeA;
+
+        /* @brief Pin mode for the encoder output B input. */
+        PinMode modeB;
+
+        /* @brief Decode with the lookup table ISR? */
+        bool lookupTable = false;
+
+        /* @brief Hardware counter, 0 while interrupts are used. */
+        TTEncoderTimer *volatile timer = 0;
+
+        /* @brief Dispatcher taking the edges, 0 while the encoder has its own pin interrupts. */
+        TTEncoderDispatcher *dispatcher = 0;
+
+        /* @brief Storage for the pin interrupts and hardware counter so neither uses the heap. */
+        TTInPlace<InterruptIn> inAStorage, inBStorage;
+
+        /* @brief Storage for the hardware counter. */
+        TTInPlace<TTEncoderTimer> timerStorage;
+
+        /* @brief Create the pin interrupts if needed and attach the ISRs for the decoding mode. */
+        void AttachInterrupts(void);
+
+        /* @brief Detach the ISRs and free the pin interrupts, which turns their EXTI lines off. */
+        void DetachInterrupts(void);
+
+        /* @brief A counted edge. */
+        struct Edge{
+            /* @brief us ticker time of the edge. */
+            uint32_t time;
+
+            /* @brief Net count after the edge. */
+            int32_t count;
+        };
+
+        /* @brief Most recent counted edges, written by the ISRs. */
+        Edge edges[TTENCODER_EDGE_BUFFER_LENGTH];
+
+        /* @brief Number of edges ever recorded. The newest is at (edgeHead - 1) % TTENCODER_EDGE_BUFFER_LENGTH. */
+        volatile uint32_t edgeHead = 0;
+
+        /* @brief Timestamp the net count after a counted edge. */
+        void RecordEdge(void);
+
+        /* @brief Hardware counter velocity, updated once per TTENCODER_VELOCITY_WINDOW_US. */
+        float counterVelocity = 0;
+
+        /* @brief Time of the last hardware counter velocity update. */
+        uint32_t counterTime = 0;
+
+        /* @brief Count at the last hardware counter velocity update. */
+        int64_t counterCount = 0;
+
         /* @brief Record the number of interrupts in clockwise and anticlockwise directions. */
         volatile uint32_t changeCount[2] = {0};
+
+        /* 
+        * @brief Net interrupt count, kept alongside changeCount so it can be read as one word.
+        * Only written by the ISRs or inside a critical section.
+        */
+        volatile int32_t netCount = 0;
         
         /* @brief Save the current state in the encoder wave sequence for the next interrupt. */
         int state = 0;
 
+        /* @brief Last inA (bit 1) and inB (bit 0) levels seen by EdgeISR. */
+        uint8_t lastCode = 0;
+
+        /* @brief Number of transitions where both pins changed. */
+        volatile uint32_t illegalCount = 0;
+
+#if TTLIBS_INSTRUMENT
+        /* @brief Edge ISR timing. */
+        TTInstrumentProbe edgeProbe;
+#endif
+
+        /* @brief Marks a transition table entry where both pins changed. */
+        static const int8_t illegalTransition = 2;
+
+        /* @brief Count change indexed by (previous code << 2) | current code. */
+        static const int8_t transitionTable[16];
+
+        /* @brief Read both pins and record the transition from the lookup table. Used for every edge on both pins. */
+        void EdgeISR(void);
+
+        /*
+        * @brief Record the transition to new pin levels from the lookup table. Call from the edge interrupt.
+        * @param code inA (bit 1) and inB (bit 0) levels.
+        * @returns Was a count recorded?
+        */
+        bool Decode(uint8_t code);
+
         /* @brief Update the state machine and record interrupt in a direction. */
         void inARiseISR(void);
 
@@ -94,8 +287,30 @@ class TTEncoder{
         /* @brief Update the state machine and record interrupt in a direction. */
         void inBFallISR(void);
 
-        /* @brief Store the interrupt callback. */
-        function<void()> onInterruptCallback = 0;
+        /* @brief Store the interrupt callbacks. */
+        TTCallbackList<void()> onInterruptCallbacks;
+
+        /* @brief Handles of the callbacks drivers added for themselves, SetOnInterruptCallback() doesn't remove them. */
+        volatile uint32_t driverHandles = 0;
+
+        /*
+        * @brief Add a callback for a driver using this encoder. Safe to call from any context including ISRs.
+        * @returns Handle for RemoveDriverCallback() or TT_CALLBACK_LIST_FULL.
+        */
+        int AddDriverCallback(Callback<void()> callback);
+
+        /* @brief Remove a callback added with AddDriverCallback(). Safe to call from any context including ISRs. */
+        void RemoveDriverCallback(int handle);
+};
+
+/*
+* @brief TTEncoder with its pins fixed at compile time.
+* e.g. TTEncoderT<PA_0, PA_1> encoder;
+*/
+template<PinName APin, PinName BPin, PinMode AMode = PullDefault, PinMode BMode = PullDefault>
+class TTEncoderT : public TTEncoder{
+    public:
+        TTEncoderT() : TTEncoder(APin, BPin, AMode, BMode){}
 };
 
 
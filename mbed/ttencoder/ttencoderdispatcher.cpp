@@ -0,0 +1,368 @@
+/**
+*     _____ _____ ___                 _
+*    |_   _|_   _| __|_ _  __ ___  __| |___ _ _
+*      | |   | | | _|| ' \/ _/ _ \/ _` / -_) '_|
+*      |_|   |_| |___|_||_\__\___/\__,_\___|_|
+*
+*
+* @file TTEncoderDispatcher.cpp
+* @brief This file contains the functions associated with TTEncoderDispatcher.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "ttencoderdispatcher.h"
+#include "ttencoder.h"
+
+#if TTENCODER_DISPATCHER_EXTI
+TTEncoderDispatcher *TTEncoderDispatcher::owner = 0;
+
+uint32_t TTEncoderDispatcher::previousVectors[7] = {0};
+
+const uint16_t TTEncoderDispatcher::vectorLines[7] = {0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x03E0, 0xFC00};
+#endif
+
+TTEncoderDispatcher::TTEncoderDispatcher(){
+#if TTENCODER_DISPATCHER_EXTI
+    core_util_critical_section_enter();
+    if(owner == 0){
+        owner = this;
+        supported = true;
+    }
+    core_util_critical_section_exit();
+
+    if(supported){
+        //EXTICR lives in SYSCFG.
+        __HAL_RCC_SYSCFG_CLK_ENABLE();
+    }
+#else
+    supported = TTENCODER_DISPATCHER_SUPPORTED;
+#endif
+}
+
+bool TTEncoderDispatcher::IsSupported(void){
+    return supported;
+}
+
+int TTEncoderDispatcher::Add(TTEncoder &encoder){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else if(!encoder.mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        mtx.unlock();
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        int retval = TT_HARDWARE_UNSUPPORTED;
+
+#if TTENCODER_DISPATCHER_SUPPORTED
+        int free = -1;
+        for(int i = TTENCODER_DISPATCHER_MAX_ENCODERS - 1; i >= 0; i--){
+            if((usedSlots & (1u << i)) == 0){
+                free = i;
+            }
+            else if(slots[i].encoder == &encoder){
+                retval = i;
+            }
+        }
+
+        uint32_t lineA = STM_PIN(encoder.pinA);
+        uint32_t lineB = STM_PIN(encoder.pinB);
+        uint16_t pinLines = (1u << lineA) | (1u << lineB);
+
+        bool clash = lineA == lineB || (lineMask & pinLines) != 0;
+
+        if(retval < 0 && supported && free >= 0 && !clash && encoder.dispatcher == 0 && encoder.timer == 0){
+            int portA = PortIndex(encoder.pinA);
+            int portB = PortIndex(encoder.pinB);
+
+            //Free the pins for the dispatcher. The encoder's own interrupts have its lines enabled until they go.
+            encoder.DetachInterrupts();
+#if TTENCODER_DISPATCHER_EXTI_IMR
+            //Lines another driver has set up.
+            clash = (EXTI->IMR & pinLines) != 0;
+#endif
+
+            if(portA < 0 || portB < 0 || clash){
+                encoder.AttachInterrupts();
+            }
+            else{
+                Slot &slot = slots[free];
+                slot.encoder = &encoder;
+                slot.portA = portA;
+                slot.portB = portB;
+                slot.bitA = lineA;
+                slot.bitB = lineB;
+                slot.lines = pinLines;
+
+                AttachPin(free * 2, encoder.pinA, encoder.modeA);
+                AttachPin(free * 2 + 1, encoder.pinB, encoder.modeB);
+
+                //Start from the real pin levels so the first edge decodes properly.
+                encoder.lastCode = (ReadLevel(portA, lineA) << 1) | ReadLevel(portB, lineB);
+                encoder.dispatcher = this;
+
+                core_util_critical_section_enter();
+                usedSlots |= 1u << free;
+                lineMask |= pinLines;
+#if TTENCODER_DISPATCHER_EXTI
+                EXTI->PR = pinLines;
+                EXTI->IMR |= pinLines;
+#endif
+                core_util_critical_section_exit();
+
+#if !TTENCODER_DISPATCHER_EXTI
+                for(int input = free * 2; input <= free * 2 + 1; input++){
+                    inputs[input].Get()->rise(callback(&lines[input], &Line::ISR));
+                    inputs[input].Get()->fall(callback(&lines[input], &Line::ISR));
+                }
+#endif
+
+                retval = free;
+            }
+        }
+#endif
+
+        encoder.mtx.unlock();
+        mtx.unlock();
+        return retval;
+    }
+}
+
+int TTEncoderDispatcher::Remove(TTEncoder &encoder){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else if(!encoder.mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        mtx.unlock();
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        int retval = TT_NO_REGISTERED_ENCODER;
+
+#if TTENCODER_DISPATCHER_SUPPORTED
+        for(uint32_t i = 0; i < TTENCODER_DISPATCHER_MAX_ENCODERS; i++){
+            if((usedSlots & (1u << i)) != 0 && slots[i].encoder == &encoder){
+                //Dispatch() can't see the slot once it is out of usedSlots.
+                core_util_critical_section_enter();
+                usedSlots &= ~(1u << i);
+                lineMask &= ~slots[i].lines;
+#if TTENCODER_DISPATCHER_EXTI
+                EXTI->IMR &= ~(uint32_t)slots[i].lines;
+#endif
+                core_util_critical_section_exit();
+
+                DetachPin(i * 2, encoder.pinA);
+                DetachPin(i * 2 + 1, encoder.pinB);
+
+                encoder.dispatcher = 0;
+                encoder.AttachInterrupts();
+                retval = TT_SUCCESS;
+            }
+        }
+#endif
+
+        encoder.mtx.unlock();
+        mtx.unlock();
+        return retval;
+    }
+}
+
+int TTEncoderDispatcher::SetOnEdgesCallback(Callback<void(uint32_t)> callback){
+    if(!mtx.trylock_for(TT_DEFAULT_MUTEX_TIMEOUT)){
+        return TT_MUTEX_TIMEOUT;
+    }
+    else{
+        bool existingCallback = false;
+        if(!onEdgesCallbacks.IsEmpty()){
+            existingCallback = true;
+        }
+
+        onEdgesCallbacks.Clear();
+        onEdgesCallbacks.Subscribe(callback);
+
+        mtx.unlock();
+
+        if(existingCallback){
+            return TT_OVERWROTE_CALLBACK;
+        }
+        else{
+            return TT_SUCCESS;
+        }
+    }
+}
+
+int TTEncoderDispatcher::AddOnEdgesCallback(Callback<void(uint32_t)> callback){
+    int handle = onEdgesCallbacks.Subscribe(callback);
+    return handle >= 0 ? handle : TT_CALLBACK_LIST_FULL;
+}
+
+int TTEncoderDispatcher::RemoveOnEdgesCallback(int handle){
+    return onEdgesCallbacks.Unsubscribe(handle) ? TT_SUCCESS : TT_INVALID_CALLBACK;
+}
+
+TTEncoderDispatcher::~TTEncoderDispatcher(){
+#if TTENCODER_DISPATCHER_SUPPORTED
+    for(uint32_t i = 0; i < TTENCODER_DISPATCHER_MAX_ENCODERS; i++){
+        if((usedSlots & (1u << i)) != 0){
+            Remove(*slots[i].encoder);
+        }
+    }
+#endif
+
+#if TTENCODER_DISPATCHER_EXTI
+    if(supported){
+        owner = 0;
+    }
+#endif
+}
+
+void TTEncoderDispatcher::NotifyHandler(void){
+    if(!scheduler.Defer(callback(this, &TTEncoderDispatcher::Deliver))){
+        //The deferred queue is full, try again later. Counts keep grouping meanwhile.
+        scheduler.Schedule(notifyTask, TTENCODER_DISPATCHER_NOTIFY_US);
+    }
+}
+
+void TTEncoderDispatcher::Deliver(void){
+    uint32_t moved = core_util_atomic_exchange_u32(&pendingSlots, 0);
+
+    if(moved != 0){
+        onEdgesCallbacks.Call(moved);
+    }
+}
+
+#if TTENCODER_DISPATCHER_SUPPORTED
+int TTEncoderDispatcher::PortIndex(PinName pin){
+    uint8_t number = STM_PORT(pin);
+
+    for(uint32_t i = 0; i < portCount; i++){
+        if(portNumbers[i] == number){
+            return i;
+        }
+    }
+
+    if(portCount == TTENCODER_DISPATCHER_MAX_PORTS){
+        return -1;
+    }
+
+    uint8_t index = portCount;
+    portNumbers[index] = number;
+#if TTENCODER_DISPATCHER_EXTI
+    ports[index] = (GPIO_TypeDef *)(GPIOA_BASE + number * (GPIOB_BASE - GPIOA_BASE));
+#else
+    ports[index] = portStorage[index].Construct((PortName)number, 0xFFFF);
+#endif
+
+    //Dispatch() reads ports up to portCount, the new one has to be ready first.
+    portCount = index + 1;
+    return index;
+}
+
+int TTEncoderDispatcher::ReadLevel(uint32_t port, uint32_t bit){
+#if TTENCODER_DISPATCHER_EXTI
+    return (ports[port]->IDR >> bit) & 1;
+#else
+    return (ports[port]->read() >> bit) & 1;
+#endif
+}
+
+void TTEncoderDispatcher::AttachPin(uint32_t input, PinName pin, PinMode mode){
+#if TTENCODER_DISPATCHER_EXTI
+    //DigitalIn enables the port clock and sets the pull.
+    inputs[input].Construct(pin, mode);
+
+    uint32_t line = STM_PIN(pin);
+    uint32_t shift = (line & 3) * 4;
+    SYSCFG->EXTICR[line >> 2] = (SYSCFG->EXTICR[line >> 2] & ~(0xFu << shift)) | ((uint32_t)STM_PORT(pin) << shift);
+
+    //Both edges of both pins, the same as the lookup table ISR.
+    EXTI->RTSR |= 1u << line;
+    EXTI->FTSR |= 1u << line;
+
+    ClaimVector(line, true);
+#else
+    inputs[input].Construct(pin, mode);
+    lines[input].owner = this;
+    lines[input].lines = 1u << STM_PIN(pin);
+#endif
+}
+
+void TTEncoderDispatcher::DetachPin(uint32_t input, PinName pin){
+#if TTENCODER_DISPATCHER_EXTI
+    uint32_t line = STM_PIN(pin);
+    EXTI->RTSR &= ~(1u << line);
+    EXTI->FTSR &= ~(1u << line);
+    ClaimVector(line, false);
+#else
+    (void)pin;
+#endif
+
+    inputs[input].Destroy();
+}
+
+void TTEncoderDispatcher::Dispatch(uint32_t fired){
+    uint32_t levels[TTENCODER_DISPATCHER_MAX_PORTS];
+    uint32_t count = portCount;
+
+    //One read per port, however many encoders are on it.
+    for(uint32_t i = 0; i < count; i++){
+#if TTENCODER_DISPATCHER_EXTI
+        levels[i] = ports[i]->IDR;
+#else
+        levels[i] = ports[i]->read();
+#endif
+    }
+
+    uint32_t used = usedSlots;
+    uint32_t counted = 0;
+
+    for(uint32_t i = 0; used != 0; i++, used >>= 1){
+        const Slot &slot = slots[i];
+
+        if((used & 1) != 0 && (slot.lines & fired) != 0){
+            uint8_t code = (((levels[slot.portA] >> slot.bitA) & 1) << 1) | ((levels[slot.portB] >> slot.bitB) & 1);
+
+            if(slot.encoder->Decode(code)){
+                counted |= 1u << i;
+            }
+        }
+    }
+
+    //One scheduled notification until it has run, however many edges arrive.
+    if(counted != 0 && !onEdgesCallbacks.IsEmpty() && core_util_atomic_fetch_or_u32(&pendingSlots, counted) == 0){
+        scheduler.Schedule(notifyTask, TTENCODER_DISPATCHER_NOTIFY_US);
+    }
+}
+#endif
+
+#if TTENCODER_DISPATCHER_EXTI
+void TTEncoderDispatcher::ClaimVector(uint32_t line, bool claim){
+    const uint32_t isrs[7] = {
+        (uint32_t)&ExtiISR<0>, (uint32_t)&ExtiISR<1>, (uint32_t)&ExtiISR<2>, (uint32_t)&ExtiISR<3>,
+        (uint32_t)&ExtiISR<4>, (uint32_t)&ExtiISR<5>, (uint32_t)&ExtiISR<6>
+    };
+
+    uint32_t vector = line < 5 ? line : (line < 10 ? 5 : 6);
+    IRQn_Type irq = vector < 5 ? (IRQn_Type)(EXTI0_IRQn + vector) : (vector == 5 ? EXTI9_5_IRQn : EXTI15_10_IRQn);
+
+    if(claim && previousVectors[vector] == 0){
+        core_util_critical_section_enter();
+        previousVectors[vector] = NVIC_GetVector(irq);
+        NVIC_SetVector(irq, isrs[vector]);
+        core_util_critical_section_exit();
+
+        NVIC_EnableIRQ(irq);
+    }
+    else if(!claim && previousVectors[vector] != 0 && (lineMask & vectorLines[vector]) == 0){
+        //Other drivers may still use the vector, leave it enabled.
+        core_util_critical_section_enter();
+        NVIC_SetVector(irq, previousVectors[vector]);
+        previousVectors[vector] = 0;
+        core_util_critical_section_exit();
+    }
+}
+#endif
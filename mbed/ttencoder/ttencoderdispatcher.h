@@ -0,0 +1,279 @@
+/**
+*     _____ _____ ___                 _
+*    |_   _|_   _| __|_ _  __ ___  __| |___ _ _
+*      | |   | | | _|| ' \/ _/ _ \/ _` / -_) '_|
+*      |_|   |_| |___|_||_\__\___/\__,_\___|_|
+*
+*
+* @file TTEncoderDispatcher.h
+* @brief This file contains TTEncoderDispatcher, one edge handler shared by many TTEncoders.
+*
+* Each TTEncoder normally takes its own pin interrupts, with mbed's per pin dispatch and a callback per edge. An encoder
+* added to a dispatcher gives up its InterruptIns instead. Every edge on any added pin runs one handler, which reads each
+* GPIO port the encoders use once and decodes only the encoders on the lines that fired, with the lookup table. User
+* code is told which encoders moved by one callback on the deferred thread, at most once per
+* TTENCODER_DISPATCHER_NOTIFY_US however fast the edges arrive.
+*
+* On STM32F2, STM32F4 and STM32F7 targets the dispatcher owns the EXTI lines and their vectors directly. Lines 5 to 9
+* and 10 to 15 share vectors with other pins, anything else pending on a shared vector is passed on to the handler
+* that was installed before. Each EXTI line number can only be used once across all ports. Other STM32 targets use one
+* InterruptIn per pin and a PortIn per port, which saves the per encoder reads and callbacks but not mbed's dispatch.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_ENCODER_DISPATCHER_H
+#define TT_ENCODER_DISPATCHER_H
+
+#include "mbed.h"
+#include "ttcallbacklist.h"
+#include "ttconstants.h"
+#include "ttinplace.h"
+#include "ttscheduler.h"
+#include <cstdint>
+
+#if defined(TARGET_STM32F2) || defined(TARGET_STM32F4) || defined(TARGET_STM32F7)
+    #define TTENCODER_DISPATCHER_EXTI 1
+#else
+    #define TTENCODER_DISPATCHER_EXTI 0
+#endif
+
+/* @brief Can EXTI->IMR show which lines other drivers have enabled? Families with one mask register can. */
+#if TTENCODER_DISPATCHER_EXTI || defined(EXTI_IMR_MR0) || defined(EXTI_IMR_IM0)
+    #define TTENCODER_DISPATCHER_EXTI_IMR 1
+#else
+    #define TTENCODER_DISPATCHER_EXTI_IMR 0
+#endif
+
+#if TTENCODER_DISPATCHER_EXTI || (DEVICE_PORTIN && DEVICE_INTERRUPTIN && defined(STM_PORT))
+    #define TTENCODER_DISPATCHER_SUPPORTED 1
+#else
+    #define TTENCODER_DISPATCHER_SUPPORTED 0
+#endif
+
+/* @brief Encoders one dispatcher can hold. No more than 32, the slots are passed as a bitmask. */
+#define TTENCODER_DISPATCHER_MAX_ENCODERS 8
+
+/* @brief GPIO ports one dispatcher can read. */
+#define TTENCODER_DISPATCHER_MAX_PORTS 4
+
+/* @brief Microseconds from the first count to the grouped callback, so it runs at most this often. */
+#define TTENCODER_DISPATCHER_NOTIFY_US 1000
+
+class TTEncoder;
+
+class TTEncoderDispatcher{
+    public:
+        /*
+        * @brief Create a dispatcher with no encoders. Only one can own the EXTI lines, IsSupported() is false for others.
+        */
+        TTEncoderDispatcher();
+
+        TTEncoderDispatcher(const TTEncoderDispatcher &) = delete;
+        TTEncoderDispatcher &operator=(const TTEncoderDispatcher &) = delete;
+
+        /*
+        * @brief Can encoders be added on this target?
+        * @returns Is the dispatcher usable?
+        */
+        bool IsSupported(void);
+
+        /*
+        * @brief Take over an encoder's edges. It decodes with the lookup table while added, whatever UseLookupTable()
+        * was set to, and keeps its counts. Edges during the switch may be missed. An encoder that can't be added keeps its
+        * own pin interrupts.
+        * @warning The encoder's interrupt callback is not called per edge while it is added, use SetOnEdgesCallback().
+        * @param encoder Encoder to add. Must not be using the hardware counter.
+        * @returns Slot of the encoder, as used in the SetOnEdgesCallback() bitmask, or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        * @retval TT_HARDWARE_UNSUPPORTED No free slot or port, the encoder is in another dispatcher or using the hardware
+        * counter, or one of its EXTI lines is already in use.
+        */
+        int Add(TTEncoder &encoder);
+
+        /*
+        * @brief Give an encoder its own pin interrupts back.
+        * @param encoder Encoder to remove.
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        * @retval TT_NO_REGISTERED_ENCODER The encoder isn't in this dispatcher.
+        */
+        int Remove(TTEncoder &encoder);
+
+        /*
+        * @brief Set a single callback for when added encoders count. Runs on the deferred thread
+        * TTENCODER_DISPATCHER_NOTIFY_US after the first count, once for every edge since it last ran.
+        * This function will OVERWRITE any exisitng callbacks, use AddOnEdgesCallback() to keep them.
+        * @param callback Function to call with a bitmask of the slots that counted.
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_MUTEX_TIMEOUT Timed out waiting for mutex lock.
+        * @retval TT_OVERWROTE_CALLBACK To set this callback, the existing callback had to be overwritten.
+        */
+        int SetOnEdgesCallback(Callback<void(uint32_t)> callback);
+
+        /*
+        * @brief Add a callback for when added encoders count, alongside any others. See SetOnEdgesCallback().
+        * Safe to call from any context including ISRs.
+        * @param callback Function to call with a bitmask of the slots that counted.
+        * @returns Handle for RemoveOnEdgesCallback() or negative error code.
+        * @retval TT_CALLBACK_LIST_FULL TT_CALLBACK_LIST_LENGTH callbacks are already added.
+        */
+        int AddOnEdgesCallback(Callback<void(uint32_t)> callback);
+
+        /*
+        * @brief Remove a callback added with AddOnEdgesCallback(). Safe to call from any context including ISRs.
+        * @param handle Handle from AddOnEdgesCallback().
+        * @returns TT_SUCCESS or negative error code.
+        * @retval TT_INVALID_CALLBACK No callback is added with the handle.
+        */
+        int RemoveOnEdgesCallback(int handle);
+
+        ~TTEncoderDispatcher();
+
+    private:
+        /* @brief Make this class thread safe by protecting members from simultaneous access. */
+        Mutex mtx;
+
+        /* @brief An added encoder and where its pins are. */
+        struct Slot{
+            /* @brief Encoder decoded from the pins. */
+            TTEncoder *encoder;
+
+            /* @brief Index into the port levels for inA and inB. */
+            uint8_t portA, portB;
+
+            /* @brief Bit of inA and inB in their port. */
+            uint8_t bitA, bitB;
+
+            /* @brief Line numbers of both pins, one bit per line. */
+            uint16_t lines;
+        };
+
+        /* @brief Added encoders, valid where usedSlots has a bit set. */
+        Slot slots[TTENCODER_DISPATCHER_MAX_ENCODERS];
+
+        /* @brief Bitmask of the slots in use. Only changed in a critical section. */
+        volatile uint32_t usedSlots = 0;
+
+        /* @brief STM_PORT() of each port read. */
+        uint8_t portNumbers[TTENCODER_DISPATCHER_MAX_PORTS];
+
+        /* @brief Number of ports read on every edge. Ports stay once added. */
+        volatile uint8_t portCount = 0;
+
+        /* @brief Line numbers in use, one bit per line. */
+        volatile uint16_t lineMask = 0;
+
+        /* @brief Slots that counted since the callback last ran. */
+        volatile uint32_t pendingSlots = 0;
+
+        /* @brief Called with the slots that counted. */
+        TTCallbackList<void(uint32_t)> onEdgesCallbacks;
+
+        /* @brief Shared scheduler the callback is deferred on. */
+        TTScheduler &scheduler = TTScheduler::Get();
+
+        /* @brief Defers the callback once the counts have had time to group. */
+        TTSchedulerTask notifyTask{callback(this, &TTEncoderDispatcher::NotifyHandler)};
+
+        /* @brief Is this the dispatcher that owns the EXTI lines? */
+        bool supported = false;
+
+        /*
+        * @brief Find or add the port a pin is on.
+        * @returns Index into the port levels, or -1 if there is no room.
+        */
+        int PortIndex(PinName pin);
+
+        /*
+        * @brief Read one pin from its port.
+        * @param port Index into the port levels.
+        * @param bit Bit of the pin in the port.
+        * @returns 0 or 1.
+        */
+        int ReadLevel(uint32_t port, uint32_t bit);
+
+        /* @brief Set a pin up for edges, they reach Dispatch() once the slot is in usedSlots. */
+        void AttachPin(uint32_t input, PinName pin, PinMode mode);
+
+        /* @brief Stop taking edges on a pin. */
+        void DetachPin(uint32_t input, PinName pin);
+
+        /*
+        * @brief Read every port once and decode each encoder on the lines that fired. Runs in interrupt context.
+        * @param fired Line numbers that fired, one bit per line.
+        */
+        void Dispatch(uint32_t fired);
+
+        /* @brief Pass the grouped counts to the deferred thread. Runs in the scheduler interrupt. */
+        void NotifyHandler(void);
+
+        /* @brief Run the callback with the slots that counted. Runs on the deferred thread. */
+        void Deliver(void);
+
+#if TTENCODER_DISPATCHER_EXTI
+    public:
+        /* @brief Vector for EXTI lines 0 to 4 and the shared 9_5 and 15_10 vectors, indexed the same as vectorLines. */
+        template<int vector> static void ExtiISR(){
+            uint32_t pending = EXTI->PR & EXTI->IMR & vectorLines[vector];
+            TTEncoderDispatcher *dispatcher = owner;
+            uint32_t mine = dispatcher != 0 ? pending & dispatcher->lineMask : 0;
+
+            if(mine != 0){
+                EXTI->PR = mine;
+                dispatcher->Dispatch(mine);
+            }
+
+            //Lines other drivers set up on a shared vector.
+            if(pending != mine && previousVectors[vector] != 0){
+                ((void (*)(void))previousVectors[vector])();
+            }
+        }
+
+    private:
+        /* @brief Input register of each port read. */
+        GPIO_TypeDef *ports[TTENCODER_DISPATCHER_MAX_PORTS];
+
+        /* @brief Pins configured as inputs, two per slot. */
+        TTInPlace<DigitalIn> inputs[TTENCODER_DISPATCHER_MAX_ENCODERS * 2];
+
+        /* @brief Take or give back the vector for a line as its first user arrives or last one leaves. */
+        void ClaimVector(uint32_t line, bool claim);
+
+        /* @brief The dispatcher that owns the EXTI lines. */
+        static TTEncoderDispatcher *owner;
+
+        /* @brief Vector installed before each of ours, 0 if we don't have it. */
+        static uint32_t previousVectors[7];
+
+        /* @brief EXTI lines served by each vector. */
+        static const uint16_t vectorLines[7];
+#elif TTENCODER_DISPATCHER_SUPPORTED
+        /* @brief Routes one pin's edges to Dispatch() with its line. */
+        struct Line{
+            TTEncoderDispatcher *owner;
+            uint32_t lines;
+
+            void ISR(void){
+                owner->Dispatch(lines);
+            }
+        };
+
+        /* @brief Each port read. */
+        PortIn *ports[TTENCODER_DISPATCHER_MAX_PORTS];
+
+        /* @brief Storage for the ports so they don't use the heap. */
+        TTInPlace<PortIn> portStorage[TTENCODER_DISPATCHER_MAX_PORTS];
+
+        /* @brief Pin interrupts, two per slot. */
+        TTInPlace<InterruptIn> inputs[TTENCODER_DISPATCHER_MAX_ENCODERS * 2];
+
+        /* @brief Routing for each pin interrupt. */
+        Line lines[TTENCODER_DISPATCHER_MAX_ENCODERS * 2];
+#endif
+};
+
+#endif
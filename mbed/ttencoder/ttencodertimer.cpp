@@ -0,0 +1,211 @@
+/**
+*     _____ _____ ___                 _
+*    |_   _|_   _| __|_ _  __ ___  __| |___ _ _
+*      | |   | | | _|| ' \/ _/ _ \/ _` / -_) '_|
+*      |_|   |_| |___|_||_\__\___/\__,_\___|_|
+*
+*
+* @file TTEncoderTimer.cpp
+* @brief This file contains the functions associated with the TTEncoder hardware counter backend.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "ttencodertimer.h"
+#include "ttconstants.h"
+
+#if TTENCODER_TIMER_SUPPORTED
+#include "pinmap.h"
+#include "PeripheralPins.h"
+#include "us_ticker_data.h"
+
+TTEncoderTimer *TTEncoderTimer::owners[6] = {0};
+
+/* @brief Clock enable and compare interrupt for each timer with an encoder mode. */
+struct TTEncoderTimerRoute{
+    TIM_TypeDef *tim;
+    IRQn_Type timIrq;
+    volatile uint32_t *enableRegister;
+    uint32_t enableBit;
+    uint8_t index;
+    uint32_t vector;
+};
+
+#define TTENCODER_TIMER_ROUTE(TIMER, TIMER_IRQ, ENABLE_REGISTER, ENABLE_BIT, INDEX) \
+    {TIMER, TIMER_IRQ, &RCC->ENABLE_REGISTER, ENABLE_BIT, INDEX, (uint32_t)&TTEncoderTimer::CompareISR<INDEX>}
+#endif
+
+TTEncoderTimer::TTEncoderTimer(PinName inA, PinName inB, PinMode inAMode, PinMode inBMode){
+#if TTENCODER_TIMER_SUPPORTED
+    const TTEncoderTimerRoute routes[] = {
+    #if defined(TIM1)
+        TTENCODER_TIMER_ROUTE(TIM1, TIM1_CC_IRQn, APB2ENR, RCC_APB2ENR_TIM1EN, 0),
+    #endif
+    #if defined(TIM2)
+        TTENCODER_TIMER_ROUTE(TIM2, TIM2_IRQn, APB1ENR, RCC_APB1ENR_TIM2EN, 1),
+    #endif
+    #if defined(TIM3)
+        TTENCODER_TIMER_ROUTE(TIM3, TIM3_IRQn, APB1ENR, RCC_APB1ENR_TIM3EN, 2),
+    #endif
+    #if defined(TIM4)
+        TTENCODER_TIMER_ROUTE(TIM4, TIM4_IRQn, APB1ENR, RCC_APB1ENR_TIM4EN, 3),
+    #endif
+    #if defined(TIM5)
+        TTENCODER_TIMER_ROUTE(TIM5, TIM5_IRQn, APB1ENR, RCC_APB1ENR_TIM5EN, 4),
+    #endif
+    #if defined(TIM8)
+        TTENCODER_TIMER_ROUTE(TIM8, TIM8_CC_IRQn, APB2ENR, RCC_APB2ENR_TIM8EN, 5),
+    #endif
+    };
+
+    //Not found leaves NC, which matches no timer.
+    TIM_TypeDef *timA = (TIM_TypeDef *)pinmap_find_peripheral(inA, PinMap_PWM);
+    TIM_TypeDef *timB = (TIM_TypeDef *)pinmap_find_peripheral(inB, PinMap_PWM);
+    uint32_t functionA = pinmap_find_function(inA, PinMap_PWM);
+    uint32_t functionB = pinmap_find_function(inB, PinMap_PWM);
+
+    //Encoder inputs only exist on the non-inverted channel 1 and 2 pins.
+    if(timA != timB || (uint32_t)functionA == (uint32_t)NC || (uint32_t)functionB == (uint32_t)NC ||
+       STM_PIN_CHANNEL(functionA) != 1 || STM_PIN_CHANNEL(functionB) != 2 ||
+       STM_PIN_INVERTED(functionA) || STM_PIN_INVERTED(functionB)){
+        return;
+    }
+
+#if defined(TIM_MST)
+    if(timA == TIM_MST){
+        return;
+    }
+#endif
+
+    const TTEncoderTimerRoute *route = 0;
+    for(uint32_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++){
+        if(routes[i].tim == timA){
+            route = &routes[i];
+        }
+    }
+
+    //Leave tim unset if the pins can't be used, IsSupported() will report it.
+    if(route == 0 || owners[route->index] != 0){
+        return;
+    }
+
+    tim = timA;
+    timIrq = route->timIrq;
+    timIndex = route->index;
+    owners[timIndex] = this;
+
+    *route->enableRegister |= route->enableBit;
+
+    pinmap_pinout(inA, PinMap_PWM);
+    pinmap_pinout(inB, PinMap_PWM);
+    pin_mode(inA, inAMode);
+    pin_mode(inB, inBMode);
+
+    tim->CR1 = 0;
+    tim->DIER = 0;
+
+    //Encoder mode 3 counts every edge of both inputs, the same as the interrupt decoder.
+    tim->SMCR = TIM_SMCR_SMS_0 | TIM_SMCR_SMS_1;
+    tim->CCMR1 = TIM_CCMR1_CC1S_0 | TIM_CCMR1_CC2S_0;
+    tim->CCMR2 = 0;
+    tim->CCER = 0;
+    tim->PSC = 0;
+    tim->ARR = 0xFFFF;
+    tim->EGR = TIM_EGR_UG;
+    tim->CNT = 0;
+    last = 0;
+
+    tim->CCR3 = (uint16_t)(last + TTENCODER_TIMER_WINDOW);
+    tim->CCR4 = (uint16_t)(last - TTENCODER_TIMER_WINDOW);
+    tim->SR = 0;
+    tim->DIER = TIM_DIER_CC3IE | TIM_DIER_CC4IE;
+
+    NVIC_SetVector(timIrq, route->vector);
+    NVIC_EnableIRQ(timIrq);
+
+    tim->CR1 = TIM_CR1_CEN;
+#else
+    (void)inA;
+    (void)inB;
+    (void)inAMode;
+    (void)inBMode;
+#endif
+}
+
+bool TTEncoderTimer::IsSupported(){
+#if TTENCODER_TIMER_SUPPORTED
+    return tim != 0;
+#else
+    return false;
+#endif
+}
+
+int64_t TTEncoderTimer::Read(void){
+    core_util_critical_section_enter();
+    Sync();
+    int64_t retval = total;
+    core_util_critical_section_exit();
+    return retval;
+}
+
+uint32_t TTEncoderTimer::Read(int direction){
+    core_util_critical_section_enter();
+    Sync();
+    uint32_t retval = directionCount[direction];
+    core_util_critical_section_exit();
+    return retval;
+}
+
+void TTEncoderTimer::Reset(int64_t count){
+    core_util_critical_section_enter();
+    Sync();
+    total = count;
+    directionCount[TT_CLOCKWISE] = 0;
+    directionCount[TT_ANTICLOCKWISE] = 0;
+    core_util_critical_section_exit();
+}
+
+void TTEncoderTimer::Sync(void){
+#if TTENCODER_TIMER_SUPPORTED
+    if(tim == 0){
+        return;
+    }
+
+    //The window keeps reads less than half the counter range apart, so the wrapped difference is exact.
+    uint16_t count = tim->CNT;
+    int16_t delta = (int16_t)(uint16_t)(count - last);
+    last = count;
+
+    total += delta;
+    if(delta > 0){
+        directionCount[TT_CLOCKWISE] += delta;
+    }
+    else{
+        directionCount[TT_ANTICLOCKWISE] -= delta;
+    }
+
+    tim->CCR3 = (uint16_t)(last + TTENCODER_TIMER_WINDOW);
+    tim->CCR4 = (uint16_t)(last - TTENCODER_TIMER_WINDOW);
+#endif
+}
+
+#if TTENCODER_TIMER_SUPPORTED
+void TTEncoderTimer::CompareHandler(void){
+    tim->SR = ~(TIM_SR_CC3IF | TIM_SR_CC4IF);
+    Sync();
+}
+#endif
+
+TTEncoderTimer::~TTEncoderTimer(){
+#if TTENCODER_TIMER_SUPPORTED
+    if(tim != 0){
+        NVIC_DisableIRQ(timIrq);
+        tim->CR1 = 0;
+        tim->DIER = 0;
+        owners[timIndex] = 0;
+    }
+#endif
+}
\ No newline at end of file
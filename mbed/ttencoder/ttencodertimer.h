@@ -0,0 +1,118 @@
+/**
+*     _____ _____ ___                 _
+*    |_   _|_   _| __|_ _  __ ___  __| |___ _ _
+*      | |   | | | _|| ' \/ _/ _ \/ _` / -_) '_|
+*      |_|   |_| |___|_||_\__\___/\__,_\___|_|
+*
+*
+* @file TTEncoderTimer.h
+* @brief This file contains the definitions associated with the TTEncoder hardware counter backend.
+*
+* Quadrature edges are counted by a timer in encoder mode, so no interrupts are taken per edge. The 16 bit hardware
+* count is extended to 64 bits in software. Two compare channels are kept TTENCODER_TIMER_WINDOW counts either side
+* of the last read, so the CPU is interrupted at most once per TTENCODER_TIMER_WINDOW counts to catch wraps.
+*
+* Supported on STM32F2, STM32F4 and STM32F7 targets when inA is channel 1 and inB is channel 2 of TIM1, TIM2, TIM3,
+* TIM4, TIM5 or TIM8, and the timer is not used by the us ticker.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_ENCODER_TIMER_H
+#define TT_ENCODER_TIMER_H
+
+#include "mbed.h"
+#include <cstdint>
+
+#if defined(TARGET_STM32F2) || defined(TARGET_STM32F4) || defined(TARGET_STM32F7)
+    #define TTENCODER_TIMER_SUPPORTED 1
+#else
+    #define TTENCODER_TIMER_SUPPORTED 0
+#endif
+
+/** @brief Counts moved from the last read before the timer interrupts to extend the count. Less than 32768. */
+#define TTENCODER_TIMER_WINDOW 0x4000
+
+class TTEncoderTimer{
+    public:
+        /*
+        * @brief Create a hardware quadrature counter.
+        * @param inA Encoder A output. Must be channel 1 of a supported timer.
+        * @param inB Encoder B output. Must be channel 2 of the same timer.
+        * @param inAMode Pin mode for the encoder output A input.
+        * @param inBMode Pin mode for the encoder output B input.
+        */
+        TTEncoderTimer(PinName inA, PinName inB, PinMode inAMode, PinMode inBMode);
+
+        /*
+        * @brief Can these pins be counted in hardware?
+        * @returns Is the backend usable?
+        */
+        bool IsSupported();
+
+        /*
+        * @brief Get the net count. Safe to call from any context.
+        * @returns Net count since the last Reset().
+        */
+        int64_t Read(void);
+
+        /*
+        * @brief Get the count in one direction. The hardware only counts net movement, so back and forth movement
+        * between reads cancels out.
+        * @param direction TT_CLOCKWISE or TT_ANTICLOCKWISE.
+        * @returns Count in a direction since the last Reset().
+        */
+        uint32_t Read(int direction);
+
+        /*
+        * @brief Set the net count and clear the direction counts. Safe to call from any context.
+        * @param count New net count.
+        */
+        void Reset(int64_t count);
+
+        ~TTEncoderTimer();
+
+    private:
+        /* @brief Net count. */
+        int64_t total = 0;
+
+        /* @brief Counts in each direction. */
+        uint32_t directionCount[2] = {0};
+
+        /* @brief Hardware count at the last read. */
+        uint16_t last = 0;
+
+        /* @brief Fold the hardware count into the extended count and move the compare window. Call with interrupts off. */
+        void Sync(void);
+
+#if TTENCODER_TIMER_SUPPORTED
+    public:
+        /* @brief Vector for each timer compare interrupt, indexed the same as owners. */
+        template<int index> static void CompareISR(){
+            if(owners[index] != 0){
+                owners[index]->CompareHandler();
+            }
+        }
+
+    private:
+        /* @brief Counting timer. */
+        TIM_TypeDef *tim = 0;
+
+        /* @brief Timer compare interrupt. */
+        IRQn_Type timIrq;
+
+        /* @brief Index of the timer in owners. */
+        uint8_t timIndex = 0;
+
+        /* @brief Extend the count when the timer leaves the compare window. */
+        void CompareHandler(void);
+
+        /* @brief Instance using each timer. */
+        static TTEncoderTimer *owners[6];
+#endif
+};
+
+#endif
\ No newline at end of file
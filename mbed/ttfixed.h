@@ -0,0 +1,94 @@
+/**
+*     _____ _____ ___ _             _
+*    |_   _|_   _| __(_)_ _____ __| |
+*      | |   | | | _|| \ \ / -_) _` |
+*      |_|   |_| |_| |_/_\_\___\__,_|
+*
+*
+* @file TTFixed.h
+* @brief This file contains the Q16.16 fixed point helpers used throughout TTLibs.
+*
+* Define TTLIBS_FIXED_POINT as 1 to build the Q16.16 variants of the unit conversion and control functions.
+* They only use integer multiply and shift, for parts without a floating point unit.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_FIXED_H
+#define TT_FIXED_H
+
+#include <cstdint>
+
+#ifndef TTLIBS_FIXED_POINT
+    #define TTLIBS_FIXED_POINT 0
+#endif
+
+/** @brief Q16.16 fixed point value, 16 integer bits and 16 fraction bits. */
+typedef int32_t ttq16;
+
+/** @brief 1.0 in Q16.16. */
+#define TT_Q16_ONE ((ttq16)1 << 16)
+
+/**
+* @brief Convert a float to Q16.16. Only for setup, it uses float math.
+* @param value Value to convert, -32768 to 32767.
+* @returns Rounded Q16.16 value.
+*/
+inline ttq16 ttQ16FromFloat(float value){
+    return (ttq16)(value * TT_Q16_ONE + (value < 0 ? -0.5f : 0.5f));
+}
+
+/**
+* @brief Convert Q16.16 to a float.
+* @param value Value to convert.
+* @returns Float value.
+*/
+inline float ttQ16ToFloat(ttq16 value){
+    return value / (float)TT_Q16_ONE;
+}
+
+/**
+* @brief Convert an integer to Q16.16.
+* @param value Value to convert, -32768 to 32767.
+* @returns Q16.16 value.
+*/
+inline ttq16 ttQ16FromInt(int32_t value){
+    return (ttq16)((uint32_t)value << 16);
+}
+
+/**
+* @brief Multiply two Q16.16 values with rounding.
+* @returns a * b in Q16.16.
+*/
+inline ttq16 ttQ16Mul(ttq16 a, ttq16 b){
+    return (ttq16)(((int64_t)a * b + (1 << 15)) >> 16);
+}
+
+/**
+* @brief Multiply two Q16.16 values and round the result to an integer.
+* @returns a * b rounded to an integer.
+*/
+inline int32_t ttQ16MulToInt(ttq16 a, ttq16 b){
+    return (int32_t)(((int64_t)a * b + ((int64_t)1 << 31)) >> 32);
+}
+
+/**
+* @brief Multiply an integer by a Q16.16 value with rounding.
+* @returns a * b rounded to an integer.
+*/
+inline int32_t ttQ16MulInt(int32_t a, ttq16 b){
+    return (int32_t)(((int64_t)a * b + (1 << 15)) >> 16);
+}
+
+/**
+* @brief Multiply an integer by a Q16.16 value keeping the fraction.
+* @returns a * b in Q16.16.
+*/
+inline ttq16 ttQ16MulIntQ16(int32_t a, ttq16 b){
+    return (ttq16)((int64_t)a * b);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+/**
+*     _____ _____ ___      ___ _
+*    |_   _|_   _|_ _|_ _ | _ \ |__ _ __ ___
+*      | |   | |  | || ' \|  _/ / _` / _/ -_)
+*      |_|   |_| |___|_||_|_| |_\__,_\__\___|
+*
+*
+* @file TTInPlace.h
+* @brief This file contains TTInPlace, statically sized storage for an object constructed at runtime.
+*
+* Used in place of new/delete so optional members such as endstops and encoders don't touch the heap.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_IN_PLACE_H
+#define TT_IN_PLACE_H
+
+#include <new>
+#include <utility>
+
+template<typename T>
+class TTInPlace{
+    public:
+        TTInPlace(){}
+
+        TTInPlace(const TTInPlace &) = delete;
+        TTInPlace &operator=(const TTInPlace &) = delete;
+
+        /**
+        * @brief Construct the object, destroying any existing one first.
+        * @param args Constructor arguments.
+        * @returns The new object.
+        */
+        template<typename... Args> T *Construct(Args&&... args){
+            Destroy();
+            object = new(storage) T(std::forward<Args>(args)...);
+            return object;
+        }
+
+        /** @brief Destroy the object if there is one. */
+        void Destroy(){
+            if(object != 0){
+                T *old = object;
+                object = 0;
+                old->~T();
+            }
+        }
+
+        /**
+        * @brief Get the object.
+        * @returns The object or 0 if it hasn't been constructed.
+        */
+        T *Get() const{
+            return object;
+        }
+
+        ~TTInPlace(){
+            Destroy();
+        }
+
+    private:
+        /** @brief Space for the object. */
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        /** @brief The constructed object, 0 when empty. */
+        T *volatile object = 0;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,252 @@
+/**
+*     _____ _____ ___         _                       _
+*    |_   _|_   _|_ _|_ _  __| |_ _ _ _  _ _ __  ___ _ _| |_
+*      | |   | |  | || ' \(_-<  _| '_| || | '  \/ -_) ' \  _|
+*      |_|   |_| |___|_||_/__/\__|_|  \_,_|_|_|_\___|_||_\__|
+*
+*
+* @file TTInstrument.h
+* @brief This file contains the optional ISR timing instrumentation used throughout TTLibs.
+*
+* Define TTLIBS_INSTRUMENT as 1 to time the driver ISRs with the DWT cycle counter. Each probe keeps the min, max and
+* average execution time, the worst jitter against the commanded period and a count of dropped events. Reading a
+* snapshot never blocks the ISR writing it. Read snapshots from thread context. An ISR that preempted the writer
+* gives up after TT_INSTRUMENT_SNAPSHOT_RETRIES and may get a copy taken mid update. With the flag at 0 the probes and TT_INSTRUMENT_SCOPE compile to nothing.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_INSTRUMENT_H
+#define TT_INSTRUMENT_H
+
+#ifndef TTLIBS_INSTRUMENT
+    #define TTLIBS_INSTRUMENT 0
+#endif
+
+#if TTLIBS_INSTRUMENT
+    /** @brief Time the rest of the enclosing scope into probe. */
+    #define TT_INSTRUMENT_SCOPE(probe) TTInstrumentScope ttInstrumentScope(probe)
+
+    /** @brief Count a dropped event in probe. */
+    #define TT_INSTRUMENT_DROP(probe) (probe).Drop()
+#else
+    #define TT_INSTRUMENT_SCOPE(probe)
+    #define TT_INSTRUMENT_DROP(probe)
+#endif
+
+#if TTLIBS_INSTRUMENT
+#include "mbed.h"
+#include "us_ticker_api.h"
+#include <cstdint>
+#include <atomic>
+
+/** @brief Attempts Snapshot() makes before returning a copy taken mid update. */
+#define TT_INSTRUMENT_SNAPSHOT_RETRIES 8
+
+#if defined(__CORTEX_M)
+    /** @brief Keep the sequence reads and writes ordered around the statistics. */
+    #define TT_INSTRUMENT_BARRIER() __DMB()
+#else
+    #define TT_INSTRUMENT_BARRIER() std::atomic_signal_fence(std::memory_order_seq_cst)
+#endif
+
+/** @brief Copy of a probe's statistics, all times in CPU cycles. */
+struct TTInstrumentSnapshot{
+    /** @brief Number of timed runs. */
+    uint32_t count;
+
+    /** @brief Shortest run. */
+    uint32_t minCycles;
+
+    /** @brief Longest run. */
+    uint32_t maxCycles;
+
+    /** @brief Mean run. */
+    uint32_t averageCycles;
+
+    /** @brief Largest difference between the interval seen and the interval commanded. */
+    uint32_t maxJitterCycles;
+
+    /** @brief Events lost, late steps or illegal encoder transitions. */
+    uint32_t dropped;
+};
+
+/** 
+* @brief Read the cycle counter, starting it the first time.
+* @returns CPU cycles, wraps every 2^32.
+*/
+inline uint32_t ttInstrumentCycles(){
+#if defined(DWT_CTRL_CYCCNTENA_Msk)
+    if(!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)){
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+    return DWT->CYCCNT;
+#else
+    //Cortex-M0 has no DWT counter, fall back to microsecond resolution.
+    return us_ticker_read() * (SystemCoreClock / 1000000);
+#endif
+}
+
+/**
+* @brief Convert microseconds to cycles.
+* @param us Microseconds.
+* @returns CPU cycles.
+*/
+inline uint32_t ttInstrumentUsToCycles(uint32_t us){
+    return us * (SystemCoreClock / 1000000);
+}
+
+/** @brief Statistics for one ISR. Written from a single interrupt priority, read from thread context. */
+class TTInstrumentProbe{
+    public:
+        /**
+        * @brief Record one run.
+        * @param cycles How long it took.
+        */
+        void Record(uint32_t cycles){
+            Begin();
+            count = count + 1;
+            total = total + cycles;
+            if(cycles < minCycles){
+                minCycles = cycles;
+            }
+            if(cycles > maxCycles){
+                maxCycles = cycles;
+            }
+            End();
+        }
+
+        /**
+        * @brief Record when a periodic ISR ran, to track jitter. An interval over twice the commanded one counts as dropped.
+        * @param now Cycle count at the start of the ISR.
+        * @param expected Commanded interval since the last call, or Scheduled(), in cycles.
+        */
+        void Interval(uint32_t now, uint32_t expected){
+            Begin();
+            if(primed){
+                uint32_t interval = now - last;
+                uint32_t jitter = interval > expected ? interval - expected : expected - interval;
+                if(jitter > maxJitterCycles){
+                    maxJitterCycles = jitter;
+                }
+                if(interval > expected * 2){
+                    dropped = dropped + 1;
+                }
+            }
+            last = now;
+            primed = true;
+            End();
+        }
+
+        /**
+        * @brief Measure the next Interval() from now rather than from the start of this ISR. For ISRs that schedule
+        * their next run at the end, so the time spent in the ISR itself doesn't count as jitter.
+        * @param now Cycle count when the next run was scheduled.
+        */
+        void Scheduled(uint32_t now){
+            last = now;
+            primed = true;
+        }
+
+        /** @brief Start a new chain of intervals, the next Interval() only records the time. */
+        void Restart(){
+            primed = false;
+        }
+
+        /** @brief Count a dropped event. */
+        void Drop(){
+            Begin();
+            dropped = dropped + 1;
+            End();
+        }
+
+        /**
+        * @brief Copy the statistics without blocking the writer, retrying if an ISR updated them mid copy. Call from
+        * thread context, from an ISR that preempted the writer the copy may be taken mid update.
+        * @returns Snapshot of the statistics.
+        */
+        TTInstrumentSnapshot Snapshot() const{
+            TTInstrumentSnapshot snapshot;
+            uint32_t before;
+            uint32_t after;
+            uint64_t totalCopy;
+            uint32_t attempts = 0;
+            do{
+                before = sequence;
+                TT_INSTRUMENT_BARRIER();
+                snapshot.count = count;
+                snapshot.minCycles = count ? minCycles : 0;
+                snapshot.maxCycles = maxCycles;
+                snapshot.maxJitterCycles = maxJitterCycles;
+                snapshot.dropped = dropped;
+                totalCopy = total;
+                TT_INSTRUMENT_BARRIER();
+                after = sequence;
+            } while(((before & 1) || before != after) && ++attempts < TT_INSTRUMENT_SNAPSHOT_RETRIES);
+
+            snapshot.averageCycles = snapshot.count ? (uint32_t)(totalCopy / snapshot.count) : 0;
+            return snapshot;
+        }
+
+        /** @brief Clear the statistics. */
+        void Reset(){
+            Begin();
+            count = 0;
+            total = 0;
+            minCycles = UINT32_MAX;
+            maxCycles = 0;
+            maxJitterCycles = 0;
+            dropped = 0;
+            primed = false;
+            End();
+        }
+
+    private:
+        /** @brief Odd while a write is in progress. */
+        volatile uint32_t sequence = 0;
+
+        volatile uint32_t count = 0;
+        volatile uint64_t total = 0;
+        volatile uint32_t minCycles = UINT32_MAX;
+        volatile uint32_t maxCycles = 0;
+        volatile uint32_t maxJitterCycles = 0;
+        volatile uint32_t dropped = 0;
+
+        /** @brief Cycle count of the last Interval() or Scheduled(). */
+        uint32_t last = 0;
+
+        /** @brief Is last valid? */
+        bool primed = false;
+
+        void Begin(){
+            sequence = sequence + 1;
+            TT_INSTRUMENT_BARRIER();
+        }
+
+        void End(){
+            TT_INSTRUMENT_BARRIER();
+            sequence = sequence + 1;
+        }
+};
+
+/** @brief Records the time from construction to destruction into a probe. */
+class TTInstrumentScope{
+    public:
+        TTInstrumentScope(TTInstrumentProbe &probe) : probe(probe), start(ttInstrumentCycles()){}
+
+        ~TTInstrumentScope(){
+            probe.Record(ttInstrumentCycles() - start);
+        }
+
+    private:
+        TTInstrumentProbe &probe;
+        uint32_t start;
+};
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,198 @@
+/**
+*     _____ _____ __  __     _   _          ___                  
+*    |_   _|_   _|  \/  |___| |_(_)___ _ _ / __|_ _ ___ _  _ _ __ 
+*      | |   | | | |\/| / _ \  _| / _ \ ' \ (_ | '_/ _ \ || | '_ \
+*      |_|   |_| |_|  |_\___/\__|_\___/_||_\___|_| \___/\_,_| .__/
+*                                                           |_|   
+*
+* @file TTMotionGroup.cpp
+* @brief This file contains the functions associated with TTMotionGroup.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "ttmotiongroup.h"
+
+TTMotionGroup::TTMotionGroup(TTStepperProfile *profile) : profile(profile){
+}
+
+int TTMotionGroup::AddAxis(TTStepper *stepper){
+    TTMOTIONGROUP_ACQUIRE_MUTEX;
+    int retval;
+
+    if(axisCount < TTMOTIONGROUP_MAX_AXES){
+        axes[axisCount] = stepper;
+        retval = axisCount++;
+    }
+    else{
+        retval = TTMOTIONGROUP_NO_FREE_AXES;
+    }
+
+    TTMOTIONGROUP_RELEASE_MUTEX;
+    return retval;
+}
+
+int TTMotionGroup::MoveSteps(const long *steps){
+    TTMOTIONGROUP_ACQUIRE_MUTEX;
+
+    if(moving){
+        TTMOTIONGROUP_RELEASE_MUTEX;
+        return TTMOTIONGROUP_ALREADY_MOVING;
+    }
+
+    if(profile == 0){
+        TTMOTIONGROUP_RELEASE_MUTEX;
+        return TTMOTIONGROUP_NO_PROFILE;
+    }
+
+    //Check every axis is free before touching any of them.
+    majorSteps = 0;
+    for(uint8_t i = 0; i < axisCount; i++){
+        if(axes[i]->moving){
+            TTMOTIONGROUP_RELEASE_MUTEX;
+            return TTMOTIONGROUP_ALREADY_MOVING;
+        }
+
+        if(axes[i]->endstopHit && !axes[i]->homing){
+            TTMOTIONGROUP_RELEASE_MUTEX;
+            return TTMOTIONGROUP_ENDSTOP_HIT;
+        }
+
+        delta[i] = steps[i] < 0 ? -steps[i] : steps[i];
+
+        //Clamping one axis would bend the line, so an axis that can't make the whole move rejects it.
+        bool direction = steps[i] < 0 ? TTSTEPPER_ANTI_CLOCKWISE : TTSTEPPER_CLOCKWISE;
+        bool pinDirection = !axes[i]->reverse ? direction : !direction;
+        uint32_t allowed = delta[i];
+        if(axes[i]->ApplySoftLimits(axes[i]->currentStep, pinDirection, allowed) != TTSTEPPER_SUCCESS || allowed != delta[i]){
+            TTMOTIONGROUP_RELEASE_MUTEX;
+            return TTMOTIONGROUP_SOFT_LIMIT;
+        }
+
+        if(delta[i] > majorSteps){
+            majorSteps = delta[i];
+        }
+    }
+
+    if(majorSteps == 0){
+        TTMOTIONGROUP_RELEASE_MUTEX;
+        return TTMOTIONGROUP_SUCCESS;
+    }
+
+    segment.steps = majorSteps;
+    segment.entryRate = minRate;
+    segment.cruiseRate = maxRate;
+    segment.exitRate = minRate;
+
+    int retval = profile->Plan(segment);
+    if(retval != TTSTEPPER_PROFILE_SUCCESS){
+        TTMOTIONGROUP_RELEASE_MUTEX;
+        return retval;
+    }
+
+    for(uint8_t i = 0; i < axisCount; i++){
+        bool direction = steps[i] < 0 ? TTSTEPPER_ANTI_CLOCKWISE : TTSTEPPER_CLOCKWISE;
+
+        axes[i]->Enable();
+        axes[i]->dir = !axes[i]->reverse ? direction : !direction;
+        axes[i]->events.clear(TTSTEPPER_FLAG_STOPPED);
+        axes[i]->moving = delta[i] > 0;
+
+        //Start half way so minor axis steps are spread evenly along the line.
+        error[i] = majorSteps / 2;
+    }
+
+    remainingSteps = majorSteps;
+    events.clear(TTMOTIONGROUP_FLAG_STOPPED);
+    moving = true;
+
+    StepTimeoutHandler();
+
+    TTMOTIONGROUP_RELEASE_MUTEX;
+    return TTMOTIONGROUP_SUCCESS;
+}
+
+int TTMotionGroup::WaitBlocking(){
+    while(IsMoving()){
+        events.wait_any(TTMOTIONGROUP_FLAG_STOPPED, osWaitForever, false);
+    }
+
+    return TTMOTIONGROUP_SUCCESS;
+}
+
+void TTMotionGroup::Stop(){
+    moving = false;
+    scheduler.Cancel(stepTask);
+
+    //Through each axis's own stop so its move ended listeners hear about it. Axes an endstop already stopped, or that
+    //had nothing to do, aren't moving and aren't told twice.
+    for(uint8_t i = 0; i < axisCount; i++){
+        axes[i]->Stop();
+    }
+
+    events.set(TTMOTIONGROUP_FLAG_STOPPED);
+}
+
+bool TTMotionGroup::IsMoving(){
+    return moving;
+}
+
+int TTMotionGroup::SetProfile(TTStepperProfile *profile){
+    TTMOTIONGROUP_ACQUIRE_MUTEX;
+    this->profile = profile;
+    TTMOTIONGROUP_RELEASE_MUTEX;
+    return TTMOTIONGROUP_SUCCESS;
+}
+
+int TTMotionGroup::SetMaxRate(float rate){
+    TTMOTIONGROUP_ACQUIRE_MUTEX;
+    maxRate = rate;
+    TTMOTIONGROUP_RELEASE_MUTEX;
+    return TTMOTIONGROUP_SUCCESS;
+}
+
+int TTMotionGroup::SetMinRate(float rate){
+    TTMOTIONGROUP_ACQUIRE_MUTEX;
+    minRate = rate;
+    TTMOTIONGROUP_RELEASE_MUTEX;
+    return TTMOTIONGROUP_SUCCESS;
+}
+
+void TTMotionGroup::StepTimeoutHandler(){
+    if(remainingSteps){
+        for(uint8_t i = 0; i < axisCount; i++){
+            if(delta[i] == 0){
+                continue;
+            }
+
+            //An endstop stopped this axis, stop the whole line rather than drift off it.
+            if(!axes[i]->moving){
+                Stop();
+                return;
+            }
+
+            error[i] -= (int32_t)delta[i];
+            if(error[i] < 0){
+                error[i] += (int32_t)majorSteps;
+
+                //Counted before the pulse, as TTStepper does, so an endstop it triggers latches the step it was hit on.
+                axes[i]->currentStep = axes[i]->dir ? axes[i]->currentStep + 1 : axes[i]->currentStep - 1;
+                axes[i]->Pulse();
+            }
+        }
+
+        remainingSteps--;
+
+        scheduler.Schedule(stepTask, profile->Next(segment));
+    }
+    else{
+        Stop();
+    }
+}
+
+TTMotionGroup::~TTMotionGroup(){
+    Stop();
+}
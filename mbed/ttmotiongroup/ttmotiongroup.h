@@ -0,0 +1,157 @@
+/**
+*     _____ _____ __  __     _   _          ___                  
+*    |_   _|_   _|  \/  |___| |_(_)___ _ _ / __|_ _ ___ _  _ _ __ 
+*      | |   | | | |\/| / _ \  _| / _ \ ' \ (_ | '_/ _ \ || | '_ \
+*      |_|   |_| |_|  |_\___/\__|_\___/_||_\___|_| \___/\_,_| .__/
+*                                                           |_|   
+*
+* @file TTMotionGroup.h
+* @brief This file contains the definitions associated with TTMotionGroup.
+*
+* Coordinates several TTSteppers along a straight line. One timer ISR steps the axis with the most steps using a
+* shared motion profile and a Bresenham DDA decides which other axes step on each tick.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_MOTION_GROUP_H
+#define TT_MOTION_GROUP_H
+
+#define TTMOTIONGROUP_MAX_AXES 4
+
+#define TTMOTIONGROUP_MUTEX_TIMEOUT 50ms
+#define TTMOTIONGROUP_ACQUIRE_MUTEX if(!mutex.trylock_for(TTMOTIONGROUP_MUTEX_TIMEOUT)){return TTMOTIONGROUP_MUTEX_TIMEDOUT;}
+#define TTMOTIONGROUP_RELEASE_MUTEX mutex.unlock()
+
+#define TTMOTIONGROUP_SUCCESS 0
+#define TTMOTIONGROUP_MUTEX_TIMEDOUT -1
+#define TTMOTIONGROUP_NO_FREE_AXES -2
+#define TTMOTIONGROUP_ALREADY_MOVING -3
+#define TTMOTIONGROUP_ENDSTOP_HIT -4
+#define TTMOTIONGROUP_NO_PROFILE -5
+#define TTMOTIONGROUP_SOFT_LIMIT -6
+
+/** @brief Event flag set by Stop() when a move ends. */
+#define TTMOTIONGROUP_FLAG_STOPPED (1UL << 0)
+
+#include "mbed.h"
+#include "ttstepper.h"
+#include <cstdint>
+
+class TTMotionGroup{
+
+    public:
+        /**
+        * @brief Create a group of coordinated steppers.
+        * @param profile Profile used to ramp the dominant axis of every move.
+        */
+        TTMotionGroup(TTStepperProfile *profile);
+
+        /**
+        * @brief Add a stepper to the group. Axes are numbered in the order they are added.
+        * @param stepper Stepper to add. It should not be moved on its own while the group is moving.
+        * @returns Axis index or a negative TTMOTIONGROUP error code.
+        */
+        int AddAxis(TTStepper *stepper);
+
+        /**
+        * @brief Move every axis at once so they start and finish together.
+        * @param steps Steps for each axis, one per added axis. Positive = clockwise, negative = anti-clockwise.
+        * @returns Success or a negative TTMOTIONGROUP error code. TTMOTIONGROUP_SOFT_LIMIT if any axis would pass its soft
+        * limits, the move is never clamped as that would take it off the line.
+        */
+        int MoveSteps(const long *steps);
+
+        /** 
+        * @brief Wait for the group to stop moving. The thread sleeps until Stop() signals the end of the move.
+        * @warning This function blocks the calling thread.
+        * @returns Success or a negative TTMOTIONGROUP error code.
+        */
+        int WaitBlocking();
+
+        /** @brief Stop every axis. */
+        void Stop();
+
+        /**
+        * @brief Gets if the group is currently moving.
+        * @returns Is the group moving?
+        */
+        bool IsMoving();
+
+        /**
+        * @brief Set the profile used to ramp the dominant axis.
+        * @param profile Profile to use.
+        * @returns Success or a negative TTMOTIONGROUP error code.
+        */
+        int SetProfile(TTStepperProfile *profile);
+
+        /**
+        * @brief Set the highest step rate of the dominant axis.
+        * @param rate Step rate in steps/s.
+        * @returns Success or a negative TTMOTIONGROUP error code.
+        */
+        int SetMaxRate(float rate);
+
+        /**
+        * @brief Set the start and end step rate of the dominant axis.
+        * @param rate Step rate in steps/s.
+        * @returns Success or a negative TTMOTIONGROUP error code.
+        */
+        int SetMinRate(float rate);
+
+        ~TTMotionGroup();
+
+    private:
+        /** @brief Protect variable from modification while in use. */
+        Mutex mutex;
+
+        /** @brief Steppers in the group. */
+        TTStepper *axes[TTMOTIONGROUP_MAX_AXES] = {0};
+
+        /** @brief Number of steppers in the group. */
+        uint8_t axisCount = 0;
+
+        /** @brief Steps each axis takes in the current move. */
+        uint32_t delta[TTMOTIONGROUP_MAX_AXES] = {0};
+
+        /** @brief Bresenham error term for each axis. */
+        int32_t error[TTMOTIONGROUP_MAX_AXES] = {0};
+
+        /** @brief Steps taken by the dominant axis in the current move. */
+        uint32_t majorSteps = 0;
+
+        /** @brief Dominant axis steps left in the current move. */
+        volatile uint32_t remainingSteps = 0;
+
+        /** @brief Is the group currently moving? */
+        volatile bool moving = false;
+
+        /** @brief Signals TTMOTIONGROUP_FLAG_STOPPED to threads waiting for a move to end. */
+        EventFlags events;
+
+        /** @brief Profile used to ramp the dominant axis. */
+        TTStepperProfile *profile;
+
+        /** @brief Planned segment for the dominant axis. */
+        TTStepperSegment segment;
+
+        /** @brief Highest step rate of the dominant axis (steps/s). */
+        float maxRate = 1000.0f;
+
+        /** @brief Start and end step rate of the dominant axis (steps/s). */
+        float minRate = 100.0f;
+
+        /** @brief Shared scheduler the group's timing runs on. */
+        TTScheduler &scheduler = TTScheduler::Get();
+
+        /** @brief Shared step timer for every axis. */
+        TTSchedulerTask stepTask{callback(this, &TTMotionGroup::StepTimeoutHandler)};
+
+        /** @brief Step every axis that is due and schedule the next tick. */
+        void StepTimeoutHandler();
+};
+
+#endif
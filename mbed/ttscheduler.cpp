@@ -0,0 +1,132 @@
+/**
+*     _____ _____ ___      _            _      _
+*    |_   _|_   _/ __| __| |_  ___ __| |_  _| |___ _ _
+*      | |   | | \__ \/ _| ' \/ -_) _` | || | / -_) '_|
+*      |_|   |_| |___/\__|_||_\___\__,_|\_,_|_\___|_|
+*
+*
+* @file TTScheduler.cpp
+* @brief This file contains the functions associated with TTScheduler.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "ttscheduler.h"
+
+TTSchedulerTask::~TTSchedulerTask(){
+    if(scheduled){
+        TTScheduler::Get().Cancel(*this);
+    }
+}
+
+TTScheduler &TTScheduler::Get(){
+    static TTScheduler scheduler;
+    return scheduler;
+}
+
+TTScheduler::TTScheduler(){
+    deferredThread.start(callback(&deferredQueue, &EventQueue::dispatch_forever));
+}
+
+void TTScheduler::Schedule(TTSchedulerTask &task, uint32_t delay){
+    core_util_critical_section_enter();
+    Remove(task);
+    task.due = ticker_read_us(get_us_ticker_data()) + delay;
+    Insert(task);
+    core_util_critical_section_exit();
+}
+
+void TTScheduler::ScheduleNext(TTSchedulerTask &task, uint32_t period){
+    core_util_critical_section_enter();
+    Remove(task);
+    us_timestamp_t now = ticker_read_us(get_us_ticker_data());
+    task.due += period;
+    if(task.due < now){
+        task.due = now;
+    }
+    Insert(task);
+    core_util_critical_section_exit();
+}
+
+void TTScheduler::Cancel(TTSchedulerTask &task){
+    core_util_critical_section_enter();
+    TTSchedulerTask *oldHead = head;
+    Remove(task);
+    if(head != oldHead){
+        if(head == 0){
+            timeout.detach();
+            armed = false;
+        }
+        else{
+            Arm();
+        }
+    }
+    core_util_critical_section_exit();
+}
+
+void TTScheduler::Insert(TTSchedulerTask &task){
+    //Tasks due at the same time run in the order they were scheduled.
+    TTSchedulerTask **link = &head;
+    while(*link != 0 && (*link)->due <= task.due){
+        link = &(*link)->next;
+    }
+
+    task.next = *link;
+    *link = &task;
+    task.scheduled = true;
+
+    if(head == &task){
+        Arm();
+    }
+}
+
+void TTScheduler::Remove(TTSchedulerTask &task){
+    if(!task.scheduled){
+        return;
+    }
+
+    TTSchedulerTask **link = &head;
+    while(*link != &task){
+        link = &(*link)->next;
+    }
+
+    *link = task.next;
+    task.next = 0;
+    task.scheduled = false;
+}
+
+void TTScheduler::Arm(){
+    us_timestamp_t now = ticker_read_us(get_us_ticker_data());
+    us_timestamp_t delay = head->due > now ? head->due - now : 0;
+    timeout.attach(callback(this, &TTScheduler::TimeoutHandler), chrono::microseconds(delay));
+    armed = true;
+    armedDue = head->due;
+}
+
+void TTScheduler::TimeoutHandler(){
+    core_util_critical_section_enter();
+    armed = false;
+
+    //Run everything that is due, tasks can reschedule themselves from their handler.
+    while(head != 0 && head->due <= ticker_read_us(get_us_ticker_data())){
+        TTSchedulerTask *task = head;
+        head = task->next;
+        task->next = 0;
+        task->scheduled = false;
+
+        core_util_critical_section_exit();
+        task->handler();
+        core_util_critical_section_enter();
+    }
+
+    //A handler rescheduling itself to the head has already armed the timer, attaching again costs a ticker remove and
+    //insert for nothing. Only arm for a head nothing armed for.
+    if(head != 0 && !(armed && armedDue == head->due)){
+        Arm();
+    }
+
+    core_util_critical_section_exit();
+}
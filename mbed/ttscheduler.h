@@ -0,0 +1,170 @@
+/**
+*     _____ _____ ___      _            _      _
+*    |_   _|_   _/ __| __| |_  ___ __| |_  _| |___ _ _
+*      | |   | | \__ \/ _| ' \/ -_) _` | || | / -_) '_|
+*      |_|   |_| |___/\__|_||_\___\__,_|\_,_|_\___|_|
+*
+*
+* @file TTScheduler.h
+* @brief This file contains TTScheduler, the timing shared by every TTLibs driver.
+*
+* There are two tiers. The hard real-time tier runs TTSchedulerTasks from one timer interrupt, drivers keep a task
+* each instead of owning a Timeout or Ticker. The deferred tier runs callbacks on an EventQueue thread, so user
+* callbacks triggered from ISRs don't lengthen them.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_SCHEDULER_H
+#define TT_SCHEDULER_H
+
+#define TTSCHEDULER_DEFERRED_EVENTS 16
+#define TTSCHEDULER_STACK_SIZE 2048
+#define TTSCHEDULER_PRIORITY osPriorityAboveNormal
+
+#include "mbed.h"
+#include "us_ticker_api.h"
+#include <cstdint>
+
+class TTScheduler;
+
+/** @brief Work for the hard real-time tier. Owned by the driver, the scheduler never copies or allocates it. */
+class TTSchedulerTask{
+
+    friend class TTScheduler;
+
+    public:
+        /**
+        * @brief Create a task.
+        * @param handler Called from the timer interrupt when the task is due.
+        */
+        TTSchedulerTask(Callback<void()> handler = nullptr) : handler(handler){}
+
+        TTSchedulerTask(const TTSchedulerTask &) = delete;
+        TTSchedulerTask &operator=(const TTSchedulerTask &) = delete;
+
+        /**
+        * @brief Set what the task runs. Only while it isn't scheduled.
+        * @param handler Called from the timer interrupt when the task is due.
+        */
+        void SetHandler(Callback<void()> handler){
+            this->handler = handler;
+        }
+
+        /**
+        * @brief Is the task waiting to run?
+        * @returns true if it is scheduled.
+        */
+        bool IsScheduled() const{
+            return scheduled;
+        }
+
+        ~TTSchedulerTask();
+
+    private:
+        /** @brief Run when due, in interrupt context. */
+        Callback<void()> handler;
+
+        /** @brief Time the task is due in microseconds. */
+        us_timestamp_t due = 0;
+
+        /** @brief Next task in the scheduler's due ordered list. */
+        TTSchedulerTask *next = 0;
+
+        /** @brief Is the task in the list? */
+        bool scheduled = false;
+};
+
+class TTScheduler{
+    public:
+        /**
+        * @brief Get the scheduler, created on first use. Call it from a thread (driver constructors do) before any ISR uses it.
+        * @returns The scheduler.
+        */
+        static TTScheduler &Get();
+
+        TTScheduler(const TTScheduler &) = delete;
+        TTScheduler &operator=(const TTScheduler &) = delete;
+
+        /**
+        * @brief Run a task after a delay, rescheduling it if it is already waiting. Safe to call from ISRs.
+        * @param task Task to run.
+        * @param delay Microseconds from now.
+        */
+        void Schedule(TTSchedulerTask &task, uint32_t delay);
+
+        /**
+        * @brief Run a task a period after it was last due, so a periodic chain doesn't drift by the interrupt latency.
+        * Falls back to now if that has already passed. Safe to call from ISRs.
+        * @param task Task to run.
+        * @param period Microseconds after the task was last due.
+        */
+        void ScheduleNext(TTSchedulerTask &task, uint32_t period);
+
+        /**
+        * @brief Stop a task from running. Safe to call from ISRs.
+        * @param task Task to cancel, nothing happens if it isn't scheduled.
+        */
+        void Cancel(TTSchedulerTask &task);
+
+        /**
+        * @brief Run a callback on the deferred thread. Safe to call from ISRs.
+        * @param function Callback to run.
+        * @param args Arguments, copied into the event.
+        * @returns true if queued, false if the deferred queue is full.
+        */
+        template<typename F, typename... Args>
+        bool Defer(F function, Args... args){
+            return deferredQueue.call(function, args...) != 0;
+        }
+
+        /**
+        * @brief Get the deferred tier's queue to post events directly.
+        * @returns The EventQueue dispatched by the deferred thread.
+        */
+        EventQueue *GetEventQueue(){
+            return &deferredQueue;
+        }
+
+    private:
+        TTScheduler();
+
+        /** @brief Insert a task into the due ordered list and re-arm if it became the head. Call in a critical section. */
+        void Insert(TTSchedulerTask &task);
+
+        /** @brief Remove a task from the list. Call in a critical section. */
+        void Remove(TTSchedulerTask &task);
+
+        /** @brief Arm the timer for the head of the list. Call in a critical section. */
+        void Arm();
+
+        /** @brief Run every task that is due. */
+        void TimeoutHandler();
+
+        /** @brief First task to run. */
+        TTSchedulerTask *head = 0;
+
+        /** @brief The one timer every task shares. */
+        Timeout timeout;
+
+        /** @brief Is the timer attached, and for what due time? Only read and written in critical sections. */
+        bool armed = false;
+        us_timestamp_t armedDue = 0;
+
+        /** @brief Storage for the deferred events so the queue doesn't use the heap. */
+        unsigned char deferredBuffer[TTSCHEDULER_DEFERRED_EVENTS * EVENTS_EVENT_SIZE];
+
+        /** @brief Deferred tier queue. */
+        EventQueue deferredQueue{sizeof(deferredBuffer), deferredBuffer};
+
+        /** @brief Stack for the deferred thread. */
+        uint64_t deferredStack[TTSCHEDULER_STACK_SIZE / sizeof(uint64_t)];
+
+        /** @brief Thread dispatching the deferred queue. */
+        Thread deferredThread{TTSCHEDULER_PRIORITY, TTSCHEDULER_STACK_SIZE, (unsigned char *)deferredStack, "ttscheduler"};
+};
+
+#endif
\ No newline at end of file
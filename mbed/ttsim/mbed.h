@@ -0,0 +1,602 @@
+/**
+*     _____ _____ ___ _
+*    |_   _|_   _/ __(_)_ __
+*      | |   | | \__ \ | '  \
+*      |_|   |_| |___/_|_|_|_|
+*
+*
+* @file mbed.h
+* @brief This file contains the host replacement for the parts of mbed-os TTLibs uses.
+*
+* This is the hardware seam. Putting the ttsim directory ahead of everything else on the include path makes the
+* drivers build for the host against TTSim instead of a target. Pins, timers and the microsecond ticker are backed by
+* the virtual clock in ttsim.h. There is one thread, blocking waits and sleeps run the simulation forward until they
+* are satisfied and EventQueues are dispatched by TTSim between interrupts, the way their threads would be.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_SIM_MBED_H
+#define TT_SIM_MBED_H
+
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+/** @brief Pins available to the simulation. */
+typedef enum{
+    PA_0, PA_1, PA_2, PA_3, PA_4, PA_5, PA_6, PA_7, PA_8, PA_9, PA_10, PA_11, PA_12, PA_13, PA_14, PA_15,
+    PB_0, PB_1, PB_2, PB_3, PB_4, PB_5, PB_6, PB_7, PB_8, PB_9, PB_10, PB_11, PB_12, PB_13, PB_14, PB_15,
+    PC_0, PC_1, PC_2, PC_3, PC_4, PC_5, PC_6, PC_7, PC_8, PC_9, PC_10, PC_11, PC_12, PC_13, PC_14, PC_15,
+    TTSIM_PIN_COUNT,
+    NC = -1
+} PinName;
+
+/** @brief Ports of 16 pins, PinName is (port << 4) | pin as on STM32 targets. */
+typedef enum{
+    PortA, PortB, PortC
+} PortName;
+
+#define STM_PORT(X) (((uint32_t)(X) >> 4) & 0xF)
+#define STM_PIN(X) ((uint32_t)(X) & 0xF)
+
+typedef enum{
+    PullNone,
+    PullUp,
+    PullDown,
+    PullDefault = PullNone
+} PinMode;
+
+typedef enum{
+    SUCCESS = 0U,
+    ERROR = !SUCCESS
+} ErrorStatus;
+
+typedef int32_t osStatus;
+
+#define osOK 0
+#define osWaitForever 0xFFFFFFFFU
+#define osFlagsError 0x80000000U
+#define osFlagsErrorTimeout 0xFFFFFFFEU
+
+#define MBED_ASSERT(expression) ((void)0)
+#define MBED_FORCEINLINE inline __attribute__((always_inline))
+#define MBED_UNUSED __attribute__((unused))
+
+#define EVENTS_EVENT_SIZE 64
+#define EVENTS_QUEUE_SIZE (32 * EVENTS_EVENT_SIZE)
+
+#define DEVICE_INTERRUPTIN 1
+#define DEVICE_PWMOUT 1
+#define DEVICE_ANALOGIN 1
+#define DEVICE_PORTIN 1
+
+/** @brief Nominal core clock, used to convert the virtual microseconds to cycles. */
+extern "C" uint32_t SystemCoreClock;
+
+extern "C"{
+    void core_util_critical_section_enter(void);
+    void core_util_critical_section_exit(void);
+    bool core_util_is_isr_active(void);
+    bool core_util_are_interrupts_enabled(void);
+    uint32_t us_ticker_read(void);
+}
+
+//There is only one thread and interrupts never preempt it, plain accesses are atomic.
+inline bool core_util_atomic_cas_u8(volatile uint8_t *ptr, uint8_t *expected, uint8_t desired){
+    if(*ptr == *expected){
+        *ptr = desired;
+        return true;
+    }
+    *expected = *ptr;
+    return false;
+}
+
+inline bool core_util_atomic_cas_u32(volatile uint32_t *ptr, uint32_t *expected, uint32_t desired){
+    if(*ptr == *expected){
+        *ptr = desired;
+        return true;
+    }
+    *expected = *ptr;
+    return false;
+}
+
+inline uint8_t core_util_atomic_load_u8(const volatile uint8_t *ptr){return *ptr;}
+inline void core_util_atomic_store_u8(volatile uint8_t *ptr, uint8_t value){*ptr = value;}
+inline uint32_t core_util_atomic_load_u32(const volatile uint32_t *ptr){return *ptr;}
+inline void core_util_atomic_store_u32(volatile uint32_t *ptr, uint32_t value){*ptr = value;}
+inline int32_t core_util_atomic_load_s32(const volatile int32_t *ptr){return *ptr;}
+inline void core_util_atomic_store_s32(volatile int32_t *ptr, int32_t value){*ptr = value;}
+inline uint64_t core_util_atomic_load_u64(const volatile uint64_t *ptr){return *ptr;}
+inline void core_util_atomic_store_u64(volatile uint64_t *ptr, uint64_t value){*ptr = value;}
+inline int64_t core_util_atomic_load_s64(const volatile int64_t *ptr){return *ptr;}
+inline void core_util_atomic_store_s64(volatile int64_t *ptr, int64_t value){*ptr = value;}
+inline bool core_util_atomic_load_bool(const volatile bool *ptr){return *ptr;}
+inline void core_util_atomic_store_bool(volatile bool *ptr, bool value){*ptr = value;}
+inline uint8_t core_util_atomic_exchange_u8(volatile uint8_t *ptr, uint8_t value){uint8_t old = *ptr; *ptr = value; return old;}
+inline uint32_t core_util_atomic_exchange_u32(volatile uint32_t *ptr, uint32_t value){uint32_t old = *ptr; *ptr = value; return old;}
+inline uint32_t core_util_atomic_incr_u32(volatile uint32_t *ptr, uint32_t delta){return *ptr += delta;}
+inline uint32_t core_util_atomic_decr_u32(volatile uint32_t *ptr, uint32_t delta){return *ptr -= delta;}
+inline int32_t core_util_atomic_incr_s32(volatile int32_t *ptr, int32_t delta){return *ptr += delta;}
+inline int64_t core_util_atomic_incr_s64(volatile int64_t *ptr, int64_t delta){return *ptr += delta;}
+inline uint32_t core_util_atomic_fetch_or_u32(volatile uint32_t *ptr, uint32_t mask){uint32_t old = *ptr; *ptr = old | mask; return old;}
+inline uint32_t core_util_atomic_fetch_and_u32(volatile uint32_t *ptr, uint32_t mask){uint32_t old = *ptr; *ptr = old & mask; return old;}
+
+/** @brief Print to stdout. */
+void debug(const char *format, ...);
+
+/** @brief Run the simulation forward. */
+void wait_us(int us);
+
+class TTSim;
+
+/** @brief Just the EXTI interrupt mask, which InterruptIn keeps as mbed's STM32 gpio_irq does. */
+typedef struct{
+    volatile uint32_t IMR;
+} EXTI_TypeDef;
+
+extern EXTI_TypeDef ttsimExti;
+
+#define EXTI (&ttsimExti)
+#define EXTI_IMR_MR0 (1UL << 0)
+
+namespace mbed{
+
+template<typename F> class Callback;
+
+/** @brief Callback backed by std::function, the host has a heap to spare. */
+template<typename R, typename... Args>
+class Callback<R(Args...)>{
+    public:
+        Callback(){}
+
+        Callback(std::nullptr_t){}
+
+        Callback(R (*function)(Args...)){
+            if(function != nullptr){
+                this->function = function;
+            }
+        }
+
+        template<typename T, typename U>
+        Callback(U *object, R (T::*method)(Args...)){
+            function = [object, method](Args... args) -> R {return (static_cast<T *>(object)->*method)(args...);};
+        }
+
+        template<typename T, typename U>
+        Callback(U *object, R (T::*method)(Args...) const){
+            function = [object, method](Args... args) -> R {return (static_cast<const T *>(object)->*method)(args...);};
+        }
+
+        template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Callback>::value
+            && !std::is_pointer<typename std::decay<F>::type>::value>::type>
+        Callback(F function) : function(function){}
+
+        R call(Args... args) const{
+            return function(args...);
+        }
+
+        R operator()(Args... args) const{
+            return function(args...);
+        }
+
+        explicit operator bool() const{
+            return (bool)function;
+        }
+
+        bool operator==(std::nullptr_t) const{
+            return !function;
+        }
+
+        bool operator!=(std::nullptr_t) const{
+            return (bool)function;
+        }
+
+    private:
+        std::function<R(Args...)> function;
+};
+
+template<typename R, typename... Args>
+Callback<R(Args...)> callback(R (*function)(Args...)){
+    return Callback<R(Args...)>(function);
+}
+
+template<typename T, typename U, typename R, typename... Args>
+Callback<R(Args...)> callback(U *object, R (T::*method)(Args...)){
+    return Callback<R(Args...)>(object, method);
+}
+
+template<typename T, typename U, typename R, typename... Args>
+Callback<R(Args...)> callback(U *object, R (T::*method)(Args...) const){
+    return Callback<R(Args...)>(object, method);
+}
+
+class DigitalOut{
+    public:
+        DigitalOut(PinName pin, int value = 0);
+        void write(int value);
+        int read();
+        int is_connected();
+        DigitalOut &operator=(int value){write(value); return *this;}
+        DigitalOut &operator=(DigitalOut &rhs){write(rhs.read()); return *this;}
+        operator int(){return read();}
+
+    private:
+        PinName pin;
+};
+
+class DigitalIn{
+    public:
+        DigitalIn(PinName pin, PinMode mode = PullDefault);
+        int read();
+        void mode(PinMode pull);
+        int is_connected();
+        operator int(){return read();}
+
+    private:
+        PinName pin;
+};
+
+class PortIn{
+    public:
+        PortIn(PortName port, int mask = 0xFFFFFFFF);
+        int read();
+        void mode(PinMode pull);
+        operator int(){return read();}
+
+    private:
+        PortName port;
+        int mask;
+};
+
+class InterruptIn{
+    public:
+        InterruptIn(PinName pin, PinMode mode = PullDefault);
+        ~InterruptIn();
+        int read();
+        void mode(PinMode pull);
+        void rise(Callback<void()> handler);
+        void fall(Callback<void()> handler);
+        void enable_irq();
+        void disable_irq();
+        operator int(){return read();}
+
+        /** @brief Called by TTSim on an edge. */
+        void Edge(int level);
+
+    private:
+        PinName pin;
+        Callback<void()> onRise;
+        Callback<void()> onFall;
+        bool enabled = true;
+
+        /** @brief Does this pin hold its EXTI line in the mask? */
+        bool masked = false;
+
+        /** @brief Hold the pin's EXTI line in the mask while either edge has a handler. */
+        void UpdateMask();
+};
+
+class PwmOut{
+    public:
+        PwmOut(PinName pin);
+        void period(float seconds);
+        void period_ms(int ms);
+        void period_us(int us);
+        void write(float value);
+        float read();
+        void pulsewidth_us(int us);
+        void suspend(){}
+        void resume(){}
+        PwmOut &operator=(float value){write(value); return *this;}
+        operator float(){return read();}
+
+    private:
+        PinName pin;
+        int periodUs = 20000;
+};
+
+/** @brief ADC HAL, unlike AnalogIn it takes no lock so can be read from an ISR. */
+typedef struct{
+    PinName pin;
+} analogin_t;
+
+void analogin_init(analogin_t *obj, PinName pin);
+float analogin_read(analogin_t *obj);
+uint16_t analogin_read_u16(analogin_t *obj);
+
+class AnalogIn{
+    public:
+        AnalogIn(PinName pin);
+        float read();
+        unsigned short read_u16();
+        operator float(){return read();}
+
+    private:
+        PinName pin;
+};
+
+/** @brief Virtual clock timer node, Timeout and Ticker are both one. */
+class TimerEvent{
+
+    friend class ::TTSim;
+
+    public:
+        TimerEvent(){}
+        TimerEvent(const TimerEvent &) = delete;
+        TimerEvent &operator=(const TimerEvent &) = delete;
+        virtual ~TimerEvent();
+
+        void detach();
+        std::chrono::microseconds remaining_time() const;
+
+    protected:
+        void Insert(Callback<void()> handler, uint64_t due, uint64_t period);
+
+    private:
+        Callback<void()> handler;
+        uint64_t due = 0;
+        uint64_t period = 0;
+        TimerEvent *next = 0;
+        bool pending = false;
+};
+
+class TimeoutBase : public TimerEvent{
+    public:
+        void attach(Callback<void()> handler, std::chrono::microseconds delay);
+};
+
+class Timeout : public TimeoutBase{};
+
+class Ticker : public TimerEvent{
+    public:
+        void attach(Callback<void()> handler, std::chrono::microseconds period);
+};
+
+class Timer{
+    public:
+        void start();
+        void stop();
+        void reset();
+        std::chrono::microseconds elapsed_time() const;
+        int read_us() const{return (int)elapsed_time().count();}
+        float read() const{return elapsed_time().count() / 1000000.0f;}
+
+    private:
+        uint64_t started = 0;
+        uint64_t accumulated = 0;
+        bool running = false;
+};
+
+class CriticalSectionLock{
+    public:
+        CriticalSectionLock(){core_util_critical_section_enter();}
+        ~CriticalSectionLock(){core_util_critical_section_exit();}
+        static void enable(){core_util_critical_section_enter();}
+        static void disable(){core_util_critical_section_exit();}
+};
+
+/** @brief Output only, enough to drain TTTrace. */
+class FileHandle{
+    public:
+        virtual ssize_t write(const void *buffer, size_t size){
+            return fwrite(buffer, 1, size, stdout);
+        }
+        virtual ssize_t read(void *buffer, size_t size){
+            (void)buffer;
+            (void)size;
+            return 0;
+        }
+        virtual ~FileHandle(){}
+};
+
+/** @brief Dynamic extent only. */
+template<typename T>
+class Span{
+    public:
+        Span() = default;
+        Span(T *data, size_t size) : pointer(data), length(size){}
+        template<size_t N>
+        Span(T (&array)[N]) : pointer(array), length(N){}
+        T *data() const{return pointer;}
+        size_t size() const{return length;}
+        bool empty() const{return length == 0;}
+        T &operator[](size_t index) const{return pointer[index];}
+        T *begin() const{return pointer;}
+        T *end() const{return pointer + length;}
+
+    private:
+        T *pointer = nullptr;
+        size_t length = 0;
+};
+
+}
+
+namespace rtos{
+
+enum{
+    osPriorityIdle = 1,
+    osPriorityLow = 8,
+    osPriorityBelowNormal = 16,
+    osPriorityNormal = 24,
+    osPriorityAboveNormal = 32,
+    osPriorityHigh = 40,
+    osPriorityRealtime = 48
+};
+
+namespace Kernel{
+    /** @brief Kernel clock running on the virtual time. */
+    struct Clock{
+        typedef std::chrono::milliseconds duration;
+        typedef std::chrono::duration<uint32_t, std::milli> duration_u32;
+        typedef std::chrono::time_point<Clock> time_point;
+        static const bool is_steady = true;
+        static time_point now();
+    };
+}
+
+/** @brief Only one thread exists, a mutex is always available. */
+class Mutex{
+    public:
+        void lock(){count++;}
+        bool trylock(){count++; return true;}
+        bool trylock_for(Kernel::Clock::duration_u32 timeout){(void)timeout; count++; return true;}
+        void unlock(){count--;}
+
+    private:
+        int count = 0;
+};
+
+class EventFlags{
+    public:
+        uint32_t set(uint32_t flags){
+            return this->flags |= flags;
+        }
+        uint32_t clear(uint32_t flags = 0x7FFFFFFF){
+            uint32_t old = this->flags;
+            this->flags &= ~flags;
+            return old;
+        }
+        uint32_t get() const{
+            return flags;
+        }
+        uint32_t wait_any(uint32_t flags, uint32_t millisec = osWaitForever, bool clear = true){
+            return Wait(flags, millisec, clear, false);
+        }
+        uint32_t wait_all(uint32_t flags, uint32_t millisec = osWaitForever, bool clear = true){
+            return Wait(flags, millisec, clear, true);
+        }
+        uint32_t wait_any_for(uint32_t flags, Kernel::Clock::duration_u32 timeout, bool clear = true){
+            return Wait(flags, timeout.count(), clear, false);
+        }
+        uint32_t wait_all_for(uint32_t flags, Kernel::Clock::duration_u32 timeout, bool clear = true){
+            return Wait(flags, timeout.count(), clear, true);
+        }
+        uint32_t wait_any_until(uint32_t flags, Kernel::Clock::time_point deadline, bool clear = true);
+        uint32_t wait_all_until(uint32_t flags, Kernel::Clock::time_point deadline, bool clear = true);
+
+    private:
+        /** @brief Run the simulation until the flags are set or the timeout passes. */
+        uint32_t Wait(uint32_t flags, uint32_t millisec, bool clear, bool all);
+        uint32_t WaitUntil(uint32_t flags, uint64_t deadline, bool clear, bool all);
+
+        volatile uint32_t flags = 0;
+};
+
+/** @brief Threads are never run, whatever they would dispatch TTSim dispatches itself. */
+class Thread{
+    public:
+        Thread(int priority = osPriorityNormal, uint32_t stackSize = 4096, unsigned char *stack = nullptr, const char *name = nullptr){
+            (void)priority;
+            (void)stackSize;
+            (void)stack;
+            (void)name;
+        }
+        osStatus start(mbed::Callback<void()> task){
+            (void)task;
+            return osOK;
+        }
+        osStatus join(){
+            return osOK;
+        }
+};
+
+namespace ThisThread{
+    void sleep_for(Kernel::Clock::duration_u32 time);
+    void sleep_until(Kernel::Clock::time_point time);
+    void yield();
+}
+
+}
+
+namespace events{
+
+/** @brief EventQueue dispatched by TTSim whenever no interrupt is running. */
+class EventQueue{
+
+    friend class ::TTSim;
+
+    public:
+        EventQueue(unsigned size = EVENTS_QUEUE_SIZE, unsigned char *buffer = nullptr);
+        EventQueue(const EventQueue &) = delete;
+        EventQueue &operator=(const EventQueue &) = delete;
+        ~EventQueue();
+
+        template<typename F, typename... Args>
+        int call(F function, Args... args){
+            return Post(Bind(function, args...), 0, 0);
+        }
+
+        template<typename T, typename R, typename... Args>
+        int call(T *object, R (T::*method)(Args...)){
+            return Post([object, method](){(object->*method)();}, 0, 0);
+        }
+
+        template<typename F, typename... Args>
+        int call_in(std::chrono::milliseconds delay, F function, Args... args){
+            return Post(Bind(function, args...), delay.count() * 1000, 0);
+        }
+
+        template<typename F, typename... Args>
+        int call_every(std::chrono::milliseconds period, F function, Args... args){
+            return Post(Bind(function, args...), period.count() * 1000, period.count() * 1000);
+        }
+
+        bool cancel(int id);
+
+        /** @brief Run every event that is due. */
+        void dispatch_once();
+
+        /** @brief Same as dispatch_once(), TTSim keeps dispatching afterwards. */
+        void dispatch_forever(){
+            dispatch_once();
+        }
+
+        void break_dispatch(){}
+
+    private:
+        struct Event{
+            std::function<void()> function;
+            uint64_t due;
+            uint64_t period;
+            int id;
+        };
+
+        template<typename F, typename... Args>
+        static std::function<void()> Bind(F function, Args... args){
+            return [function, args...]() mutable {function(args...);};
+        }
+
+        int Post(std::function<void()> function, uint64_t delay, uint64_t period);
+
+        /** @brief Earliest due event or UINT64_MAX. */
+        uint64_t NextDue() const;
+
+        unsigned capacity;
+        Event *events;
+        unsigned count = 0;
+        int nextId = 1;
+        EventQueue *next = 0;
+};
+
+}
+
+using namespace std;
+using namespace mbed;
+using namespace rtos;
+using namespace events;
+using namespace std::chrono_literals;
+
+#endif
@@ -0,0 +1,812 @@
+/**
+*     _____ _____ ___              _                 _
+*    |_   _|_   _| _ ) ___ _ _  __| |_  _ __  __ _ _| |__
+*      | |   | | | _ \/ -_) ' \/ _| ' \| '  \/ _` | '_| / /
+*      |_|   |_| |___/\___|_||_\__|_||_|_|_|_\__,_|_| |_\_\
+*
+*
+* @file TTBenchmark.cpp
+* @brief This file contains the host benchmarks for TTStepper, TTEncoder and TTDcMotor, run against TTSim.
+*
+* Prints one "name value unit" line per metric. Save the output as a baseline and pass it back in to fail on
+* regressions: ttbenchmark [baseline [tolerance]]. Timings are the best of several runs in host nanoseconds, so compare
+* them against a baseline from the same, otherwise idle, machine. Accuracy metrics use the virtual clock and are exact
+* for a given build, the profile accuracy ones also fail the run past a fixed limit.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "ttsim.h"
+#include "ttstepper.h"
+#include "ttencoder.h"
+#include "ttdcmotor.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#define TTBENCHMARK_MAX_METRICS 80
+#define TTBENCHMARK_DEFAULT_TOLERANCE 0.25
+#define TTBENCHMARK_RUNS 9
+
+#define TTBENCHMARK_STEPS_PER_REV 200
+#define TTBENCHMARK_MIN_SPEED 0.5f
+#define TTBENCHMARK_MAX_SPEED 10.0f
+#define TTBENCHMARK_ACCELERATION 4000.0f
+#define TTBENCHMARK_JERK 200000.0f
+
+//Absolute bounds on the trapezoidal profile against the ideal curve, checked with or without a baseline.
+#define TTBENCHMARK_PROFILE_MAX_ERROR 1000.0
+#define TTBENCHMARK_PROFILE_MAX_DURATION_ERROR 1.0
+
+#define TTBENCHMARK_ENCODER_EDGES 100000
+#define TTBENCHMARK_DISPATCH_ENCODERS 6
+
+#define TTBENCHMARK_PLANT_MAX_RATE 20000.0f
+#define TTBENCHMARK_PLANT_TIME_CONSTANT 0.02f
+#define TTBENCHMARK_PLANT_STEP_US 10
+#define TTBENCHMARK_PLANT_STALL_CURRENT 10.0f
+#define TTBENCHMARK_PLANT_COAST_TIME_CONSTANT 0.5f
+#define TTBENCHMARK_SENSE_FULL_SCALE 25.0f
+#define TTBENCHMARK_CURRENT_LIMIT 3.0f
+#define TTBENCHMARK_SLEW_RATE 5.0f
+
+/** @brief A measured value and which way is worse. */
+struct TTBenchmarkMetric{
+    char name[48];
+    double value;
+    const char *unit;
+    bool lowerIsBetter;
+
+    /** @brief Compared against the baseline? Worst case host timings are too noisy to be. */
+    bool checked;
+};
+
+static TTBenchmarkMetric metrics[TTBENCHMARK_MAX_METRICS];
+static int metricCount = 0;
+static int limitFailures = 0;
+
+static void Report(const char *name, double value, const char *unit, bool lowerIsBetter, bool checked = true){
+    if(metricCount == TTBENCHMARK_MAX_METRICS){
+        return;
+    }
+
+    TTBenchmarkMetric &metric = metrics[metricCount++];
+    snprintf(metric.name, sizeof(metric.name), "%s", name);
+    metric.value = value;
+    metric.unit = unit;
+    metric.lowerIsBetter = lowerIsBetter;
+    metric.checked = checked;
+    printf("%s %.3f %s\n", metric.name, value, unit);
+}
+
+/** @brief Fail the run if a metric is over an absolute limit, whatever the baseline says. */
+static void Limit(const char *name, double value, double limit){
+    if(value > limit){
+        fprintf(stderr, "OUT OF TOLERANCE %s %.3f limit %.3f\n", name, value, limit);
+        limitFailures++;
+    }
+}
+
+static double MeanIsrNs(const TTSimIsrStats &stats){
+    if(stats.count == 0){
+        return 0;
+    }
+
+    return (double)stats.totalNs / stats.count;
+}
+
+static double HostNs(std::chrono::steady_clock::time_point start){
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+/** @brief Step ISR cost, and so the highest step rate, for one way of generating periods. */
+static void BenchStepIsr(const char *mode, bool useRampTable, TTStepperProfile *profile){
+    TTStepper stepper(PA_0, PA_1, PA_2, TTBENCHMARK_STEPS_PER_REV);
+    stepper.SetMinSpeed(TTBENCHMARK_MIN_SPEED);
+    stepper.SetMaxSpeed(TTBENCHMARK_MAX_SPEED);
+    stepper.UseRampTable(useRampTable);
+    stepper.SetProfile(profile);
+
+    long pulses = 0;
+    TTSim::SetPinWatcher(PA_1, [&pulses](PinName pin, int level){
+        (void)pin;
+        pulses += level;
+    });
+
+    const long steps = 200000;
+    //Best of several runs, host preemption only ever makes things slower.
+    double best = 1e12;
+    double worst = 1e12;
+    double attaches = 0;
+    long error = 0;
+    for(int run = 0; run < TTBENCHMARK_RUNS; run++){
+        pulses = 0;
+        TTSim::ResetIsrStats();
+        stepper.MoveSteps(run % 2 ? -steps : steps);
+        stepper.WaitBlocking(600s);
+
+        TTSimIsrStats stats = TTSim::GetIsrStats();
+        best = std::min(best, MeanIsrNs(stats));
+        worst = std::min(worst, (double)stats.maxNs);
+        attaches = std::max(attaches, (double)stats.timerAttaches / steps);
+        error = std::max(error, labs(pulses - steps));
+    }
+    TTSim::SetPinWatcher(PA_1, nullptr);
+
+    char name[48];
+    snprintf(name, sizeof(name), "stepper.%s.isr_mean", mode);
+    Report(name, best, "ns", true);
+    snprintf(name, sizeof(name), "stepper.%s.isr_max", mode);
+    Report(name, worst, "ns", true, false);
+    snprintf(name, sizeof(name), "stepper.%s.max_step_rate", mode);
+    Report(name, best > 0 ? 1e9 / best : 0, "steps/s", false);
+    snprintf(name, sizeof(name), "stepper.%s.step_error", mode);
+    Report(name, error, "steps", true);
+    snprintf(name, sizeof(name), "stepper.%s.timer_attaches", mode);
+    Report(name, attaches, "calls/step", true);
+}
+
+/** @brief Cost of planning a move and of each period, calling the profile directly. */
+static void BenchRamp(const char *mode, TTStepperProfile &profile){
+    const float entry = TTBENCHMARK_MIN_SPEED * TTBENCHMARK_STEPS_PER_REV;
+    const float cruise = TTBENCHMARK_MAX_SPEED * TTBENCHMARK_STEPS_PER_REV;
+    const int plans = 10000;
+    const uint32_t steps = 5000;
+
+    double plan = 1e12;
+    double next = 1e12;
+    for(int run = 0; run < TTBENCHMARK_RUNS; run++){
+        TTStepperSegment segment;
+
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < plans; i++){
+            segment = TTStepperSegment();
+            segment.steps = steps + (i & 63);
+            segment.entryRate = entry;
+            segment.cruiseRate = cruise;
+            segment.exitRate = entry;
+            profile.Plan(segment);
+        }
+        plan = std::min(plan, HostNs(start) / plans);
+
+        //Sum the periods so the calls can't be optimised away.
+        volatile uint64_t total = 0;
+        start = std::chrono::steady_clock::now();
+        for(uint32_t i = 0; i < segment.steps; i++){
+            total = total + profile.Next(segment);
+        }
+        next = std::min(next, HostNs(start) / segment.steps);
+    }
+
+    char name[48];
+    snprintf(name, sizeof(name), "ramp.%s.plan", mode);
+    Report(name, plan, "ns", true);
+    snprintf(name, sizeof(name), "ramp.%s.next", mode);
+    Report(name, next, "ns", true);
+}
+
+/** @brief Ideal time at which a constant acceleration move reaches a position. */
+static double TrapezoidTime(double position, double steps, double entry, double cruise, double acceleration){
+    double rampSteps = (cruise * cruise - entry * entry) / (2 * acceleration);
+    double peak = cruise;
+    if(rampSteps * 2 > steps){
+        rampSteps = steps / 2;
+        peak = sqrt(entry * entry + 2 * acceleration * rampSteps);
+    }
+
+    double rampTime = (peak - entry) / acceleration;
+    double cruiseSteps = steps - 2 * rampSteps;
+    double total = 2 * rampTime + cruiseSteps / peak;
+
+    auto ramp = [&](double x){
+        return (sqrt(entry * entry + 2 * acceleration * x) - entry) / acceleration;
+    };
+
+    if(position <= rampSteps){
+        return ramp(position);
+    }
+    else if(position <= rampSteps + cruiseSteps){
+        return rampTime + (position - rampSteps) / peak;
+    }
+    return total - ramp(steps - position);
+}
+
+/** @brief How closely the step pulses of a trapezoidal move follow the ideal motion. */
+static void BenchProfileAccuracy(){
+    TTStepperTrapezoidalProfile profile(TTBENCHMARK_ACCELERATION);
+    TTStepper stepper(PA_0, PA_1, PA_2, TTBENCHMARK_STEPS_PER_REV, 1.0f, &profile);
+    stepper.SetMinSpeed(TTBENCHMARK_MIN_SPEED);
+    stepper.SetMaxSpeed(TTBENCHMARK_MAX_SPEED);
+
+    std::vector<uint64_t> times;
+    TTSim::SetPinWatcher(PA_1, [&times](PinName pin, int level){
+        (void)pin;
+        if(level){
+            times.push_back(TTSim::Now());
+        }
+    });
+
+    const double entry = TTBENCHMARK_MIN_SPEED * TTBENCHMARK_STEPS_PER_REV;
+    const double cruise = TTBENCHMARK_MAX_SPEED * TTBENCHMARK_STEPS_PER_REV;
+    const long lengths[] = {200, 1000, 5000};
+
+    double worst = 0;
+    double squares = 0;
+    double endError = 0;
+    size_t samples = 0;
+    for(long steps : lengths){
+        times.clear();
+        stepper.MoveSteps(steps);
+        stepper.WaitBlocking(600s);
+
+        for(size_t i = 0; i < times.size(); i++){
+            double error = (times[i] - times[0]) - TrapezoidTime(i, steps, entry, cruise, TTBENCHMARK_ACCELERATION) * 1e6;
+            worst = std::max(worst, fabs(error));
+            squares += error * error;
+            samples++;
+        }
+
+        if(times.size() > 1){
+            double ideal = TrapezoidTime(times.size() - 1, steps, entry, cruise, TTBENCHMARK_ACCELERATION) * 1e6;
+            endError = std::max(endError, fabs((times.back() - times[0]) - ideal) * 100 / ideal);
+        }
+    }
+    TTSim::SetPinWatcher(PA_1, nullptr);
+
+    Report("profile.trapezoidal.max_error", worst, "us", true);
+    Report("profile.trapezoidal.rms_error", samples ? sqrt(squares / samples) : 0, "us", true);
+    Report("profile.trapezoidal.duration_error", endError, "%", true);
+    Limit("profile.trapezoidal.max_error", worst, TTBENCHMARK_PROFILE_MAX_ERROR);
+    Limit("profile.trapezoidal.duration_error", endError, TTBENCHMARK_PROFILE_MAX_DURATION_ERROR);
+}
+
+/** @brief Cost of planning a batch of moves on the calling thread, and that it steps exactly what was asked. */
+static void BenchBatch(){
+    TTStepperTrapezoidalProfile profile(TTBENCHMARK_ACCELERATION);
+    TTStepper stepper(PA_0, PA_1, PA_2, TTBENCHMARK_STEPS_PER_REV, 1.0f, &profile);
+    stepper.SetMinSpeed(TTBENCHMARK_MIN_SPEED);
+    stepper.SetMaxSpeed(TTBENCHMARK_MAX_SPEED);
+
+    long pulses = 0;
+    TTSim::SetPinWatcher(PA_1, [&pulses](PinName pin, int level){
+        (void)pin;
+        pulses += level;
+    });
+
+    //Same direction runs blend at their junctions, the reversals have to stop.
+    const TTStepperMove moves[TTSTEPPER_QUEUE_LENGTH] = {
+        {400, 0}, {1200, 0}, {300, 0}, {-800, 0}, {-50, 0}, {-2000, 0}, {600, 0}, {150, 0}
+    };
+
+    long expectedPulses = 0;
+    long expectedSteps = 0;
+    for(const TTStepperMove &move : moves){
+        expectedPulses += labs(move.steps);
+        expectedSteps += move.steps;
+    }
+
+    double plan = 1e12;
+    long error = 0;
+    for(int run = 0; run < TTBENCHMARK_RUNS; run++){
+        pulses = 0;
+        int32_t start = stepper.GetSteps();
+        TTStepperBatch batch;
+
+        auto begin = std::chrono::steady_clock::now();
+        int retval = stepper.MoveBatch(moves, &batch);
+        plan = std::min(plan, HostNs(begin) / TTSTEPPER_QUEUE_LENGTH);
+
+        if(retval != TTSTEPPER_SUCCESS || batch.Wait(600s) != TTSTEPPER_SUCCESS){
+            error = std::max(error, expectedPulses);
+            stepper.Stop();
+            continue;
+        }
+
+        error = std::max(error, labs(pulses - expectedPulses));
+        error = std::max(error, labs(stepper.GetSteps() - start - expectedSteps));
+    }
+    TTSim::SetPinWatcher(PA_1, nullptr);
+
+    Report("stepper.batch.plan", plan, "ns", true);
+    Report("stepper.batch.step_error", error, "steps", true);
+}
+
+/** @brief Time to home from the far end of a long axis, and how close FastHome() puts zero to the endstop edge. */
+static void BenchHoming(){
+    const long start = 20000;
+    const long hysteresis = 5;
+
+    //The axis, with a lower endstop that closes at 0 and opens again past the hysteresis.
+    long position = start;
+    TTSim::SetPinWatcher(PA_1, [&position, hysteresis](PinName pin, int level){
+        (void)pin;
+        if(level){
+            position += TTSim::GetPin(PA_2) ? 1 : -1;
+            if(position <= 0){
+                TTSim::SetPin(PA_3, 1);
+            }
+            else if(position > hysteresis){
+                TTSim::SetPin(PA_3, 0);
+            }
+        }
+    });
+
+    double times[2] = {0, 0};
+    long zeroError = 0;
+    for(int fast = 0; fast < 2; fast++){
+        position = start;
+        TTSim::SetPin(PA_3, 0);
+
+        TTStepper stepper(PA_0, PA_1, PA_2, TTBENCHMARK_STEPS_PER_REV);
+        stepper.SetMinSpeed(TTBENCHMARK_MIN_SPEED);
+        stepper.SetMaxSpeed(TTBENCHMARK_MAX_SPEED);
+        stepper.RegisterEndstop(PA_3, PullDown);
+
+        uint64_t begin = TTSim::Now();
+        int retval = fast ? stepper.FastHome() : stepper.Home();
+        times[fast] = (TTSim::Now() - begin) / 1e6;
+
+        if(fast){
+            zeroError = retval == TTSTEPPER_SUCCESS ? labs(stepper.GetSteps() - position) : start;
+        }
+    }
+    TTSim::SetPinWatcher(PA_1, nullptr);
+
+    Report("stepper.home.slow_time", times[0], "s", true);
+    Report("stepper.home.fast_time", times[1], "s", true);
+    Report("stepper.home.zero_error", zeroError, "steps", true);
+}
+
+/** @brief Pulses saved by coarsening the step resolution at speed, and that the motor still ends where it should. */
+static void BenchMicrostep(){
+    const uint16_t microsteps = 16;
+    TTStepperTrapezoidalProfile profile(TTBENCHMARK_ACCELERATION * microsteps);
+    TTStepperMicrostepPins pins(PA_4, PA_5, PA_6);
+    TTStepper stepper(PA_0, PA_1, PA_2, TTBENCHMARK_STEPS_PER_REV * microsteps, 1.0f, &profile);
+    stepper.SetMinSpeed(TTBENCHMARK_MIN_SPEED);
+    stepper.SetMaxSpeed(TTBENCHMARK_MAX_SPEED);
+    stepper.SetMicrostepDriver(&pins, microsteps, 4000);
+
+    //Decode the A4988 MS pins on every pulse to see how far it really moved.
+    long pulses = 0;
+    long position = 0;
+    TTSim::SetPinWatcher(PA_1, [&pulses, &position](PinName pin, int level){
+        (void)pin;
+        if(level){
+            static const int resolutions[8] = {1, 2, 4, 8, 0, 0, 0, 16};
+            int resolution = resolutions[TTSim::GetPin(PA_4) | (TTSim::GetPin(PA_5) << 1) | (TTSim::GetPin(PA_6) << 2)];
+            int size = resolution ? 16 / resolution : 0;
+            position += TTSim::GetPin(PA_2) ? size : -size;
+            pulses++;
+        }
+    });
+
+    const long moves[] = {40000, -40000, 12345, -777, 3};
+    long steps = 0;
+    long error = 0;
+    for(long move : moves){
+        stepper.MoveSteps(move);
+        stepper.WaitBlocking(600s);
+        steps += labs(move);
+        error = std::max(error, labs(position - stepper.GetSteps()));
+    }
+    error += labs(stepper.GetSteps() - (40000 - 40000 + 12345 - 777 + 3));
+
+    //Stopped at speed, mid stride, where nothing at the end of the move can cancel a miscount out.
+    long stopError = 0;
+    for(int run = 0; run < 5; run++){
+        stepper.MoveSteps(100000);
+        TTSim::RunFor(1000000 + run * 1234);
+        stepper.Stop();
+        stopError = std::max(stopError, labs(position - stepper.GetSteps()));
+    }
+    TTSim::SetPinWatcher(PA_1, nullptr);
+
+    Report("stepper.microstep.pulses_saved", 100.0 * (steps - pulses) / steps, "%", false);
+    Report("stepper.microstep.position_error", error, "steps", true);
+    Report("stepper.microstep.stop_position_error", stopError, "steps", true);
+}
+
+/** @brief Quadrature levels of A and B in counting up order, starting where the state machine decoder assumes. */
+static const int quadrature[4][2] = {{1, 0}, {1, 1}, {0, 1}, {0, 0}};
+
+/** @brief Put an encoder's pins at the first quadrature state, before the encoder is created. */
+static void QuadratureStart(PinName a, PinName b, int &phase){
+    phase = 0;
+    TTSim::SetPin(a, quadrature[0][0]);
+    TTSim::SetPin(b, quadrature[0][1]);
+}
+
+/** @brief Drive one quadrature edge. */
+static void QuadratureEdge(PinName a, PinName b, int &phase, bool up){
+    int from = phase;
+    phase = (phase + (up ? 1 : 3)) & 3;
+    if(quadrature[phase][0] != quadrature[from][0]){
+        TTSim::SetPin(a, quadrature[phase][0]);
+    }
+    else{
+        TTSim::SetPin(b, quadrature[phase][1]);
+    }
+}
+
+/** @brief Edge ISR cost, counting accuracy and velocity accuracy over a range of edge rates. */
+static void BenchEncoder(const char *mode, bool useLookupTable){
+    int phase;
+    QuadratureStart(PB_0, PB_1, phase);
+    TTEncoder encoder(PB_0, PB_1);
+    encoder.UseLookupTable(useLookupTable);
+
+    const double rates[] = {1000, 10000, 100000, 1000000};
+    const char *rateNames[] = {"1k", "10k", "100k", "1M"};
+
+    double best = 1e12;
+    long countError = 0;
+    char name[48];
+    for(size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++){
+        encoder.Reset();
+        TTSim::ResetIsrStats();
+
+        uint64_t start = TTSim::Now() + 1000;
+        for(int i = 0; i < TTBENCHMARK_ENCODER_EDGES; i++){
+            TTSim::RunUntil(start + (uint64_t)(i * 1e6 / rates[r]));
+            QuadratureEdge(PB_0, PB_1, phase, true);
+        }
+
+        float velocity = encoder.GetVelocity();
+        best = std::min(best, MeanIsrNs(TTSim::GetIsrStats()));
+        countError = std::max(countError, labs(encoder.getInterruptCount() - TTBENCHMARK_ENCODER_EDGES));
+
+        snprintf(name, sizeof(name), "encoder.%s.velocity_error_%s", mode, rateNames[r]);
+        Report(name, fabs(velocity - rates[r]) * 100 / rates[r], "%", true);
+
+        //Let it settle so the next rate starts from standstill.
+        TTSim::RunFor(TTENCODER_VELOCITY_TIMEOUT_US * 2);
+    }
+
+    snprintf(name, sizeof(name), "encoder.%s.edge_isr_mean", mode);
+    Report(name, best, "ns", true);
+    snprintf(name, sizeof(name), "encoder.%s.max_edge_rate", mode);
+    Report(name, best > 0 ? 1e9 / best : 0, "edges/s", false);
+    snprintf(name, sizeof(name), "encoder.%s.count_error", mode);
+    Report(name, countError, "counts", true);
+}
+
+static uint32_t dispatchNotifications = 0;
+
+static void CountNotification(){
+    dispatchNotifications++;
+}
+
+static void CountEdgesNotification(uint32_t){
+    dispatchNotifications++;
+}
+
+/**
+* @brief Edge ISR cost and counting accuracy for several encoders, each with its own ISRs and a callback per edge, then
+* all in one dispatcher with a grouped callback. The host only runs the portable dispatcher, not the EXTI one.
+*/
+static void BenchDispatcher(){
+    const PinName pins[TTBENCHMARK_DISPATCH_ENCODERS * 2] = {PA_0, PA_1, PA_2, PA_3, PA_4, PA_5, PA_6, PA_7, PA_8, PA_9, PA_10, PA_11};
+    int phases[TTBENCHMARK_DISPATCH_ENCODERS];
+    for(int i = 0; i < TTBENCHMARK_DISPATCH_ENCODERS; i++){
+        QuadratureStart(pins[i * 2], pins[i * 2 + 1], phases[i]);
+    }
+
+    TTEncoder encoder0(PA_0, PA_1), encoder1(PA_2, PA_3), encoder2(PA_4, PA_5);
+    TTEncoder encoder3(PA_6, PA_7), encoder4(PA_8, PA_9), encoder5(PA_10, PA_11);
+    TTEncoder *encoders[TTBENCHMARK_DISPATCH_ENCODERS] = {&encoder0, &encoder1, &encoder2, &encoder3, &encoder4, &encoder5};
+    TTEncoderDispatcher dispatcher;
+    dispatcher.SetOnEdgesCallback(CountEdgesNotification);
+
+    const char *modes[] = {"separate", "dispatched"};
+    char name[48];
+    for(int m = 0; m < 2; m++){
+        for(int e = 0; e < TTBENCHMARK_DISPATCH_ENCODERS; e++){
+            if(m == 0){
+                encoders[e]->UseLookupTable(true);
+                encoders[e]->SetOnInterruptCallback(CountNotification);
+            }
+            else if(dispatcher.Add(*encoders[e]) < 0){
+                printf("dispatcher add failed\n");
+                return;
+            }
+        }
+
+        double best = 1e12;
+        long countError = 0;
+        uint32_t notifications = 0;
+        for(int run = 0; run < TTBENCHMARK_RUNS; run++){
+            for(int e = 0; e < TTBENCHMARK_DISPATCH_ENCODERS; e++){
+                encoders[e]->Reset();
+            }
+            TTSim::ResetIsrStats();
+            dispatchNotifications = 0;
+
+            //100k edges/s spread round the encoders.
+            uint64_t start = TTSim::Now() + 1000;
+            for(int i = 0; i < TTBENCHMARK_ENCODER_EDGES; i++){
+                int e = i % TTBENCHMARK_DISPATCH_ENCODERS;
+                TTSim::RunUntil(start + (uint64_t)i * 10);
+                QuadratureEdge(pins[e * 2], pins[e * 2 + 1], phases[e], true);
+            }
+
+            best = std::min(best, MeanIsrNs(TTSim::GetIsrStats()));
+
+            //Let the last grouped callback run.
+            TTSim::RunFor(TTENCODER_DISPATCHER_NOTIFY_US * 2);
+            notifications = std::max(notifications, dispatchNotifications);
+
+            long error = 0;
+            for(int e = 0; e < TTBENCHMARK_DISPATCH_ENCODERS; e++){
+                long expected = TTBENCHMARK_ENCODER_EDGES / TTBENCHMARK_DISPATCH_ENCODERS +
+                                (e < TTBENCHMARK_ENCODER_EDGES % TTBENCHMARK_DISPATCH_ENCODERS ? 1 : 0);
+                error += labs(encoders[e]->getInterruptCount() - expected);
+            }
+            countError = std::max(countError, error);
+        }
+
+        snprintf(name, sizeof(name), "encoder.%s%d.edge_isr_mean", modes[m], TTBENCHMARK_DISPATCH_ENCODERS);
+        Report(name, best, "ns", true);
+        snprintf(name, sizeof(name), "encoder.%s%d.count_error", modes[m], TTBENCHMARK_DISPATCH_ENCODERS);
+        Report(name, countError, "counts", true);
+        snprintf(name, sizeof(name), "encoder.%s%d.callbacks", modes[m], TTBENCHMARK_DISPATCH_ENCODERS);
+        Report(name, notifications, "calls", true);
+    }
+}
+
+/**
+* @brief Adding encoders that already have their own pin interrupts. One is free to join, the other shares an EXTI line
+* with another driver's InterruptIn, so it has to be turned away and keep counting on its own interrupts.
+*/
+static void BenchDispatcherAdd(){
+    int joinPhase, clashPhase;
+    QuadratureStart(PB_4, PB_5, joinPhase);
+    QuadratureStart(PB_6, PB_7, clashPhase);
+    TTEncoder joining(PB_4, PB_5), clashing(PB_6, PB_7);
+    InterruptIn other(PC_6);
+    other.rise(CountNotification);
+
+    TTEncoderDispatcher dispatcher;
+    long addErrors = dispatcher.Add(joining) < 0 ? 1 : 0;
+    addErrors += dispatcher.Add(clashing) != TT_HARDWARE_UNSUPPORTED ? 1 : 0;
+
+    const long edges = 1000;
+    for(long i = 0; i < edges; i++){
+        TTSim::RunFor(10);
+        QuadratureEdge(PB_4, PB_5, joinPhase, true);
+        QuadratureEdge(PB_6, PB_7, clashPhase, true);
+    }
+    TTSim::RunFor(TTENCODER_DISPATCHER_NOTIFY_US * 2);
+
+    long countError = labs(joining.getInterruptCount() - edges) + labs(clashing.getInterruptCount() - edges);
+    Report("encoder.dispatcher_add.add_error", addErrors, "encoders", true);
+    Report("encoder.dispatcher_add.count_error", countError, "counts", true);
+}
+
+/** @brief Closed loop velocity control of a first order motor model, timing the control and encoder ISRs. */
+static void BenchDcMotor(){
+    int phase;
+    QuadratureStart(PB_2, PB_3, phase);
+    TTDcMotor motor(PA_5, PA_6, PA_7, 0.00005f);
+    motor.RegisterEncoder(PB_2, PB_3);
+    motor.SetVelocityGains(0.00002f, 0.0002f, 0, 1 / TTBENCHMARK_PLANT_MAX_RATE);
+    motor.SetMotionLimits(TTBENCHMARK_PLANT_MAX_RATE, 200000);
+
+    const float target = TTBENCHMARK_PLANT_MAX_RATE / 2;
+    const uint64_t settle = 1000000;
+    const uint64_t measure = 500000;
+
+    TTSim::ResetIsrStats();
+    motor.SetVelocity(target);
+
+    float velocity = 0;
+    float position = 0;
+    double error = 0;
+    uint64_t samples = 0;
+    const float dt = TTBENCHMARK_PLANT_STEP_US / 1000000.0f;
+    uint64_t start = TTSim::Now();
+    while(TTSim::Now() - start < settle + measure){
+        TTSim::RunFor(TTBENCHMARK_PLANT_STEP_US);
+
+        //Clockwise is A high, B low.
+        int a = TTSim::GetPin(PA_6);
+        int b = TTSim::GetPin(PA_7);
+        float drive = TTSim::GetDuty(PA_5) * (a && !b ? 1 : (b && !a ? -1 : 0));
+        velocity += (drive * TTBENCHMARK_PLANT_MAX_RATE - velocity) * dt / TTBENCHMARK_PLANT_TIME_CONSTANT;
+
+        float next = position + velocity * dt;
+        while(floorf(next) > floorf(position)){
+            QuadratureEdge(PB_2, PB_3, phase, true);
+            position += 1;
+        }
+        while(floorf(next) < floorf(position)){
+            QuadratureEdge(PB_2, PB_3, phase, false);
+            position -= 1;
+        }
+        position = next;
+
+        if(TTSim::Now() - start >= settle){
+            error += fabs(velocity - target);
+            samples++;
+        }
+    }
+
+    Report("dcmotor.isr_mean", MeanIsrNs(TTSim::GetIsrStats()), "ns", true);
+    Report("dcmotor.velocity_error", samples ? error * 100 / samples / target : 0, "%", true);
+    motor.Stop();
+}
+
+/** @brief Current and speed of a motor model with back EMF, driven by the h-bridge pins. */
+struct TTBenchmarkPlant{
+    float velocity;
+    float peakCurrent;
+    float lastCurrent;
+};
+
+/**
+* @brief Run the motor model on PB_5 (enable), PB_6 (A) and PB_7 (B), sensing its current on PB_8.
+* @param plant Model state, peakCurrent is raised to the highest current seen.
+* @param us Microseconds to run for.
+* @param locked Hold the shaft still, as when stalled.
+*/
+static void RunPlant(TTBenchmarkPlant &plant, uint64_t us, bool locked){
+    const float dt = TTBENCHMARK_PLANT_STEP_US / 1000000.0f;
+    uint64_t start = TTSim::Now();
+
+    while(TTSim::Now() - start < us){
+        TTSim::RunFor(TTBENCHMARK_PLANT_STEP_US);
+
+        int a = TTSim::GetPin(PB_6);
+        int b = TTSim::GetPin(PB_7);
+        float duty = TTSim::GetDuty(PB_5);
+        float current = 0;
+
+        if(duty == 0 || (!a && !b)){
+            //Bridge off, only friction slows it.
+            plant.velocity -= plant.velocity * dt / TTBENCHMARK_PLANT_COAST_TIME_CONSTANT;
+        }
+        else{
+            //Both sides on the same rail short the motor, it brakes on its own back EMF.
+            float drive = a == b ? 0 : (a ? duty : -duty);
+            current = TTBENCHMARK_PLANT_STALL_CURRENT * (drive - plant.velocity / TTBENCHMARK_PLANT_MAX_RATE);
+            plant.velocity += (drive * TTBENCHMARK_PLANT_MAX_RATE - plant.velocity) * dt / TTBENCHMARK_PLANT_TIME_CONSTANT;
+        }
+
+        if(locked){
+            plant.velocity = 0;
+        }
+
+        plant.lastCurrent = fabsf(current);
+        plant.peakCurrent = std::max(plant.peakCurrent, plant.lastCurrent);
+        TTSim::SetAnalog(PB_8, plant.lastCurrent / TTBENCHMARK_SENSE_FULL_SCALE);
+    }
+}
+
+/** @brief Peak currents starting and reversing with and without the duty ramp, stall current limiting and stop times. */
+static void BenchDcMotorRamp(){
+    TTDcMotor motor(PB_5, PB_6, PB_7, 0.00005f);
+    TTBenchmarkPlant plant = {0, 0, 0};
+    char name[48];
+
+    const char *modes[] = {"instant", "ramped"};
+    for(int m = 0; m < 2; m++){
+        motor.SetSlewRate(m == 0 ? 0 : TTBENCHMARK_SLEW_RATE);
+
+        plant.peakCurrent = 0;
+        motor.Spin(1, TTDcMotor::clockwise);
+        RunPlant(plant, 500000, false);
+        snprintf(name, sizeof(name), "dcmotor.%s.start_peak_current", modes[m]);
+        Report(name, plant.peakCurrent, "A", true);
+
+        plant.peakCurrent = 0;
+        motor.Spin(1, TTDcMotor::anticlockwise);
+        RunPlant(plant, 1000000, false);
+        snprintf(name, sizeof(name), "dcmotor.%s.reverse_peak_current", modes[m]);
+        Report(name, plant.peakCurrent, "A", true);
+
+        motor.Stop();
+        RunPlant(plant, 3000000, false);
+    }
+
+    //Stalled at full duty, with and without the limit.
+    motor.SetSlewRate(TTBENCHMARK_SLEW_RATE);
+    for(int limited = 0; limited < 2; limited++){
+        motor.SetCurrentLimit(limited ? PB_8 : NC, TTBENCHMARK_SENSE_FULL_SCALE, TTBENCHMARK_CURRENT_LIMIT);
+        motor.Spin(1, TTDcMotor::clockwise);
+        RunPlant(plant, 1000000, true);
+        snprintf(name, sizeof(name), "dcmotor.%s.stall_current", limited ? "limited" : "unlimited");
+        Report(name, plant.lastCurrent, "A", true);
+        motor.Stop();
+    }
+    motor.SetCurrentLimit(NC, 0, 0);
+
+    //Time from full speed until under 5% of it.
+    const char *stops[] = {"coast", "brake"};
+    for(int mode = 0; mode < 2; mode++){
+        motor.SetSlewRate(0);
+        motor.SetStopMode(mode == 0 ? TTDcMotor::coast : TTDcMotor::brake);
+        motor.Spin(1, TTDcMotor::clockwise);
+        RunPlant(plant, 500000, false);
+
+        motor.Stop();
+        uint64_t start = TTSim::Now();
+        while(fabsf(plant.velocity) > TTBENCHMARK_PLANT_MAX_RATE * 0.05f && TTSim::Now() - start < 10000000){
+            RunPlant(plant, 100, false);
+        }
+
+        snprintf(name, sizeof(name), "dcmotor.%s.stop_time", stops[mode]);
+        Report(name, (TTSim::Now() - start) / 1000.0, "ms", true);
+    }
+    motor.SetStopMode(TTDcMotor::coast);
+}
+
+/** @brief Compare against a saved run, returning the number of regressions. */
+static int CompareBaseline(const char *path, double tolerance){
+    FILE *file = fopen(path, "r");
+    if(file == 0){
+        fprintf(stderr, "Can't open baseline %s\n", path);
+        return 1;
+    }
+
+    int regressions = 0;
+    char name[48];
+    double baseline;
+    char unit[16];
+    while(fscanf(file, "%47s %lf %15s", name, &baseline, unit) == 3){
+        for(int i = 0; i < metricCount; i++){
+            if(!metrics[i].checked || strcmp(metrics[i].name, name) != 0){
+                continue;
+            }
+
+            //Small absolute slack so metrics that are normally 0 don't fail on noise.
+            double value = metrics[i].value;
+            bool worse = metrics[i].lowerIsBetter ? value > baseline * (1 + tolerance) + 0.5 : value < baseline * (1 - tolerance);
+            if(worse){
+                fprintf(stderr, "REGRESSION %s %.3f was %.3f %s\n", name, value, baseline, unit);
+                regressions++;
+            }
+        }
+    }
+
+    fclose(file);
+    return regressions;
+}
+
+int main(int argc, char **argv){
+    TTStepperTrapezoidalProfile trapezoidal(TTBENCHMARK_ACCELERATION);
+    TTStepperSCurveProfile sCurve(TTBENCHMARK_ACCELERATION, TTBENCHMARK_JERK);
+
+    BenchStepIsr("computed", false, 0);
+    BenchStepIsr("table", true, 0);
+    BenchStepIsr("trapezoidal", false, &trapezoidal);
+    BenchStepIsr("scurve", false, &sCurve);
+
+    BenchRamp("trapezoidal", trapezoidal);
+    BenchRamp("scurve", sCurve);
+
+    BenchProfileAccuracy();
+    BenchBatch();
+    BenchHoming();
+    BenchMicrostep();
+
+    BenchEncoder("statemachine", false);
+    BenchEncoder("lookup", true);
+    BenchDispatcher();
+    BenchDispatcherAdd();
+
+    BenchDcMotor();
+    BenchDcMotorRamp();
+
+    if(argc > 1){
+        double tolerance = argc > 2 ? atof(argv[2]) : TTBENCHMARK_DEFAULT_TOLERANCE;
+        return CompareBaseline(argv[1], tolerance) == 0 && limitFailures == 0 ? 0 : 1;
+    }
+
+    return limitFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,717 @@
+/**
+*     _____ _____ ___ _
+*    |_   _|_   _/ __(_)_ __
+*      | |   | | \__ \ | '  \
+*      |_|   |_| |___/_|_|_|_|
+*
+*
+* @file TTSim.cpp
+* @brief This file contains the functions associated with TTSim and the mbed.h replacements it backs.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "ttsim.h"
+#include "us_ticker_api.h"
+#include <algorithm>
+#include <chrono>
+
+uint32_t SystemCoreClock = TTSIM_CORE_CLOCK;
+
+EXTI_TypeDef ttsimExti = {0};
+
+namespace{
+    /** @brief Virtual time in microseconds. */
+    uint64_t now = 0;
+
+    int levels[TTSIM_PIN_COUNT];
+
+    /** @brief Levels of each port's pins as an input register would read them, kept with levels. */
+    uint32_t portLevels[(TTSIM_PIN_COUNT + 15) / 16];
+    bool driven[TTSIM_PIN_COUNT];
+    float duties[TTSIM_PIN_COUNT];
+    float analogs[TTSIM_PIN_COUNT];
+    InterruptIn *interrupts[TTSIM_PIN_COUNT];
+    Callback<void(PinName, int)> watchers[TTSIM_PIN_COUNT];
+
+    /** @brief Pending timers in due order. */
+    TimerEvent *timers = 0;
+
+    /** @brief Every EventQueue. */
+    EventQueue *queues = 0;
+
+    /** @brief Is an EventQueue being dispatched? A wait inside an event mustn't dispatch its own queue again. */
+    bool dispatching = false;
+
+    int isrDepth = 0;
+    int criticalDepth = 0;
+    TTSimIsrStats isrStats = {0, 0, 0, 0};
+
+    /** @brief Cost of reading the host clock, taken off every interrupt timing. */
+    int64_t clockOverheadNs = -1;
+
+    int64_t ClockOverhead(){
+        if(clockOverheadNs < 0){
+            clockOverheadNs = INT64_MAX;
+            for(int i = 0; i < 1000; i++){
+                auto start = std::chrono::steady_clock::now();
+                int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                clockOverheadNs = std::min(clockOverheadNs, ns);
+            }
+        }
+        return clockOverheadNs;
+    }
+
+    bool Valid(PinName pin){
+        return pin >= 0 && pin < TTSIM_PIN_COUNT;
+    }
+
+    void SetLevel(PinName pin, int level){
+        levels[pin] = level;
+        if(level){
+            portLevels[pin >> 4] |= 1u << (pin & 15);
+        }
+        else{
+            portLevels[pin >> 4] &= ~(1u << (pin & 15));
+        }
+    }
+}
+
+uint64_t TTSim::Now(){
+    return now;
+}
+
+void TTSim::RunFor(uint64_t us){
+    RunUntil(now + us);
+}
+
+void TTSim::RunUntil(uint64_t time){
+    while(RunNext(time)){}
+}
+
+bool TTSim::RunNext(uint64_t deadline){
+    DispatchQueues();
+
+    uint64_t timerDue = timers != 0 ? timers->due : UINT64_MAX;
+    uint64_t queueDue = NextQueueDue();
+    uint64_t due = std::min(timerDue, queueDue);
+
+    if(due == UINT64_MAX || due > deadline){
+        if(deadline != UINT64_MAX && deadline > now){
+            now = deadline;
+            DispatchQueues();
+        }
+        return false;
+    }
+
+    if(due > now){
+        now = due;
+    }
+
+    if(timerDue == due){
+        TimerEvent *timer = timers;
+        timers = timer->next;
+        timer->pending = false;
+
+        //Copy first, the handler may re-attach the timer.
+        Callback<void()> handler = timer->handler;
+        if(timer->period != 0){
+            timer->due += timer->period;
+            InsertTimer(timer);
+        }
+        RunIsr(handler);
+    }
+    else{
+        DispatchQueues();
+    }
+
+    return true;
+}
+
+void TTSim::SetPin(PinName pin, int level){
+    if(!Valid(pin)){
+        return;
+    }
+
+    driven[pin] = true;
+    DrivePin(pin, level);
+}
+
+int TTSim::GetPin(PinName pin){
+    return Valid(pin) ? levels[pin] : 0;
+}
+
+float TTSim::GetDuty(PinName pin){
+    return Valid(pin) ? duties[pin] : 0;
+}
+
+void TTSim::SetAnalog(PinName pin, float value){
+    if(Valid(pin)){
+        analogs[pin] = value;
+    }
+}
+
+void TTSim::SetPinWatcher(PinName pin, Callback<void(PinName, int)> watcher){
+    if(Valid(pin)){
+        watchers[pin] = watcher;
+    }
+}
+
+TTSimIsrStats TTSim::GetIsrStats(){
+    return isrStats;
+}
+
+void TTSim::ResetIsrStats(){
+    isrStats = {0, 0, 0, 0};
+}
+
+bool TTSim::InIsr(){
+    return isrDepth > 0;
+}
+
+void TTSim::DrivePin(PinName pin, int level){
+    if(!Valid(pin)){
+        return;
+    }
+
+    level = level ? 1 : 0;
+    if(levels[pin] == level){
+        return;
+    }
+    SetLevel(pin, level);
+
+    if(watchers[pin]){
+        watchers[pin](pin, level);
+    }
+
+    InterruptIn *interrupt = interrupts[pin];
+    if(interrupt != 0){
+        RunIsr([interrupt, level](){interrupt->Edge(level);});
+    }
+}
+
+void TTSim::PullPin(PinName pin, PinMode mode){
+    //Pulls only set the level of pins nothing is driving.
+    if(Valid(pin) && !driven[pin] && mode != PullNone){
+        SetLevel(pin, mode == PullUp);
+    }
+}
+
+void TTSim::SetDuty(PinName pin, float duty){
+    if(Valid(pin)){
+        duties[pin] = duty;
+    }
+}
+
+float TTSim::GetAnalog(PinName pin){
+    return Valid(pin) ? analogs[pin] : 0;
+}
+
+void TTSim::AttachInterrupt(PinName pin, InterruptIn *interrupt){
+    if(Valid(pin)){
+        interrupts[pin] = interrupt;
+    }
+}
+
+void TTSim::DetachInterrupt(PinName pin, InterruptIn *interrupt){
+    if(Valid(pin) && interrupts[pin] == interrupt){
+        interrupts[pin] = 0;
+    }
+}
+
+void TTSim::InsertTimer(TimerEvent *timer){
+    //Timers due at the same time run in the order they were attached.
+    TimerEvent **link = &timers;
+    while(*link != 0 && (*link)->due <= timer->due){
+        link = &(*link)->next;
+    }
+    timer->next = *link;
+    *link = timer;
+    timer->pending = true;
+}
+
+void TTSim::RemoveTimer(TimerEvent *timer){
+    if(!timer->pending){
+        return;
+    }
+
+    for(TimerEvent **link = &timers; *link != 0; link = &(*link)->next){
+        if(*link == timer){
+            *link = timer->next;
+            break;
+        }
+    }
+    timer->pending = false;
+}
+
+void TTSim::AttachQueue(EventQueue *queue){
+    queue->next = queues;
+    queues = queue;
+}
+
+void TTSim::DetachQueue(EventQueue *queue){
+    for(EventQueue **link = &queues; *link != 0; link = &(*link)->next){
+        if(*link == queue){
+            *link = queue->next;
+            break;
+        }
+    }
+}
+
+void TTSim::EnterCritical(){
+    criticalDepth++;
+}
+
+void TTSim::ExitCritical(){
+    criticalDepth--;
+}
+
+bool TTSim::InCritical(){
+    return criticalDepth > 0;
+}
+
+void TTSim::RunIsr(const Callback<void()> &handler){
+    if(!handler){
+        return;
+    }
+
+    if(isrDepth > 0){
+        isrDepth++;
+        handler();
+        isrDepth--;
+        return;
+    }
+
+    int64_t overhead = ClockOverhead();
+    isrDepth++;
+    auto start = std::chrono::steady_clock::now();
+    handler();
+    int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    isrDepth--;
+
+    uint64_t ns = elapsed > overhead ? elapsed - overhead : 0;
+
+    isrStats.count++;
+    isrStats.totalNs += ns;
+    if(ns > isrStats.maxNs){
+        isrStats.maxNs = ns;
+    }
+
+    //Deferred work would run as soon as the interrupt returns.
+    DispatchQueues();
+}
+
+void TTSim::DispatchQueues(){
+    if(dispatching || isrDepth > 0){
+        return;
+    }
+
+    dispatching = true;
+    for(EventQueue *queue = queues; queue != 0; queue = queue->next){
+        queue->dispatch_once();
+    }
+    dispatching = false;
+}
+
+uint64_t TTSim::NextQueueDue(){
+    if(dispatching){
+        return UINT64_MAX;
+    }
+
+    uint64_t due = UINT64_MAX;
+    for(EventQueue *queue = queues; queue != 0; queue = queue->next){
+        due = std::min(due, queue->NextDue());
+    }
+    return due;
+}
+
+extern "C" void core_util_critical_section_enter(void){
+    TTSim::EnterCritical();
+}
+
+extern "C" void core_util_critical_section_exit(void){
+    TTSim::ExitCritical();
+}
+
+extern "C" bool core_util_is_isr_active(void){
+    return TTSim::InIsr();
+}
+
+extern "C" bool core_util_are_interrupts_enabled(void){
+    return !TTSim::InCritical();
+}
+
+extern "C" uint32_t us_ticker_read(void){
+    return (uint32_t)TTSim::Now();
+}
+
+const ticker_data_t *get_us_ticker_data(void){
+    return nullptr;
+}
+
+us_timestamp_t ticker_read_us(const ticker_data_t *ticker){
+    (void)ticker;
+    return TTSim::Now();
+}
+
+void debug(const char *format, ...){
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+void wait_us(int us){
+    //Busy waiting in an interrupt holds everything else off.
+    if(TTSim::InIsr()){
+        now += us;
+    }
+    else{
+        TTSim::RunFor(us);
+    }
+}
+
+namespace mbed{
+
+DigitalOut::DigitalOut(PinName pin, int value) : pin(pin){
+    write(value);
+}
+
+void DigitalOut::write(int value){
+    TTSim::DrivePin(pin, value);
+}
+
+int DigitalOut::read(){
+    return TTSim::GetPin(pin);
+}
+
+int DigitalOut::is_connected(){
+    return pin != NC;
+}
+
+DigitalIn::DigitalIn(PinName pin, PinMode mode) : pin(pin){
+    this->mode(mode);
+}
+
+int DigitalIn::read(){
+    return TTSim::GetPin(pin);
+}
+
+void DigitalIn::mode(PinMode pull){
+    TTSim::PullPin(pin, pull);
+}
+
+int DigitalIn::is_connected(){
+    return pin != NC;
+}
+
+PortIn::PortIn(PortName port, int mask) : port(port), mask(mask & 0xFFFF){}
+
+int PortIn::read(){
+    return portLevels[port] & mask;
+}
+
+void PortIn::mode(PinMode pull){
+    for(int bit = 0; bit < 16; bit++){
+        if((mask & (1 << bit)) != 0){
+            TTSim::PullPin((PinName)((port << 4) | bit), pull);
+        }
+    }
+}
+
+InterruptIn::InterruptIn(PinName pin, PinMode mode) : pin(pin){
+    this->mode(mode);
+    TTSim::AttachInterrupt(pin, this);
+}
+
+InterruptIn::~InterruptIn(){
+    TTSim::DetachInterrupt(pin, this);
+    onRise = nullptr;
+    onFall = nullptr;
+    UpdateMask();
+}
+
+int InterruptIn::read(){
+    return TTSim::GetPin(pin);
+}
+
+void InterruptIn::mode(PinMode pull){
+    TTSim::PullPin(pin, pull);
+}
+
+void InterruptIn::rise(Callback<void()> handler){
+    onRise = handler;
+    UpdateMask();
+}
+
+void InterruptIn::fall(Callback<void()> handler){
+    onFall = handler;
+    UpdateMask();
+}
+
+void InterruptIn::UpdateMask(){
+    //Counted per line, pins on different ports can share one.
+    static uint8_t holders[16];
+    bool hold = onRise || onFall;
+    if(hold == masked){
+        return;
+    }
+
+    uint32_t line = STM_PIN(pin);
+    masked = hold;
+    holders[line] += hold ? 1 : -1;
+    if(holders[line] != 0){
+        EXTI->IMR |= 1u << line;
+    }
+    else{
+        EXTI->IMR &= ~(1u << line);
+    }
+}
+
+void InterruptIn::enable_irq(){
+    enabled = true;
+}
+
+void InterruptIn::disable_irq(){
+    enabled = false;
+}
+
+void InterruptIn::Edge(int level){
+    if(!enabled){
+        return;
+    }
+
+    if(level && onRise){
+        onRise();
+    }
+    else if(!level && onFall){
+        onFall();
+    }
+}
+
+PwmOut::PwmOut(PinName pin) : pin(pin){
+    TTSim::SetDuty(pin, 0);
+}
+
+void PwmOut::period(float seconds){
+    periodUs = (int)(seconds * 1000000.0f);
+}
+
+void PwmOut::period_ms(int ms){
+    periodUs = ms * 1000;
+}
+
+void PwmOut::period_us(int us){
+    periodUs = us;
+}
+
+void PwmOut::write(float value){
+    TTSim::SetDuty(pin, value < 0 ? 0 : value > 1 ? 1 : value);
+}
+
+float PwmOut::read(){
+    return TTSim::GetDuty(pin);
+}
+
+void PwmOut::pulsewidth_us(int us){
+    write(periodUs > 0 ? (float)us / periodUs : 0);
+}
+
+void analogin_init(analogin_t *obj, PinName pin){
+    obj->pin = pin;
+}
+
+float analogin_read(analogin_t *obj){
+    return TTSim::GetAnalog(obj->pin);
+}
+
+uint16_t analogin_read_u16(analogin_t *obj){
+    return (uint16_t)(TTSim::GetAnalog(obj->pin) * 65535.0f);
+}
+
+AnalogIn::AnalogIn(PinName pin) : pin(pin){}
+
+float AnalogIn::read(){
+    return TTSim::GetAnalog(pin);
+}
+
+unsigned short AnalogIn::read_u16(){
+    return (unsigned short)(TTSim::GetAnalog(pin) * 65535.0f);
+}
+
+TimerEvent::~TimerEvent(){
+    detach();
+}
+
+void TimerEvent::detach(){
+    TTSim::RemoveTimer(this);
+}
+
+std::chrono::microseconds TimerEvent::remaining_time() const{
+    return std::chrono::microseconds(pending && due > TTSim::Now() ? due - TTSim::Now() : 0);
+}
+
+void TimerEvent::Insert(Callback<void()> handler, uint64_t due, uint64_t period){
+    isrStats.timerAttaches++;
+    TTSim::RemoveTimer(this);
+    this->handler = handler;
+    this->due = due;
+    this->period = period;
+    TTSim::InsertTimer(this);
+}
+
+void TimeoutBase::attach(Callback<void()> handler, std::chrono::microseconds delay){
+    Insert(handler, TTSim::Now() + delay.count(), 0);
+}
+
+void Ticker::attach(Callback<void()> handler, std::chrono::microseconds period){
+    Insert(handler, TTSim::Now() + period.count(), period.count() > 0 ? period.count() : 1);
+}
+
+void Timer::start(){
+    if(!running){
+        started = TTSim::Now();
+        running = true;
+    }
+}
+
+void Timer::stop(){
+    if(running){
+        accumulated += TTSim::Now() - started;
+        running = false;
+    }
+}
+
+void Timer::reset(){
+    accumulated = 0;
+    started = TTSim::Now();
+}
+
+std::chrono::microseconds Timer::elapsed_time() const{
+    return std::chrono::microseconds(accumulated + (running ? TTSim::Now() - started : 0));
+}
+
+}
+
+namespace rtos{
+
+Kernel::Clock::time_point Kernel::Clock::now(){
+    return time_point(duration(TTSim::Now() / 1000));
+}
+
+uint32_t EventFlags::wait_any_until(uint32_t flags, Kernel::Clock::time_point deadline, bool clear){
+    return WaitUntil(flags, deadline.time_since_epoch().count() * 1000, clear, false);
+}
+
+uint32_t EventFlags::wait_all_until(uint32_t flags, Kernel::Clock::time_point deadline, bool clear){
+    return WaitUntil(flags, deadline.time_since_epoch().count() * 1000, clear, true);
+}
+
+uint32_t EventFlags::Wait(uint32_t flags, uint32_t millisec, bool clear, bool all){
+    return WaitUntil(flags, millisec == osWaitForever ? UINT64_MAX : TTSim::Now() + (uint64_t)millisec * 1000, clear, all);
+}
+
+uint32_t EventFlags::WaitUntil(uint32_t flags, uint64_t deadline, bool clear, bool all){
+    while(all ? (this->flags & flags) != flags : (this->flags & flags) == 0){
+        //Nothing left that could set the flags, on a target this would block forever.
+        if(!TTSim::RunNext(deadline)){
+            if(all ? (this->flags & flags) != flags : (this->flags & flags) == 0){
+                return osFlagsErrorTimeout;
+            }
+        }
+    }
+
+    uint32_t result = this->flags;
+    if(clear){
+        this->flags &= ~flags;
+    }
+    return result;
+}
+
+void ThisThread::sleep_for(Kernel::Clock::duration_u32 time){
+    TTSim::RunFor((uint64_t)time.count() * 1000);
+}
+
+void ThisThread::sleep_until(Kernel::Clock::time_point time){
+    uint64_t deadline = time.time_since_epoch().count() * 1000;
+    if(deadline > TTSim::Now()){
+        TTSim::RunUntil(deadline);
+    }
+}
+
+void ThisThread::yield(){
+    TTSim::RunNext(TTSim::Now());
+}
+
+}
+
+namespace events{
+
+EventQueue::EventQueue(unsigned size, unsigned char *buffer){
+    (void)buffer;
+    capacity = size / EVENTS_EVENT_SIZE;
+    events = new Event[capacity];
+    TTSim::AttachQueue(this);
+}
+
+EventQueue::~EventQueue(){
+    TTSim::DetachQueue(this);
+    delete[] events;
+}
+
+int EventQueue::Post(std::function<void()> function, uint64_t delay, uint64_t period){
+    if(count == capacity){
+        return 0;
+    }
+
+    int id = nextId++;
+    events[count++] = {function, TTSim::Now() + delay, period, id};
+    return id;
+}
+
+bool EventQueue::cancel(int id){
+    for(unsigned i = 0; i < count; i++){
+        if(events[i].id == id){
+            std::move(events + i + 1, events + count, events + i);
+            count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void EventQueue::dispatch_once(){
+    //Events may post or cancel others, look for the next due one each time.
+    bool ran = true;
+    while(ran){
+        ran = false;
+        for(unsigned i = 0; i < count; i++){
+            if(events[i].due <= TTSim::Now()){
+                std::function<void()> function = events[i].function;
+                if(events[i].period != 0){
+                    events[i].due += events[i].period;
+                }
+                else{
+                    std::move(events + i + 1, events + count, events + i);
+                    count--;
+                }
+                function();
+                ran = true;
+                break;
+            }
+        }
+    }
+}
+
+uint64_t EventQueue::NextDue() const{
+    uint64_t due = UINT64_MAX;
+    for(unsigned i = 0; i < count; i++){
+        due = std::min(due, events[i].due);
+    }
+    return due;
+}
+
+}
@@ -0,0 +1,154 @@
+/**
+*     _____ _____ ___ _
+*    |_   _|_   _/ __(_)_ __
+*      | |   | | \__ \ | '  \
+*      |_|   |_| |___/_|_|_|_|
+*
+*
+* @file TTSim.h
+* @brief This file contains TTSim, the virtual clock and pin model behind the host build of TTLibs.
+*
+* Time only moves when the simulation is run, either explicitly or from a blocking wait or sleep, so results don't
+* depend on how busy the host is. Timer and pin interrupts run to completion in due order and the host time they take
+* is recorded, which is what the benchmarks measure.
+*
+* Build the drivers for the host with the ttsim directory first on the include path, e.g. for the benchmarks
+* g++ -std=gnu++14 -O2 -Imbed/ttsim -Imbed -Imbed/ttstepper -Imbed/ttencoder -Imbed/ttdcmotor -o ttbenchmark
+* mbed/ttsim/ttsim.cpp mbed/ttsim/ttbenchmark.cpp mbed/ttscheduler.cpp, plus the .cpp files in ttstepper, ttencoder and
+* ttdcmotor.
+*
+* The ttsim directory is listed in .mbedignore so target builds never see it.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_SIM_H
+#define TT_SIM_H
+
+/** @brief Core clock SystemCoreClock reports, only used to turn virtual microseconds into cycles. */
+#ifndef TTSIM_CORE_CLOCK
+    #define TTSIM_CORE_CLOCK 100000000
+#endif
+
+#include "mbed.h"
+#include <cstdint>
+
+/**
+* @brief Host time spent in interrupts since the last reset, less the cost of timing them.
+* Nested interrupts count towards the outer one.
+*/
+struct TTSimIsrStats{
+    /** @brief Number of interrupts run. */
+    uint64_t count;
+
+    /** @brief Total host time in nanoseconds. */
+    uint64_t totalNs;
+
+    /** @brief Longest interrupt in nanoseconds. */
+    uint64_t maxNs;
+
+    /** @brief Timers attached, each a remove and insert on the target's us ticker. */
+    uint64_t timerAttaches;
+};
+
+class TTSim{
+    public:
+        /**
+        * @brief Get the virtual time.
+        * @returns Microseconds since the simulation started.
+        */
+        static uint64_t Now();
+
+        /**
+        * @brief Run every timer and event due in the next us microseconds, then move the clock to the end.
+        * @param us Microseconds to run for.
+        */
+        static void RunFor(uint64_t us);
+
+        /**
+        * @brief Run every timer and event due up to a time, then move the clock to it.
+        * @param time Virtual time in microseconds.
+        */
+        static void RunUntil(uint64_t time);
+
+        /**
+        * @brief Run the next timer or event that is due by a deadline.
+        * @param deadline Virtual time in microseconds, UINT64_MAX for none.
+        * @returns true if something ran, false if nothing was due and the clock moved to the deadline.
+        */
+        static bool RunNext(uint64_t deadline);
+
+        /**
+        * @brief Drive an input pin as the outside world would. Edges run any InterruptIn on the pin as an interrupt.
+        * @param pin Pin to drive.
+        * @param level 0 or 1.
+        */
+        static void SetPin(PinName pin, int level);
+
+        /**
+        * @brief Get a pin's level, whoever drives it.
+        * @param pin Pin to read.
+        * @returns 0 or 1.
+        */
+        static int GetPin(PinName pin);
+
+        /**
+        * @brief Get the duty cycle a PwmOut is producing.
+        * @param pin PwmOut pin.
+        * @returns 0 to 1.
+        */
+        static float GetDuty(PinName pin);
+
+        /**
+        * @brief Set the voltage an AnalogIn reads.
+        * @param pin AnalogIn pin.
+        * @param value 0 to 1 of full scale.
+        */
+        static void SetAnalog(PinName pin, float value);
+
+        /**
+        * @brief Watch a pin, called with the new level whenever it changes.
+        * @param pin Pin to watch.
+        * @param watcher Called in the context that changed the pin, nullptr to stop watching.
+        */
+        static void SetPinWatcher(PinName pin, Callback<void(PinName, int)> watcher);
+
+        /** @brief Get the interrupt timing since the last ResetIsrStats(). */
+        static TTSimIsrStats GetIsrStats();
+
+        /** @brief Clear the interrupt timing. */
+        static void ResetIsrStats();
+
+        /** @brief Is an interrupt running? */
+        static bool InIsr();
+
+        /** @brief Used by the mbed.h replacements. */
+        static void DrivePin(PinName pin, int level);
+        static void PullPin(PinName pin, PinMode mode);
+        static void SetDuty(PinName pin, float duty);
+        static float GetAnalog(PinName pin);
+        static void AttachInterrupt(PinName pin, InterruptIn *interrupt);
+        static void DetachInterrupt(PinName pin, InterruptIn *interrupt);
+        static void InsertTimer(TimerEvent *timer);
+        static void RemoveTimer(TimerEvent *timer);
+        static void AttachQueue(EventQueue *queue);
+        static void DetachQueue(EventQueue *queue);
+        static void EnterCritical();
+        static void ExitCritical();
+        static bool InCritical();
+
+    private:
+        /** @brief Run a handler as an interrupt, timing it. */
+        static void RunIsr(const Callback<void()> &handler);
+
+        /** @brief Give each EventQueue's thread a turn. */
+        static void DispatchQueues();
+
+        /** @brief Earliest due event in any queue or UINT64_MAX. */
+        static uint64_t NextQueueDue();
+};
+
+#endif
@@ -0,0 +1,30 @@
+/**
+*     _____ _____ ___ _
+*    |_   _|_   _/ __(_)_ __
+*      | |   | | \__ \ | '  \
+*      |_|   |_| |___/_|_|_|_|
+*
+*
+* @file us_ticker_api.h
+* @brief This file contains the host replacement for the mbed-os microsecond ticker, read from the virtual clock.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_SIM_US_TICKER_API_H
+#define TT_SIM_US_TICKER_API_H
+
+#include "mbed.h"
+
+typedef uint64_t us_timestamp_t;
+
+struct ticker_data_t;
+
+const ticker_data_t *get_us_ticker_data(void);
+
+us_timestamp_t ticker_read_us(const ticker_data_t *ticker);
+
+#endif
\ No newline at end of file
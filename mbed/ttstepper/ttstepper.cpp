@@ -18,12 +18,23 @@
 #include "ttstepper.h"
 #include <algorithm>
 #include <chrono>
-#include <functional>
 
-TTStepper::TTStepper(PinName en, PinName step, PinName dir, uint32_t stepsPerRev, float posPerRev) : step(step), dir(dir), en(en), stepsPerRev(stepsPerRev), posPerRev(posPerRev){
+TTStepper::TTStepper(PinName en, PinName step, PinName dir, uint32_t stepsPerRev, float posPerRev) : step(step), dir(dir), en(en), stepPin(step), stepsPerRev(stepsPerRev), posPerRev(posPerRev){
+#if TTLIBS_FIXED_POINT
+    stepsPerDegQ16 = ttQ16FromFloat(stepsPerRev / 360.0f);
+    degsPerStepQ16 = ttQ16FromFloat(360.0f / stepsPerRev);
+    stepsPerUnitQ16 = ttQ16FromFloat(stepsPerRev / posPerRev);
+    unitsPerStepQ16 = ttQ16FromFloat(posPerRev / stepsPerRev);
+#endif
+
     Disable();
 }
 
+TTStepper::TTStepper(PinName en, PinName step, PinName dir, uint32_t stepsPerRev, float posPerRev, TTStepperProfile *profile)
+    : TTStepper(en, step, dir, stepsPerRev, posPerRev){
+    this->profile = profile;
+}
+
 int TTStepper::SetEnable(bool enable){
     TTSTEPPER_ACQUIRE_MUTEX;
     int retval = TTSTEPPER_SUCCESS;
@@ -58,13 +69,13 @@ int TTStepper::RegisterEndstop(PinName pin, PinMode mode){
 
     //Attatch endstop interrupts.
     if(lowerEndstop == 0){
-        lowerEndstop = new InterruptIn(pin, mode);
+        lowerEndstop = endstops[0].Construct(pin, mode);
         lowerEndstop->rise(callback(this, &TTStepper::LowerEndstopRiseISR));
         lowerEndstop->fall(callback(this, &TTStepper::LowerEndstopFallISR));
         retval = TTSTEPPER_LOWER_ENDSTOP;
     }
     else if(upperEndstop == 0){
-        upperEndstop = new InterruptIn(pin, mode);
+        upperEndstop = endstops[1].Construct(pin, mode);
         upperEndstop->rise(callback(this, &TTStepper::UpperEndstopRiseISR));
         upperEndstop->fall(callback(this, &TTStepper::UpperEndstopFallISR));
         retval = TTSTEPPER_UPPER_ENDSTOP;
@@ -80,39 +91,22 @@ int TTStepper::RegisterEndstop(PinName pin, PinMode mode){
 int TTStepper::Home(uint32_t bounceSteps, int endstopId){
     TTSTEPPER_ACQUIRE_MUTEX;
 
-    homing = true;
-    debug("Homing\r\n");
-    int retVal = SUCCESS;
     InterruptIn *endstop;
-
-    //Check for a registered endstop.
-    if(endstopId == TTSTEPPER_LOWER_ENDSTOP){
-        if(lowerEndstop == 0){
-            TTSTEPPER_RELEASE_MUTEX;
-            return TTSTEPPER_ENDSTOP_NOT_REGISTERED;
-        } else {
-            endstop = lowerEndstop;
-        }
-    }
-    else if(endstopId == TTSTEPPER_UPPER_ENDSTOP){
-        if(upperEndstop == 0){
-            TTSTEPPER_RELEASE_MUTEX;
-            return TTSTEPPER_ENDSTOP_NOT_REGISTERED;
-        } else {
-            endstop = upperEndstop;
-        }
-    }
-    else{
+    int retVal = GetEndstop(endstopId, &endstop);
+    if(retVal != TTSTEPPER_SUCCESS){
         TTSTEPPER_RELEASE_MUTEX;
-        return TTSTEPPER_INVALID_ID;
+        return retVal;
     }
 
+    homing = true;
+    TT_TRACE(TT_TRACE_HOMING, ttTraceSource(this), 0);
+
     //Make sure motor is stopped.
     Stop();
 
-    debug("Moving to endstop\r\n");
+    TT_TRACE(TT_TRACE_HOMING, ttTraceSource(this), 1);
 
-    while(endstop->read() == !invertEndstops){
+    while(!IsEndstopHit(endstop)){
         retVal = Step(1000000000, TTSTEPPER_ANTI_CLOCKWISE);
         if(retVal == TTSTEPPER_ALREADY_MOVING){ 
             TTSTEPPER_RELEASE_MUTEX;
@@ -124,11 +118,11 @@ int TTStepper::Home(uint32_t bounceSteps, int endstopId){
     //If hit before wait triggered. Clear endstop hit.
     ClearEndstopHit();
 
-    debug("Bouncing from endstop\r\n");
+    TT_TRACE(TT_TRACE_HOMING, ttTraceSource(this), 2);
 
-    //Move out of hit endstop
-    while(endstop->read() == invertEndstops){
-        retVal = Step(1000000000, TTSTEPPER_CLOCKWISE);
+    //Move out of hit endstop, a step at a time as releasing it doesn't stop the motor.
+    while(IsEndstopHit(endstop)){
+        retVal = Step(1, TTSTEPPER_CLOCKWISE);
         if(retVal == TTSTEPPER_ALREADY_MOVING){ 
             TTSTEPPER_RELEASE_MUTEX; 
             return retVal;
@@ -148,26 +142,524 @@ int TTStepper::Home(uint32_t bounceSteps, int endstopId){
 
     WaitBlocking();
 
-    //Reset step.
+    //Reset step, moving the latched endstop step with it.
+    core_util_atomic_store_s32(&endstopStep, GetEndstopStep() - currentStep);
     currentStep = 0;
 
     //Clear any latent endstop interrupts.
     ClearEndstopHit();
 
     homing = false;
-    debug("Homed!\r\n");
+    TT_TRACE(TT_TRACE_HOMING, ttTraceSource(this), 3);
     TTSTEPPER_RELEASE_MUTEX;
     return SUCCESS;
 }
 
+int TTStepper::FastHome(uint32_t bounceSteps, int endstopId, uint32_t backOffSteps){
+    TTSTEPPER_ACQUIRE_MUTEX;
+
+    InterruptIn *endstop;
+    int retVal = GetEndstop(endstopId, &endstop);
+    if(retVal != TTSTEPPER_SUCCESS){
+        TTSTEPPER_RELEASE_MUTEX;
+        return retVal;
+    }
+
+    homing = true;
+    TT_TRACE(TT_TRACE_HOMING, ttTraceSource(this), 0);
+
+    //Make sure motor is stopped.
+    Stop();
+
+    TT_TRACE(TT_TRACE_HOMING, ttTraceSource(this), 1);
+
+    //Fast approach, skipped if already on the endstop.
+    while(retVal == SUCCESS && !IsEndstopHit(endstop)){
+        retVal = HomingMove(1000000000, TTSTEPPER_ANTI_CLOCKWISE, true);
+    }
+
+    TT_TRACE(TT_TRACE_HOMING, ttTraceSource(this), 2);
+
+    //Back off, then creep out of the endstop a step at a time if that wasn't far enough.
+    if(retVal == SUCCESS){
+        retVal = HomingMove(backOffSteps, TTSTEPPER_CLOCKWISE, true);
+    }
+
+    while(retVal == SUCCESS && IsEndstopHit(endstop)){
+        retVal = HomingMove(1, TTSTEPPER_CLOCKWISE, false);
+    }
+
+    TT_TRACE(TT_TRACE_HOMING, ttTraceSource(this), 4);
+
+    //Slow approach. If the endstop reads hit without firing, zero is wherever the motor is.
+    core_util_atomic_store_s32(&endstopStep, currentStep);
+    while(retVal == SUCCESS && !IsEndstopHit(endstop)){
+        retVal = HomingMove(1000000000, TTSTEPPER_ANTI_CLOCKWISE, false);
+    }
+
+    if(retVal == SUCCESS){
+        //Zero on the step the endstop fired at, not where the motor came to rest.
+        currentStep = currentStep - GetEndstopStep();
+        core_util_atomic_store_s32(&endstopStep, 0);
+
+        TT_TRACE(TT_TRACE_HOMING, ttTraceSource(this), 2);
+
+        //Move out of hit endstop
+        while(retVal == SUCCESS && IsEndstopHit(endstop)){
+            retVal = HomingMove(1, TTSTEPPER_CLOCKWISE, false);
+        }
+    }
+
+    //Move extra to avoid re-triggering endstop.
+    if(retVal == SUCCESS){
+        retVal = HomingMove(bounceSteps, TTSTEPPER_CLOCKWISE, true);
+    }
+
+    homing = false;
+    TT_TRACE(TT_TRACE_HOMING, ttTraceSource(this), 3);
+    TTSTEPPER_RELEASE_MUTEX;
+    return retVal;
+}
+
+int TTStepper::HomingMove(uint32_t steps, bool direction, bool fast){
+    //The fast phases ramp up to the approach speed like a normal move. By default slow enough to stop dead from.
+    float savedMaxSpeed = maxSpeed;
+    if(fast){
+        float approach = homeApproachSpeed > 0 ? homeApproachSpeed : homeSpeed * TTSTEPPER_HOME_APPROACH_MULTIPLIER;
+        maxSpeed = approach < maxSpeed ? approach : maxSpeed;
+    }
+    homingFast = fast;
+
+    int retVal = Step(steps, direction);
+    if(retVal == SUCCESS){
+        WaitBlocking();
+    }
+
+    homingFast = false;
+    maxSpeed = savedMaxSpeed;
+
+    //If hit before wait triggered. Clear endstop hit.
+    ClearEndstopHit();
+    return retVal;
+}
+
+bool TTStepper::IsEndstopHit(InterruptIn *endstop){
+    //Same sense as Endstop(), a rise is a hit unless the endstops are inverted.
+    return endstop->read() == !invertEndstops;
+}
+
+int TTStepper::GetEndstop(int endstopId, InterruptIn **endstop){
+    //Check for a registered endstop.
+    if(endstopId == TTSTEPPER_LOWER_ENDSTOP){
+        if(lowerEndstop == 0){
+            return TTSTEPPER_ENDSTOP_NOT_REGISTERED;
+        }
+        *endstop = lowerEndstop;
+    }
+    else if(endstopId == TTSTEPPER_UPPER_ENDSTOP){
+        if(upperEndstop == 0){
+            return TTSTEPPER_ENDSTOP_NOT_REGISTERED;
+        }
+        *endstop = upperEndstop;
+    }
+    else{
+        return TTSTEPPER_INVALID_ID;
+    }
+
+    return TTSTEPPER_SUCCESS;
+}
+
+int TTStepper::SetSoftLimits(int32_t lowerStep, int32_t upperStep, bool clamp){
+    TTSTEPPER_ACQUIRE_MUTEX;
+
+    if(lowerStep > upperStep){
+        TTSTEPPER_RELEASE_MUTEX;
+        return TTSTEPPER_INVALID_LIMITS;
+    }
+
+    softLimitLower = lowerStep;
+    softLimitUpper = upperStep;
+    softLimitClamp = clamp;
+    softLimits = true;
+
+    TTSTEPPER_RELEASE_MUTEX;
+    return TTSTEPPER_SUCCESS;
+}
+
+int TTStepper::ClearSoftLimits(){
+    TTSTEPPER_ACQUIRE_MUTEX;
+    softLimits = false;
+    TTSTEPPER_RELEASE_MUTEX;
+    return TTSTEPPER_SUCCESS;
+}
+
+int32_t TTStepper::GetEndstopStep(){
+    return core_util_atomic_load_s32(&endstopStep);
+}
+
+int TTStepper::ApplySoftLimits(int32_t from, bool pinDirection, uint32_t &steps){
+    if(!softLimits || steps == 0){
+        return TTSTEPPER_SUCCESS;
+    }
+
+    //Room left before the limit in the direction of travel, none if already past it. 64 bit so long moves can't wrap.
+    int64_t room = pinDirection ? (int64_t)softLimitUpper - from : (int64_t)from - softLimitLower;
+    if(room >= steps){
+        return TTSTEPPER_SUCCESS;
+    }
+
+    if(softLimitClamp && room > 0){
+        steps = room;
+        return TTSTEPPER_SUCCESS;
+    }
+
+    return TTSTEPPER_SOFT_LIMIT;
+}
+
+int32_t TTStepper::PlannedEndStep(){
+    //The ISR moves steps from the queue to the running move, so read both at once.
+    CriticalSectionLock lock;
+
+    int32_t end = currentStep;
+    if(moving){
+        end = dir ? end + remainingSteps : end - remainingSteps;
+    }
+
+    for(uint32_t i = queueHead; i != queueTail; i++){
+        const QueuedMove &move = queue[i % TTSTEPPER_QUEUE_LENGTH];
+        bool pinDirection = !reverse ? move.direction : !move.direction;
+
+        //Replanning only ever changes rates, both plans have the same steps.
+        end = pinDirection ? end + move.plan[0].steps : end - move.plan[0].steps;
+    }
+
+    return end;
+}
+
 int TTStepper::MoveSteps(long steps){
+    return MoveSteps(steps, profile);
+}
+
+int TTStepper::MoveSteps(long steps, TTStepperProfile *profile){
     TTSTEPPER_ACQUIRE_MUTEX;
-    int retval = Step(steps, steps < 0 ? TTSTEPPER_ANTI_CLOCKWISE : TTSTEPPER_CLOCKWISE);
+    int retval = Step(steps < 0 ? -steps : steps, steps < 0 ? TTSTEPPER_ANTI_CLOCKWISE : TTSTEPPER_CLOCKWISE, profile);
     TTSTEPPER_RELEASE_MUTEX;
     return retval;
 }
 
+int TTStepper::QueueSteps(long steps){
+    return QueueSteps(steps, profile);
+}
+
+int TTStepper::QueueSteps(long steps, TTStepperProfile *moveProfile){
+    TTSTEPPER_ACQUIRE_MUTEX;
+
+    if(moveProfile == 0){
+        TTSTEPPER_RELEASE_MUTEX;
+        return TTSTEPPER_NO_PROFILE;
+    }
+
+    if(endstopHit && !homing){
+        TTSTEPPER_RELEASE_MUTEX;
+        return TTSTEPPER_ENDSTOP_HIT;
+    }
+
+    uint32_t head = core_util_atomic_load_u32(&queueHead);
+    uint32_t tail = queueTail;
+
+    if(tail - head >= TTSTEPPER_QUEUE_LENGTH){
+        TTSTEPPER_RELEASE_MUTEX;
+        return TTSTEPPER_QUEUE_FULL;
+    }
+
+    if(steps == 0){
+        TTSTEPPER_RELEASE_MUTEX;
+        return TTSTEPPER_SUCCESS;
+    }
+
+    bool direction = steps < 0 ? TTSTEPPER_ANTI_CLOCKWISE : TTSTEPPER_CLOCKWISE;
+    uint32_t count = steps < 0 ? -steps : steps;
+
+    //Queued moves start wherever the ones before them end.
+    int retval = ApplySoftLimits(PlannedEndStep(), !reverse ? direction : !direction, count);
+    if(retval != TTSTEPPER_SUCCESS){
+        TTSTEPPER_RELEASE_MUTEX;
+        return retval;
+    }
+
+    float minRate = minSpeed * stepsPerRev;
+    uint8_t linked;
+    float entryRate = LinkQueuedMove(direction, count, moveProfile, linked);
+
+    //Planned from both entry rates before the previous move is relinked, so a failed plan leaves the queue untouched.
+    QueuedMove &move = queue[tail % TTSTEPPER_QUEUE_LENGTH];
+    move.plan[0].steps = count;
+    move.plan[0].entryRate = entryRate;
+    move.plan[0].cruiseRate = maxSpeed * stepsPerRev;
+    move.plan[0].exitRate = minRate;
+    move.plan[1] = move.plan[0];
+    move.plan[1].entryRate = minRate;
+
+    retval = moveProfile->Plan(move.plan[0]);
+    if(retval == TTSTEPPER_PROFILE_SUCCESS && entryRate > minRate){
+        retval = moveProfile->Plan(move.plan[1]);
+    }
+    if(retval != TTSTEPPER_PROFILE_SUCCESS){
+        TTSTEPPER_RELEASE_MUTEX;
+        return retval;
+    }
+
+    move.profile = moveProfile;
+    move.direction = direction;
+
+    //Linked and published together. In between, the ISR could run the previous move out at the junction rate into an
+    //empty queue and stop dead from speed.
+    core_util_critical_section_enter();
+    move.selected = entryRate > minRate && !CommitQueuedLink(linked) ? 1 : 0;
+    core_util_atomic_store_u32(&queueTail, tail + 1);
+    core_util_critical_section_exit();
+
+    StartQueue();
+
+    TTSTEPPER_RELEASE_MUTEX;
+    return TTSTEPPER_SUCCESS;
+}
+
+int TTStepper::MoveBatch(Span<const TTStepperMove> moves, TTStepperBatch *batch){
+    TTSTEPPER_ACQUIRE_MUTEX;
+
+    if(endstopHit && !homing){
+        TTSTEPPER_RELEASE_MUTEX;
+        return TTSTEPPER_ENDSTOP_HIT;
+    }
+
+    uint32_t head = core_util_atomic_load_u32(&queueHead);
+    uint32_t tail = queueTail;
+    uint32_t space = TTSTEPPER_QUEUE_LENGTH - (tail - head);
+
+    //Validate everything first so a bad move can't leave half a batch queued. Zero step moves are dropped here.
+    uint32_t counts[TTSTEPPER_QUEUE_LENGTH];
+    bool directions[TTSTEPPER_QUEUE_LENGTH];
+    TTStepperProfile *profiles[TTSTEPPER_QUEUE_LENGTH];
+    uint32_t queued = 0;
+    int32_t end = PlannedEndStep();
+
+    for(const TTStepperMove &move : moves){
+        if(move.steps == 0){
+            continue;
+        }
+
+        if(queued == space){
+            TTSTEPPER_RELEASE_MUTEX;
+            return TTSTEPPER_QUEUE_FULL;
+        }
+
+        profiles[queued] = move.profile != 0 ? move.profile : profile;
+        if(profiles[queued] == 0){
+            TTSTEPPER_RELEASE_MUTEX;
+            return TTSTEPPER_NO_PROFILE;
+        }
+
+        directions[queued] = move.steps < 0 ? TTSTEPPER_ANTI_CLOCKWISE : TTSTEPPER_CLOCKWISE;
+        counts[queued] = move.steps < 0 ? -move.steps : move.steps;
+
+        bool pinDirection = !reverse ? directions[queued] : !directions[queued];
+        int retval = ApplySoftLimits(end, pinDirection, counts[queued]);
+        if(retval != TTSTEPPER_SUCCESS){
+            TTSTEPPER_RELEASE_MUTEX;
+            return retval;
+        }
+
+        end = pinDirection ? end + counts[queued] : end - counts[queued];
+        queued++;
+    }
+
+    if(queued == 0){
+        if(batch != 0){
+            *batch = TTStepperBatch();
+        }
+        TTSTEPPER_RELEASE_MUTEX;
+        return TTSTEPPER_SUCCESS;
+    }
+
+    float minRate = minSpeed * stepsPerRev;
+    float cruiseRate = maxSpeed * stepsPerRev;
+    uint8_t linked;
+    float linkRate = LinkQueuedMove(directions[0], counts[0], profiles[0], linked);
+    float entryRate = linkRate;
+
+    //One pass, each junction is known before its move is planned so nothing is planned twice. The slots past the
+    //tail aren't visible to the ISR until the tail is published.
+    for(uint32_t i = 0; i < queued; i++){
+        float exitRate = minRate;
+        if(i + 1 < queued && directions[i + 1] == directions[i]){
+            //Limited by the cruise rate, what this move can reach and what the next move can stop from. The first
+            //move's reach is taken from rest, its exit has to hold whichever entry rate it ends up with.
+            float reachable = profiles[i]->ReachableRate(i == 0 ? minRate : entryRate, counts[i]);
+            float stoppable = profiles[i + 1]->ReachableRate(minRate, counts[i + 1]);
+            exitRate = reachable < cruiseRate ? reachable : cruiseRate;
+            exitRate = stoppable < exitRate ? stoppable : exitRate;
+            exitRate = exitRate > minRate ? exitRate : minRate;
+        }
+
+        QueuedMove &move = queue[(tail + i) % TTSTEPPER_QUEUE_LENGTH];
+        move.plan[0].steps = counts[i];
+        move.plan[0].entryRate = entryRate;
+        move.plan[0].cruiseRate = cruiseRate;
+        move.plan[0].exitRate = exitRate;
+
+        int retval = profiles[i]->Plan(move.plan[0]);
+
+        //The first move is also planned from rest, in case the ISR takes the move before it can be relinked.
+        if(i == 0 && retval == TTSTEPPER_PROFILE_SUCCESS && linkRate > minRate){
+            move.plan[1] = move.plan[0];
+            move.plan[1].entryRate = minRate;
+            retval = profiles[i]->Plan(move.plan[1]);
+        }
+
+        if(retval != TTSTEPPER_PROFILE_SUCCESS){
+            TTSTEPPER_RELEASE_MUTEX;
+            return retval;
+        }
+
+        move.profile = profiles[i];
+        move.direction = directions[i];
+        move.selected = 0;
+
+        entryRate = exitRate;
+    }
+
+    //Only linked once every move has planned, so a failed batch leaves the queue as it was. Linked and published
+    //together, as in QueueSteps(), then the whole batch reaches the ISR at once.
+    core_util_critical_section_enter();
+    if(linkRate > minRate && !CommitQueuedLink(linked)){
+        queue[tail % TTSTEPPER_QUEUE_LENGTH].selected = 1;
+    }
+    core_util_atomic_store_u32(&queueTail, tail + queued);
+    core_util_critical_section_exit();
+
+    if(batch != 0){
+        batch->stepper = this;
+        batch->end = tail + queued;
+    }
+
+    StartQueue();
+
+    TTSTEPPER_RELEASE_MUTEX;
+    return TTSTEPPER_SUCCESS;
+}
+
+float TTStepper::LinkQueuedMove(bool direction, uint32_t count, TTStepperProfile *moveProfile, uint8_t &selected){
+    uint32_t head = core_util_atomic_load_u32(&queueHead);
+    uint32_t tail = queueTail;
+    float minRate = minSpeed * stepsPerRev;
+    float cruiseRate = maxSpeed * stepsPerRev;
+    float entryRate = minRate;
+    selected = queueTaken;
+
+    //Look ahead. If the previous move hasn't started, raise its exit rate so it runs straight into this one.
+    if(tail != head && queue[(tail - 1) % TTSTEPPER_QUEUE_LENGTH].direction == direction){
+        QueuedMove &previous = queue[(tail - 1) % TTSTEPPER_QUEUE_LENGTH];
+        selected = core_util_atomic_load_u8(&previous.selected);
+
+        if(selected != queueTaken){
+            const TTStepperSegment &planned = previous.plan[selected];
+
+            //Limited by both cruise rates, what the previous move can reach and what this move can stop from.
+            float junction = cruiseRate < planned.cruiseRate ? cruiseRate : planned.cruiseRate;
+            float reachable = previous.profile->ReachableRate(planned.entryRate, planned.steps);
+            float stoppable = moveProfile->ReachableRate(minRate, count);
+            junction = reachable < junction ? reachable : junction;
+            junction = stoppable < junction ? stoppable : junction;
+
+            //The spare plan isn't read by the ISR, it only takes the selected one.
+            if(junction > planned.exitRate){
+                uint8_t other = !selected;
+                previous.plan[other] = planned;
+                previous.plan[other].exitRate = junction;
+
+                if(previous.profile->Plan(previous.plan[other]) == TTSTEPPER_PROFILE_SUCCESS){
+                    entryRate = junction;
+                }
+            }
+        }
+    }
+
+    return entryRate;
+}
+
+bool TTStepper::CommitQueuedLink(uint8_t selected){
+    QueuedMove &previous = queue[(queueTail - 1) % TTSTEPPER_QUEUE_LENGTH];
+
+    //Fails if the ISR took the move since it was replanned, it then ends at its old exit rate.
+    return core_util_atomic_cas_u8(&previous.selected, &selected, (uint8_t)!selected);
+}
+
+void TTStepper::StartQueue(){
+    //Nothing running to pull it from the queue, start it here.
+    if(!moving){
+        Enable();
+        events.clear(TTSTEPPER_FLAG_STOPPED);
+        moving = true;
+
+        if(PopQueuedMove(true)){
+            if(useTimer){
+                StartTimer();
+            }
+            else{
+                StepTimeoutHandler();
+            }
+        }
+        else{
+            moving = false;
+        }
+    }
+}
+
+void TTStepper::FinishQueuedMove(){
+    if(runningQueued){
+        runningQueued = false;
+        core_util_atomic_store_u32(&finishedMoves, runningMove + 1);
+        events.set(TTSTEPPER_FLAG_MOVE_DONE);
+    }
+}
+
+int TTStepper::QueueLength(){
+    return core_util_atomic_load_u32(&queueTail) - core_util_atomic_load_u32(&queueHead);
+}
+
+bool TTStepper::PopQueuedMove(bool allowDirectionChange){
+    uint32_t head = queueHead;
+
+    if(head == core_util_atomic_load_u32(&queueTail)){
+        return false;
+    }
+
+    QueuedMove &move = queue[head % TTSTEPPER_QUEUE_LENGTH];
+    bool pinDirection = !reverse ? move.direction : !move.direction;
+
+    if(!allowDirectionChange && pinDirection != (bool)dir.read()){
+        return false;
+    }
+
+    uint8_t selected = core_util_atomic_exchange_u8(&move.selected, queueTaken);
+    segment = move.plan[selected];
+    activeProfile = move.profile;
+    dir = pinDirection;
+    remainingSteps = segment.steps;
+
+    runningMove = head;
+    runningQueued = true;
+
+    core_util_atomic_store_u32(&queueHead, head + 1);
+    return true;
+}
+
 int TTStepper::MoveDegs(float degrees){
+    return MoveDegs(degrees, profile);
+}
+
+int TTStepper::MoveDegs(float degrees, TTStepperProfile *profile){
     TTSTEPPER_ACQUIRE_MUTEX;
 
     bool direction = TTSTEPPER_CLOCKWISE;
@@ -177,14 +669,18 @@ int TTStepper::MoveDegs(float degrees){
         direction = TTSTEPPER_ANTI_CLOCKWISE;
     }
 
-    int retval = Step((degrees / 360) * stepsPerRev, direction);
+    int retval = Step((degrees / 360) * stepsPerRev, direction, profile);
 
     TTSTEPPER_RELEASE_MUTEX;
     return retval;
 }
 
 int TTStepper::MovePos(float units){
-    return MoveDegs((units / posPerRev) * 360.f);
+    return MovePos(units, profile);
+}
+
+int TTStepper::MovePos(float units, TTStepperProfile *profile){
+    return MoveDegs((units / posPerRev) * 360.f, profile);
 }
 
 void TTStepper::GoToRot(float degrees){
@@ -195,24 +691,176 @@ void TTStepper::GoToPos(float pos){
     GoToRot((pos / posPerRev) * 360.f);
 }
 
+#if TTLIBS_FIXED_POINT
+int TTStepper::MoveDegsQ16(ttq16 degrees){
+    return MoveSteps(ttQ16MulToInt(degrees, stepsPerDegQ16));
+}
+
+int TTStepper::MovePosQ16(ttq16 units){
+    return MoveSteps(ttQ16MulToInt(units, stepsPerUnitQ16));
+}
+
+int TTStepper::GoToRotQ16(ttq16 degrees){
+    //Work in steps so the current position isn't rounded through degrees.
+    return MoveSteps(ttQ16MulToInt(degrees, stepsPerDegQ16) - GetSteps());
+}
+
+int TTStepper::GoToPosQ16(ttq16 pos){
+    return MoveSteps(ttQ16MulToInt(pos, stepsPerUnitQ16) - GetSteps());
+}
+
+ttq16 TTStepper::GetDegsQ16(){
+    return ttQ16MulIntQ16(GetSteps(), degsPerStepQ16);
+}
+
+ttq16 TTStepper::GetPosQ16(){
+    return ttQ16MulIntQ16(GetSteps(), unitsPerStepQ16);
+}
+#endif
+
 int TTStepper::WaitBlocking(){
-    TTSTEPPER_ACQUIRE_MUTEX;
+    //No mutex, so other threads can still stop the motor while this one waits.
+    //The flag is left set so every waiting thread wakes.
+    while(IsMoving()){
+        events.wait_any(TTSTEPPER_FLAG_STOPPED, osWaitForever, false);
+    }
+
+    return TTSTEPPER_SUCCESS;
+}
+
+int TTStepper::WaitBlocking(Kernel::Clock::duration_u32 timeout){
+    Kernel::Clock::time_point deadline = Kernel::Clock::now() + timeout;
 
     while(IsMoving()){
-        ThisThread::sleep_for(1ms);
+        if(Kernel::Clock::now() >= deadline){
+            return TTSTEPPER_WAIT_TIMEDOUT;
+        }
+
+        events.wait_any_until(TTSTEPPER_FLAG_STOPPED, deadline, false);
     }
 
+    return TTSTEPPER_SUCCESS;
+}
+
+bool TTStepperBatch::IsDone() const{
+    //Wrap safe, the count only has to stay within half its range of the batch end.
+    return stepper == 0 || (int32_t)(core_util_atomic_load_u32(&stepper->finishedMoves) - end) >= 0;
+}
+
+int TTStepperBatch::Wait(Kernel::Clock::duration_u32 timeout) const{
+    if(stepper == 0){
+        return TTSTEPPER_SUCCESS;
+    }
+
+    Kernel::Clock::time_point deadline = Kernel::Clock::now() + timeout;
+
+    while(true){
+        //Cleared before checking so a move finishing in between still wakes the wait.
+        stepper->events.clear(TTSTEPPER_FLAG_MOVE_DONE);
+
+        if(IsDone()){
+            return TTSTEPPER_SUCCESS;
+        }
+
+        //The last move may have finished and stopped the motor since IsDone() was read.
+        if(!stepper->IsMoving()){
+            return IsDone() ? TTSTEPPER_SUCCESS : TTSTEPPER_BATCH_STOPPED;
+        }
+
+        if(Kernel::Clock::now() >= deadline){
+            return TTSTEPPER_WAIT_TIMEDOUT;
+        }
+
+        stepper->events.wait_any_until(TTSTEPPER_FLAG_STOPPED | TTSTEPPER_FLAG_MOVE_DONE, deadline, false);
+    }
+}
+
+int TTStepper::SetMoveEndedCallback(Callback<void()> callback){
+    TTSTEPPER_ACQUIRE_MUTEX;
+    moveEndedCallbacks.Clear();
+    moveEndedCallbacks.Subscribe(callback);
     TTSTEPPER_RELEASE_MUTEX;
     return TTSTEPPER_SUCCESS;
 }
 
+int TTStepper::AddMoveEndedCallback(Callback<void()> callback){
+    int handle = moveEndedCallbacks.Subscribe(callback);
+    return handle < 0 ? TTSTEPPER_CALLBACKS_FULL : handle;
+}
+
+int TTStepper::RemoveMoveEndedCallback(int handle){
+    return moveEndedCallbacks.Unsubscribe(handle) ? TTSTEPPER_SUCCESS : TTSTEPPER_INVALID_CALLBACK;
+}
+
+void TTStepper::NotifyMoveEnded(){
+    moveEndedCallbacks.Call();
+}
+
 void TTStepper::Stop(){
+    bool wasMoving = moving;
     moving = false;
-    stepTimout.detach();
+    scheduler.Cancel(stepTask);
+#if TTLIBS_INSTRUMENT
+    //The next move's first step isn't late against this one.
+    stepProbe.Restart();
+#endif
+#if TTLIBS_TRACE
+    traceRampPhase = 0xFF;
+#endif
+
+    //Always rest at the finest resolution, the next move starts from it.
+    pendingStride = 0;
+    if(stride != 1){
+        stride = 1;
+        microstepDriver->SetMicrosteps(microsteps);
+    }
+    pulsePeriod = UINT32_MAX;
+
+    //Discard queued moves, batches waiting on them see the motor stop instead.
+    core_util_atomic_store_u32(&queueHead, core_util_atomic_load_u32(&queueTail));
+    runningQueued = false;
+
+    //Give back any steps the timer was sent but never took.
+    if(timer != 0){
+        uint32_t unsent = timer->Stop();
+        currentStep = dir ? currentStep - unsent : currentStep + unsent;
+    }
+
+    //Wake waiting threads.
+    events.set(TTSTEPPER_FLAG_STOPPED);
+
+    if(wasMoving && !moveEndedCallbacks.IsEmpty()){
+        scheduler.Defer(callback(this, &TTStepper::NotifyMoveEnded));
+    }
+}
+
+int32_t TTStepper::GetSteps(){
+    return core_util_atomic_load_s32(&currentStep);
+}
+
+uint32_t TTStepper::GetRemainingSteps(){
+    return core_util_atomic_load_u32(&remainingSteps);
+}
+
+#if TTLIBS_INSTRUMENT
+TTInstrumentSnapshot TTStepper::GetStepInstrumentation(){
+    return stepProbe.Snapshot();
 }
 
+TTInstrumentSnapshot TTStepper::GetEndstopInstrumentation(){
+    return endstopProbe.Snapshot();
+}
+
+void TTStepper::ResetInstrumentation(){
+    core_util_critical_section_enter();
+    stepProbe.Reset();
+    endstopProbe.Reset();
+    core_util_critical_section_exit();
+}
+#endif
+
 float TTStepper::GetDegs(){
-    return (currentStep / (float)stepsPerRev) * 360.0f;
+    return (GetSteps() / (float)stepsPerRev) * 360.0f;
 }
 
 float TTStepper::GetPos(){
@@ -220,7 +868,7 @@ float TTStepper::GetPos(){
 }
 
 bool TTStepper::IsMoving(){
-    return moving;
+    return core_util_atomic_load_bool(&moving);
 }
 
 void TTStepper::ClearEndstopHit(void){
@@ -231,6 +879,24 @@ void TTStepper::ClearEndstopReleased(void){
     endstopReleased = 0;
 }
 
+int TTStepper::AddEndstopHitCallback(Callback<void(int)> callback){
+    int handle = endstopHitCallbacks.Subscribe(callback);
+    return handle < 0 ? TTSTEPPER_CALLBACKS_FULL : handle;
+}
+
+int TTStepper::RemoveEndstopHitCallback(int handle){
+    return endstopHitCallbacks.Unsubscribe(handle) ? TTSTEPPER_SUCCESS : TTSTEPPER_INVALID_CALLBACK;
+}
+
+int TTStepper::AddEndstopReleasedCallback(Callback<void(int)> callback){
+    int handle = endstopReleasedCallbacks.Subscribe(callback);
+    return handle < 0 ? TTSTEPPER_CALLBACKS_FULL : handle;
+}
+
+int TTStepper::RemoveEndstopReleasedCallback(int handle){
+    return endstopReleasedCallbacks.Unsubscribe(handle) ? TTSTEPPER_SUCCESS : TTSTEPPER_INVALID_CALLBACK;
+}
+
 int TTStepper::SetMaxSpeed(float speed){
     TTSTEPPER_ACQUIRE_MUTEX;
     maxSpeed = speed;
@@ -252,6 +918,13 @@ int TTStepper::SetHomingSpeed(float speed){
     return TTSTEPPER_SUCCESS;
 }
 
+int TTStepper::SetHomingApproachSpeed(float speed){
+    TTSTEPPER_ACQUIRE_MUTEX;
+    homeApproachSpeed = speed;
+    TTSTEPPER_RELEASE_MUTEX;
+    return TTSTEPPER_SUCCESS;
+}
+
 int TTStepper::SetAccelerationMultiplier(float multiplier){
     TTSTEPPER_ACQUIRE_MUTEX;
     speedInterval = TTSTEPPER_BASE_SPEED_INTERVAL * multiplier;
@@ -259,6 +932,13 @@ int TTStepper::SetAccelerationMultiplier(float multiplier){
     return TTSTEPPER_SUCCESS;
 }
 
+int TTStepper::SetProfile(TTStepperProfile *profile){
+    TTSTEPPER_ACQUIRE_MUTEX;
+    this->profile = profile;
+    TTSTEPPER_RELEASE_MUTEX;
+    return TTSTEPPER_SUCCESS;
+}
+
 int TTStepper::Reverse(bool reverse){
     TTSTEPPER_ACQUIRE_MUTEX;
     this->reverse = reverse;
@@ -273,10 +953,115 @@ int TTStepper::InvertEndstops(bool invert){
     return TTSTEPPER_SUCCESS;
 }
 
+int TTStepper::UseRampTable(bool enable){
+    TTSTEPPER_ACQUIRE_MUTEX;
+
+    //The step ISR reads the table, so only switch between moves.
+    if(moving){
+        TTSTEPPER_RELEASE_MUTEX;
+        return TTSTEPPER_ALREADY_MOVING;
+    }
+
+    useRampTable = enable;
+    TTSTEPPER_RELEASE_MUTEX;
+    return TTSTEPPER_SUCCESS;
+}
+
+int TTStepper::UseHardwareTimer(bool enable){
+    TTSTEPPER_ACQUIRE_MUTEX;
+
+    if(moving){
+        TTSTEPPER_RELEASE_MUTEX;
+        return TTSTEPPER_ALREADY_MOVING;
+    }
+
+    if(enable){
+#if TTSTEPPER_TIMER_SUPPORTED
+        if(timer == 0){
+            timer = timerStorage.Construct(stepPin, stepActiveLow);
+        }
+#endif
+
+        if(timer == 0 || !timer->IsSupported()){
+            TTSTEPPER_RELEASE_MUTEX;
+            return TTSTEPPER_TIMER_UNSUPPORTED;
+        }
+    }
+
+    useTimer = enable;
+    TTSTEPPER_RELEASE_MUTEX;
+    return TTSTEPPER_SUCCESS;
+}
+
+int TTStepper::SetMicrostepDriver(TTStepperMicrostepDriver *driver, uint16_t microsteps, float maxStepRate){
+    TTSTEPPER_ACQUIRE_MUTEX;
+
+    //The step ISR switches resolution on the move, so only change drivers between moves.
+    if(moving){
+        TTSTEPPER_RELEASE_MUTEX;
+        return TTSTEPPER_ALREADY_MOVING;
+    }
+
+    uint16_t coarsest = 1;
+    if(driver != 0){
+        if(microsteps == 0 || driver->SetMicrosteps(microsteps) != TTSTEPPER_MICROSTEP_SUCCESS){
+            TTSTEPPER_RELEASE_MUTEX;
+            return TTSTEPPER_MICROSTEP_UNSUPPORTED;
+        }
+
+        //The ISR doubles and halves the step size, so every resolution on the way down has to be supported.
+        while(maxStepRate > 0 && microsteps % (coarsest * 2) == 0 && driver->IsSupported(microsteps / (coarsest * 2))){
+            coarsest *= 2;
+        }
+    }
+
+    microstepDriver = driver;
+    this->microsteps = microsteps;
+    maxStride = coarsest;
+    strideMinPeriod = maxStepRate > 0 ? 1000000.0f / maxStepRate : 0;
+    stride = 1;
+
+    TTSTEPPER_RELEASE_MUTEX;
+    return TTSTEPPER_SUCCESS;
+}
+
+uint16_t TTStepper::GetStepStride(){
+    return stride;
+}
+
 int TTStepper::Step(uint32_t steps, bool direction){
+    return Step(steps, direction, profile);
+}
+
+int TTStepper::Step(uint32_t steps, bool direction, TTStepperProfile *moveProfile){
     if(!endstopHit | homing){
         if(!moving){
 
+            //Homing finds the limits, so isn't held to them.
+            if(!homing){
+                int retval = ApplySoftLimits(currentStep, !reverse ? direction : !direction, steps);
+                if(retval != TTSTEPPER_SUCCESS){
+                    return retval;
+                }
+            }
+
+            //Homing runs at the constant homing speed, apart from FastHome()'s fast phases.
+            activeProfile = homing && !homingFast ? 0 : moveProfile;
+            runningQueued = false;
+
+            if(activeProfile != 0){
+                segment.steps = steps;
+                segment.entryRate = minSpeed * stepsPerRev;
+                segment.cruiseRate = maxSpeed * stepsPerRev;
+                segment.exitRate = segment.entryRate;
+
+                int retval = activeProfile->Plan(segment);
+                if(retval != TTSTEPPER_PROFILE_SUCCESS){
+                    return retval;
+                }
+            }
+
+            events.clear(TTSTEPPER_FLAG_STOPPED);
             moving = true;
 
             Enable();
@@ -285,7 +1070,19 @@ int TTStepper::Step(uint32_t steps, bool direction){
             
             remainingSteps = steps;
 
-            uint32_t accelerationStopStep = (maxSpeed - minSpeed) / speedInterval;
+            uint32_t accelerationStopStep;
+            if(useRampTable){
+                BuildRampTable();
+                accelerationStopStep = rampTableSteps;
+                homePeriod = SpeedToPeriod(homeSpeed);
+                rampStep = 0;
+                rampIndex = 0;
+                rampStrideCount = 0;
+            }
+            else{
+                accelerationStopStep = (maxSpeed - minSpeed) / speedInterval;
+            }
+
             if(steps > accelerationStopStep * 2){
                 slowStep = accelerationStopStep;
             }
@@ -295,7 +1092,12 @@ int TTStepper::Step(uint32_t steps, bool direction){
 
             speed = minSpeed;
 
-            StepTimeoutHandler();
+            if(useTimer){
+                return StartTimer();
+            }
+            else{
+                StepTimeoutHandler();
+            }
 
             return SUCCESS;
         }
@@ -311,15 +1113,180 @@ int TTStepper::Step(uint32_t steps, bool direction){
 }
 
 void TTStepper::StepTimeoutHandler(){
-    if(remainingSteps){
-        step = stepActiveLow ? false : true;
-        step = !step;
+    TT_INSTRUMENT_SCOPE(stepProbe);
+#if TTLIBS_INSTRUMENT
+    stepProbe.Interval(ttInstrumentCycles(), commandedCycles);
+#endif
 
-        currentStep = dir ? currentStep + 1 : currentStep - 1;
-        
-        remainingSteps--;
+    if(remainingSteps == 0){
+        FinishQueuedMove();
+    }
+
+    if(remainingSteps || PopQueuedMove(true)){
+        //Counted before the pulse so an endstop it triggers latches the step it was hit on.
+        uint32_t period = NextPeriod();
+        Pulse();
+
+        //Only once the pulse has gone out at the resolution it was counted at.
+        if(pendingStride != 0){
+            ApplyStride();
+        }
+
+        //An endstop ISR can preempt the pulse and stop the motor.
+        if(moving){
+#if TTLIBS_INSTRUMENT
+            //The period runs from here, not from the start of this ISR.
+            commandedCycles = ttInstrumentUsToCycles(period);
+            stepProbe.Scheduled(ttInstrumentCycles());
+#endif
+            scheduler.Schedule(stepTask, period);
+        }
+    }
+    else{
+        Stop();
+    }
+}
+
+void TTStepper::Pulse(){
+    step = stepActiveLow ? false : true;
+    step = !step;
+}
+
+uint32_t TTStepper::TimerPeriodHandler(){
+    if(remainingSteps || PopQueuedMove(false)){
+        uint32_t period = NextPeriod();
+        return period ? period : 1;
+    }
+
+    return 0;
+}
+
+void TTStepper::TimerDoneHandler(){
+    //Moves chained in TimerPeriodHandler() only finish once the timer has stepped them.
+    FinishQueuedMove();
+
+    //Moves that reverse direction can only start once the timer has stepped everything before them.
+    if(PopQueuedMove(true)){
+        StartTimer();
+    }
+    else{
+        Stop();
+    }
+}
+
+int TTStepper::StartTimer(){
+    int retval = timer->Start(callback(this, &TTStepper::TimerPeriodHandler), callback(this, &TTStepper::TimerDoneHandler));
+
+    //Nothing has stepped, so Stop() only has to end the move.
+    if(retval != TTSTEPPER_TIMER_SUCCESS){
+        Stop();
+    }
+
+    return retval;
+}
+
+uint32_t TTStepper::NextPeriod(){
+    //Each pulse moves stride of the finest steps.
+    currentStep = dir ? currentStep + stride : currentStep - stride;
+    TT_TRACE(TT_TRACE_STEP, ttTraceSource(this), (uint16_t)currentStep);
+    
+    remainingSteps -= stride;
+
+    long period;
+    if(maxStride == 1 || useTimer){
+        period = StepPeriod(remainingSteps);
+    }
+    else{
+        //Size the next pulse from the last one, then wait for every fine step it covers.
+        uint16_t next = NextStride(pulsePeriod);
+        period = 0;
+        for(uint16_t i = 0; i < next; i++){
+            period += StepPeriod(remainingSteps - i);
+        }
+
+        //The pulse about to go out was counted as stride, so the MS pins can't change until it has.
+        if(next != stride){
+            pendingStride = next;
+        }
+        pulsePeriod = period;
+    }
+
+#if TTLIBS_TRACE
+    //Shorter periods are speeding up, longer ones slowing down.
+    uint8_t phase = traceRampPhase == 0xFF || (uint32_t)period < tracePeriod ? 0 : (uint32_t)period == tracePeriod ? 1 : 2;
+    if(phase != traceRampPhase){
+        traceRampPhase = phase;
+        TT_TRACE(TT_TRACE_RAMP_PHASE, ttTraceSource(this), phase);
+    }
+    tracePeriod = period;
+#endif
+
+    return period;
+}
+
+void TTStepper::ApplyStride(){
+    //Stop() may have put the pins back to the finest resolution since the stride was picked.
+    core_util_critical_section_enter();
+    if(moving && pendingStride != 0){
+        stride = pendingStride;
+        microstepDriver->SetMicrosteps(microsteps / stride);
+    }
+    pendingStride = 0;
+    core_util_critical_section_exit();
+}
+
+uint16_t TTStepper::NextStride(uint32_t lastPeriod){
+    uint16_t next = stride;
+
+    //Coarser once pulses come faster than the limit, but only from a step the coarser step lands on.
+    if(lastPeriod < strideMinPeriod && next < maxStride && (currentStep & ((next * 2) - 1)) == 0){
+        next *= 2;
+    }
+    //Finer once halving the step keeps the rate well under the limit.
+    else if(next > 1 && lastPeriod >= strideMinPeriod * 4){
+        next /= 2;
+    }
+
+    //Finish the move with whatever fits in the steps left.
+    while(next > 1 && next > remainingSteps){
+        next /= 2;
+    }
+
+    return next;
+}
+
+uint32_t TTStepper::StepPeriod(uint32_t remaining){
+    long period;
+    if(activeProfile != 0){
+        period = activeProfile->Next(segment);
+    }
+    else if(useRampTable){
+        if(remaining > slowStep){
+            if(rampStep < rampTableSteps){
+                rampStep++;
+
+                if(++rampStrideCount == rampTableStride){
+                    rampStrideCount = 0;
+                    rampIndex++;
+                }
+            }
+        }
+        else if(rampStep > 0){
+            rampStep--;
 
-        if(remainingSteps > slowStep){
+            if(rampStrideCount == 0){
+                rampStrideCount = rampTableStride - 1;
+                rampIndex--;
+            }
+            else{
+                rampStrideCount--;
+            }
+        }
+
+        period = homing && !homingFast ? homePeriod : rampTable[rampIndex];
+    }
+    else{
+        if(remaining > slowStep){
             if(speed < maxSpeed){
                 speed += speedInterval;
 
@@ -336,39 +1303,76 @@ void TTStepper::StepTimeoutHandler(){
             }
         }
 
-        long period;
-        if(homing){
-            period = (1000000.0f / (stepsPerRev * homeSpeed));
-        } else{
-            period = (1000000.0f / (stepsPerRev * speed));
-        }
+        period = homing && !homingFast ? SpeedToPeriod(homeSpeed) : SpeedToPeriod(speed);
+    }
+
+    return period;
+}
 
-        stepTimout.attach(callback(this, &TTStepper::StepTimeoutHandler), chrono::microseconds(period));
+uint32_t TTStepper::SpeedToPeriod(float speed){
+    return 1000000.0f / (stepsPerRev * speed);
+}
+
+void TTStepper::BuildRampTable(){
+    //Reuse the existing table if nothing it depends on has changed.
+    if(rampTableValid && rampTableMinSpeed == minSpeed && rampTableMaxSpeed == maxSpeed && rampTableSpeedInterval == speedInterval){
+        return;
+    }
+
+    if(speedInterval > 0 && maxSpeed > minSpeed){
+        rampTableSteps = (maxSpeed - minSpeed) / speedInterval;
     }
     else{
-        Stop();
+        rampTableSteps = 0;
+    }
+
+    //Spread long ramps over the table so it never exceeds TTSTEPPER_ACCELERATION_CURVE_LENGTH entries.
+    rampTableStride = (rampTableSteps / TTSTEPPER_ACCELERATION_CURVE_LENGTH) + 1;
+
+    uint32_t length = (rampTableSteps / rampTableStride) + 1;
+    for(uint32_t i = 0; i < length; i++){
+        float entrySpeed = minSpeed + (i * rampTableStride * speedInterval);
+        rampTable[i] = SpeedToPeriod(entrySpeed > maxSpeed ? maxSpeed : entrySpeed);
     }
+
+    rampTableMinSpeed = minSpeed;
+    rampTableMaxSpeed = maxSpeed;
+    rampTableSpeedInterval = speedInterval;
+    rampTableValid = true;
 }
 
 void TTStepper::Endstop(int id, bool rise){
+    TT_INSTRUMENT_SCOPE(endstopProbe);
     rise = invertEndstops ? !rise : rise;
+    TT_TRACE(rise ? TT_TRACE_ENDSTOP_HIT : TT_TRACE_ENDSTOP_RELEASE, ttTraceSource(this), id);
 
     if(rise){
         Stop();
+
+        //Latched here, after Stop() has given back any steps the timer never took, so it is the trigger step.
+        core_util_atomic_store_s32(&endstopStep, currentStep);
         
         endstopHit = id;
-        if(onEndstopHit != 0){
-            onEndstopHit(id);
+        if(!endstopHitCallbacks.IsEmpty()){
+            scheduler.Defer(callback(this, &TTStepper::NotifyEndstopHit), id);
         }
     }
     else{
         endstopReleased = id;
-        if(onEndstopReleased != 0){
-            onEndstopReleased(id);
+        if(!endstopReleasedCallbacks.IsEmpty()){
+            scheduler.Defer(callback(this, &TTStepper::NotifyEndstopReleased), id);
         }
     }
 }
 
+void TTStepper::NotifyEndstopHit(int id){
+    endstopHitCallbacks.Call(id);
+}
+
+void TTStepper::NotifyEndstopReleased(int id){
+    endstopReleasedCallbacks.Call(id);
+}
+
 void TTStepper::LowerEndstopRiseISR(void){
     Endstop(TTSTEPPER_LOWER_ENDSTOP, true);
 }
@@ -40,15 +40,95 @@
 #define TTSTEPPER_ENDSTOP_HIT -5
 #define TTSTEPPER_NO_FREE_ENDSTOPS -6
 #define TTSTEPPER_ALREADY_MOVING -7
+#define TTSTEPPER_QUEUE_FULL -11
+#define TTSTEPPER_NO_PROFILE -12
+#define TTSTEPPER_WAIT_TIMEDOUT -13
+#define TTSTEPPER_BATCH_STOPPED -14
+#define TTSTEPPER_SOFT_LIMIT -15
+#define TTSTEPPER_INVALID_LIMITS -16
+#define TTSTEPPER_CALLBACKS_FULL -18
+#define TTSTEPPER_INVALID_CALLBACK -19
+
+/** @brief Event flag set by Stop() when a move ends. */
+#define TTSTEPPER_FLAG_STOPPED (1UL << 0)
+
+/** @brief Event flag set by the step ISR when a queued move finishes. */
+#define TTSTEPPER_FLAG_MOVE_DONE (1UL << 1)
+
+/** @brief Number of moves that can wait in the motion queue. Must be a power of two. */
+#define TTSTEPPER_QUEUE_LENGTH 8
+
+/** @brief FastHome() approach speed as a multiple of the homing speed, unless one is set. Low enough to stop dead from. */
+#define TTSTEPPER_HOME_APPROACH_MULTIPLIER 4
 
 #include "mbed.h"
+#include "ttcallbacklist.h"
+#include "ttfixed.h"
+#include "ttinplace.h"
+#include "ttscheduler.h"
+#include "ttsteppermicrostep.h"
+#include "ttinstrument.h"
+#include "tttrace.h"
+#include "ttstepperprofile.h"
+#include "ttsteppertimer.h"
 #include <cstdint>
 
+class TTMotionGroup;
+class TTStepper;
+
+/** @brief One move of a batch, see TTStepper::MoveBatch(). */
+struct TTStepperMove{
+    /** @brief How many steps to take. Positive = clockwise, negative = anti-clockwise. */
+    long steps;
+
+    /** @brief Profile to ramp the move with, or 0 for the stepper's profile. */
+    TTStepperProfile *profile;
+};
+
+/** @brief Completion handle for a batch of moves. A default constructed handle is always done. */
+class TTStepperBatch{
+
+    friend class TTStepper;
+
+    public:
+        /**
+        * @brief Has every move in the batch finished? Wait-free, safe to call from any context including ISRs.
+        * With the hardware timer moves in the same direction are only reported done once the timer has stepped them all.
+        * @returns true once the last move's last step has been taken.
+        */
+        bool IsDone() const;
+
+        /**
+        * @brief Wait for every move in the batch to finish.
+        * @warning This function blocks the calling thread.
+        * @param timeout Longest time to wait.
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_WAIT_TIMEDOUT if moves are still running,
+        * TTSTEPPER_BATCH_STOPPED if Stop() or an endstop discarded part of the batch.
+        */
+        int Wait(Kernel::Clock::duration_u32 timeout) const;
+
+    private:
+        /** @brief Stepper running the batch, 0 if nothing was queued. */
+        TTStepper *stepper = 0;
+
+        /** @brief Queue sequence number after the batch's last move. */
+        uint32_t end = 0;
+};
+
 class TTStepper{
 
+    friend class TTMotionGroup;
+    friend class TTStepperBatch;
+
     public:
         TTStepper(PinName en, PinName step, PinName dir, uint32_t stepsPerRev, float posPerRev = 1.0f);
 
+        /**
+        * @brief Create a stepper with a motion profile already set.
+        * @param profile Profile to plan moves with, or 0 for the speedInterval ramp.
+        */
+        TTStepper(PinName en, PinName step, PinName dir, uint32_t stepsPerRev, float posPerRev, TTStepperProfile *profile);
+
         /** 
         * @brief Set the stepper enable pin logical high (independent of active low).
         * @returns Enable pin state
@@ -87,6 +167,19 @@ class TTStepper{
         */
         int Home(uint32_t bounceSteps = 100, int endstopId = TTSTEPPER_LOWER_ENDSTOP);
 
+        /**
+        * @brief Home in two phases. A fast ramped approach runs until the endstop fires, backs off, then a slow approach at
+        * the homing speed finds the endstop precisely. Zero is the step at which the slow approach triggered the endstop,
+        * latched in the endstop ISR, so the motor finishes at bounceSteps plus however far it took to release the endstop.
+        * @warning The fast approach stops dead when the endstop fires. It runs at TTSTEPPER_HOME_APPROACH_MULTIPLIER times
+        * the homing speed unless SetHomingApproachSpeed() is used, raise it only as far as the axis can stop from.
+        * @param bounceSteps How many steps to "bounce" after releasing the endstop.
+        * @param endstopId Endstop to home to (TTSTEPPER_LOWER_ENDSTOP or TTSTEPPER_UPPER_ENDSTOP).
+        * @param backOffSteps How far to back off after the fast approach, must clear the endstop's hysteresis.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int FastHome(uint32_t bounceSteps = 100, int endstopId = TTSTEPPER_LOWER_ENDSTOP, uint32_t backOffSteps = 200);
+
         /**
         * @brief Move the motor a specified number of steps.
         * @param steps How many steps to take. Positive = clockwise, negative = anti-clockwise.
@@ -94,6 +187,50 @@ class TTStepper{
         */
         int MoveSteps(long steps);
 
+        /**
+        * @brief Move the motor a specified number of steps with a specific motion profile.
+        * @param steps How many steps to take. Positive = clockwise, negative = anti-clockwise.
+        * @param profile Profile to ramp this move with, or 0 for the speedInterval ramp.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int MoveSteps(long steps, TTStepperProfile *profile);
+
+        /**
+        * @brief Add a move to the motion queue without waiting for the current move to finish.
+        * The step ISR starts queued moves back to back. Consecutive moves in the same direction are joined
+        * at the highest rate both can handle instead of stopping in between.
+        * @param steps How many steps to take. Positive = clockwise, negative = anti-clockwise.
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_QUEUE_FULL if the queue has no space.
+        * TTSTEPPER_NO_PROFILE if no profile is set, queued moves need one to plan the junctions.
+        */
+        int QueueSteps(long steps);
+
+        /**
+        * @brief Add a move with a specific motion profile to the motion queue.
+        * @param steps How many steps to take. Positive = clockwise, negative = anti-clockwise.
+        * @param moveProfile Profile to ramp this move with.
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_QUEUE_FULL if the queue has no space.
+        * TTSTEPPER_NO_PROFILE if moveProfile is 0.
+        */
+        int QueueSteps(long steps, TTStepperProfile *moveProfile);
+
+        /**
+        * @brief Plan a list of moves and add them all to the motion queue in one go. Every move is validated and planned,
+        * junctions included, before any is published, so the ISR starts them back to back and the batch is all or
+        * nothing. Zero step moves are skipped.
+        * @param moves Moves in the order to run them.
+        * @param batch (Optional) Set to a handle that completes when the last move finishes.
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_QUEUE_FULL if the queue can't hold every move.
+        * TTSTEPPER_NO_PROFILE if a move has no profile and the stepper has none set.
+        */
+        int MoveBatch(Span<const TTStepperMove> moves, TTStepperBatch *batch = 0);
+
+        /**
+        * @brief Get the number of queued moves that have not started yet.
+        * @returns Number of waiting moves.
+        */
+        int QueueLength();
+
         /**
         * @brief Move the motor a specified number of degrees.
         * @param degrees How many degrees to move. Positive = clockwise, negative = anti-clockwise.
@@ -101,6 +238,14 @@ class TTStepper{
         */
         int MoveDegs(float degrees);
 
+        /**
+        * @brief Move the motor a specified number of degrees with a specific motion profile.
+        * @param degrees How many degrees to move. Positive = clockwise, negative = anti-clockwise.
+        * @param profile Profile to ramp this move with, or 0 for the speedInterval ramp.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int MoveDegs(float degrees, TTStepperProfile *profile);
+
         /**
         * @brief Move the motor a specified number of units.
         * @param units How many units to move. Positive = clockwise, negative = anti-clockwise.
@@ -108,6 +253,14 @@ class TTStepper{
         */
         int MovePos(float units);
 
+        /**
+        * @brief Move the motor a specified number of units with a specific motion profile.
+        * @param units How many units to move. Positive = clockwise, negative = anti-clockwise.
+        * @param profile Profile to ramp this move with, or 0 for the speedInterval ramp.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int MovePos(float units, TTStepperProfile *profile);
+
         /**
         * @brief Go to a net rotation.
         * @param Target rotation. Can be >360 degrees. Positive = clockwise, negative = anti-clockwise.
@@ -123,17 +276,79 @@ class TTStepper{
         void GoToPos(float pos);
 
         /** 
-        * @brief Wait for the motor to stop moving.
+        * @brief Wait for the motor to stop moving. The thread sleeps until Stop() signals the end of the move.
         * @warning This function blocks the calling thread.
         * @returns Success or a negative TTSTEPPER error code.
         */
         int WaitBlocking();
 
+        /** 
+        * @brief Wait for the motor to stop moving, giving up after a timeout.
+        * @warning This function blocks the calling thread.
+        * @param timeout Longest time to wait.
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_WAIT_TIMEDOUT if the motor is still moving.
+        */
+        int WaitBlocking(Kernel::Clock::duration_u32 timeout);
+
+        /**
+        * @brief Set a function to call when a move ends. Runs on the TTScheduler deferred thread, not in the ISR that ended the move.
+        * Replaces any callbacks added with AddMoveEndedCallback().
+        * @param callback Function to call, or nullptr to remove them all.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int SetMoveEndedCallback(Callback<void()> callback);
+
+        /**
+        * @brief Add a function to call when a move ends, alongside any others. Runs on the TTScheduler deferred thread.
+        * Safe to call from any context including ISRs.
+        * @param callback Function to call.
+        * @returns Handle for RemoveMoveEndedCallback() or a negative TTSTEPPER error code. TTSTEPPER_CALLBACKS_FULL if
+        * TT_CALLBACK_LIST_LENGTH are already added.
+        */
+        int AddMoveEndedCallback(Callback<void()> callback);
+
         /**
-        * @brief Stops the motor.
+        * @brief Remove a function added with AddMoveEndedCallback(). Safe to call from any context including ISRs.
+        * @param handle Handle from AddMoveEndedCallback().
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_INVALID_CALLBACK if nothing is added with it.
+        */
+        int RemoveMoveEndedCallback(int handle);
+
+        /**
+        * @brief Stops the motor and discards any queued moves.
         */
         void Stop();
 
+        /**
+        * @brief Get the net step count of the stepper. Wait-free, safe to call from any context including ISRs.
+        * @returns The net step count. Positive = clockwise, negative = anti-clockwise.
+        */
+        int32_t GetSteps();
+
+        /**
+        * @brief Get how many steps are left in the current move. Wait-free, safe to call from any context including ISRs.
+        * @returns Steps left, not counting queued moves.
+        */
+        uint32_t GetRemainingSteps();
+
+#if TTLIBS_INSTRUMENT
+        /**
+        * @brief Get timing statistics for the step ISR. Jitter is against the period each step was scheduled for,
+        * steps more than a whole period late count as dropped. The hardware timer backend isn't timed.
+        * @returns Snapshot of the step ISR statistics.
+        */
+        TTInstrumentSnapshot GetStepInstrumentation();
+
+        /**
+        * @brief Get timing statistics for the endstop ISR.
+        * @returns Snapshot of the endstop ISR statistics.
+        */
+        TTInstrumentSnapshot GetEndstopInstrumentation();
+
+        /** @brief Clear the step and endstop statistics. */
+        void ResetInstrumentation();
+#endif
+
         /**
         * @brief Get the net rotation of the stepper in degrees.
         * @returns The net rotation rotation of the stepper in degrees. Positive = clockwise, negative = anti-clockwise.
@@ -146,8 +361,50 @@ class TTStepper{
         */
         float GetPos();
 
+#if TTLIBS_FIXED_POINT
+        /**
+        * @brief Move the motor a specified number of degrees using integer math only.
+        * @param degrees Q16.16 degrees to move. Positive = clockwise, negative = anti-clockwise.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int MoveDegsQ16(ttq16 degrees);
+
+        /**
+        * @brief Move the motor a specified number of units using integer math only.
+        * @param units Q16.16 units to move. Positive = clockwise, negative = anti-clockwise.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int MovePosQ16(ttq16 units);
+
+        /**
+        * @brief Go to a net rotation using integer math only.
+        * @param degrees Q16.16 target rotation. Positive = clockwise, negative = anti-clockwise.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int GoToRotQ16(ttq16 degrees);
+
+        /**
+        * @brief Go to a net position using integer math only.
+        * @param pos Q16.16 target position. Positive = clockwise, negative = anti-clockwise.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int GoToPosQ16(ttq16 pos);
+
         /**
-        * @brief Gets if the stepper is currently moving.
+        * @brief Get the net rotation of the stepper using integer math only. Limited to +-32767 degrees.
+        * @returns Q16.16 net rotation in degrees. Positive = clockwise, negative = anti-clockwise.
+        */
+        ttq16 GetDegsQ16();
+
+        /**
+        * @brief Get the net position of the stepper using integer math only. Limited to +-32767 units.
+        * @returns Q16.16 net position in units. Positive = clockwise, negative = anti-clockwise.
+        */
+        ttq16 GetPosQ16();
+#endif
+
+        /**
+        * @brief Gets if the stepper is currently moving. Wait-free, safe to call from any context including ISRs.
         * @returns Is the motor moving?
         * @retval true The motor is moving.
         * @retval false The motor is stationary.
@@ -157,9 +414,64 @@ class TTStepper{
         /** @brief Reset the endstop hit flag. This will allow the motor to move after an endstop is triggered. */
         void ClearEndstopHit();
 
+        /**
+        * @brief Get the step the last endstop hit happened at, latched in the endstop ISR. Homing moves it with zero.
+        * @returns Step position of the last endstop hit.
+        */
+        int32_t GetEndstopStep();
+
+        /**
+        * @brief Limit moves to a range of step positions. Checked before a move starts or is queued, queued moves are
+        * checked from where the moves ahead of them end. Homing ignores the limits.
+        * @param lowerStep Lowest step position a move may reach.
+        * @param upperStep Highest step position a move may reach.
+        * @param clamp true to shorten moves that would pass a limit so they end on it, false to reject them.
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_INVALID_LIMITS if lowerStep is above upperStep.
+        * Moves return TTSTEPPER_SOFT_LIMIT when they are rejected, or when clamped and already at the limit.
+        */
+        int SetSoftLimits(int32_t lowerStep, int32_t upperStep, bool clamp = false);
+
+        /**
+        * @brief Stop limiting moves.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int ClearSoftLimits();
+
         /** @brief Reset the endstop released flag. This flag is purely informative. */
         void ClearEndstopReleased();
 
+        /**
+        * @brief Add a function to call when an endstop is hit. Runs on the TTScheduler deferred thread with the id of the
+        * endstop (TTSTEPPER_LOWER_ENDSTOP or TTSTEPPER_UPPER_ENDSTOP). Safe to call from any context including ISRs.
+        * @param callback Function to call.
+        * @returns Handle for RemoveEndstopHitCallback() or a negative TTSTEPPER error code. TTSTEPPER_CALLBACKS_FULL if
+        * TT_CALLBACK_LIST_LENGTH are already added.
+        */
+        int AddEndstopHitCallback(Callback<void(int)> callback);
+
+        /**
+        * @brief Remove a function added with AddEndstopHitCallback(). Safe to call from any context including ISRs.
+        * @param handle Handle from AddEndstopHitCallback().
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_INVALID_CALLBACK if nothing is added with it.
+        */
+        int RemoveEndstopHitCallback(int handle);
+
+        /**
+        * @brief Add a function to call when an endstop is released. Runs on the TTScheduler deferred thread with the id of
+        * the endstop. Safe to call from any context including ISRs.
+        * @param callback Function to call.
+        * @returns Handle for RemoveEndstopReleasedCallback() or a negative TTSTEPPER error code.
+        * TTSTEPPER_CALLBACKS_FULL if TT_CALLBACK_LIST_LENGTH are already added.
+        */
+        int AddEndstopReleasedCallback(Callback<void(int)> callback);
+
+        /**
+        * @brief Remove a function added with AddEndstopReleasedCallback(). Safe to call from any context including ISRs.
+        * @param handle Handle from AddEndstopReleasedCallback().
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_INVALID_CALLBACK if nothing is added with it.
+        */
+        int RemoveEndstopReleasedCallback(int handle);
+
         /** 
         * @brief Scale maximum motor speed (units are abstract). Sets the home speed to 10% max speed. Sets min speed to 1% max speed.
         * @param speed The desired speed.
@@ -181,6 +493,14 @@ class TTStepper{
         */
         int SetHomingSpeed(float speed);
 
+        /** 
+        * @brief Set the top speed of FastHome()'s fast approach and back-off (units are abstract).
+        * @param speed The desired speed, 0 for TTSTEPPER_HOME_APPROACH_MULTIPLIER times the homing speed. Never above the
+        * max speed.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int SetHomingApproachSpeed(float speed);
+
         /** 
         * @brief Scale stepper acceleration.
         * @param multiplier The desired acceleration multiplier.
@@ -188,6 +508,14 @@ class TTStepper{
         */
         int SetAccelerationMultiplier(float multiplier);
 
+        /** 
+        * @brief Set the motion profile used to ramp moves. Rates are taken from the min and max speeds.
+        * A TTStepperSCurveProfile removes the acceleration corners of the ramp, which avoids exciting resonance.
+        * @param profile The profile to use, or 0 to use the speedInterval ramp.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int SetProfile(TTStepperProfile *profile);
+
         /** 
         * @brief Set the stepper to run in the opposite direction. Clockwise becomes anti-clockwise and vice versa.
         * @param reverse Should the stepper output be reversed?
@@ -206,6 +534,47 @@ class TTStepper{
         */
         int InvertEndstops(bool invert);
 
+        /** 
+        * @brief Drive the acceleration ramp from a precomputed integer period table instead of per step float maths.
+        * The table is built by the next move and reused until the min speed, max speed or acceleration changes.
+        * @param enable Should the ramp table be used?
+        * @param true The step ISR only does an index lookup and integer compare per step.
+        * @param false The step ISR recalculates the speed and period every step.
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_ALREADY_MOVING if called mid-move.
+        */
+        int UseRampTable(bool enable);
+
+        /** 
+        * @brief Generate step pulses from a hardware timer PWM channel on the step pin instead of a Timeout.
+        * Periods are streamed to the timer by DMA so the CPU is only interrupted between buffers of steps.
+        * While moving, the net position runs up to 2 * TTSTEPPER_TIMER_CHUNK_LENGTH steps ahead and is corrected on Stop().
+        * @param enable Should the hardware timer be used?
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_ALREADY_MOVING if called mid-move.
+        * TTSTEPPER_TIMER_UNSUPPORTED if the step pin or target can't drive steps from a timer. Moves return
+        * TTSTEPPER_TIMER_CLAIMED if something else is running the timer with a different prescaler.
+        */
+        int UseHardwareTimer(bool enable);
+
+        /**
+        * @brief Let the step ISR coarsen the driver's step resolution at speed. Positions, step counts and stepsPerRev stay
+        * in steps at the finest resolution, a coarser pulse just covers several of them, so nothing has to be rescaled.
+        * Above maxStepRate pulses/s the pulse size doubles (once a step it lands on is reached), down to full steps, and
+        * halves again once that keeps the rate well under. The motor always rests at the finest resolution.
+        * Not used with the hardware timer, which has its periods before the pins could switch.
+        * @param driver Driver to switch, 0 for none.
+        * @param microsteps Finest resolution, the one stepsPerRev is given in.
+        * @param maxStepRate Highest pulse rate before switching to coarser steps, 0 to never switch.
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_ALREADY_MOVING if called mid-move.
+        * TTSTEPPER_MICROSTEP_UNSUPPORTED if the driver can't step at microsteps.
+        */
+        int SetMicrostepDriver(TTStepperMicrostepDriver *driver, uint16_t microsteps, float maxStepRate = 0);
+
+        /**
+        * @brief Get how many of the finest steps each step pulse currently moves.
+        * @returns 1 at the finest resolution, up to the microsteps set with SetMicrostepDriver().
+        */
+        uint16_t GetStepStride();
+
         ~TTStepper();      
 
     private:
@@ -221,16 +590,28 @@ class TTStepper{
         * @brief Take a number of steps in a specified direction.
         * @param steps Number of steps to take.
         * @param direction Direction to move in.  TTSTEPPER_CLOCKWISE or TTSTEPPER_ANTI_CLOCKWISE.
-        * @returns Success or a negative TTSTEPPER error code.
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_PROFILE_INVALID if the profile could not plan the move.
         */
         int Step(uint32_t steps, bool direction); 
 
+        /**
+        * @brief Take a number of steps in a specified direction with a specific motion profile.
+        * @param steps Number of steps to take.
+        * @param direction Direction to move in.  TTSTEPPER_CLOCKWISE or TTSTEPPER_ANTI_CLOCKWISE.
+        * @param moveProfile Profile to ramp this move with, or 0 for the speedInterval ramp.
+        * @returns Success or a negative TTSTEPPER error code. TTSTEPPER_PROFILE_INVALID if the profile could not plan the move.
+        */
+        int Step(uint32_t steps, bool direction, TTStepperProfile *moveProfile);
+
         /** @brief Protect variable from modification while in use. */
         Mutex mutex;
         
     //==================================================================================== GPIO
         DigitalOut step, dir, en;
 
+        /** @brief Step pin, kept to create the hardware timer backend. */
+        PinName stepPin;
+
         /** @brief Is the stepper enable pin active low? */
         bool enActiveLow = true;
 
@@ -244,8 +625,65 @@ class TTStepper{
         /** @brief Is the stepper currently homing? */
         volatile bool homing = false;
 
+        /** @brief Is FastHome() on a fast phase? Homing moves then ramp like any other move. */
+        volatile bool homingFast = false;
+
+        /** @brief Step the endstop last fired at, latched in the endstop ISR once the motor has stopped. */
+        volatile int32_t endstopStep = 0;
+
+        /** @brief Are the soft limits set? */
+        bool softLimits = false;
+
+        /** @brief Shorten moves that pass a soft limit rather than reject them? */
+        bool softLimitClamp = false;
+
+        /** @brief Lowest and highest step positions a move may reach. */
+        int32_t softLimitLower = 0, softLimitUpper = 0;
+
+        /**
+        * @brief Check a move against the soft limits, shortening it if they clamp. Call with the mutex held.
+        * @param from Step position the move starts at.
+        * @param pinDirection Direction pin level for the move, true counts up.
+        * @param steps Steps in the move, shortened if clamped.
+        * @returns Success or TTSTEPPER_SOFT_LIMIT.
+        */
+        int ApplySoftLimits(int32_t from, bool pinDirection, uint32_t &steps);
+
+        /**
+        * @brief Work out where the running move and every queued move will leave the motor.
+        * @returns Step position once the queue is empty.
+        */
+        int32_t PlannedEndStep();
+
+        /**
+        * @brief Run one homing move and wait for it to end.
+        * @param steps How many steps to take.
+        * @param direction Direction to move.
+        * @param fast Ramp up to the homing approach speed rather than run at the homing speed.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int HomingMove(uint32_t steps, bool direction, bool fast);
+
+        /**
+        * @brief Read an endstop, taking inversion into account.
+        * @param endstop Endstop to read.
+        * @returns true if the endstop is hit.
+        */
+        bool IsEndstopHit(InterruptIn *endstop);
+
+        /**
+        * @brief Get the registered endstop for an id.
+        * @param endstopId TTSTEPPER_LOWER_ENDSTOP or TTSTEPPER_UPPER_ENDSTOP.
+        * @param endstop Set to the endstop.
+        * @returns Success or a negative TTSTEPPER error code.
+        */
+        int GetEndstop(int endstopId, InterruptIn **endstop);
+
+        /** @brief Storage for the lower and upper endstops so registering them doesn't use the heap. */
+        TTInPlace<InterruptIn> endstops[2];
+
         /** @brief Instance lower and upper endstops. */
-        InterruptIn *lowerEndstop, *upperEndstop = 0;
+        InterruptIn *lowerEndstop = 0, *upperEndstop = 0;
 
         /**
         * @brief Record an endstop event.
@@ -269,17 +707,17 @@ class TTStepper{
         /** @brief The id of the last endstop released. 0 = none, 1 = lower * 2 = upper. */
         int endstopReleased = 0;
 
-        /** 
-        * @brief Function to call on endstop hit. 
-        * @param endstopHot The id of the endstop hit. 0 = lower, 1 = upper.
-        */
-        function<void(int endstopHit)> onEndstopHit;
+        /** @brief Functions to call on endstop hit, with the id of the endstop. Run on the TTScheduler deferred thread. */
+        TTCallbackList<void(int)> endstopHitCallbacks;
 
-        /** 
-        * @brief Function to call on endstop release. 
-        * @param endstopHot The id of the endstop hit. 0 = lower, 1 = upper.
-        */
-        function<void(int endstopReleased)> onEndstopReleased;
+        /** @brief Functions to call on endstop release, with the id of the endstop. Run on the TTScheduler deferred thread. */
+        TTCallbackList<void(int)> endstopReleasedCallbacks;
+
+        /** @brief Run the endstop hit callbacks. Runs on the TTScheduler deferred thread. */
+        void NotifyEndstopHit(int id);
+
+        /** @brief Run the endstop released callbacks. Runs on the TTScheduler deferred thread. */
+        void NotifyEndstopReleased(int id);
 
     //=================================================================================== SPEED
         /** @brief Maximum motor speed (abstract units). */
@@ -291,12 +729,146 @@ class TTStepper{
         /** @brief Speed to use while homing (abstract units). */
         float homeSpeed = 0.25f;
 
+        /** @brief Top speed of FastHome()'s fast phases (abstract units), 0 = TTSTEPPER_HOME_APPROACH_MULTIPLIER * homeSpeed. */
+        float homeApproachSpeed = 0;
+
         /** @brief Motor acceleration interval (abstract units). */
         float speedInterval = 0.001f;
 
         /** @brief Current motor speed (abstract units). */
         float speed = minSpeed;
 
+    //================================================================================= PROFILE
+        /** @brief Profile used to plan new moves. 0 = speedInterval ramp. */
+        TTStepperProfile *profile = 0;
+
+        /** @brief Profile driving the current move. 0 = speedInterval ramp. */
+        TTStepperProfile *activeProfile = 0;
+
+        /** @brief Planned segment for the current move. */
+        TTStepperSegment segment;
+
+    //============================================================================ MOTION QUEUE
+        /** @brief Marks a queued move as taken by the step ISR. */
+        static const uint8_t queueTaken = 0xFF;
+
+        /** 
+        * @brief A move waiting in the motion queue. The plan is double buffered so the junction with the next move
+        * can be replanned by the producer while the ISR may be taking the move.
+        */
+        struct QueuedMove{
+            /** @brief Original and replanned segments. */
+            TTStepperSegment plan[2];
+
+            /** @brief Index of the valid plan, or queueTaken once the ISR has started the move. */
+            volatile uint8_t selected;
+
+            /** @brief Profile to ramp the move with. */
+            TTStepperProfile *profile;
+
+            /** @brief Direction to move in. TTSTEPPER_CLOCKWISE or TTSTEPPER_ANTI_CLOCKWISE. */
+            bool direction;
+        };
+
+        /** @brief Single producer (QueueSteps) single consumer (step ISR) ring buffer of moves. */
+        QueuedMove queue[TTSTEPPER_QUEUE_LENGTH];
+
+        /** @brief Next move to start. Only written by the consumer. */
+        volatile uint32_t queueHead = 0;
+
+        /** @brief Next free slot. Only written by the producer. */
+        volatile uint32_t queueTail = 0;
+
+        /** @brief Sequence number (queue index) of the queued move being stepped. */
+        uint32_t runningMove = 0;
+
+        /** @brief Is a queued move being stepped? false for MoveSteps() moves. */
+        bool runningQueued = false;
+
+        /** @brief Every queued move before this sequence number has finished. Only written by the step ISR. */
+        volatile uint32_t finishedMoves = 0;
+
+        /**
+        * @brief Work out the entry rate of a new move that follows the last queued one, and replan that move into its
+        * spare plan to exit at it if it hasn't started. Nothing changes for the ISR until CommitQueuedLink(). Call with
+        * the mutex held.
+        * @param direction Direction of the new move.
+        * @param count Steps in the new move.
+        * @param moveProfile Profile of the new move.
+        * @param selected Set to the previous move's plan the replan replaces, for CommitQueuedLink().
+        * @returns Entry rate for the new move (steps/s), the minimum rate if the previous move can't be linked.
+        */
+        float LinkQueuedMove(bool direction, uint32_t count, TTStepperProfile *moveProfile, uint8_t &selected);
+
+        /**
+        * @brief Switch the last queued move to the plan LinkQueuedMove() made, once everything after it is planned.
+        * Call with the mutex held.
+        * @param selected Plan the replan replaces, from LinkQueuedMove().
+        * @returns true if the move now exits at the junction rate, false if the ISR took it first.
+        */
+        bool CommitQueuedLink(uint8_t selected);
+
+        /** @brief Start stepping the queue if the motor is idle. Call with the mutex held. */
+        void StartQueue();
+
+        /** @brief Mark the queued move being stepped as finished. Called from the step ISR. */
+        void FinishQueuedMove();
+
+        /**
+        * @brief Start the next queued move if there is one.
+        * @param allowDirectionChange Can the next move reverse the direction? The timer backend streams periods ahead
+        * of the pulses so it can only chain moves in the same direction.
+        * @returns Was a move started?
+        */
+        bool PopQueuedMove(bool allowDirectionChange);
+
+    //============================================================================== RAMP TABLE
+        /** @brief Should the step ISR use the precomputed ramp table? */
+        bool useRampTable = false;
+
+        /** @brief Step periods (us) for each point along the acceleration ramp. */
+        uint32_t rampTable[TTSTEPPER_ACCELERATION_CURVE_LENGTH];
+
+        /** @brief Is the ramp table built for the cached speed settings below? */
+        bool rampTableValid = false;
+
+        /** @brief Minimum speed the ramp table was built for. */
+        float rampTableMinSpeed = 0.0f;
+
+        /** @brief Maximum speed the ramp table was built for. */
+        float rampTableMaxSpeed = 0.0f;
+
+        /** @brief Acceleration interval the ramp table was built for. */
+        float rampTableSpeedInterval = 0.0f;
+
+        /** @brief Number of acceleration steps between min and max speed. */
+        uint32_t rampTableSteps = 0;
+
+        /** @brief Number of acceleration steps covered by each ramp table entry. */
+        uint32_t rampTableStride = 1;
+
+        /** @brief Step period (us) used while homing. */
+        uint32_t homePeriod = 0;
+
+        /** @brief Acceleration steps taken along the ramp, 0 = min speed, rampTableSteps = max speed. */
+        volatile uint32_t rampStep = 0;
+
+        /** @brief Current ramp table entry. */
+        volatile uint32_t rampIndex = 0;
+
+        /** @brief Acceleration steps taken within the current ramp table entry. */
+        volatile uint32_t rampStrideCount = 0;
+
+        /**
+        * @brief Calculate a step period from a speed.
+        * @param speed Speed to convert (abstract units).
+        * @returns Step period in microseconds.
+        */
+        uint32_t SpeedToPeriod(float speed);
+
+        /** @brief Rebuild the ramp table if the speed settings have changed since it was last built. */
+        void BuildRampTable();
+
     //======================================================================== GENERAL MOVEMENT
         /** @brief The number of stepper steps per output revolution. */
         uint32_t stepsPerRev;
@@ -304,8 +876,22 @@ class TTStepper{
         /** @brief How many units are moved with each output revolution. */
         float posPerRev;
 
-        /** @brief The net stepper step.*/
-        volatile long currentStep = 0;
+#if TTLIBS_FIXED_POINT
+        /** @brief Precomputed stepsPerRev / 360 in Q16.16 so conversions multiply instead of divide. */
+        ttq16 stepsPerDegQ16;
+
+        /** @brief Precomputed 360 / stepsPerRev in Q16.16. */
+        ttq16 degsPerStepQ16;
+
+        /** @brief Precomputed stepsPerRev / posPerRev in Q16.16. */
+        ttq16 stepsPerUnitQ16;
+
+        /** @brief Precomputed posPerRev / stepsPerRev in Q16.16. */
+        ttq16 unitsPerStepQ16;
+#endif
+
+        /** @brief The net stepper step. Only written by the step ISRs or while stopped, read atomically.*/
+        volatile int32_t currentStep = 0;
 
         /** @brief How many steps are left in the current movement.*/
         volatile uint32_t remainingSteps = 0;
@@ -314,19 +900,154 @@ class TTStepper{
         volatile uint32_t slowStep = 0;
 
         /** @brief Is the stepper currently moving? */
-        bool moving = false;
+        volatile bool moving = false;
+
+        /** @brief Signals TTSTEPPER_FLAG_STOPPED to threads waiting for a move to end. */
+        EventFlags events;
+
+        /** @brief Called from Stop() when a move ends. */
+        TTCallbackList<void()> moveEndedCallbacks;
+
+        /** @brief Run the move ended callbacks. Runs on the TTScheduler deferred thread. */
+        void NotifyMoveEnded();
 
         /** @brief Should the motor output be reversed? */
         bool reverse = false;
 
     //================================================================================== TIMING
+        /** @brief Shared scheduler every stepper's timing runs on. */
+        TTScheduler &scheduler = TTScheduler::Get();
+
         /** @brief Recursive trigger for asynchronus interrupt driven stepping. */
-        Timeout stepTimout;
+        TTSchedulerTask stepTask{callback(this, &TTStepper::StepTimeoutHandler)};
+
+#if TTLIBS_INSTRUMENT
+        /** @brief StepTimeoutHandler timing. */
+        TTInstrumentProbe stepProbe;
+
+        /** @brief Endstop() timing. */
+        TTInstrumentProbe endstopProbe;
+
+        /** @brief The period the next step was scheduled for, in cycles. */
+        uint32_t commandedCycles = 0;
+#endif
+
+#if TTLIBS_TRACE
+        /** @brief Period of the last step, to spot ramp phase changes. */
+        uint32_t tracePeriod = 0;
+
+        /** @brief Ramp phase last traced, 0xFF at the start of a move. */
+        uint8_t traceRampPhase = 0xFF;
+#endif
+
+        /** @brief Hardware step generator, created by UseHardwareTimer(). */
+        TTStepperTimer *timer = 0;
+
+#if TTSTEPPER_TIMER_SUPPORTED
+        /** @brief Storage for the hardware step generator. Only reserved on targets that have one. */
+        TTInPlace<TTStepperTimer> timerStorage;
+#endif
+
+        /** @brief Should moves be stepped by the hardware timer? */
+        bool useTimer = false;
+
+        /** @brief Toggle the step pin to take a single step. */
+        void Pulse();
+
+        /**
+        * @brief Account for a step pulse and work out how long to wait before the next one.
+        * @returns The period until the next step pulse in microseconds.
+        */
+        uint32_t NextPeriod();
+
+        /**
+        * @brief Advance the ramp by one of the finest steps.
+        * @param remaining Steps left after this one.
+        * @returns The period until the next fine step in microseconds.
+        */
+        uint32_t StepPeriod(uint32_t remaining);
+
+        /**
+        * @brief Pick the size of the next step pulse.
+        * @param lastPeriod Period before the last pulse (us).
+        * @returns Finest steps the next pulse moves.
+        */
+        uint16_t NextStride(uint32_t lastPeriod);
+
+        /** @brief Switch the MS pins to the pending stride unless the motor has stopped. Runs in the step ISR. */
+        void ApplyStride();
+
+    //============================================================================== MICROSTEPS
+        /** @brief Driver whose resolution the step ISR switches, 0 for none. */
+        TTStepperMicrostepDriver *microstepDriver = 0;
+
+        /** @brief Finest resolution (microsteps per full step), the unit of every step count. */
+        uint16_t microsteps = 1;
+
+        /** @brief Most of the finest steps one pulse may move. 1 disables switching. */
+        uint16_t maxStride = 1;
+
+        /** @brief Shortest pulse period before switching to coarser steps (us). */
+        uint32_t strideMinPeriod = 0;
+
+        /** @brief Finest steps the current step pulse moves. */
+        volatile uint16_t stride = 1;
+
+        /** @brief Stride picked for the next pulse, set on the MS pins after the current one. 0 = no change. */
+        volatile uint16_t pendingStride = 0;
+
+        /** @brief Period before the last step pulse (us), UINT32_MAX from rest. */
+        uint32_t pulsePeriod = UINT32_MAX;
 
     //===================================================================================== ISR
         void StepTimeoutHandler();
+
+        /**
+        * @brief Supply the hardware timer with the next period.
+        * @returns The period until the next step in microseconds, 0 when the move is complete.
+        */
+        uint32_t TimerPeriodHandler();
+
+        /** @brief Called by the hardware timer once the move has finished. */
+        void TimerDoneHandler();
+
+        /**
+        * @brief Start the hardware timer on the current move, stopping the motor if it refuses.
+        * @returns TTSTEPPER_TIMER_SUCCESS or the timer's negative error code.
+        */
+        int StartTimer();
         void SpeedTimeoutHandler();
 };
 
+/**
+* @brief TTStepper with its pins fixed at compile time and its motion profile held inline, so nothing is allocated.
+* e.g. TTStepperT<PA_0, PA_1, PA_4, 200> stepper(8.0f, 4000.0f);
+* posPerRev is a constructor argument because C++14 doesn't allow float template parameters.
+*/
+template<PinName EnPin, PinName StepPin, PinName DirPin, uint32_t StepsPerRev, typename Profile = TTStepperTrapezoidalProfile>
+class TTStepperT : public TTStepper{
+    public:
+        /**
+        * @brief Create the stepper.
+        * @param posPerRev Position units travelled per revolution.
+        * @param profileArgs Arguments forwarded to the Profile constructor.
+        */
+        template<typename... ProfileArgs>
+        TTStepperT(float posPerRev, ProfileArgs&&... profileArgs)
+            : TTStepper(EnPin, StepPin, DirPin, StepsPerRev, posPerRev, &motionProfile), motionProfile(std::forward<ProfileArgs>(profileArgs)...){}
+
+        /**
+        * @brief Get the inline motion profile, to adjust its limits.
+        * @returns The profile.
+        */
+        Profile &GetProfile(){
+            return motionProfile;
+        }
+
+    private:
+        /** @brief The motion profile, the base only stores its address during construction. */
+        Profile motionProfile;
+};
+
 
 #endif
\ No newline at end of file
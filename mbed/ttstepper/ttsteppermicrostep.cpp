@@ -0,0 +1,76 @@
+/**
+*        _____ _____ ___ _                          
+*       |_   _|_   _/ __| |_ ___ _ __ _ __  ___ _ _ 
+*         | |   | | \__ \  _/ -_) '_ \ '_ \/ -_) '_|
+*         |_|   |_| |___/\__\___| .__/ .__/\___|_|  
+*                               |_|  |_|            
+*
+*
+* @file TTStepperMicrostep.cpp
+* @brief This file contains the functions associated with TTStepper microstep control.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "ttsteppermicrostep.h"
+
+/** @brief MS pin levels for one resolution, MS1 in bit 0. */
+struct TTStepperMicrostepLevels{
+    uint16_t microsteps;
+    uint8_t levels;
+};
+
+/** @brief Pin tables from the datasheets, indexed by chip. Unused entries are 0 microsteps. */
+static const TTStepperMicrostepLevels microstepTables[4][6] = {
+    //A4988.
+    {{1, 0b000}, {2, 0b001}, {4, 0b010}, {8, 0b011}, {16, 0b111}, {0, 0}},
+    //DRV8825.
+    {{1, 0b000}, {2, 0b001}, {4, 0b010}, {8, 0b011}, {16, 0b100}, {32, 0b101}},
+    //TMC2208 standalone, no full steps.
+    {{2, 0b01}, {4, 0b10}, {8, 0b00}, {16, 0b11}, {0, 0}, {0, 0}},
+    //TMC2209 standalone, the same pins select finer steps than on the TMC2208.
+    {{8, 0b00}, {16, 0b11}, {32, 0b01}, {64, 0b10}, {0, 0}, {0, 0}}
+};
+
+TTStepperMicrostepPins::TTStepperMicrostepPins(PinName ms1, PinName ms2, PinName ms3, int chip) : ms1(ms1), ms2(ms2), ms3(ms3), chip(chip){}
+
+int TTStepperMicrostepPins::Levels(uint16_t microsteps){
+    if(chip < 0 || chip > TTSTEPPER_MICROSTEP_TMC2209){
+        return -1;
+    }
+
+    for(const TTStepperMicrostepLevels &entry : microstepTables[chip]){
+        if(entry.microsteps != 0 && entry.microsteps == microsteps){
+            return entry.levels;
+        }
+    }
+
+    return -1;
+}
+
+int TTStepperMicrostepPins::SetMicrosteps(uint16_t microsteps){
+    int levels = Levels(microsteps);
+    if(levels < 0){
+        return TTSTEPPER_MICROSTEP_UNSUPPORTED;
+    }
+
+    //Tied off pins are left alone.
+    if(ms1.is_connected()){
+        ms1 = levels & 0b001;
+    }
+    if(ms2.is_connected()){
+        ms2 = (levels & 0b010) >> 1;
+    }
+    if(ms3.is_connected()){
+        ms3 = (levels & 0b100) >> 2;
+    }
+
+    return TTSTEPPER_MICROSTEP_SUCCESS;
+}
+
+bool TTStepperMicrostepPins::IsSupported(uint16_t microsteps){
+    return Levels(microsteps) >= 0;
+}
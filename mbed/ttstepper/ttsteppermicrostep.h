@@ -0,0 +1,93 @@
+/**
+*        _____ _____ ___ _                          
+*       |_   _|_   _/ __| |_ ___ _ __ _ __  ___ _ _ 
+*         | |   | | \__ \  _/ -_) '_ \ '_ \/ -_) '_|
+*         |_|   |_| |___/\__\___| .__/ .__/\___|_|  
+*                               |_|  |_|            
+*
+*
+* @file TTStepperMicrostep.h
+* @brief This file contains the definitions associated with TTStepper microstep control.
+*
+* A TTStepperMicrostepDriver sets the step resolution of the driver chip. TTStepperMicrostepPins does it with the MS
+* pins of common step/dir drivers, drivers configured another way (e.g. over UART) implement the same interface.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_STEPPER_MICROSTEP_H
+#define TT_STEPPER_MICROSTEP_H
+
+#define TTSTEPPER_MICROSTEP_SUCCESS 0
+#define TTSTEPPER_MICROSTEP_UNSUPPORTED -17
+
+/** @brief Allegro A4988, MS1 MS2 MS3. Full to 1/16. */
+#define TTSTEPPER_MICROSTEP_A4988 0
+
+/** @brief TI DRV8825, MODE0 MODE1 MODE2. Full to 1/32. */
+#define TTSTEPPER_MICROSTEP_DRV8825 1
+
+/** @brief Trinamic TMC2208 standalone, MS1 MS2. 1/2 to 1/16. */
+#define TTSTEPPER_MICROSTEP_TMC2208 2
+
+/** @brief Trinamic TMC2209 standalone, MS1 MS2. 1/8 to 1/64. */
+#define TTSTEPPER_MICROSTEP_TMC2209 3
+
+#include "mbed.h"
+#include <cstdint>
+
+class TTStepperMicrostepDriver{
+    public:
+        /**
+        * @brief Set the step resolution. Takes effect from the next step pulse.
+        * TTStepper calls this from the step ISR when it switches resolution on the move, so it must not block.
+        * @param microsteps Microsteps per full step, 1 for full steps.
+        * @returns TTSTEPPER_MICROSTEP_SUCCESS or TTSTEPPER_MICROSTEP_UNSUPPORTED.
+        */
+        virtual int SetMicrosteps(uint16_t microsteps) = 0;
+
+        /**
+        * @brief Can the driver step at a resolution?
+        * @param microsteps Microsteps per full step, 1 for full steps.
+        * @returns true if SetMicrosteps() will accept it.
+        */
+        virtual bool IsSupported(uint16_t microsteps) = 0;
+
+        virtual ~TTStepperMicrostepDriver(){}
+};
+
+/** @brief Microstep control through a step/dir driver's MS pins. */
+class TTStepperMicrostepPins : public TTStepperMicrostepDriver{
+    public:
+        /**
+        * @brief Create MS pin control. Pins tied off on the board can be NC, they then have to match the setting used.
+        * @param ms1 MS1 / MODE0 pin.
+        * @param ms2 MS2 / MODE1 pin.
+        * @param ms3 MS3 / MODE2 pin.
+        * @param chip TTSTEPPER_MICROSTEP_A4988, TTSTEPPER_MICROSTEP_DRV8825, TTSTEPPER_MICROSTEP_TMC2208 or
+        * TTSTEPPER_MICROSTEP_TMC2209.
+        */
+        TTStepperMicrostepPins(PinName ms1, PinName ms2 = NC, PinName ms3 = NC, int chip = TTSTEPPER_MICROSTEP_A4988);
+
+        int SetMicrosteps(uint16_t microsteps);
+
+        bool IsSupported(uint16_t microsteps);
+
+    private:
+        /**
+        * @brief Find the pin levels for a resolution.
+        * @param microsteps Microsteps per full step.
+        * @returns MS1 in bit 0 to MS3 in bit 2, or -1 if the chip can't step at that resolution.
+        */
+        int Levels(uint16_t microsteps);
+
+        DigitalOut ms1, ms2, ms3;
+
+        /** @brief Which pin table to use. */
+        int chip;
+};
+
+#endif
@@ -0,0 +1,403 @@
+/**
+*        _____ _____ ___ _                          
+*       |_   _|_   _/ __| |_ ___ _ __ _ __  ___ _ _ 
+*         | |   | | \__ \  _/ -_) '_ \ '_ \/ -_) '_|
+*         |_|   |_| |___/\__\___| .__/ .__/\___|_|  
+*                               |_|  |_|            
+*
+*
+* @file TTStepperProfile.cpp
+* @brief This file contains the functions associated with the TTStepper motion profiles.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "ttstepperprofile.h"
+#include <cmath>
+
+/** @brief Integer square root, rounded down. Only used for the first few steps of a ramp. */
+static uint32_t SquareRoot(uint64_t value){
+    uint64_t root = 0;
+    uint64_t bit = (uint64_t)1 << 62;
+    while(bit > value){
+        bit >>= 2;
+    }
+
+    while(bit != 0){
+        if(value >= root + bit){
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else{
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return root;
+}
+
+/**
+* @brief Exact period of the step from ramp position n to n + 1, t = sqrt(2 / a) * (sqrt(n + 1) - sqrt(n)).
+* @param scale Segment exactScale, 1000000 * sqrt(2 / a) in fixed point.
+* @param from Ramp position n nearer standstill, in quarter steps.
+* @returns The period in us, fixed point.
+*/
+static int32_t ExactPeriod(uint32_t scale, uint32_t from){
+    //sqrt(x << 32) is sqrt(x) << 16 and quarter steps double the root, 17 bits in all.
+    uint64_t difference = SquareRoot((uint64_t)(from + 4) << 32) - SquareRoot((uint64_t)from << 32);
+    uint64_t period = (scale * difference) >> 17;
+    return period > INT32_MAX ? INT32_MAX : period;
+}
+
+TTStepperTrapezoidalProfile::TTStepperTrapezoidalProfile(float acceleration) : acceleration(acceleration){
+}
+
+int TTStepperTrapezoidalProfile::SetAcceleration(float acceleration){
+    if(acceleration <= 0){
+        return TTSTEPPER_PROFILE_INVALID;
+    }
+
+    this->acceleration = acceleration;
+    return TTSTEPPER_PROFILE_SUCCESS;
+}
+
+float TTStepperTrapezoidalProfile::GetAcceleration(){
+    return acceleration;
+}
+
+int TTStepperTrapezoidalProfile::Plan(TTStepperSegment &segment){
+    if(acceleration <= 0 || segment.cruiseRate <= 0){
+        return TTSTEPPER_PROFILE_INVALID;
+    }
+
+    float entry = segment.entryRate < segment.cruiseRate ? segment.entryRate : segment.cruiseRate;
+    float exit = segment.exitRate < segment.cruiseRate ? segment.exitRate : segment.cruiseRate;
+    float peak = segment.cruiseRate;
+
+    //Steps needed to get from entry to peak and from peak to exit. v^2 = u^2 + 2as.
+    float accelSteps = ((peak * peak) - (entry * entry)) / (2 * acceleration);
+    float decelSteps = ((peak * peak) - (exit * exit)) / (2 * acceleration);
+
+    //Too short to reach cruise speed, meet in the middle.
+    if(accelSteps + decelSteps > segment.steps){
+        float peakSquared = ((2 * acceleration * segment.steps) + (entry * entry) + (exit * exit)) / 2;
+        peak = sqrtf(peakSquared);
+
+        accelSteps = (peakSquared - (entry * entry)) / (2 * acceleration);
+        accelSteps = accelSteps < 0 ? 0 : accelSteps;
+        accelSteps = accelSteps > segment.steps ? segment.steps : accelSteps;
+        decelSteps = segment.steps - accelSteps;
+    }
+
+    //Equivalent number of ramp steps from standstill to the entry and exit rates.
+    float entryN = (entry * entry) / (2 * acceleration);
+    float exitN = (exit * exit) / (2 * acceleration);
+
+    //Exact time of the first step, t = (sqrt(u^2 + 2a) - u) / a, rearranged so a high entry rate doesn't cancel out.
+    float firstPeriod = 2000000.0f / (sqrtf((entry * entry) + (2 * acceleration)) + entry);
+    float exactScale = 1000000.0f * sqrtf(2 / acceleration) * (1 << TTSTEPPER_PROFILE_PERIOD_SHIFT);
+
+    //Ramp positions are kept in quarter steps so a ramp that starts or ends between whole steps stays on the curve.
+    segment.step = 0;
+    segment.rest = 0;
+    segment.n = (4 * entryN) + 0.5f;
+    segment.decelStep = segment.steps - (uint32_t)decelSteps;
+    segment.decelN = -(int32_t)((4 * ((uint32_t)decelSteps + exitN)) + 0.5f) - 4;
+    segment.exactScale = exactScale < UINT32_MAX ? exactScale : UINT32_MAX;
+    segment.period = firstPeriod * (1 << TTSTEPPER_PROFILE_PERIOD_SHIFT);
+    segment.minPeriod = (1000000.0f / peak) * (1 << TTSTEPPER_PROFILE_PERIOD_SHIFT);
+    segment.maxPeriod = exit > 0 ? (1000000.0f / exit) * (1 << TTSTEPPER_PROFILE_PERIOD_SHIFT) : INT32_MAX;
+    segment.phase = segment.period <= segment.minPeriod ? cruising : accelerating;
+
+    if(segment.phase == cruising){
+        segment.period = segment.minPeriod;
+    }
+
+    return TTSTEPPER_PROFILE_SUCCESS;
+}
+
+float TTStepperTrapezoidalProfile::ReachableRate(float from, uint32_t steps){
+    if(acceleration <= 0){
+        return from;
+    }
+
+    return sqrtf((from * from) + (2 * acceleration * steps));
+}
+
+uint32_t TTStepperTrapezoidalProfile::Next(TTStepperSegment &segment){
+    //The period to wait after the step that was just taken.
+    uint32_t period = segment.period >> TTSTEPPER_PROFILE_PERIOD_SHIFT;
+
+    segment.step++;
+
+    if(segment.phase != decelerating && segment.step >= segment.decelStep){
+        segment.phase = decelerating;
+        segment.n = segment.decelN;
+        segment.rest = 0;
+    }
+
+    switch(segment.phase){
+        case accelerating:{
+            segment.n += 4;
+            if(segment.n < 4 * TTSTEPPER_PROFILE_EXACT_STEPS){
+                //The recurrence is furthest off at low speed, work these periods out exactly.
+                segment.period = ExactPeriod(segment.exactScale, segment.n);
+                segment.rest = 0;
+            }
+            else{
+                //c(n) = c(n-1) - 2c(n-1) / (4n + 1)
+                int32_t numerator = (2 * segment.period) + segment.rest;
+                int32_t denominator = segment.n + 1;
+                segment.period -= numerator / denominator;
+                segment.rest = numerator % denominator;
+            }
+
+            if(segment.period <= segment.minPeriod){
+                segment.period = segment.minPeriod;
+                segment.rest = 0;
+                segment.phase = cruising;
+            }
+            break;
+        }
+
+        case cruising:
+            break;
+
+        case decelerating:
+            //Same recurrence counting up from a negative n, which lengthens the period.
+            if(segment.n <= -8){
+                segment.n += 4;
+                if(-segment.n < 4 * TTSTEPPER_PROFILE_EXACT_STEPS){
+                    segment.period = ExactPeriod(segment.exactScale, -segment.n - 4);
+                    segment.rest = 0;
+                }
+                else{
+                    int32_t numerator = (2 * segment.period) + segment.rest;
+                    int32_t denominator = segment.n + 1;
+                    segment.period -= numerator / denominator;
+                    segment.rest = numerator % denominator;
+                }
+
+                if(segment.period > segment.maxPeriod){
+                    segment.period = segment.maxPeriod;
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return period;
+}
+
+
+TTStepperSCurveProfile::TTStepperSCurveProfile(float acceleration, float jerk) : acceleration(acceleration), jerk(jerk){
+}
+
+int TTStepperSCurveProfile::SetAcceleration(float acceleration){
+    if(acceleration <= 0){
+        return TTSTEPPER_PROFILE_INVALID;
+    }
+
+    this->acceleration = acceleration;
+    return TTSTEPPER_PROFILE_SUCCESS;
+}
+
+int TTStepperSCurveProfile::SetJerk(float jerk){
+    if(jerk <= 0){
+        return TTSTEPPER_PROFILE_INVALID;
+    }
+
+    this->jerk = jerk;
+    return TTSTEPPER_PROFILE_SUCCESS;
+}
+
+float TTStepperSCurveProfile::GetAcceleration(){
+    return acceleration;
+}
+
+float TTStepperSCurveProfile::GetJerk(){
+    return jerk;
+}
+
+float TTStepperSCurveProfile::RampTime(float deltaRate){
+    deltaRate = deltaRate < 0 ? -deltaRate : deltaRate;
+
+    //Peak acceleration of the curve is 1.5 dv / T, peak jerk is 6 dv / T^2.
+    float accelTime = (1.5f * deltaRate) / acceleration;
+    float jerkTime = sqrtf((6 * deltaRate) / jerk);
+
+    return accelTime > jerkTime ? accelTime : jerkTime;
+}
+
+float TTStepperSCurveProfile::RampSteps(float from, float to){
+    //The curve is symmetric so the average rate is the midpoint.
+    return ((from + to) / 2) * RampTime(to - from);
+}
+
+/**
+* @brief Convert a ramp duration into the scale used to find x = t / T in Q16.
+* @param seconds Ramp duration in seconds.
+* @returns 2^32 / duration in microseconds.
+*/
+static uint32_t RampScale(float seconds){
+    float micros = seconds * 1000000.0f;
+    if(micros < 2){
+        return UINT32_MAX;
+    }
+    return 4294967296.0f / micros;
+}
+
+/**
+* @brief Evaluate the smoothstep 3x^2 - 2x^3.
+* @param x Ramp position in Q16, 0 to 65536.
+* @returns Ramp fraction in Q16.
+*/
+static uint32_t SmoothStep(uint32_t x){
+    if(x >= 65536){
+        return 65536;
+    }
+
+    uint32_t xSquared = (x * x) >> 16;
+    return ((uint64_t)xSquared * ((3 * 65536) - (2 * x))) >> 16;
+}
+
+int TTStepperSCurveProfile::Plan(TTStepperSegment &segment){
+    if(acceleration <= 0 || jerk <= 0 || segment.cruiseRate <= 0){
+        return TTSTEPPER_PROFILE_INVALID;
+    }
+
+    float entry = segment.entryRate < segment.cruiseRate ? segment.entryRate : segment.cruiseRate;
+    float exit = segment.exitRate < segment.cruiseRate ? segment.exitRate : segment.cruiseRate;
+    float peak = segment.cruiseRate;
+
+    //Too short to reach cruise speed, search for the highest peak that fits.
+    if(RampSteps(entry, peak) + RampSteps(peak, exit) > segment.steps){
+        float low = entry > exit ? entry : exit;
+        float high = peak;
+
+        for(int i = 0; i < 24; i++){
+            float mid = (low + high) / 2;
+            if(RampSteps(entry, mid) + RampSteps(mid, exit) > segment.steps){
+                high = mid;
+            }
+            else{
+                low = mid;
+            }
+        }
+
+        peak = low;
+    }
+
+    float accelTime = RampTime(peak - entry);
+    float decelTime = RampTime(peak - exit);
+    float decelSteps = RampSteps(peak, exit);
+    decelSteps = decelSteps > segment.steps ? segment.steps : decelSteps;
+
+    float firstPeriod;
+    if(entry > 0){
+        firstPeriod = 1000000.0f / entry;
+    }
+    else{
+        //Starting from rest, find when the first step is reached. p(t) = dv T (x^3 - x^4 / 2).
+        float low = 0;
+        float high = 1;
+        for(int i = 0; i < 24; i++){
+            float x = (low + high) / 2;
+            if((peak * accelTime * ((x * x * x) - ((x * x * x * x) / 2))) > 1){
+                high = x;
+            }
+            else{
+                low = x;
+            }
+        }
+
+        firstPeriod = high * accelTime * 1000000.0f;
+    }
+
+    segment.step = 0;
+    segment.elapsed = 0;
+    segment.decelStep = segment.steps - (uint32_t)decelSteps;
+    segment.entryRateFixed = entry * (1 << TTSTEPPER_PROFILE_RATE_SHIFT);
+    segment.peakRateFixed = peak * (1 << TTSTEPPER_PROFILE_RATE_SHIFT);
+    segment.exitRateFixed = exit * (1 << TTSTEPPER_PROFILE_RATE_SHIFT);
+    segment.accelScale = RampScale(accelTime);
+    segment.decelScale = RampScale(decelTime);
+    segment.period = firstPeriod * (1 << TTSTEPPER_PROFILE_PERIOD_SHIFT);
+    segment.phase = segment.peakRateFixed > segment.entryRateFixed ? accelerating : cruising;
+
+    return TTSTEPPER_PROFILE_SUCCESS;
+}
+
+float TTStepperSCurveProfile::ReachableRate(float from, uint32_t steps){
+    if(acceleration <= 0 || jerk <= 0){
+        return from;
+    }
+
+    //Never better than constant acceleration at the acceleration limit.
+    float low = from;
+    float high = sqrtf((from * from) + (2 * acceleration * steps));
+
+    for(int i = 0; i < 24; i++){
+        float mid = (low + high) / 2;
+        if(RampSteps(from, mid) > steps){
+            high = mid;
+        }
+        else{
+            low = mid;
+        }
+    }
+
+    return low;
+}
+
+uint32_t TTStepperSCurveProfile::Next(TTStepperSegment &segment){
+    //The period to wait after the step that was just taken.
+    uint32_t period = segment.period >> TTSTEPPER_PROFILE_PERIOD_SHIFT;
+
+    segment.step++;
+    segment.elapsed += period;
+
+    if(segment.phase != decelerating && segment.step >= segment.decelStep){
+        segment.phase = decelerating;
+        segment.elapsed = 0;
+    }
+
+    int32_t rate;
+    switch(segment.phase){
+        case accelerating:{
+            uint32_t x = ((uint64_t)segment.elapsed * segment.accelScale) >> 16;
+            rate = segment.entryRateFixed + (int32_t)(((int64_t)(segment.peakRateFixed - segment.entryRateFixed) * SmoothStep(x)) >> 16);
+
+            if(x >= 65536){
+                segment.phase = cruising;
+            }
+            break;
+        }
+
+        case decelerating:{
+            uint32_t x = ((uint64_t)segment.elapsed * segment.decelScale) >> 16;
+            rate = segment.peakRateFixed - (int32_t)(((int64_t)(segment.peakRateFixed - segment.exitRateFixed) * SmoothStep(x)) >> 16);
+            break;
+        }
+
+        default:
+            rate = segment.peakRateFixed;
+            break;
+    }
+
+    //Never stall, 1 step/s is the slowest rate the period can hold.
+    if(rate < (1 << TTSTEPPER_PROFILE_RATE_SHIFT)){
+        rate = 1 << TTSTEPPER_PROFILE_RATE_SHIFT;
+    }
+
+    //1000000 us in the period and rate fixed point formats.
+    segment.period = (1000000u << (TTSTEPPER_PROFILE_PERIOD_SHIFT + TTSTEPPER_PROFILE_RATE_SHIFT)) / (uint32_t)rate;
+
+    return period;
+}
\ No newline at end of file
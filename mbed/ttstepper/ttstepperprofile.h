@@ -0,0 +1,224 @@
+/**
+*        _____ _____ ___ _                          
+*       |_   _|_   _/ __| |_ ___ _ __ _ __  ___ _ _ 
+*         | |   | | \__ \  _/ -_) '_ \ '_ \/ -_) '_|
+*         |_|   |_| |___/\__\___| .__/ .__/\___|_|  
+*                               |_|  |_|            
+*
+*
+* @file TTStepperProfile.h
+* @brief This file contains the definitions associated with the TTStepper motion profiles.
+*
+* A profile turns a move into a sequence of step periods. Plan() is called once per move from thread context
+* and may use float maths. Next() is called from the step ISR after every step and must stay integer only.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_STEPPER_PROFILE_H
+#define TT_STEPPER_PROFILE_H
+
+#define TTSTEPPER_PROFILE_SUCCESS 0
+#define TTSTEPPER_PROFILE_INVALID -8
+
+/** @brief Fraction bits used for fixed point step periods. */
+#define TTSTEPPER_PROFILE_PERIOD_SHIFT 8
+
+/** @brief Fraction bits used for fixed point step rates. */
+#define TTSTEPPER_PROFILE_RATE_SHIFT 4
+
+/** @brief Steps at each end of a trapezoidal ramp timed exactly rather than by the recurrence. */
+#define TTSTEPPER_PROFILE_EXACT_STEPS 32
+
+#include "mbed.h"
+#include <cstdint>
+
+/** @brief A single planned move and the working state a profile needs to step through it. */
+struct TTStepperSegment{
+    /** @brief Number of steps in the move. */
+    uint32_t steps = 0;
+
+    /** @brief Step rate at the start of the move (steps/s). */
+    float entryRate = 0.0f;
+
+    /** @brief Highest step rate allowed during the move (steps/s). */
+    float cruiseRate = 0.0f;
+
+    /** @brief Step rate at the end of the move (steps/s). */
+    float exitRate = 0.0f;
+
+    /** @brief Profile specific phase (accelerating, cruising etc.). */
+    uint8_t phase = 0;
+
+    /** @brief Steps taken so far. */
+    uint32_t step = 0;
+
+    /** @brief Step at which deceleration begins. */
+    uint32_t decelStep = 0;
+
+    /** @brief Current step period (us, fixed point with TTSTEPPER_PROFILE_PERIOD_SHIFT fraction bits). */
+    int32_t period = 0;
+
+    /** @brief Shortest step period allowed (us, fixed point). */
+    int32_t minPeriod = 0;
+
+    /** @brief Longest step period allowed while decelerating (us, fixed point). */
+    int32_t maxPeriod = 0;
+
+    /** @brief Ramp position used by the period recurrence, in quarter steps. */
+    int32_t n = 0;
+
+    /** @brief Remainder carried between recurrence divisions. */
+    int32_t rest = 0;
+
+    /** @brief Ramp position to load when deceleration begins, in quarter steps. */
+    int32_t decelN = 0;
+
+    /** @brief 1000000 * sqrt(2 / a), fixed point, for the exactly timed ramp steps. */
+    uint32_t exactScale = 0;
+
+    /** @brief Time spent in the current ramp (us). */
+    uint32_t elapsed = 0;
+
+    /** @brief Rate at the start of the move, the peak of the move and the end of the move (steps/s, fixed point). */
+    int32_t entryRateFixed = 0, peakRateFixed = 0, exitRateFixed = 0;
+
+    /** @brief 2^32 / ramp duration (us) for the acceleration and deceleration ramps. */
+    uint32_t accelScale = 0, decelScale = 0;
+};
+
+class TTStepperProfile{
+    public:
+        /**
+        * @brief Plan a move. Called from thread context before the first step.
+        * @param segment Segment with steps and rates filled in. The working state is written by the profile.
+        * @returns TTSTEPPER_PROFILE_SUCCESS or TTSTEPPER_PROFILE_INVALID.
+        */
+        virtual int Plan(TTStepperSegment &segment) = 0;
+
+        /**
+        * @brief Advance the segment by one step. Called from the step ISR.
+        * @param segment Segment previously planned by this profile.
+        * @returns The period to wait before the next step in microseconds.
+        */
+        virtual uint32_t Next(TTStepperSegment &segment) = 0;
+
+        /**
+        * @brief Get the highest rate this profile can reach from a starting rate within a number of steps.
+        * Used to plan junction rates between queued moves. Defaults to no speed gain.
+        * @param from Starting rate (steps/s).
+        * @param steps Steps available.
+        * @returns Highest reachable rate (steps/s).
+        */
+        virtual float ReachableRate(float from, uint32_t steps){
+            (void)steps;
+            return from;
+        }
+
+        virtual ~TTStepperProfile(){}
+};
+
+/**
+* @brief Constant acceleration profile using the integer period recurrence described by David Austin
+* (Generate stepper-motor speed profiles in real time, 2005) and Atmel AVR446.
+*/
+class TTStepperTrapezoidalProfile : public TTStepperProfile{
+    public:
+        /**
+        * @brief Create a constant acceleration profile.
+        * @param acceleration Acceleration and deceleration in steps/s^2.
+        */
+        TTStepperTrapezoidalProfile(float acceleration);
+
+        /**
+        * @brief Set the acceleration used by moves planned after this call.
+        * @param acceleration Acceleration and deceleration in steps/s^2.
+        * @returns TTSTEPPER_PROFILE_SUCCESS or TTSTEPPER_PROFILE_INVALID.
+        */
+        int SetAcceleration(float acceleration);
+
+        /** @brief Get the acceleration in steps/s^2. */
+        float GetAcceleration();
+
+        int Plan(TTStepperSegment &segment);
+
+        uint32_t Next(TTStepperSegment &segment);
+
+        float ReachableRate(float from, uint32_t steps);
+
+        enum phase{accelerating, cruising, decelerating};
+
+    private:
+        /** @brief Acceleration and deceleration (steps/s^2). */
+        float acceleration;
+};
+
+/**
+* @brief Jerk limited S-curve profile. Each ramp follows v(t) = u + (v - u)(3x^2 - 2x^3) with x = t / T, which keeps
+* acceleration continuous so the corners of the trapezoid are rounded off. T is chosen from the acceleration and jerk
+* limits in Plan(), the ISR only evaluates the polynomial with integer multiplies.
+*/
+class TTStepperSCurveProfile : public TTStepperProfile{
+    public:
+        /**
+        * @brief Create a jerk limited profile.
+        * @param acceleration Maximum acceleration and deceleration in steps/s^2.
+        * @param jerk Maximum jerk in steps/s^3.
+        */
+        TTStepperSCurveProfile(float acceleration, float jerk);
+
+        /**
+        * @brief Set the maximum acceleration used by moves planned after this call.
+        * @param acceleration Maximum acceleration and deceleration in steps/s^2.
+        * @returns TTSTEPPER_PROFILE_SUCCESS or TTSTEPPER_PROFILE_INVALID.
+        */
+        int SetAcceleration(float acceleration);
+
+        /**
+        * @brief Set the maximum jerk used by moves planned after this call.
+        * @param jerk Maximum jerk in steps/s^3.
+        * @returns TTSTEPPER_PROFILE_SUCCESS or TTSTEPPER_PROFILE_INVALID.
+        */
+        int SetJerk(float jerk);
+
+        /** @brief Get the maximum acceleration in steps/s^2. */
+        float GetAcceleration();
+
+        /** @brief Get the maximum jerk in steps/s^3. */
+        float GetJerk();
+
+        int Plan(TTStepperSegment &segment);
+
+        uint32_t Next(TTStepperSegment &segment);
+
+        float ReachableRate(float from, uint32_t steps);
+
+        enum phase{accelerating, cruising, decelerating};
+
+    private:
+        /** @brief Maximum acceleration and deceleration (steps/s^2). */
+        float acceleration;
+
+        /** @brief Maximum jerk (steps/s^3). */
+        float jerk;
+
+        /**
+        * @brief Get the shortest ramp duration that respects the acceleration and jerk limits.
+        * @param deltaRate Rate change over the ramp (steps/s).
+        * @returns Ramp duration in seconds.
+        */
+        float RampTime(float deltaRate);
+
+        /**
+        * @brief Get the number of steps a ramp covers.
+        * @param from Rate at the start of the ramp (steps/s).
+        * @param to Rate at the end of the ramp (steps/s).
+        * @returns Ramp length in steps.
+        */
+        float RampSteps(float from, float to);
+};
+
+#endif
@@ -0,0 +1,418 @@
+/**
+*        _____ _____ ___ _                          
+*       |_   _|_   _/ __| |_ ___ _ __ _ __  ___ _ _ 
+*         | |   | | \__ \  _/ -_) '_ \ '_ \/ -_) '_|
+*         |_|   |_| |___/\__\___| .__/ .__/\___|_|  
+*                               |_|  |_|            
+*
+*
+* @file TTStepperTimer.cpp
+* @brief This file contains the functions associated with the TTStepper hardware timer backend.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "ttsteppertimer.h"
+
+#if TTSTEPPER_TIMER_SUPPORTED
+#include "pinmap.h"
+#include "PeripheralPins.h"
+#include "us_ticker_data.h"
+
+TTStepperTimer *TTStepperTimer::owners[16] = {0};
+
+/** @brief DMA request routing for a timer update event (RM0090 / RM0385 DMA request mapping). */
+struct TTStepperTimerRoute{
+    TIM_TypeDef *tim;
+    IRQn_Type timIrq;
+    DMA_Stream_TypeDef *stream;
+    IRQn_Type streamIrq;
+    uint8_t streamIndex;
+    uint32_t channel;
+    uint32_t streamVector;
+    uint32_t updateVector;
+};
+
+#define TTSTEPPER_TIMER_ROUTE(TIMER, TIMER_IRQ, STREAM, STREAM_IRQ, INDEX, CHANNEL) \
+    {TIMER, TIMER_IRQ, STREAM, STREAM_IRQ, INDEX, CHANNEL, (uint32_t)&TTStepperTimer::StreamISR<INDEX>, (uint32_t)&TTStepperTimer::UpdateISR<INDEX>}
+#endif
+
+TTStepperTimer::TTStepperTimer(PinName step, bool activeLow)
+#if TTSTEPPER_TIMER_SUPPORTED
+    : pwm(step)
+#endif
+{
+#if TTSTEPPER_TIMER_SUPPORTED
+    const TTStepperTimerRoute routes[] = {
+    #if defined(TIM1)
+        TTSTEPPER_TIMER_ROUTE(TIM1, TIM1_UP_TIM10_IRQn, DMA2_Stream5, DMA2_Stream5_IRQn, 13, 6),
+    #endif
+    #if defined(TIM2)
+        TTSTEPPER_TIMER_ROUTE(TIM2, TIM2_IRQn, DMA1_Stream1, DMA1_Stream1_IRQn, 1, 3),
+    #endif
+    #if defined(TIM3)
+        TTSTEPPER_TIMER_ROUTE(TIM3, TIM3_IRQn, DMA1_Stream2, DMA1_Stream2_IRQn, 2, 5),
+    #endif
+    #if defined(TIM4)
+        TTSTEPPER_TIMER_ROUTE(TIM4, TIM4_IRQn, DMA1_Stream6, DMA1_Stream6_IRQn, 6, 2),
+    #endif
+    #if defined(TIM5)
+        TTSTEPPER_TIMER_ROUTE(TIM5, TIM5_IRQn, DMA1_Stream0, DMA1_Stream0_IRQn, 0, 6),
+    #endif
+    #if defined(TIM8)
+        TTSTEPPER_TIMER_ROUTE(TIM8, TIM8_UP_TIM13_IRQn, DMA2_Stream1, DMA2_Stream1_IRQn, 9, 7),
+    #endif
+    };
+
+    TIM_TypeDef *pinTim = (TIM_TypeDef *)pinmap_peripheral(step, PinMap_PWM);
+    uint32_t function = pinmap_function(step, PinMap_PWM);
+    uint8_t channel = STM_PIN_CHANNEL(function);
+    bool inverted = STM_PIN_INVERTED(function);
+
+    const TTStepperTimerRoute *route = 0;
+    for(uint32_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++){
+        if(routes[i].tim == pinTim){
+            route = &routes[i];
+        }
+    }
+
+    //Leave tim unset if the pin can't be used, IsSupported() will report it.
+    if(route == 0 || channel < 1 || channel > 4 || owners[route->streamIndex] != 0){
+        return;
+    }
+
+#if defined(TIM_MST)
+    if(pinTim == TIM_MST){
+        return;
+    }
+#endif
+
+    tim = pinTim;
+    timIrq = route->timIrq;
+    stream = route->stream;
+    streamIrq = route->streamIrq;
+    updateVector = route->updateVector;
+    streamIndex = route->streamIndex;
+    streamChannel = route->channel;
+    owners[streamIndex] = this;
+
+    //Let mbed route the pin and start the timer, then take over the registers.
+    pwm.period_us(1000);
+    pwm.pulsewidth_us(TTSTEPPER_TIMER_PULSE_WIDTH);
+
+    tim->CR1 &= ~TIM_CR1_CEN;
+    tim->DIER &= ~(TIM_DIER_UDE | TIM_DIER_UIE);
+
+    ccr = &tim->CCR1 + (channel - 1);
+    ccmr = channel <= 2 ? &tim->CCMR1 : &tim->CCMR2;
+    ccmrShift = ((channel - 1) % 2) * 8;
+
+    //Hold the output inactive until a move starts.
+    *ccmr = (*ccmr & ~(0x7 << (ccmrShift + 4))) | (0x4 << (ccmrShift + 4));
+
+    //Active low pulses swap the output polarity.
+    uint32_t polarityBit = 1 << ((4 * (channel - 1)) + (inverted ? 3 : 1));
+    if(activeLow){
+        tim->CCER |= polarityBit;
+    }
+    else{
+        tim->CCER &= ~polarityBit;
+    }
+
+    //1us timer ticks, applied by Start(). Timers on a divided APB run at twice the bus clock.
+    uint32_t timerClock;
+    if(tim == TIM1 
+    #if defined(TIM8)
+        || tim == TIM8
+    #endif
+    ){
+        timerClock = HAL_RCC_GetPCLK2Freq();
+        timerClock *= (RCC->CFGR & RCC_CFGR_PPRE2) == RCC_CFGR_PPRE2_DIV1 ? 1 : 2;
+    }
+    else{
+        timerClock = HAL_RCC_GetPCLK1Freq();
+        timerClock *= (RCC->CFGR & RCC_CFGR_PPRE1) == RCC_CFGR_PPRE1_DIV1 ? 1 : 2;
+    }
+    prescaler = (timerClock / 1000000) - 1;
+
+    if(streamIndex < 8){
+        __HAL_RCC_DMA1_CLK_ENABLE();
+    }
+    else{
+        __HAL_RCC_DMA2_CLK_ENABLE();
+    }
+
+    stream->CR &= ~DMA_SxCR_EN;
+    while(stream->CR & DMA_SxCR_EN){}
+
+    //Memory to timer ARR, 32 bit words, one word per update request.
+    stream->CR = (streamChannel << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 | DMA_SxCR_MINC |
+                 DMA_SxCR_DIR_0 | DMA_SxCR_PL_1 | DMA_SxCR_TCIE;
+    stream->PAR = (uint32_t)&tim->ARR;
+    ClearStreamFlags();
+
+    NVIC_SetVector(streamIrq, route->streamVector);
+    NVIC_EnableIRQ(streamIrq);
+#else
+    (void)step;
+    (void)activeLow;
+#endif
+}
+
+bool TTStepperTimer::IsSupported(){
+#if TTSTEPPER_TIMER_SUPPORTED
+    return tim != 0;
+#else
+    return false;
+#endif
+}
+
+bool TTStepperTimer::IsRunning(){
+    return running;
+}
+
+int TTStepperTimer::Start(Callback<uint32_t()> next, Callback<void()> done){
+    if(!IsSupported()){
+        return TTSTEPPER_TIMER_UNSUPPORTED;
+    }
+
+    if(running){
+        return TTSTEPPER_TIMER_BUSY;
+    }
+
+#if TTSTEPPER_TIMER_SUPPORTED
+    //Refuse before taking any periods, so a refused move hasn't stepped.
+    if((tim->CR1 & TIM_CR1_CEN) && tim->PSC != prescaler){
+        return TTSTEPPER_TIMER_CLAIMED;
+    }
+#endif
+
+    this->next = next;
+    this->done = done;
+    finished = false;
+    endQueued = false;
+    computed = 0;
+    transfers = 0;
+    count[0] = count[1] = 0;
+    hasEnd[0] = hasEnd[1] = false;
+
+    uint32_t first = next();
+    if(first == 0){
+        done();
+        return TTSTEPPER_TIMER_SUCCESS;
+    }
+    computed++;
+
+    uint32_t second = next();
+    if(second == 0){
+        finished = true;
+    }
+    else{
+        computed++;
+    }
+
+#if TTSTEPPER_TIMER_SUPPORTED
+    tim->CR1 &= ~(TIM_CR1_CEN | TIM_CR1_OPM);
+    tim->DIER &= ~(TIM_DIER_UDE | TIM_DIER_UIE);
+    tim->CR1 |= TIM_CR1_ARPE;
+    tim->PSC = prescaler;
+
+    //Claim the update vector for this move.
+    previousVector = NVIC_GetVector(timIrq);
+    previousEnabled = NVIC_GetEnableIRQ(timIrq) != 0;
+    NVIC_SetVector(timIrq, updateVector);
+    NVIC_EnableIRQ(timIrq);
+
+    //PWM mode 1 with preload, the pulse is at the start of every period.
+    *ccmr = (*ccmr & ~(0x7 << (ccmrShift + 4))) | (0x6 << (ccmrShift + 4)) | (1 << (ccmrShift + 3));
+
+    //Load the first period straight into the shadow registers.
+    tim->CNT = 0;
+    tim->ARR = Reload(first);
+    *ccr = TTSTEPPER_TIMER_PULSE_WIDTH;
+    tim->EGR = TIM_EGR_UG;
+    tim->SR = ~TIM_SR_UIF;
+
+    running = true;
+    stopping = false;
+
+    if(second == 0){
+        //Single step, remove the pulse and stop the counter at the first update.
+        stopping = true;
+        *ccr = 0;
+        tim->CR1 |= TIM_CR1_OPM;
+        tim->DIER |= TIM_DIER_UIE;
+    }
+    else{
+        //The second period waits in the preload register, DMA supplies the rest.
+        tim->ARR = Reload(second);
+        Fill(0);
+        Fill(1);
+        active = 0;
+        Transfer(0);
+        tim->DIER |= TIM_DIER_UDE;
+    }
+
+    tim->CR1 |= TIM_CR1_CEN;
+#endif
+
+    return TTSTEPPER_TIMER_SUCCESS;
+}
+
+uint32_t TTStepperTimer::Stop(){
+    if(!running){
+        return 0;
+    }
+
+    uint32_t emitted = 0;
+
+    core_util_critical_section_enter();
+
+#if TTSTEPPER_TIMER_SUPPORTED
+    tim->CR1 &= ~TIM_CR1_CEN;
+    tim->DIER &= ~(TIM_DIER_UDE | TIM_DIER_UIE);
+    *ccmr = (*ccmr & ~(0x7 << (ccmrShift + 4))) | (0x4 << (ccmrShift + 4));
+
+    uint32_t pending = stream->NDTR;
+    stream->CR &= ~DMA_SxCR_EN;
+    ClearStreamFlags();
+    ReleaseUpdateVector();
+
+    //The first step plus one step for every update, each update also triggers one transfer.
+    emitted = 1 + transfers;
+    if(!stopping){
+        emitted += count[active] - pending;
+    }
+#endif
+
+    running = false;
+
+    core_util_critical_section_exit();
+
+    return computed > emitted ? computed - emitted : 0;
+}
+
+void TTStepperTimer::Fill(uint8_t index){
+    uint32_t n = 0;
+    hasEnd[index] = false;
+
+    while(n < TTSTEPPER_TIMER_CHUNK_LENGTH && !endQueued){
+        uint32_t period = finished ? 0 : next();
+
+        if(period == 0){
+            //Placeholder for the update that starts the final step. Its transfer completing triggers the stop.
+            finished = true;
+            endQueued = true;
+            hasEnd[index] = true;
+            buffer[index][n++] = Reload(TTSTEPPER_TIMER_PULSE_WIDTH * 2);
+        }
+        else{
+            computed++;
+            buffer[index][n++] = Reload(period);
+        }
+    }
+
+    count[index] = n;
+}
+
+uint32_t TTStepperTimer::Reload(uint32_t period){
+    //Leave room for the pulse itself.
+    if(period <= TTSTEPPER_TIMER_PULSE_WIDTH){
+        period = TTSTEPPER_TIMER_PULSE_WIDTH + 1;
+    }
+
+#if TTSTEPPER_TIMER_SUPPORTED
+    if(tim != TIM2 && tim != TIM5 && period > 0x10000){
+        period = 0x10000;
+    }
+#endif
+
+    return period - 1;
+}
+
+#if TTSTEPPER_TIMER_SUPPORTED
+void TTStepperTimer::Transfer(uint8_t index){
+    stream->CR &= ~DMA_SxCR_EN;
+    while(stream->CR & DMA_SxCR_EN){}
+
+    ClearStreamFlags();
+    stream->M0AR = (uint32_t)buffer[index];
+    stream->NDTR = count[index];
+    stream->CR |= DMA_SxCR_EN;
+}
+
+void TTStepperTimer::ClearStreamFlags(){
+    const uint8_t offsets[4] = {0, 6, 16, 22};
+    DMA_TypeDef *dma = streamIndex < 8 ? DMA1 : DMA2;
+    uint8_t index = streamIndex % 8;
+
+    if(index < 4){
+        dma->LIFCR = 0x3DUL << offsets[index];
+    }
+    else{
+        dma->HIFCR = 0x3DUL << offsets[index - 4];
+    }
+}
+
+void TTStepperTimer::StreamHandler(){
+    ClearStreamFlags();
+
+    uint8_t completed = active;
+    transfers += count[completed];
+
+    if(hasEnd[completed]){
+        //The final step has just started. Drop the pulse and stop the counter at the next update.
+        stopping = true;
+        tim->DIER &= ~TIM_DIER_UDE;
+        *ccr = 0;
+        tim->CR1 |= TIM_CR1_OPM;
+        tim->SR = ~TIM_SR_UIF;
+        tim->DIER |= TIM_DIER_UIE;
+        return;
+    }
+
+    //Keep the DMA fed first, the next update is at most one period away.
+    active = !completed;
+    Transfer(active);
+    Fill(completed);
+}
+
+void TTStepperTimer::UpdateHandler(){
+    tim->SR = ~TIM_SR_UIF;
+
+    if(!(tim->DIER & TIM_DIER_UIE)){
+        return;
+    }
+
+    tim->DIER &= ~TIM_DIER_UIE;
+    *ccmr = (*ccmr & ~(0x7 << (ccmrShift + 4))) | (0x4 << (ccmrShift + 4));
+    running = false;
+    ReleaseUpdateVector();
+
+    if(done){
+        done();
+    }
+}
+
+void TTStepperTimer::ReleaseUpdateVector(){
+    if(!previousEnabled){
+        NVIC_DisableIRQ(timIrq);
+    }
+    NVIC_SetVector(timIrq, previousVector);
+    previousEnabled = false;
+}
+#endif
+
+TTStepperTimer::~TTStepperTimer(){
+    Stop();
+
+#if TTSTEPPER_TIMER_SUPPORTED
+    if(tim != 0){
+        NVIC_DisableIRQ(streamIrq);
+        owners[streamIndex] = 0;
+    }
+#endif
+}
@@ -0,0 +1,231 @@
+/**
+*        _____ _____ ___ _                          
+*       |_   _|_   _/ __| |_ ___ _ __ _ __  ___ _ _ 
+*         | |   | | \__ \  _/ -_) '_ \ '_ \/ -_) '_|
+*         |_|   |_| |___/\__\___| .__/ .__/\___|_|  
+*                               |_|  |_|            
+*
+*
+* @file TTStepperTimer.h
+* @brief This file contains the definitions associated with the TTStepper hardware timer backend.
+*
+* Step pulses are produced by a timer PWM channel on the step pin. Each timer update event starts a new period and
+* a DMA transfer loads the following period into the preloaded auto-reload register. The CPU is only interrupted
+* once per TTSTEPPER_TIMER_CHUNK_LENGTH steps to refill the period buffers.
+*
+* Supported on STM32F2, STM32F4 and STM32F7 targets for TIM1, TIM2, TIM3, TIM4, TIM5 and TIM8 step pins that
+* are not used by the us ticker. Timer ticks are 1us so 16 bit timers limit the longest period to 65535us.
+*
+* The backend owns the whole timer, not just the step channel. Start() sets the prescaler, counter and auto-reload
+* register for every channel, so don't share the timer with other PwmOut pins. A timer that is already running
+* with a different prescaler is refused with TTSTEPPER_TIMER_CLAIMED rather than retimed.
+*
+* The timer update vector is only claimed while steps are being generated. Start() installs it with
+* NVIC_SetVector() and the end of the move restores the previous vector. TIM1 and TIM8 share their update vectors
+* with TIM10 and TIM13 (TIM1_UP_TIM10, TIM8_UP_TIM13), so the previous handler is still called while the move runs.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_STEPPER_TIMER_H
+#define TT_STEPPER_TIMER_H
+
+#include "mbed.h"
+#include <cstdint>
+
+#if defined(TARGET_STM32F2) || defined(TARGET_STM32F4) || defined(TARGET_STM32F7)
+    #define TTSTEPPER_TIMER_SUPPORTED 1
+#else
+    #define TTSTEPPER_TIMER_SUPPORTED 0
+#endif
+
+/** @brief Number of periods in each DMA buffer. */
+#define TTSTEPPER_TIMER_CHUNK_LENGTH 32
+
+/** @brief Width of each step pulse in microseconds. */
+#define TTSTEPPER_TIMER_PULSE_WIDTH 2
+
+#define TTSTEPPER_TIMER_SUCCESS 0
+#define TTSTEPPER_TIMER_UNSUPPORTED -9
+#define TTSTEPPER_TIMER_BUSY -10
+#define TTSTEPPER_TIMER_CLAIMED -20
+
+class TTStepperTimer{
+    public:
+        /**
+        * @brief Create a hardware step generator.
+        * @param step Step pin. Must be a PWM pin on a supported timer.
+        * @param activeLow Is the step pulse active low?
+        */
+        TTStepperTimer(PinName step, bool activeLow);
+
+        /**
+        * @brief Can this pin generate steps from hardware?
+        * @returns Is the backend usable?
+        */
+        bool IsSupported();
+
+        /**
+        * @brief Start generating steps. The first step is taken immediately.
+        * @param next Called once per step to get the period (us) to wait after that step, 0 when there are no more steps.
+        * Called from thread context for the first periods then from the DMA ISR.
+        * @param done Called from ISR context once the last step period has elapsed.
+        * @returns TTSTEPPER_TIMER_SUCCESS or a negative error code.
+        * @retval TTSTEPPER_TIMER_UNSUPPORTED This pin can not generate steps from hardware.
+        * @retval TTSTEPPER_TIMER_BUSY Steps are already being generated.
+        * @retval TTSTEPPER_TIMER_CLAIMED Something else is running the timer with a different prescaler.
+        */
+        int Start(Callback<uint32_t()> next, Callback<void()> done);
+
+        /**
+        * @brief Stop generating steps immediately.
+        * @returns The number of periods returned by next that were never stepped.
+        */
+        uint32_t Stop();
+
+        /** @brief Is the timer currently generating steps? */
+        bool IsRunning();
+
+        ~TTStepperTimer();
+
+    private:
+        /** @brief Period source for the running move. */
+        Callback<uint32_t()> next;
+
+        /** @brief Move finished notification. */
+        Callback<void()> done;
+
+        /** @brief Is the timer currently generating steps? */
+        volatile bool running = false;
+
+        /** @brief Period buffers, one is transferred while the other is refilled. */
+        uint32_t buffer[2][TTSTEPPER_TIMER_CHUNK_LENGTH];
+
+        /** @brief Number of periods in each buffer. */
+        uint32_t count[2] = {0};
+
+        /** @brief Does the buffer hold the end of the move? */
+        bool hasEnd[2] = {false};
+
+        /** @brief Buffer currently being transferred. */
+        uint8_t active = 0;
+
+        /** @brief Has next reported the end of the move? */
+        bool finished = false;
+
+        /** @brief Has the end of the move been written to a buffer? */
+        bool endQueued = false;
+
+        /** @brief Has the final step started? */
+        volatile bool stopping = false;
+
+        /** @brief Number of non zero periods returned by next. */
+        volatile uint32_t computed = 0;
+
+        /** @brief Number of DMA transfers already completed. */
+        volatile uint32_t transfers = 0;
+
+        /**
+        * @brief Fill a buffer with the next periods.
+        * @param index Buffer to fill.
+        */
+        void Fill(uint8_t index);
+
+        /**
+        * @brief Convert a period into an auto-reload value.
+        * @param period Period in microseconds.
+        * @returns Auto-reload register value.
+        */
+        uint32_t Reload(uint32_t period);
+
+#if TTSTEPPER_TIMER_SUPPORTED
+    public:
+        /** @brief Vector for each DMA stream. */
+        template<int index> static void StreamISR(){
+            if(owners[index] != 0){
+                owners[index]->StreamHandler();
+            }
+        }
+
+        /** @brief Vector for each timer update interrupt, indexed the same as owners. */
+        template<int index> static void UpdateISR(){
+            if(owners[index] != 0){
+                TTStepperTimer *owner = owners[index];
+                uint32_t chained = owner->previousEnabled ? owner->previousVector : 0;
+
+                owner->UpdateHandler();
+
+                //Shared vectors still serve the other timer.
+                if(chained != 0){
+                    ((void (*)())chained)();
+                }
+            }
+        }
+
+    private:
+        /** @brief Configures the pin and timer base. */
+        PwmOut pwm;
+
+        /** @brief Step timer. */
+        TIM_TypeDef *tim = 0;
+
+        /** @brief Timer update interrupt. */
+        IRQn_Type timIrq;
+
+        /** @brief Vector installed for the timer update interrupt while running. */
+        uint32_t updateVector = 0;
+
+        /** @brief Timer update vector in place before Start(). */
+        uint32_t previousVector = 0;
+
+        /** @brief Was the timer update interrupt enabled before Start()? */
+        bool previousEnabled = false;
+
+        /** @brief Prescaler for 1us timer ticks. */
+        uint32_t prescaler = 0;
+
+        /** @brief Timer capture compare register for the step channel. */
+        volatile uint32_t *ccr = 0;
+
+        /** @brief Timer capture compare mode register for the step channel. */
+        volatile uint32_t *ccmr = 0;
+
+        /** @brief Bit offset of the step channel within ccmr. */
+        uint8_t ccmrShift = 0;
+
+        /** @brief DMA stream driven by the timer update request. */
+        DMA_Stream_TypeDef *stream = 0;
+
+        /** @brief DMA stream interrupt. */
+        IRQn_Type streamIrq;
+
+        /** @brief Index of the stream in owners, 0 - 7 DMA1, 8 - 15 DMA2. */
+        uint8_t streamIndex = 0;
+
+        /** @brief DMA request channel for the timer update. */
+        uint32_t streamChannel = 0;
+
+        /** @brief Start a DMA transfer from a buffer. */
+        void Transfer(uint8_t index);
+
+        /** @brief Clear all DMA interrupt flags for the stream. */
+        void ClearStreamFlags();
+
+        /** @brief Refill buffers and stop at the end of the move. */
+        void StreamHandler();
+
+        /** @brief Report the end of the move once the last period has elapsed. */
+        void UpdateHandler();
+
+        /** @brief Hand the timer update vector back to its previous handler. */
+        void ReleaseUpdateVector();
+
+        /** @brief Instance using each DMA stream. */
+        static TTStepperTimer *owners[16];
+#endif
+};
+
+#endif
@@ -0,0 +1,145 @@
+/**
+*     _____ _____ _____
+*    |_   _|_   _|_   _| _ __ _ __ ___
+*      | |   | |   | || '_/ _` / _/ -_)
+*      |_|   |_|   |_||_| \__,_\__\___|
+*
+*
+* @file TTTrace.cpp
+* @brief This file contains the functions associated with TTTrace.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#include "tttrace.h"
+
+#if TTLIBS_TRACE
+#include "us_ticker_api.h"
+
+static_assert((TTTRACE_LENGTH & (TTTRACE_LENGTH - 1)) == 0, "TTTRACE_LENGTH must be a power of 2");
+
+volatile TTTraceRecord TTTrace::records[TTTRACE_LENGTH];
+volatile uint32_t TTTrace::head = 0;
+uint32_t TTTrace::drained = 0;
+FileHandle *TTTrace::drainOut = 0;
+std::chrono::milliseconds TTTrace::drainPeriod{0};
+Mutex TTTrace::drainMutex;
+EventFlags TTTrace::drainEvents;
+bool TTTrace::drainStarted = false;
+uint64_t TTTrace::drainStack[TTTRACE_DRAIN_STACK_SIZE / sizeof(uint64_t)];
+Thread TTTrace::drainThread{TTTRACE_DRAIN_PRIORITY, TTTRACE_DRAIN_STACK_SIZE, (unsigned char *)TTTrace::drainStack, "tttrace"};
+
+void TTTrace::Record(uint8_t tag, uint8_t source, uint16_t data){
+    //Claiming the slot is the only atomic, a higher priority ISR simply takes the next one.
+    uint32_t sequence = core_util_atomic_incr_u32(&head, 1) - 1;
+    volatile TTTraceRecord &record = records[sequence & (TTTRACE_LENGTH - 1)];
+
+    //Mark the slot incomplete first, so a drain that was reading its previous contents sees the change.
+    record.sequence = sequence - 1;
+    record.time = us_ticker_read();
+    record.tag = tag;
+    record.source = source;
+    record.data = data;
+    record.sequence = sequence;
+}
+
+uint32_t TTTrace::Drain(FileHandle *out){
+    //Written in small batches so the stack use stays fixed.
+    TTTraceRecord batch[16];
+    uint32_t batched = 0;
+    uint32_t written = 0;
+    uint32_t lost = 0;
+
+    uint32_t end = core_util_atomic_load_u32(&head);
+    if(end - drained > TTTRACE_LENGTH){
+        lost += end - drained - TTTRACE_LENGTH;
+        drained = end - TTTRACE_LENGTH;
+    }
+
+    while(drained != end){
+        volatile TTTraceRecord &record = records[drained & (TTTRACE_LENGTH - 1)];
+
+        uint32_t before = record.sequence;
+        if((int32_t)(before - drained) < 0){
+            //Claimed but not written yet, pick it up next time.
+            break;
+        }
+
+        TTTraceRecord &copy = batch[batched];
+        copy.sequence = drained;
+        copy.time = record.time;
+        copy.tag = record.tag;
+        copy.source = record.source;
+        copy.data = record.data;
+        drained++;
+
+        //Overwritten before or during the copy.
+        if(before != copy.sequence || record.sequence != copy.sequence){
+            lost++;
+            continue;
+        }
+        batched++;
+
+        if(batched == sizeof(batch) / sizeof(batch[0]) - 1){
+            out->write(batch, batched * sizeof(batch[0]));
+            written += batched;
+            batched = 0;
+        }
+    }
+
+    //The last slot is always free for the lost record.
+    if(lost){
+        batch[batched++] = {drained, us_ticker_read(), TT_TRACE_LOST, 0, (uint16_t)(lost > 0xFFFF ? 0xFFFF : lost)};
+    }
+
+    if(batched){
+        out->write(batch, batched * sizeof(batch[0]));
+        written += batched;
+    }
+
+    return written;
+}
+
+bool TTTrace::StartDrain(FileHandle *out, std::chrono::milliseconds period){
+    drainMutex.lock();
+    drainOut = out;
+    drainPeriod = period;
+    if(!drainStarted){
+        drainStarted = drainThread.start(callback(&TTTrace::DrainLoop)) == osOK;
+    }
+    bool started = drainStarted;
+    drainMutex.unlock();
+
+    drainEvents.set(TTTRACE_FLAG_WAKE);
+    return started;
+}
+
+void TTTrace::StopDrain(){
+    drainMutex.lock();
+    drainOut = 0;
+    drainMutex.unlock();
+}
+
+void TTTrace::DrainLoop(){
+    while(true){
+        drainMutex.lock();
+        FileHandle *out = drainOut;
+        std::chrono::milliseconds period = drainPeriod;
+        if(out != 0){
+            Drain(out);
+        }
+        drainMutex.unlock();
+
+        //Sleep until started again when stopped.
+        if(out != 0){
+            drainEvents.wait_any_for(TTTRACE_FLAG_WAKE, period);
+        }
+        else{
+            drainEvents.wait_any(TTTRACE_FLAG_WAKE);
+        }
+    }
+}
+#endif
@@ -0,0 +1,165 @@
+/**
+*     _____ _____ _____
+*    |_   _|_   _|_   _| _ __ _ __ ___
+*      | |   | |   | || '_/ _` / _/ -_)
+*      |_|   |_|   |_||_| \__,_\__\___|
+*
+*
+* @file TTTrace.h
+* @brief This file contains TTTrace, a fixed size binary trace of driver events.
+*
+* Define TTLIBS_TRACE as 1 to record steps, ramp phase changes, endstops, encoder edges and DFPlayer frames into an
+* in RAM ring. Appending is a handful of stores, safe from any ISR, and the oldest records are overwritten when it is
+* full. StartDrain() writes the raw records to a FileHandle (a BufferedSerial or SerialWireOutput) from a low priority
+* thread of its own, so writes that block on the UART don't hold up the TTScheduler deferred callbacks. With the flag at
+* 0 TT_TRACE compiles to nothing.
+*
+* @author Ted Tooth
+* @date 07 June 2021
+*
+* @copyright Ted Tooth 2021
+*/
+
+#ifndef TT_TRACE_H
+#define TT_TRACE_H
+
+#ifndef TTLIBS_TRACE
+    #define TTLIBS_TRACE 0
+#endif
+
+/** @brief Records held before the oldest is overwritten, must be a power of 2. */
+#ifndef TTTRACE_LENGTH
+    #define TTTRACE_LENGTH 256
+#endif
+
+/** @brief Priority of the thread StartDrain() writes from, below the drivers so tracing never delays them. */
+#ifndef TTTRACE_DRAIN_PRIORITY
+    #define TTTRACE_DRAIN_PRIORITY osPriorityLow
+#endif
+
+/** @brief Stack of the drain thread (bytes). */
+#ifndef TTTRACE_DRAIN_STACK_SIZE
+    #define TTTRACE_DRAIN_STACK_SIZE 1024
+#endif
+
+/** @brief Wakes the drain thread when draining starts or stops. */
+#define TTTRACE_FLAG_WAKE (1UL << 0)
+
+/** @brief Record tags, what data holds is listed with each. */
+enum ttTraceTag{
+    TT_TRACE_LOST = 0,              // data = records overwritten or torn before they were drained
+    TT_TRACE_STEP,                  // data = low 16 bits of the step count after the step
+    TT_TRACE_RAMP_PHASE,            // data = 0 accelerating, 1 cruising, 2 decelerating
+    TT_TRACE_ENDSTOP_HIT,           // data = endstop id
+    TT_TRACE_ENDSTOP_RELEASE,       // data = endstop id
+    TT_TRACE_HOMING,                // data = 0 started, 1 approaching, 2 backing off, 3 homed, 4 slow re-approach (FastHome)
+    TT_TRACE_ENCODER_EDGE,          // data = low 16 bits of the net count
+    TT_TRACE_DFPLAYER_TX,           // source = command, data = argument
+    TT_TRACE_DFPLAYER_RX            // source = command, data = parameter
+};
+
+#if TTLIBS_TRACE
+    /** @brief Append a record. */
+    #define TT_TRACE(tag, source, data) TTTrace::Record((tag), (source), (data))
+#else
+    #define TT_TRACE(tag, source, data)
+#endif
+
+#if TTLIBS_TRACE
+#include "mbed.h"
+#include <cstdint>
+
+/** @brief One record as stored and as written out, 12 bytes little endian. */
+struct TTTraceRecord{
+    /** @brief Position in the trace, also marks whether the slot has been completely written. */
+    uint32_t sequence;
+
+    /** @brief us_ticker time in microseconds. */
+    uint32_t time;
+
+    /** @brief ttTraceTag. */
+    uint8_t tag;
+
+    /** @brief Which driver instance, see ttTraceSource(). */
+    uint8_t source;
+
+    /** @brief Tag specific value. */
+    uint16_t data;
+};
+
+/**
+* @brief Make a source id for a driver instance. Different instances may share an id, it is only a hint.
+* @param object The driver.
+* @returns 8 bit id.
+*/
+inline uint8_t ttTraceSource(const void *object){
+    return (uint8_t)((uintptr_t)object >> 2);
+}
+
+class TTTrace{
+    public:
+        /**
+        * @brief Append a record, overwriting the oldest when full. Safe to call from any context.
+        * @param tag ttTraceTag.
+        * @param source Driver instance id.
+        * @param data Tag specific value.
+        */
+        static void Record(uint8_t tag, uint8_t source, uint16_t data);
+
+        /**
+        * @brief Write every complete record not yet drained. Records lost since the last drain are reported with a
+        * TT_TRACE_LOST record. Call from one thread only.
+        * @param out Where to write, e.g. a BufferedSerial or SerialWireOutput.
+        * @returns Records written.
+        */
+        static uint32_t Drain(FileHandle *out);
+
+        /**
+        * @brief Drain to out periodically from the drain thread, started the first time this is called. Don't call
+        * Drain() from other threads while it runs.
+        * @param out Where to write.
+        * @param period Time between drains.
+        * @returns true if started.
+        */
+        static bool StartDrain(FileHandle *out, std::chrono::milliseconds period);
+
+        /** @brief Stop draining started with StartDrain(). Waits for a drain in progress, out is unused once it returns. */
+        static void StopDrain();
+
+    private:
+        /** @brief The ring. */
+        static volatile TTTraceRecord records[TTTRACE_LENGTH];
+
+        /** @brief Sequence number of the next record to write. */
+        static volatile uint32_t head;
+
+        /** @brief Sequence number of the next record to drain. */
+        static uint32_t drained;
+
+        /** @brief Where the drain thread writes, 0 when not draining. */
+        static FileHandle *drainOut;
+
+        /** @brief Time between drains. */
+        static std::chrono::milliseconds drainPeriod;
+
+        /** @brief Held by the drain thread while it writes, and to change where it writes. */
+        static Mutex drainMutex;
+
+        /** @brief Wakes the drain thread. */
+        static EventFlags drainEvents;
+
+        /** @brief Has the drain thread been started? It runs for good once it has. */
+        static bool drainStarted;
+
+        /** @brief Stack of the drain thread. */
+        static uint64_t drainStack[TTTRACE_DRAIN_STACK_SIZE / sizeof(uint64_t)];
+
+        /** @brief Thread StartDrain() writes from. */
+        static Thread drainThread;
+
+        /** @brief Body of the drain thread. */
+        static void DrainLoop();
+};
+#endif
+
+#endif
\ No newline at end of file